@@ -0,0 +1,190 @@
+#!/bin/bash
+# End-to-end streaming benchmark against the emulated camera, see TomUsbCamEmulator.py. Attaches the emulator through
+# vhci_hcd, streams with v4l2-ctl through TomUsbCamDriver and prints one line of key=value results, so runs can be
+# appended to a file and compared:
+#
+#   sudo ./TomUsbCamBenchmark.sh -s 1280x720 -c 300 -o bench_history.txt
+#
+# fps comes from the buffer timestamps, dropped frames from gaps in the buffer sequence numbers, and the Cpu time is
+# what the whole machine spent while streaming, less the emulator process, per captured frame. The emulator's own
+# Cpu time is reported separately since it runs on the same machine. The driver gives every frame the camera sends a
+# sequence number, so the gaps cover frames skipped for want of a buffer as well as damaged frames it dropped. How many
+# of them were skipped comes from the queue_underruns counter in debugfs, when debugfs is mounted. Needs root, python3,
+# usbip and v4l2-ctl.
+
+set -u
+
+ScriptDir=$(cd "$(dirname "$0")" && pwd)
+ModulePath="$ScriptDir/../TomUsbCamDriver.ko"
+FrameSize=640x480
+PixelFormat=YUYV
+FrameCount=300
+Fps=0
+Port=3240
+OutputFile=
+
+Usage()
+{
+    echo "Usage: $0 [-m module.ko] [-s WIDTHxHEIGHT] [-p FOURCC] [-c frames] [-f emulator fps] [-P port] [-o results file]" >&2
+    exit 2
+}
+
+while getopts "m:s:p:c:f:P:o:h" Option
+do
+    case $Option in
+        m) ModulePath=$OPTARG ;;
+        s) FrameSize=$OPTARG ;;
+        p) PixelFormat=$OPTARG ;;
+        c) FrameCount=$OPTARG ;;
+        f) Fps=$OPTARG ;;
+        P) Port=$OPTARG ;;
+        o) OutputFile=$OPTARG ;;
+        *) Usage ;;
+    esac
+done
+
+for Tool in python3 usbip v4l2-ctl
+do
+    command -v $Tool > /dev/null || { echo "$0: $Tool not found" >&2; exit 1; }
+done
+
+[ "$(id -u)" -eq 0 ] || { echo "$0: must be run as root" >&2; exit 1; }
+
+WorkDir=$(mktemp -d)
+EmulatorPid=
+VhciPort=
+
+Cleanup()
+{
+    [ -n "$VhciPort" ] && usbip detach -p "$VhciPort" > /dev/null 2>&1
+    [ -n "$EmulatorPid" ] && kill "$EmulatorPid" 2> /dev/null && wait "$EmulatorPid" 2> /dev/null
+    rm -rf "$WorkDir"
+}
+
+trap Cleanup EXIT
+
+# The emulated camera matches uvcvideo too, so make sure this driver is the one that binds.
+modprobe vhci-hcd || exit 1
+modprobe -r uvcvideo 2> /dev/null
+
+if [ ! -d /sys/module/TomUsbCamDriver ]
+then
+    insmod "$ModulePath" || exit 1
+fi
+
+CamerasBefore=$(cut -d' ' -f2 /sys/module/TomUsbCamDriver/parameters/cameras)
+
+python3 "$ScriptDir/TomUsbCamEmulator.py" --port "$Port" --fps "$Fps" > "$WorkDir/emulator.log" 2>&1 &
+EmulatorPid=$!
+
+for Try in $(seq 50)
+do
+    grep -q "serving" "$WorkDir/emulator.log" && break
+    sleep 0.1
+done
+
+usbip --tcp-port "$Port" attach -r 127.0.0.1 -b 1-1 || { cat "$WorkDir/emulator.log" >&2; exit 1; }
+
+VhciPort=$(usbip port 2> /dev/null | awk '/^Port [0-9]+:/ { Port = $2 } /127\.0\.0\.1.*\/1-1/ { sub(":", "", Port); print Port + 0; exit }')
+
+# Wait for the driver to register a video node for the new camera.
+VideoNode=
+for Try in $(seq 100)
+do
+    for Node in $(cut -d' ' -f2 /sys/module/TomUsbCamDriver/parameters/cameras)
+    do
+        case " $CamerasBefore " in
+            *" $Node "*) ;;
+            *) [ "$Node" != "-" ] && VideoNode=/dev/$Node ;;
+        esac
+    done
+
+    [ -n "$VideoNode" ] && [ -e "$VideoNode" ] && break
+    sleep 0.1
+done
+
+[ -n "$VideoNode" ] || { echo "$0: the driver didn't register a video node" >&2; exit 1; }
+
+# The statistics directory is named after the camera's index, the first field of its line.
+StatsDir=/sys/kernel/debug/TomUsbCam/$(awk -v Node="${VideoNode#/dev/}" '$2 == Node { print $1 }' /sys/module/TomUsbCamDriver/parameters/cameras)
+
+# Prints nothing if the counter can't be read.
+ReadCounter()
+{
+    cat "$StatsDir/$1" 2> /dev/null
+}
+
+Width=${FrameSize%x*}
+Height=${FrameSize#*x}
+
+v4l2-ctl -d "$VideoNode" --set-fmt-video=width="$Width",height="$Height",pixelformat="$PixelFormat" || exit 1
+
+ClockTicks=$(getconf CLK_TCK)
+
+# Busy jiffies of the whole machine: everything but idle and iowait.
+MachineBusyTicks()
+{
+    awk '/^cpu / { print $2 + $3 + $4 + $7 + $8 + $9 }' /proc/stat
+}
+
+# utime + stime of a process.
+ProcessTicks()
+{
+    awk '{ sub(/.*\) /, ""); print $12 + $13 }' "/proc/$1/stat"
+}
+
+MachineStart=$(MachineBusyTicks)
+EmulatorStart=$(ProcessTicks "$EmulatorPid")
+UnderrunsStart=$(ReadCounter queue_underruns)
+
+v4l2-ctl -d "$VideoNode" --stream-mmap=4 --stream-count="$FrameCount" --stream-to=/dev/null --verbose > "$WorkDir/stream.log" 2>&1
+StreamStatus=$?
+
+MachineEnd=$(MachineBusyTicks)
+EmulatorEnd=$(ProcessTicks "$EmulatorPid")
+UnderrunsEnd=$(ReadCounter queue_underruns)
+
+# -1 says the counter wasn't available.
+Underruns=-1
+
+if [ -n "$UnderrunsStart" ] && [ -n "$UnderrunsEnd" ]
+then
+    Underruns=$((UnderrunsEnd - UnderrunsStart))
+fi
+
+[ $StreamStatus -eq 0 ] || { tail "$WorkDir/stream.log" >&2; exit 1; }
+
+# Each dequeued buffer is logged as e.g. "cap dqbuf: 0 seq:      0 bytesused: 614400 ts: 1234.567890 ...".
+awk -v MachineTicks=$((MachineEnd - MachineStart)) -v EmulatorTicks=$((EmulatorEnd - EmulatorStart)) -v ClockTicks="$ClockTicks" \
+    -v FrameSize="$FrameSize" -v PixelFormat="$PixelFormat" -v Date="$(date +%Y-%m-%dT%H:%M:%S)" -v Underruns="$Underruns" '
+    /dqbuf/ && /seq:/ {
+        for (Idx = 1; Idx <= NF; Idx++)
+        {
+            if ($Idx == "seq:") Seq = $(Idx + 1)
+            if ($Idx == "ts:") Ts = $(Idx + 1)
+            if ($Idx == "bytesused:") BytesUsed = $(Idx + 1)
+        }
+        if (Frames == 0) { FirstSeq = Seq; FirstTs = Ts }
+        LastSeq = Seq
+        LastTs = Ts
+        Bytes += BytesUsed
+        if (/error/) Damaged++
+        Frames++
+    }
+    END {
+        if (Frames < 2) { print "benchmark error: fewer than 2 frames captured" > "/dev/stderr"; exit 1 }
+        Fps = (LastTs > FirstTs) ? (Frames - 1) / (LastTs - FirstTs) : 0
+        Dropped = (LastSeq - FirstSeq + 1) - Frames
+        DriverMs = (MachineTicks - EmulatorTicks) * 1000 / ClockTicks / Frames
+        EmulatorMs = EmulatorTicks * 1000 / ClockTicks / Frames
+        printf "date=%s format=%s size=%s frames=%d fps=%.2f dropped=%d underruns=%d damaged=%d mbytes_per_sec=%.1f cpu_ms_per_frame=%.3f emulator_cpu_ms_per_frame=%.3f\n",
+               Date, PixelFormat, FrameSize, Frames, Fps, Dropped, Underruns, Damaged + 0,
+               (LastTs > FirstTs) ? Bytes / (LastTs - FirstTs) / 1000000 : 0, DriverMs, EmulatorMs
+    }' "$WorkDir/stream.log" > "$WorkDir/result.txt" || exit 1
+
+cat "$WorkDir/result.txt"
+
+if [ -n "$OutputFile" ]
+then
+    cat "$WorkDir/result.txt" >> "$OutputFile"
+fi
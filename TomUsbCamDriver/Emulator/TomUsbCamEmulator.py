@@ -0,0 +1,700 @@
+#!/usr/bin/env python3
+# Stand-in for the Cubeternet 1e4e:0109 microscope, so TomUsbCamDriver can be exercised without the camera.
+#
+# dummy_hcd can't carry isochronous transfers, and the configfs Uvc gadget builds its own descriptors instead of the
+# camera's, so the camera is served over Usb/Ip instead. This script is the device side of the connection, and the
+# vhci_hcd module on the same machine is the host controller the driver sees the camera on:
+#
+#   modprobe vhci-hcd
+#   ./TomUsbCamEmulator.py &
+#   usbip attach -r 127.0.0.1 -b 1-1
+#
+# The descriptors are rebuilt byte for byte from the lsusb -v dump in TextFileToPassDataToVirtualMachine.txt. The
+# camera answers the probe/commit and processing unit requests, and streams synthetic Yuyv frames with Uvc payload
+# headers on the isochronous endpoint at the committed frame interval, or at --fps. See TomUsbCamBenchmark.sh.
+#
+# Helpful sites:
+# [1]: https://www.kernel.org/doc/html/latest/usb/usbip_protocol.html
+# [2]: "UVC 1.5 Class specification.pdf"
+
+import argparse
+import os
+import re
+import socket
+import struct
+import sys
+import threading
+import time
+
+DEFAULT_DESCRIPTOR_DUMP = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "TextFileToPassDataToVirtualMachine.txt")
+
+# Usb/Ip operations and commands, see [1]. Everything on the wire is big endian.
+UsbIpVersion = 0x0111
+OpRequestDeviceList = 0x8005
+OpReplyDeviceList = 0x0005
+OpRequestImport = 0x8003
+OpReplyImport = 0x0003
+CommandSubmit = 0x1
+CommandUnlink = 0x2
+ReturnSubmit = 0x3
+ReturnUnlink = 0x4
+DirectionIn = 0x1
+UsbSpeedHigh = 3
+
+# Linux errno values the host expects in the status fields.
+ErrnoPipe = 32
+ErrnoConnReset = 104
+
+# Standard requests.
+RequestGetStatus = 0x00
+RequestGetDescriptor = 0x06
+RequestGetConfiguration = 0x08
+RequestGetInterface = 0x0a
+RequestSetInterface = 0x0b
+DescriptorTypeDevice = 0x1
+DescriptorTypeConfiguration = 0x2
+DescriptorTypeString = 0x3
+
+# Uvc class requests and selectors, see tables A-8, A-13 & A-15 of [2].
+SetCur = 0x01
+GetCur = 0x81
+GetMin = 0x82
+GetMax = 0x83
+GetRes = 0x84
+GetLen = 0x85
+GetInfo = 0x86
+GetDef = 0x87
+ProbeControl = 0x1
+CommitControl = 0x2
+ProbeControlLen = 26
+ProcessingUnitId = 3
+
+# The processing unit controls bmControls 0x2f advertises: (min, max, res, default), all 2 bytes long.
+ProcessingUnitControls = {
+    0x02: (-64, 64, 1, 0),      # Brightness
+    0x03: (0, 95, 1, 32),       # Contrast
+    0x06: (-2000, 2000, 1, 0),  # Hue
+    0x07: (0, 100, 1, 64),      # Saturation
+    0x09: (100, 300, 1, 100),   # Gamma
+}
+
+# bmHeaderInfo bits, see section 2.4.3.3 of [2].
+HeaderFrameId = 0x01
+HeaderEndOfFrame = 0x02
+HeaderPresentationTime = 0x04
+HeaderSourceClock = 0x08
+HeaderEndOfHeader = 0x80
+PayloadHeaderLen = 12
+
+MicroframeSec = 125e-6
+FrameIntervalUnitsPerSec = 10000000
+
+
+# Rebuild the raw descriptors from "lsusb -v" output. Every field is printed in wire order as "<name> <value> ...",
+# and the field's size follows from its name's prefix, so each descriptor is the concatenation of its fields cut to its
+# bLength. That also drops what lsusb prints past the end of a short descriptor, e.g. bmVideoStandards of the
+# processing unit. Returns the device descriptor, the whole configuration and the string table.
+def ParseDescriptorDump(Path):
+
+    FieldPattern = re.compile(r"^\s*([a-z]+[A-Z0-9]\w*|MaxPower)([(\[]\s*\d+[)\]])?\s+(\S+)\s*(.*)$")
+    Descriptors = []
+    Strings = {}
+    ControlSize = 1
+
+    for Line in open(Path, encoding="utf-8", errors="replace"):
+
+        if Line.startswith("Device Status:"):
+            break
+
+        Match = FieldPattern.match(Line)
+
+        if not Match:
+            continue
+
+        Name, Value, Rest = Match.group(1), Match.group(3), Match.group(4).strip()
+
+        if Name == "bLength":
+            Descriptors.append(bytearray())
+
+        if not Descriptors:
+            continue
+
+        # String descriptor indexes are followed by the string itself.
+        if Name.startswith("i") and not Name.startswith("id") and Rest and int(Value) != 0:
+            Strings[int(Value)] = Rest
+
+        Descriptors[-1] += EncodeField(Name, Value, ControlSize)
+
+        if Name == "bControlSize":
+            ControlSize = int(Value)
+
+    Descriptors = [bytes(Descriptor[:Descriptor[0]]) for Descriptor in Descriptors]
+
+    for Descriptor in Descriptors:
+        if len(Descriptor) != Descriptor[0]:
+            raise ValueError("descriptor of type %d is %d bytes, bLength says %d" % (Descriptor[1], len(Descriptor), Descriptor[0]))
+
+    # lsusb doesn't print the class-specific descriptor Uvc puts after the video control interrupt endpoint, see
+    # table 3-12 of [2], though wTotalLength counts it. Put it back, with wMaxTransferSize the endpoint's packet size.
+    Restored = []
+    InterfaceClass = InterfaceSubClass = 0
+
+    for Idx, Descriptor in enumerate(Descriptors):
+
+        Restored.append(Descriptor)
+
+        if Descriptor[1] == 0x04:
+            InterfaceClass, InterfaceSubClass = Descriptor[5], Descriptor[6]
+
+        NextType = Descriptors[Idx + 1][1] if Idx + 1 < len(Descriptors) else None
+
+        if (Descriptor[1] == 0x05) and (InterfaceClass, InterfaceSubClass) == (14, 1) and (Descriptor[3] & 0x3) == 0x3 and NextType != 0x25:
+            Restored.append(bytes([5, 0x25, 0x03]) + Descriptor[4:6])
+
+    Configuration = b"".join(Restored[1:])
+    TotalLength = struct.unpack_from("<H", Configuration, 2)[0]
+
+    if len(Configuration) != TotalLength:
+        raise ValueError("configuration is %d bytes, wTotalLength says %d" % (len(Configuration), TotalLength))
+
+    return Descriptors[0], Configuration, Strings
+
+
+def EncodeField(Name, Value, ControlSize):
+
+    if Name == "MaxPower":
+        return bytes([int(re.match(r"\d+", Value).group(0)) // 2])
+
+    if Name.startswith("guid"):
+        return bytes.fromhex(Value.strip("{}").replace("-", ""))
+
+    if Name.startswith("bcd"):
+        Major, Minor = Value.split(".")
+        return struct.pack("<H", (int(Major) << 8) | int(Minor, 16))
+
+    if Value.endswith("MHz"):
+        Number = round(float(Value[:-3]) * 1000000)
+    else:
+        Number = int(re.match(r"(0x[0-9a-fA-F]+|-?\d+)", Value).group(0), 0)
+
+    if Name in ("bmControls", "bmaControls"):
+        Size = ControlSize
+    elif Name.startswith("dw"):
+        Size = 4
+    elif Name.startswith("w") or Name.startswith("id"):
+        Size = 2
+    elif Name.startswith("t"):
+        Size = 3
+    else:
+        Size = 1
+
+    return Number.to_bytes(Size, "little")
+
+
+# Walk the configuration for what the emulator needs to know: the frame sizes of the Yuyv format, and the
+# isochronous packet size of each alternate setting of each interface.
+def ParseConfiguration(Configuration):
+
+    Frames = {}
+    AltSettingPacketSizes = {}
+    Interface = AltSetting = 0
+    DefaultFrameIndex = 1
+    Offset = 0
+
+    while Offset < len(Configuration):
+
+        Length, Type = Configuration[Offset], Configuration[Offset + 1]
+        Descriptor = Configuration[Offset:Offset + Length]
+
+        if Type == 0x04:
+            Interface, AltSetting = Descriptor[2], Descriptor[3]
+        elif (Type == 0x05) and (Descriptor[3] & 0x3) == 0x1:
+            MaxPacketSize = struct.unpack_from("<H", Descriptor, 4)[0]
+            AltSettingPacketSizes[(Interface, AltSetting)] = (MaxPacketSize & 0x7ff) * (((MaxPacketSize >> 11) & 0x3) + 1)
+        elif (Type == 0x24) and (Interface == 1) and Descriptor[2] == 0x04:
+            DefaultFrameIndex = Descriptor[22]
+        elif (Type == 0x24) and (Interface == 1) and Descriptor[2] == 0x05:
+            Width, Height = struct.unpack_from("<HH", Descriptor, 5)
+            DefaultInterval = struct.unpack_from("<I", Descriptor, 21)[0]
+            Frames[Descriptor[3]] = (Width, Height, DefaultInterval)
+
+        Offset += Length
+
+    return Frames, DefaultFrameIndex, AltSettingPacketSizes
+
+
+class Camera:
+
+    def __init__(self, DevicePath, Fps):
+
+        self.DeviceDescriptor, self.Configuration, self.Strings = ParseDescriptorDump(DevicePath)
+        self.Frames, DefaultFrameIndex, self.AltSettingPacketSizes = ParseConfiguration(self.Configuration)
+        self.Fps = Fps
+        self.Lock = threading.Lock()
+        self.AltSettings = {}
+        self.Controls = {Selector: Values[3] for Selector, Values in ProcessingUnitControls.items()}
+        self.Probe = self.BuildProbe(1, DefaultFrameIndex, self.Frames[DefaultFrameIndex][2])
+        self.Commit = bytes(self.Probe)
+        self.Stream = None
+
+    # Fill in what the camera decides in a probe block: the frame size, and the payload size it needs per microframe,
+    # rounded up to the smallest alternate setting that holds it, like the real camera does.
+    def BuildProbe(self, FormatIndex, FrameIndex, FrameInterval):
+
+        if FrameIndex not in self.Frames:
+            FrameIndex = min(self.Frames)
+
+        Width, Height, DefaultInterval = self.Frames[FrameIndex]
+        FrameInterval = FrameInterval or DefaultInterval
+        FrameSize = Width * Height * 2
+
+        BytesPerMicroframe = FrameSize * FrameIntervalUnitsPerSec // FrameInterval // 8000 + PayloadHeaderLen
+        PacketSizes = sorted(Size for (Interface, AltSetting), Size in self.AltSettingPacketSizes.items() if Interface == 1)
+        MaxPayload = next((Size for Size in PacketSizes if Size >= BytesPerMicroframe), PacketSizes[-1])
+
+        return bytearray(struct.pack("<HBBIHHHHHII", 0, FormatIndex, FrameIndex, FrameInterval, 0, 0, 0, 0, 0, FrameSize, MaxPayload))
+
+    def Descriptor(self, Type, Index, Length):
+
+        if Type == DescriptorTypeDevice:
+            return self.DeviceDescriptor[:Length]
+
+        if Type == DescriptorTypeConfiguration:
+            return self.Configuration[:Length]
+
+        if Type == DescriptorTypeString:
+            if Index == 0:
+                return bytes([4, DescriptorTypeString, 0x09, 0x04])[:Length]
+            if Index in self.Strings:
+                Encoded = self.Strings[Index].encode("utf-16-le")
+                return (bytes([len(Encoded) + 2, DescriptorTypeString]) + Encoded)[:Length]
+
+        return None
+
+    # Handle a control transfer. Returns the data stage for IN requests, b"" for OUT requests, or None to stall.
+    def ControlRequest(self, Setup, Data):
+
+        RequestType, Request, Value, Index, Length = struct.unpack("<BBHHH", Setup)
+        Type = (RequestType >> 5) & 0x3
+
+        with self.Lock:
+
+            if Type == 0:
+                return self.StandardRequest(RequestType, Request, Value, Index, Length)
+
+            if Type == 1:
+                return self.ClassRequest(Request, Value, Index, Length, Data)
+
+        return None
+
+    def StandardRequest(self, RequestType, Request, Value, Index, Length):
+
+        if Request == RequestGetDescriptor:
+            return self.Descriptor(Value >> 8, Value & 0xff, Length)
+
+        if Request == RequestGetStatus:
+            return bytes(2)[:Length]
+
+        if Request == RequestGetConfiguration:
+            return bytes([1])[:Length]
+
+        if Request == RequestGetInterface:
+            return bytes([self.AltSettings.get(Index & 0xff, 0)])[:Length]
+
+        if Request == RequestSetInterface:
+            self.AltSettings[Index & 0xff] = Value
+
+            if (Index & 0xff) == 1:
+                self.Stream = StreamState(self) if Value else None
+
+            return b""
+
+        # SET_CONFIGURATION, SET/CLEAR_FEATURE and the like have nothing to do here.
+        return b"" if not (RequestType & 0x80) else None
+
+    def ClassRequest(self, Request, Value, Index, Length, Data):
+
+        Selector = Value >> 8
+        Interface = Index & 0xff
+        Unit = Index >> 8
+
+        if (Interface == 1) and Selector in (ProbeControl, CommitControl):
+            return self.StreamingRequest(Request, Selector, Length, Data)
+
+        if (Interface == 0) and (Unit == ProcessingUnitId) and Selector in ProcessingUnitControls:
+
+            Minimum, Maximum, Resolution, Default = ProcessingUnitControls[Selector]
+
+            if Request == SetCur:
+                self.Controls[Selector] = max(Minimum, min(Maximum, struct.unpack("<h", Data[:2])[0]))
+                return b""
+
+            Answers = {GetCur: self.Controls[Selector], GetMin: Minimum, GetMax: Maximum, GetRes: Resolution, GetDef: Default}
+
+            if Request == GetInfo:
+                return bytes([0x03])[:Length]
+
+            if Request == GetLen:
+                return struct.pack("<H", 2)[:Length]
+
+            if Request in Answers:
+                return struct.pack("<h", Answers[Request])[:Length]
+
+        # The extension unit and everything else the camera doesn't have stalls.
+        return None
+
+    def StreamingRequest(self, Request, Selector, Length, Data):
+
+        if Request == SetCur:
+
+            Asked = Data.ljust(ProbeControlLen, b"\0")
+            Block = self.BuildProbe(Asked[2], Asked[3], struct.unpack_from("<I", Asked, 4)[0])
+
+            if Selector == ProbeControl:
+                self.Probe = Block
+            else:
+                self.Commit = bytes(Block)
+
+            return b""
+
+        if Request == GetInfo:
+            return bytes([0x03])[:Length]
+
+        if Request == GetLen:
+            return struct.pack("<H", ProbeControlLen)[:Length]
+
+        if Request in (GetCur, GetMin, GetMax, GetDef):
+            return bytes(self.Probe if Selector == ProbeControl else self.Commit)[:Length]
+
+        return None
+
+
+# What is being streamed since the streaming interface was switched to an isochronous alternate setting.
+class StreamState:
+
+    def __init__(self, CameraPtr):
+
+        FrameIndex = CameraPtr.Commit[3]
+        FrameInterval = struct.unpack_from("<I", CameraPtr.Commit, 4)[0]
+
+        self.Width, self.Height = CameraPtr.Frames[FrameIndex][:2]
+        self.FrameSize = self.Width * self.Height * 2
+        self.FrameTime = (1.0 / CameraPtr.Fps) if CameraPtr.Fps else (FrameInterval / FrameIntervalUnitsPerSec)
+        self.PacketSize = CameraPtr.AltSettingPacketSizes.get((1, CameraPtr.AltSettings.get(1, 0)), 0)
+        self.StartTime = time.monotonic()
+        self.Microframe = 0
+        self.FrameNumber = 0
+        self.FrameId = 0
+        self.FrameOffset = None
+        self.NextFrameStart = 0.0
+
+        # A vertical luma ramp with neutral chroma, twice over so each frame can start one line further down.
+        Line = bytearray()
+
+        for Row in range(self.Height):
+            Luma = 16 + (Row * 219) // max(1, self.Height - 1)
+            Line += bytes([Luma, 128]) * self.Width
+
+        self.Pattern = memoryview(bytes(Line) * 2)
+
+    # Device clock at the start of a microframe. dwClockFrequency of this camera is 30 MHz.
+    def DeviceClock(self, Microframe):
+        return (Microframe * 3750) & 0xffffffff
+
+    # The payload sent in the next microframe: the next slice of the current frame behind a 12 byte header, or nothing
+    # between frames.
+    def NextPayload(self):
+
+        Microframe = self.Microframe
+        self.Microframe += 1
+
+        Now = Microframe * MicroframeSec
+
+        if self.FrameOffset is None:
+
+            if Now < self.NextFrameStart:
+                return b""
+
+            self.FrameOffset = 0
+            self.FramePts = self.DeviceClock(Microframe)
+            self.FrameId ^= HeaderFrameId
+            self.FrameNumber += 1
+            self.NextFrameStart += self.FrameTime
+
+            # Don't fall further and further behind if the alternate setting can't carry the frame rate.
+            self.NextFrameStart = max(self.NextFrameStart, Now)
+
+        Chunk = min(self.FrameSize - self.FrameOffset, self.PacketSize - PayloadHeaderLen)
+
+        if Chunk <= 0:
+            return b""
+
+        HeaderInfo = HeaderEndOfHeader | HeaderSourceClock | HeaderPresentationTime | self.FrameId
+
+        if self.FrameOffset + Chunk == self.FrameSize:
+            HeaderInfo |= HeaderEndOfFrame
+
+        Start = ((self.FrameNumber % self.Height) * self.Width * 2) + self.FrameOffset
+        Header = struct.pack("<BBIIH", PayloadHeaderLen, HeaderInfo, self.FramePts, self.DeviceClock(Microframe), (Microframe // 8) & 0x7ff)
+
+        self.FrameOffset += Chunk
+
+        if self.FrameOffset == self.FrameSize:
+            self.FrameOffset = None
+
+        return Header + self.Pattern[Start:Start + Chunk]
+
+
+class UsbIpConnection:
+
+    def __init__(self, Connection, CameraPtr):
+
+        self.Connection = Connection
+        self.Camera = CameraPtr
+        self.SendLock = threading.Lock()
+        self.PendingLock = threading.Condition()
+        self.PendingIsochronous = []
+        self.PendingOther = {}
+        self.Running = True
+
+    def Receive(self, Length):
+
+        Data = bytearray()
+
+        while len(Data) < Length:
+
+            Chunk = self.Connection.recv(Length - len(Data))
+
+            if not Chunk:
+                raise ConnectionError("host closed the connection")
+
+            Data += Chunk
+
+        return bytes(Data)
+
+    def Send(self, Data):
+        with self.SendLock:
+            self.Connection.sendall(Data)
+
+    # Only IN transfers carry their data back. OUT transfers just say how much of theirs was taken.
+    def ReturnSubmit(self, SeqNum, Status, Data=b"", StartFrame=0, Packets=None, ActualLength=None):
+
+        PacketCount = len(Packets) if Packets is not None else 0
+        ActualLength = len(Data) if ActualLength is None else ActualLength
+        Header = struct.pack(">IIIIIiiiii8x", ReturnSubmit, SeqNum, 0, 0, 0, Status, ActualLength, StartFrame, PacketCount, 0)
+        Descriptors = b"".join(struct.pack(">IIIi", *Packet) for Packet in (Packets or []))
+
+        self.Send(Header + bytes(Data) + Descriptors)
+
+    def Run(self):
+
+        IsochronousThread = threading.Thread(target=self.IsochronousLoop, daemon=True)
+        IsochronousThread.start()
+
+        try:
+
+            while True:
+
+                Command, SeqNum, DevId, Direction, Endpoint = struct.unpack(">IIIII", self.Receive(20))
+                Body = self.Receive(28)
+
+                if Command == CommandUnlink:
+                    self.Unlink(SeqNum, struct.unpack_from(">I", Body)[0])
+                    continue
+
+                if Command != CommandSubmit:
+                    raise ConnectionError("unknown command %d" % Command)
+
+                Flags, BufferLength, StartFrame, PacketCount, Interval = struct.unpack_from(">IiiiI", Body)
+                Setup = Body[20:28]
+                Data = self.Receive(BufferLength) if (Direction != DirectionIn) and BufferLength > 0 else b""
+                Packets = []
+
+                if Endpoint != 0 and PacketCount > 0 and PacketCount != 0xffffffff:
+                    for _ in range(PacketCount):
+                        Packets.append(struct.unpack(">IIIi", self.Receive(16)))
+
+                if Endpoint == 0:
+                    self.Control(SeqNum, Setup, Data)
+                elif Packets:
+                    with self.PendingLock:
+                        self.PendingIsochronous.append((SeqNum, Endpoint, Packets))
+                        self.PendingLock.notify()
+                else:
+                    # The interrupt endpoint never has anything to say, so its Urbs wait until they are unlinked.
+                    with self.PendingLock:
+                        self.PendingOther[SeqNum] = Endpoint
+
+        finally:
+
+            with self.PendingLock:
+                self.Running = False
+                self.PendingLock.notify()
+
+    def Control(self, SeqNum, Setup, Data):
+
+        Answer = self.Camera.ControlRequest(Setup, Data)
+
+        if Answer is None:
+            self.ReturnSubmit(SeqNum, -ErrnoPipe)
+        elif Setup[0] & 0x80:
+            self.ReturnSubmit(SeqNum, 0, Answer)
+        else:
+            self.ReturnSubmit(SeqNum, 0, ActualLength=len(Data))
+
+    def Unlink(self, SeqNum, UnlinkSeqNum):
+
+        Status = 0
+
+        with self.PendingLock:
+
+            for Idx, Pending in enumerate(self.PendingIsochronous):
+                if Pending[0] == UnlinkSeqNum:
+                    del self.PendingIsochronous[Idx]
+                    Status = -ErrnoConnReset
+                    break
+
+            if self.PendingOther.pop(UnlinkSeqNum, None) is not None:
+                Status = -ErrnoConnReset
+
+        Header = struct.pack(">IIIIIi24x", ReturnUnlink, SeqNum, 0, 0, 0, Status)
+        self.Send(Header)
+
+    # Complete the isochronous Urbs one after another, each once the microframes it covers have gone by, so the
+    # stream runs at the rate a real bus would carry it.
+    def IsochronousLoop(self):
+
+        StreamStart = time.monotonic()
+        MicroframesSent = 0
+
+        while True:
+
+            with self.PendingLock:
+
+                while self.Running and not self.PendingIsochronous:
+                    self.PendingLock.wait()
+
+                if not self.Running:
+                    return
+
+                SeqNum, Endpoint, Packets = self.PendingIsochronous.pop(0)
+
+            Stream = self.Camera.Stream if Endpoint == 1 else None
+
+            # Start the clock again after the stream was idle, rather than sending a burst to catch up.
+            if time.monotonic() - (StreamStart + MicroframesSent * MicroframeSec) > 0.1:
+                StreamStart = time.monotonic()
+                MicroframesSent = 0
+
+            Data = bytearray()
+            Results = []
+
+            for Offset, Length, _, _ in Packets:
+
+                Payload = Stream.NextPayload() if Stream else b""
+                Payload = Payload[:Length]
+
+                Results.append((Offset, Length, len(Payload), 0))
+                Data += Payload
+
+            MicroframesSent += len(Packets)
+            Delay = StreamStart + MicroframesSent * MicroframeSec - time.monotonic()
+
+            if Delay > 0:
+                time.sleep(Delay)
+
+            with self.PendingLock:
+                if not self.Running:
+                    return
+
+            self.ReturnSubmit(SeqNum, 0, Data, (MicroframesSent // 8) & 0x3ff, Results)
+
+
+# The device as "usbip list" and "usbip attach" see it.
+def UsbDeviceRecord(CameraPtr, BusId):
+
+    Device = CameraPtr.DeviceDescriptor
+    Vendor, Product, Release = struct.unpack_from("<HHH", Device, 8)
+
+    return struct.pack(">256s32sIII", b"/sys/devices/platform/tomusbcam-emulator/usb1/" + BusId.encode(), BusId.encode(), 1, 2, UsbSpeedHigh) + \
+        struct.pack(">HHHBBBBBB", Vendor, Product, Release, Device[4], Device[5], Device[6], 1, Device[17], CameraPtr.Configuration[4])
+
+
+def Serve(CameraPtr, Address, Port, BusId):
+
+    Listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    Listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    Listener.bind((Address, Port))
+    Listener.listen(1)
+
+    print("TomUsbCamEmulator: serving %04x:%04x as %s on %s:%d" %
+          (struct.unpack_from("<H", CameraPtr.DeviceDescriptor, 8)[0], struct.unpack_from("<H", CameraPtr.DeviceDescriptor, 10)[0],
+           BusId, Address, Port), flush=True)
+
+    while True:
+
+        Connection, _ = Listener.accept()
+        Connection.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+
+        try:
+
+            Version, Code, Status = struct.unpack(">HHI", Connection.recv(8, socket.MSG_WAITALL))
+
+            if Code == OpRequestDeviceList:
+
+                Interfaces = b""
+                Offset = 0
+
+                while Offset < len(CameraPtr.Configuration):
+                    Descriptor = CameraPtr.Configuration[Offset:Offset + CameraPtr.Configuration[Offset]]
+                    if Descriptor[1] == 0x04 and Descriptor[3] == 0:
+                        Interfaces += bytes([Descriptor[5], Descriptor[6], Descriptor[7], 0])
+                    Offset += len(Descriptor)
+
+                Connection.sendall(struct.pack(">HHII", UsbIpVersion, OpReplyDeviceList, 0, 1) + UsbDeviceRecord(CameraPtr, BusId) + Interfaces)
+
+            elif Code == OpRequestImport:
+
+                Requested = Connection.recv(32, socket.MSG_WAITALL).rstrip(b"\0").decode()
+
+                if Requested != BusId:
+                    Connection.sendall(struct.pack(">HHI", UsbIpVersion, OpReplyImport, 1))
+                    continue
+
+                Connection.sendall(struct.pack(">HHI", UsbIpVersion, OpReplyImport, 0) + UsbDeviceRecord(CameraPtr, BusId))
+
+                print("TomUsbCamEmulator: attached", flush=True)
+
+                UsbIpConnection(Connection, CameraPtr).Run()
+
+        except (ConnectionError, OSError) as Error:
+            print("TomUsbCamEmulator: detached (%s)" % Error, flush=True)
+
+        finally:
+            Connection.close()
+
+            with CameraPtr.Lock:
+                CameraPtr.Stream = None
+                CameraPtr.AltSettings = {}
+
+
+def Main():
+
+    Parser = argparse.ArgumentParser(description="Serve an emulated Cubeternet 1e4e:0109 camera over Usb/Ip.")
+    Parser.add_argument("--descriptors", default=DEFAULT_DESCRIPTOR_DUMP, help="lsusb -v dump of the camera to present")
+    Parser.add_argument("--fps", type=float, default=0, help="frame rate to stream at (default: the committed frame interval)")
+    Parser.add_argument("--address", default="127.0.0.1", help="address to listen on")
+    Parser.add_argument("--port", type=int, default=3240, help="Usb/Ip port to listen on")
+    Parser.add_argument("--busid", default="1-1", help="bus id to export the camera as")
+    Arguments = Parser.parse_args()
+
+    CameraPtr = Camera(Arguments.descriptors, Arguments.fps)
+
+    try:
+        Serve(CameraPtr, Arguments.address, Arguments.port, Arguments.busid)
+    except KeyboardInterrupt:
+        return 0
+
+
+if __name__ == "__main__":
+    sys.exit(Main())
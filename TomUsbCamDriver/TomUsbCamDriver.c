@@ -1,14 +1,65 @@
 
 // Writing a test driver to replace the standard Uvc driver. Use with the Cubeternet
 // microscope camera.
-#include "TomUsbCamDriver.h"
 #include "TomUsbCamDriverDefines.h"
+#include "TomUsbCamDriver.h"
+
+// Define the tracepoints here, see TomUsbCamTrace.h.
+#define CREATE_TRACE_POINTS
+#include "TomUsbCamTrace.h"
 
 MODULE_DESCRIPTION("Test V4l2 Usb driver");
 MODULE_AUTHOR("Tom Cloud");
 MODULE_LICENSE("GPL");
 MODULE_DEVICE_TABLE (usb, TomUsbCamTable);
 
+// Which memory the video buffers of each camera use, indexed in the order the cameras are plugged in. The vmalloc and
+// dma-sg backends both build the buffers out of single pages, so REQBUFS never needs a high-order allocation.
+static int TomUsbCamBufferBackend[TOM_USB_CAM_MAX_DEVICES];
+module_param_array_named(buffer_backend, TomUsbCamBufferBackend, int, NULL, 0444);
+MODULE_PARM_DESC(buffer_backend, "Video buffer memory per camera: 0 = vmalloc (default), 1 = dma-sg");
+
+// Where each camera's isochronous payloads are processed, indexed the same way. See TOM_USB_CAM_PROCESSING_STAGE_*.
+static int TomUsbCamProcessingStage[TOM_USB_CAM_MAX_DEVICES];
+module_param_array_named(processing_stage, TomUsbCamProcessingStage, int, NULL, 0444);
+MODULE_PARM_DESC(processing_stage, "Payload processing per camera: 0 = Urb completion handler (default), 1 = kthread, 2 = unbound workqueue");
+
+// Cpu list (e.g. "2-3") the processing kthreads are allowed to run on. Unbound workqueues are named
+// tomusbcam-<usb device> and take their cpumask from /sys/devices/virtual/workqueue/ instead.
+static char *TomUsbCamProcessingCpus;
+module_param_named(processing_cpus, TomUsbCamProcessingCpus, charp, 0444);
+MODULE_PARM_DESC(processing_cpus, "Cpu list the payload processing kthreads run on (default: any)");
+
+// What to do with each camera's damaged frames. See TOM_USB_CAM_DAMAGED_FRAMES_*.
+static int TomUsbCamDamagedFrames[TOM_USB_CAM_MAX_DEVICES];
+module_param_array_named(damaged_frames, TomUsbCamDamagedFrames, int, NULL, 0444);
+MODULE_PARM_DESC(damaged_frames, "Damaged frames per camera: 0 = deliver with V4L2_BUF_FLAG_ERROR (default), 1 = drop");
+
+// What each camera falls back to when its bus is short of bandwidth on STREAMON. See TOM_USB_CAM_BANDWIDTH_FALLBACK_*.
+static int TomUsbCamBandwidthFallback[TOM_USB_CAM_MAX_DEVICES];
+module_param_array_named(bandwidth_fallback, TomUsbCamBandwidthFallback, int, NULL, 0444);
+MODULE_PARM_DESC(bandwidth_fallback, "Mode fallback per camera when the bus is short of bandwidth: 0 = lower frame rate first (default), 1 = smaller frame first, 2 = none");
+
+// How each camera's still node gets its images. See TOM_USB_CAM_STILL_CAPTURE_*.
+static int TomUsbCamStillCapture[TOM_USB_CAM_MAX_DEVICES];
+module_param_array_named(still_capture, TomUsbCamStillCapture, int, NULL, 0444);
+MODULE_PARM_DESC(still_capture, "Still image capture per camera: 0 = the camera's own method 2 or 3 if it has one, else switch the stream (default), 1 = always switch the stream");
+
+// Periodic bandwidth all the cameras on one bus may reserve between them. Lower it to leave room for other
+// isochronous or interrupt devices on the same bus.
+static unsigned int TomUsbCamPeriodicBudget;
+module_param_named(periodic_budget, TomUsbCamPeriodicBudget, uint, 0644);
+MODULE_PARM_DESC(periodic_budget, "Periodic bytes per (micro)frame the cameras on a bus may reserve (default: 6000 high speed, 1350 full speed)");
+
+// Every attached camera, see TomUsbCamDeviceStruct. The lock also covers each camera's interface pointers.
+static LIST_HEAD(TomUsbCamDeviceListHead);
+static DEFINE_MUTEX(TomUsbCamDeviceListLock);
+module_param_cb(cameras, &TomUsbCamCamerasParamOps, NULL, 0444);
+MODULE_PARM_DESC(cameras, "Attached cameras: parameter index, video node, bus number, host controller, bus info and reserved bytes per (micro)frame");
+
+// /sys/kernel/debug/TomUsbCam, which holds a directory of streaming statistics per camera.
+static struct dentry *TomUsbCamDebugfsRootPtr;
+
 // Helpful sites:
 // [1]: http://www.cs.albany.edu/~sdc/CSI500/linux-2.6.31.14/Documentation/DocBook/usb/re18.html
 // [2]: https://elixir.bootlin.com/linux/latest/source/include/linux/usb.h
@@ -56,6 +107,13 @@ static int TomUsbCamIoctl(struct usb_interface *UsbDevInterfaceStructPtr, unsign
 static int TomUsbCamProbe(struct usb_interface *UsbDevInterfaceStructPtr, const struct usb_device_id *id)
 {
 
+    // The id table matches the whole device, so this is also called for the microphone's audio interfaces.
+    // Leave those for the usb audio driver, otherwise the audio streaming interface looks like a video one below.
+    if (UsbDevInterfaceStructPtr->cur_altsetting->desc.bInterfaceClass != USB_CLASS_VIDEO)
+    {
+        return -ENODEV;
+    }
+
     // Since this probe function is called for both the control and isochronous interfaces, figure out which
     // one we are dealing with before proceeding.
     int NumOfAltSettingsForThisIntf = UsbDevInterfaceStructPtr->num_altsetting;
@@ -66,11 +124,21 @@ static int TomUsbCamProbe(struct usb_interface *UsbDevInterfaceStructPtr, const
     // and bulk transfers. I beleive this is for sending low-speed still frame captures. The other interface, 0x81,
     // seems to be the streaming interface. Since this probe function is called for each of these 2 capture interfaces,
     // use the low-speed interface call to set up the control interface, which is used to pass camera configuration
-    // commands back and forth over Usb. The low-speed interface call can be recognized because it only has 1 alternative
-    // Usb setting.  
-    bool IntfIsForCtrl = (NumOfAltSettingsForThisIntf > 1) ? false : true;
+    // commands back and forth over Usb. The interface subclass says which of the 2 this is.
+    bool IntfIsForCtrl = (UsbDevInterfaceStructPtr->cur_altsetting->desc.bInterfaceSubClass == VideoControlInterfaceSubclass);
 
     int DeviceProbeSuccessStatus = -ENOMEM;
+
+    // Both interfaces of a camera share one device struct, whichever of them is probed first creates it.
+    struct TomUsbCamDeviceStruct *TomUsbCamDeviceStructPtr = TomUsbCamGetDevice(UsbDevInterfaceStructPtr);
+
+    if (!TomUsbCamDeviceStructPtr)
+    {
+
+        pr_err("TomUsbCamProbe error: TomUsbCamDeviceStructPtr allocation failed");
+
+        return -ENOMEM;
+    }
 	
 	bool MemoryAllocatedForDev = false, CtrlIntfBufferAllocated = false, IsochronousInBufferAllocated = false,
          CorrectIsochronousIntfFound = false;
@@ -100,13 +168,7 @@ static int TomUsbCamProbe(struct usb_interface *UsbDevInterfaceStructPtr, const
     }
     else
     {
-	    
-	    
-//tom skip the isoc intf until the ctrl intf is working with v4l2	    
-return -1;	    
-	    
-	    
-	    
+
 	    TomUsbCamIsochronousInputDevStructPtr = kzalloc(sizeof(struct TomUsbCamIsochronousInputDevStruct), GFP_KERNEL);
 	    
 	    // Any positive address indicates the allocation succeeded
@@ -130,6 +192,7 @@ return -1;
         {
 	    
 	        // Seve the usb device and interface structures for later
+	        TomUsbCamCtrlIntfDevStructPtr->DeviceStructPtr = TomUsbCamDeviceStructPtr;
 	        TomUsbCamCtrlIntfDevStructPtr->UsbDevStructPtr = usb_get_dev(interface_to_usbdev(UsbDevInterfaceStructPtr));
 
 	        // UsbDevInterfaceStructPtr = struct usb_interface defined at: [1]
@@ -139,6 +202,7 @@ return -1;
 	    else
 	    {
 	    
+	        TomUsbCamIsochronousInputDevStructPtr->DeviceStructPtr = TomUsbCamDeviceStructPtr;
 	        TomUsbCamIsochronousInputDevStructPtr->UsbDevStructPtr = usb_get_dev(interface_to_usbdev(UsbDevInterfaceStructPtr));
 
 	        TomUsbCamIsochronousInputDevStructPtr->UsbDevInterfaceStructPtr = UsbDevInterfaceStructPtr;	
@@ -151,186 +215,65 @@ return -1;
 	    // cur_altsetting = struct usb_host_interface defined at line 81 here: [2]
 	    struct usb_host_interface *UsbIntfPtr = UsbDevInterfaceStructPtr->cur_altsetting;	 	    
 	           
-        // Try to send & receive a message to the device to verify this is the default control interface
+        // Set up the control interface from what usbcore already knows about the camera.
         if (IntfIsForCtrl)
         {
 
-            // Use usb_get_descriptor(), usb_control_msg(), and an Urb to get the Vid/Pid as a test.
-
-            // usb_get_descriptor() method
-            // ------------------------------
-            
             // The kref seems to be a global reference count for this driver. If a single device is plugged in
             // and multiple programs use it, the reference count will be updated accordingly. If multiple
             // devices are plugged in, I think they all get their own instance of this driver. It seems that
             // both the sochronous and control interfaces will use their own reference counts.
             kref_init(&TomUsbCamCtrlIntfDevStructPtr->KernelRefCountStruct);	            
         
-            // Allocate space for the temporary descriptor before using it
-            // See examples #2 & #4 here:
-            // https://cpp.hotexamples.com/examples/-/-/usb_get_descriptor/cpp-usb_get_descriptor-function-examples.html
-            struct usb_device_descriptor *TempDescriptorPtr = kzalloc(sizeof(*TempDescriptorPtr), GFP_NOIO);
-            
-            if (!TempDescriptorPtr)
-            {
-               pr_err("TomUsbCamProbe error: TempDescriptorPtr allocation failed");
-            }               
-                       
-            // usb_get_descriptor() is the the rx/tx test to make sure this is actually the control interface.
-            // If this were a unidirection isochronous streaming interface, no data should be returned, or it should be garbage.
-            int usb_get_descriptorBytesRead = usb_get_descriptor(TomUsbCamCtrlIntfDevStructPtr->UsbDevStructPtr, USB_DT_DEVICE, 0, 
-                                                                 TempDescriptorPtr, sizeof(*TempDescriptorPtr));            
-           
-            pr_info("TomUsbCamProbe control interface data:\n");           
-           
-            if (usb_get_descriptorBytesRead > 0)
-            {
-            
-                pr_info("usb_get_descriptor Vid/Pid: 0x%04x/0x%04x, expected = 0x1e4e/0x0109.", 
-                        TempDescriptorPtr->idVendor, 
-                        TempDescriptorPtr->idProduct);            
-            }
-            else
-            {
-                pr_info("TomUsbCamProbe incorrect control interface choosen");
-            }
-
-            kfree(TempDescriptorPtr);   
-            
-            // usb_control_msg() method
-            // ------------------------------
-
-            // Allocate 18 bytes for a Pid/Vid query per:
-            // https://libusbk.sourceforge.net/UsbK3/struct_u_s_b___d_e_v_i_c_e___d_e_s_c_r_i_p_t_o_r.html
-            // usb_get_descriptor is a wrapper around a usb_control_msg() call per:
-            // https://elixir.bootlin.com/linux/latest/source/drivers/usb/core/message.c#L780
-            // Formulate query per:
-            // https://www.beyondlogic.org/usbnutshell/usb6.shtml#StandardDeviceRequests
-            // Kernel-allocated memory must be used or else the control message fails per the usbmon utility.
-            unsigned char *UsbPacketDataPtr = kzalloc(18, GFP_NOIO);
-            
-            ReadFromCamera(TomUsbCamCtrlIntfDevStructPtr->UsbDevStructPtr,
-                           GetStandardDescriptorRequest,
-                           StandardTypeRequestType,
-                           DeviceRecipientRequestType,
-                           GetDescriptorDeviceValue,
-                           0x0,
-                           0x0,
-                           UsbPacketDataPtr,
-                           GetDeviceDescriptorPacketLen,
-                           FiveSecTimeoutInMsecs);            
-              
-            pr_info("usb_control_msg Vid/Pid: 0x%04x/0x%04x, expected = 0x1e4e/0x0109.", 
-                    UsbPacketDataPtr[9] << 8 | UsbPacketDataPtr[8], 
-                    UsbPacketDataPtr[11] << 8 | UsbPacketDataPtr[10]);
-
-            kfree(UsbPacketDataPtr);
+            // usbcore read the device descriptor while enumerating the camera, so there's no need to ask again.
+            pr_info("TomUsbCamProbe control interface Vid/Pid: 0x%04x/0x%04x, expected = 0x1e4e/0x0109.", 
+                    le16_to_cpu(TomUsbCamCtrlIntfDevStructPtr->UsbDevStructPtr->descriptor.idVendor), 
+                    le16_to_cpu(TomUsbCamCtrlIntfDevStructPtr->UsbDevStructPtr->descriptor.idProduct));
             
             // Get all of the Usb descriptors for use later on. The descriptors describe the 
             // entire Usb device architecture.
             SaveAllDescriptors(TomUsbCamCtrlIntfDevStructPtr);
-            
-            // Urb method
-            // ------------------------------
-            
-            /*
-	            //Tom use an Urb here, see:
-	            //https://github.com/torvalds/linux/blob/5bfc75d92efd494db37f5c4c173d3639d4772966/drivers/media/usb/gspca/konica.c
-	            // Pass 0 as the number of "iso packets" since it is being used to communicate with a control endpoint. See:
-	            // https://manpages.debian.org/testing/linux-manual-4.9/usb_alloc_urb.9
-	            struct urb *urb = usb_alloc_urb(0, GFP_KERNEL);
-	            
-	            urb->transfer_buffer = usb_alloc_coherent(TomUsbCamCtrlIntfDevStructPtr->UsbDevStructPtr, 
-	                                                      4,
-	                                                      GFP_KERNEL,
-	                                                      &urb->transfer_dma);
-	            
-	            pr_info("***urb->transfer_buffer: %p***", 
-                        urb->transfer_buffer);
-                   
-                  
-                //Tom use usb_fill_bulk_urb() instead of a usb_control_msg() to stay with the "Urb" methodology here
-                //tom see s2255_write_config for retrieving results of this setting? 	                                             
-	            
-	            
-	            usb_fill_bulk_urb(UsbRequestBlockPtr,
-	                              TomUsbCamCtrlIntfDevStructPtr->UsbDevStructPtr,
-                                  usb_sndbulkpipe(TomUsbCamCtrlIntfDevStructPtr->UsbDevStructPtr, 
-	                                              TomUsbCamCtrlIntfDevStructPtr->CtrlIntfEndpointAddr                        
-                        	                                           
-	                                            
-	            int BytesRcvd = usb_control_msg(TomUsbCamCtrlIntfDevStructPtr->UsbDevStructPtr,
-	                                            usb_rcvctrlpipe(TomUsbCamCtrlIntfDevStructPtr->UsbDevStructPtr, 
-                                                                DeviceToHostDataPhaseTransferDirectionRequestType),
-	                                            0x00,
-	                                            0xa3,
-	                                            0x0000, //BrightnessValue,
-	                                            0x0001, //SelectorOutputTerminalIndex,
-	                                            urb->transfer_buffer,
-	                                            0x0004,
-	                                            1000);
-	                                            
-                usb_free_coherent(TomUsbCamCtrlIntfDevStructPtr->UsbDevStructPtr, 
-                                  4,
-	                              urb->transfer_buffer,
-	                              urb->transfer_dma);
-	                              
-                usb_free_urb(urb);	                                            	                                            	  	                                                                                      
-	            */
         }
 	     
         // If this interface has alternate settings, cycle through them to see what they support. For the usb camera
-        // on interface 2, it seems like they are all input isochronous & interrupt endpoints with only the buffer size differing.
-        // The buffer size of alternate setting 8 is 1023 bytes, which is the largest, so use this setting for now.
+        // on interface 1, they are all input isochronous endpoints with only the packet size differing
+        // (160, 208, 768, 780, 812, 976, 1020, & 3x1020 bytes for alternate settings 1 through 8).
+        // Remember the largest one so the streaming Urbs can be sized for it. The interface itself is left at the
+        // zero-bandwidth alternate setting 0 until streaming actually starts, otherwise the periodic bandwidth
+        // would be reserved on the bus for as long as the camera is plugged in.
         else
         {
-        
-            kref_init(&TomUsbCamIsochronousInputDevStructPtr->KernelRefCountStruct);	        
-        
-            // Start with alternate setting index 0 even though this is the default
+
+            kref_init(&TomUsbCamIsochronousInputDevStructPtr->KernelRefCountStruct);
+
+            size_t LargestPacketSize = 0;
+
             for (int AltSettingIdx = 0; AltSettingIdx < NumOfAltSettingsForThisIntf; ++AltSettingIdx)
-            {     
-                
-                // "0" is returned on success
-                int InterfaceChangeReturnCode = usb_set_interface(TomUsbCamIsochronousInputDevStructPtr->UsbDevStructPtr, UsbIntfPtr->desc.bInterfaceNumber, AltSettingIdx);
-                
-                if (InterfaceChangeReturnCode)
-                {
-                    pr_err("TomUsbCamProbe error: InterfaceChangeReturnCode = %d", InterfaceChangeReturnCode);
-                }
-                else
-                {
-                    
-                    UsbIntfPtr = UsbDevInterfaceStructPtr->cur_altsetting;
-                    
-                    // UsbIntfPtr->desc = struct usb_interface_descriptor defined at line 389 here: [3]
-                    for (int EndPointNum = 0; EndPointNum < UsbIntfPtr->desc.bNumEndpoints; ++EndPointNum) 
-                    {	
-
-                        // UsbIntfPtr->endpoint = struct usb_host_endpoint defined at line 67 here: [2]
-                        // &UsbIntfPtr->endpoint[i].desc = struct usb_endpoint_descriptor  defined at line 407 here: [3]
-                        struct usb_endpoint_descriptor *TempEndPointPtr = &UsbIntfPtr->endpoint[EndPointNum].desc;
-                        
-                        size_t BufferSize = TempEndPointPtr->wMaxPacketSize;
-                        
-                        // 1023 bytes seems to be the largest isochronous interface buffer size for this camera. 
-                        // Use this interface alternate setting for now. In total for this camera there are 8 
-                        // isochronous settings with sizes (160, 208, 760, 780, 812, 976, 1020, & 1023 for alternative settings
-                        // 1 through 8 respectively. UsbDevInterfaceStructPtr seems to retain the last interface setting.
-                        if (BufferSize == 1023)
-                        {
-                            
-                            CorrectIsochronousIntfFound = true;
-                            SelectedAltSettingIdx = AltSettingIdx;
-        
-                            break;
-                        }                
-                    } 
-                }
-                
-                if (CorrectIsochronousIntfFound)
+            {
+
+                // UsbDevInterfaceStructPtr->altsetting[] is not necessarily in bAlternateSetting order.
+                struct usb_host_interface *TempIntfPtr = &UsbDevInterfaceStructPtr->altsetting[AltSettingIdx];
+
+                // UsbIntfPtr->desc = struct usb_interface_descriptor defined at line 389 here: [3]
+                for (int EndPointNum = 0; EndPointNum < TempIntfPtr->desc.bNumEndpoints; ++EndPointNum)
                 {
-                    break;
+
+                    // UsbIntfPtr->endpoint = struct usb_host_endpoint defined at line 67 here: [2]
+                    // &UsbIntfPtr->endpoint[i].desc = struct usb_endpoint_descriptor  defined at line 407 here: [3]
+                    struct usb_endpoint_descriptor *TempEndPointPtr = &TempIntfPtr->endpoint[EndPointNum].desc;
+
+                    // The upper bits of wMaxPacketSize hold the number of extra transactions per microframe
+                    // for high-bandwidth endpoints, e.g. 0x13fc is 3 x 1020 bytes.
+                    size_t PacketSize = usb_endpoint_maxp(TempEndPointPtr) * usb_endpoint_maxp_mult(TempEndPointPtr);
+
+                    if (usb_endpoint_is_isoc_in(TempEndPointPtr) && (PacketSize > LargestPacketSize))
+                    {
+
+                        LargestPacketSize = PacketSize;
+                        CorrectIsochronousIntfFound = true;
+                        SelectedAltSettingIdx = TempIntfPtr->desc.bAlternateSetting;
+                        UsbIntfPtr = TempIntfPtr;
+                    }
                 }
             }
         }
@@ -408,114 +351,49 @@ return -1;
                 // &
                 // https://www.kernel.org/doc/html/v4.13/driver-api/infrastructure.html#c.device
                 // A non-zero value is returned upon failure.
+                // The struct outlives the disconnect for as long as its nodes are held open, see TomUsbCamDisconnect().
+                TomUsbCamCtrlIntfDevStructPtr->V4l2DevStruct.release = TomUsbCamV4l2DeviceRelease;
+
                 if (v4l2_device_register(&TomUsbCamCtrlIntfDevStructPtr->UsbDevStructPtr->dev, 
                                          &TomUsbCamCtrlIntfDevStructPtr->V4l2DevStruct))
                 {
 		            pr_err("TomUsbCamProbe error: v4l2_device_register() failed");
-		            break;                
+		            goto CtrlIntfErrorFreeBuffer;
                 }
 	        
 	            // Init all the format fields for the frames grabbed from the webcam. See:
 	            // https://linuxtv.org/downloads/legacy/video4linux/API/V4L2_API/spec/ch02.html#:~:text=The%20v4l2_pix_format%20structure%20defines%20the,buffer%20formats%20see%20also%20VIDIOC_G_FBUF%20.)
 	            
-	            int ImageWidth = 1280, ImageHeight = 720;
-	            
-	            // For every pixel there is 1 Y byte, and 0.5 U & V bytes, for an average of 2 bytes per pixel.
-	            float YuyvScalingFactor = 2.0, BytesPerLine = ImageWidth * YuyvScalingFactor,
-	                  ImageCompleteSizeInBytes = BytesPerLine * ImageHeight;
-	            
-	            TomUsbCamCtrlIntfDevStructPtr->V4l2PixFormatStruct.width = ImageWidth;
-	            TomUsbCamCtrlIntfDevStructPtr->V4l2PixFormatStruct.height = ImageHeight;
-	            
-	            // Each u,v chrominance value applies to 2 luminance values in the horizontal direction.
-	            TomUsbCamCtrlIntfDevStructPtr->V4l2PixFormatStruct.pixelformat = V4L2_PIX_FMT_YUYV;
-	            
-	            // Return the entire, non-interleaved, image.
-	            TomUsbCamCtrlIntfDevStructPtr->V4l2PixFormatStruct.field = V4L2_FIELD_NONE;
-
-                // Don't add any padding to image lines
-                TomUsbCamCtrlIntfDevStructPtr->V4l2PixFormatStruct.bytesperline = (int) BytesPerLine;
-	                    
-                TomUsbCamCtrlIntfDevStructPtr->V4l2PixFormatStruct.sizeimage = (int) ImageCompleteSizeInBytes;
-
-                // This seems to be for converting to Rgb, not sure why it is needed. I'm just randomly choosing this
-                // setting for now.
-                TomUsbCamCtrlIntfDevStructPtr->V4l2PixFormatStruct.colorspace = V4L2_COLORSPACE_SMPTE170M;
-	                    
-	            TomUsbCamCtrlIntfDevStructPtr->V4l2PixFormatStruct.priv = 0;       
+	            // Nothing is sent to the camera here. The camera's default mode is negotiated through the probe/commit
+	            // controls on the first STREAMON unless S_FMT picks a different one first.
+	            if (BuildStreamingModeTable(TomUsbCamCtrlIntfDevStructPtr))
+	            {
+		            pr_err("TomUsbCamProbe error: no supported streaming formats found");
+		            goto CtrlIntfErrorUnregisterV4l2Device;
+	            }
 	                    
-	            // Init the control handler for passing ioctl() controls.
-	            // Give a hint as to how many controls this driver wants to export to user space for the user to manipulate.
-	            // Possible controls are listed here: 
-	            // https://www.kernel.org/doc/html/v4.9/media/uapi/v4l/control.html
-	            int NumberOfControlSettings = 3;
-	            
-	            v4l2_ctrl_handler_init(&TomUsbCamCtrlIntfDevStructPtr->V4l2CtrlHandler, NumberOfControlSettings);
-	            
-	            int Max, Min, Step, Default;
-	            
-                // Check which controls this specific camera actually supports. This information is contained
-                // in the device descriptor data that was saved when the camera was plugged in.
-                // Parent interface #0 is the control interface, the processing unit selector describes the supported
-                // capabilites.
-                uint8_t ParentInterfaceAssoc = 0, VideoInterfaceSubtype = InterfaceProcessingUnitIndex;
-                int8_t DescriptorReadSuccess;
-
-                struct VideoInterfaceDescriptorStruct *VideoInterfaceDescriptorStructPtr;
-
-                GetVideoInterfaceDescriptorStruct(TomUsbCamCtrlIntfDevStructPtr, ParentInterfaceAssoc, VideoInterfaceSubtype,
-                                                  &VideoInterfaceDescriptorStructPtr, &DescriptorReadSuccess);
-	            
-	            // Section 3.7.2.5 of [5] enumerates what the 2-byte bmControls value translates to. Update the supported
-	            // features of this camera so the setters() can be correctly enabled later.
-	            uint16_t CameraControlCapabilities = (uint16_t) (VideoInterfaceDescriptorStructPtr->VarData[6] << 8) |
-                                                        VideoInterfaceDescriptorStructPtr->VarData[5];
-
-                TomUsbCamCtrlIntfDevStructPtr->HueChangeSupported = CameraControlCapabilities & 0x4;
-                TomUsbCamCtrlIntfDevStructPtr->ContrastChangeSupported = CameraControlCapabilities & 0x2;
-                TomUsbCamCtrlIntfDevStructPtr->BrightnessChangeSupported = CameraControlCapabilities & 0x1;               
+	            if (TomUsbCamInitAsyncControls(TomUsbCamCtrlIntfDevStructPtr))
+	            {
+		            pr_err("TomUsbCamProbe error: control Urb allocation failed");
+		            goto CtrlIntfErrorUnregisterV4l2Device;
+	            }
 
-                if (TomUsbCamCtrlIntfDevStructPtr->HueChangeSupported)
-                {
-                
-                    // Query the control values from the actual camera so they can be passed on to the V4l2 driver.               
-                    QueryCameraFactoryValues(TomUsbCamCtrlIntfDevStructPtr->UsbDevStructPtr, HueValue, BrightnessControlPacketLen,
-                                             TomUsbCamCtrlIntfDevStructPtr->CtrlIntfBuffer, &Max, &Min, &Step, &Default, false);		            
-           
-	                // Last 4 parameters are s32 min, s32 max, u32 step, s32 default.
-	                v4l2_ctrl_new_std(&TomUsbCamCtrlIntfDevStructPtr->V4l2CtrlHandler, &TomUsbCamV4l2ControlOps, 
-	                                  V4L2_CID_HUE, Min, Max, Step, Default);
-                }
-                
-                if (TomUsbCamCtrlIntfDevStructPtr->ContrastChangeSupported)
-                {                
-                    
-                    QueryCameraFactoryValues(TomUsbCamCtrlIntfDevStructPtr->UsbDevStructPtr, ContrastValue, BrightnessControlPacketLen,
-                             TomUsbCamCtrlIntfDevStructPtr->CtrlIntfBuffer, &Max, &Min, &Step, &Default, true);	                    
-	                                  
-	                v4l2_ctrl_new_std(&TomUsbCamCtrlIntfDevStructPtr->V4l2CtrlHandler, &TomUsbCamV4l2ControlOps, 
-	                                  V4L2_CID_CONTRAST, Min, Max, Step, Default);
-                }
+	            // The streaming counters, one set per cpu.
+	            TomUsbCamCtrlIntfDevStructPtr->StreamStatsForThisCameraStruct.CountersPtr = alloc_percpu(struct StreamCountersStruct);
 
-                if (TomUsbCamCtrlIntfDevStructPtr->BrightnessChangeSupported)
-                {	                      
-                
-                    QueryCameraFactoryValues(TomUsbCamCtrlIntfDevStructPtr->UsbDevStructPtr, BrightnessValue, BrightnessControlPacketLen,
-                                             TomUsbCamCtrlIntfDevStructPtr->CtrlIntfBuffer, &Max, &Min, &Step, &Default, true);	
- 
-	                v4l2_ctrl_new_std(&TomUsbCamCtrlIntfDevStructPtr->V4l2CtrlHandler, &TomUsbCamV4l2ControlOps,
-			                          V4L2_CID_BRIGHTNESS, Min, Max, Step, Default);
-                }	                              
-          
-	            if (TomUsbCamCtrlIntfDevStructPtr->V4l2CtrlHandler.error) 
+	            if (!TomUsbCamCtrlIntfDevStructPtr->StreamStatsForThisCameraStruct.CountersPtr)
 	            {
-        
-                    int ErrorNumber = TomUsbCamCtrlIntfDevStructPtr->V4l2CtrlHandler.error;
+		            pr_err("TomUsbCamProbe error: streaming counter allocation failed");
+		            goto CtrlIntfErrorFreeAsyncControls;
+	            }
 
-                    v4l2_ctrl_handler_free(&TomUsbCamCtrlIntfDevStructPtr->V4l2CtrlHandler);
-        
-                    pr_err("TomUsbCamProbe error: v4l2_ctrl_handler error number: %d", ErrorNumber);
-                }
+	            // Init the control handler for passing ioctl() controls. The controls themselves are added by
+	            // TomUsbCamQueryControlsWork() once the video node is up. Give a hint as to how many controls this
+	            // driver could export to user space for the user to manipulate.
+	            v4l2_ctrl_handler_init(&TomUsbCamCtrlIntfDevStructPtr->V4l2CtrlHandler, TOM_USB_CAM_MAX_CONTROLS);
+
+	            INIT_WORK(&TomUsbCamCtrlIntfDevStructPtr->DeferredQueriesForThisCameraStruct.QueryWork, TomUsbCamQueryControlsWork);
+	            init_completion(&TomUsbCamCtrlIntfDevStructPtr->DeferredQueriesForThisCameraStruct.QueriesDone);
             
                 TomUsbCamCtrlIntfDevStructPtr->V4l2DevStruct.ctrl_handler = &TomUsbCamCtrlIntfDevStructPtr->V4l2CtrlHandler;
 
@@ -523,10 +401,13 @@ return -1;
                 // through memory.
                 TomUsbCamCtrlIntfDevStructPtr->TomUsbCamV4l2Queue.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
                 
-                // Tom do I only need mmap? It doesn't appear Dma is supported right now because any vb2_dma* symbols are missing
-                // in /proc/kallsyms .
+                // Dmabuf lets a consumer import its own buffers (e.g. from udmabuf or a memfd) or export ours with
+                // VIDIOC_EXPBUF, and userptr lets it hand in its own (e.g. hugepage backed, mlocked) memory. Either way
+                // frames land straight in the consumer's memory without another copy. The vmalloc memops map imported
+                // buffers and pinned user pages into the kernel, so the payload copy below works the same way for every mode.
                 TomUsbCamCtrlIntfDevStructPtr->TomUsbCamV4l2Queue.io_modes = VB2_MMAP | 
-                                                                             //VB2_DMABUF | 
+                                                                             VB2_USERPTR | 
+                                                                             VB2_DMABUF | 
                                                                              VB2_READ;
                                                                              
                 TomUsbCamCtrlIntfDevStructPtr->TomUsbCamV4l2Queue.dev = &TomUsbCamCtrlIntfDevStructPtr->UsbDevStructPtr->dev;
@@ -538,39 +419,86 @@ return -1;
                 TomUsbCamCtrlIntfDevStructPtr->TomUsbCamV4l2Queue.buf_struct_size = sizeof(struct TomUsbCamV4l2VideoBufferContainer);
                 
                 TomUsbCamCtrlIntfDevStructPtr->TomUsbCamV4l2Queue.ops = &TomUsbCamV4l2QueueOps;
+
+                // Buffers can be queued with a media request carrying the controls for their frame.
+                TomUsbCamCtrlIntfDevStructPtr->TomUsbCamV4l2Queue.supports_requests = true;
                 
                 // The pci skeleton driver seemed to support Dma but since I am only supporting Mmap, trying using "vb2_common_vm_ops"
                 // from here:
                 // https://github.com/torvalds/linux/blob/master/drivers/media/common/videobuf2/videobuf2-memops.c
                 // and here:
                 // http://books.gigatux.nl/mirror/kerneldevelopment/0672327201/ch14lev1sec2.html
-                //TomUsbCamCtrlIntfDevStructPtr->TomUsbCamV4l2Queue.mem_ops = &vb2_dma_contig_memops;
-                //TomUsbCamCtrlIntfDevStructPtr->TomUsbCamV4l2Queue.mem_ops = &vb2_common_vm_ops;
-                // TomUsbCamCtrlIntfDevStructPtr->TomUsbCamV4l2Queue.mem_ops = &vb2_mmap;
-                // TomUsbCamCtrlIntfDevStructPtr->TomUsbCamV4l2Queue.mem_ops = &mmap_mem_ops;
-                
-                TomUsbCamCtrlIntfDevStructPtr->TomUsbCamV4l2Queue.timestamp_flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
-                
+                // The frames are copied out of the isochronous Urb buffers by the cpu, so the video buffers never need
+                // to be physically contiguous. vb2_dma_contig_memops would need high-order allocations that fail once
+                // memory is fragmented, so use either vmalloc'd buffers like the uvcvideo driver does, or page lists.
+                int DeviceIdx = TomUsbCamDeviceStructPtr->DeviceIdx;
+
+                TomUsbCamCtrlIntfDevStructPtr->BufferBackend = TomUsbCamDeviceParam(TomUsbCamBufferBackend, DeviceIdx,
+                                                                                    TOM_USB_CAM_BUFFER_BACKEND_VMALLOC);
+
+                TomUsbCamCtrlIntfDevStructPtr->ProcessingStage = TomUsbCamDeviceParam(TomUsbCamProcessingStage, DeviceIdx,
+                                                                                      TOM_USB_CAM_PROCESSING_STAGE_URB_COMPLETION);
+
+                TomUsbCamCtrlIntfDevStructPtr->DamagedFramePolicy = TomUsbCamDeviceParam(TomUsbCamDamagedFrames, DeviceIdx,
+                                                                                         TOM_USB_CAM_DAMAGED_FRAMES_DELIVER);
+
+                TomUsbCamCtrlIntfDevStructPtr->BandwidthFallback = TomUsbCamDeviceParam(TomUsbCamBandwidthFallback, DeviceIdx,
+                                                                                        TOM_USB_CAM_BANDWIDTH_FALLBACK_INTERVAL_FIRST);
+
+                if (TomUsbCamCtrlIntfDevStructPtr->BufferBackend == TOM_USB_CAM_BUFFER_BACKEND_DMA_SG)
+                {
+
+                    // The page list gets Dma mapped for importers, and the usb_device itself can't do Dma, so hand
+                    // vb2 the host controller's device. Frames are still written by the cpu one page at a time, see
+                    // TomUsbCamCopyToFrame(). The vb2 cache syncs assume a cache-coherent host, like x86.
+                    TomUsbCamCtrlIntfDevStructPtr->TomUsbCamV4l2Queue.mem_ops = &vb2_dma_sg_memops;
+                    TomUsbCamCtrlIntfDevStructPtr->TomUsbCamV4l2Queue.dev = TomUsbCamCtrlIntfDevStructPtr->UsbDevStructPtr->bus->sysdev;
+                }
+                else
+                {
+                    TomUsbCamCtrlIntfDevStructPtr->BufferBackend = TOM_USB_CAM_BUFFER_BACKEND_VMALLOC;
+                    TomUsbCamCtrlIntfDevStructPtr->TomUsbCamV4l2Queue.mem_ops = &vb2_vmalloc_memops;
+                }
+
+                TomUsbCamCtrlIntfDevStructPtr->TomUsbCamV4l2Queue.timestamp_flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC |
+                                                                                    V4L2_BUF_FLAG_TSTAMP_SRC_SOE;
+
                 // Ensure that at least 2 buffers are present before streaming can start.
                 TomUsbCamCtrlIntfDevStructPtr->TomUsbCamV4l2Queue.min_buffers_needed = 2;
-                
-                // Still need to add the "lock" for TomUsbCamV4l2Queue. See https://github.com/torvalds/linux/blob/master/samples/v4l/v4l2-pci-skeleton.c#L845
-                // and comment for using a different lock for the usb device.
-                
-                
-                
-                
+
                 // Init the video_device struct so this device is recognized as a legitimate v4l2 device.
                 // Struct defined here:
                 // https://elixir.bootlin.com/linux/latest/source/include/media/v4l2-dev.h#L263
                 mutex_init(&TomUsbCamCtrlIntfDevStructPtr->TomUsbCamLock);
-                
+
+                // Serialize the queue ioctls with the same lock as the video device. See
+                // https://github.com/torvalds/linux/blob/master/samples/v4l/v4l2-pci-skeleton.c#L845
+                TomUsbCamCtrlIntfDevStructPtr->TomUsbCamV4l2Queue.lock = &TomUsbCamCtrlIntfDevStructPtr->TomUsbCamLock;
+
+                INIT_LIST_HEAD(&TomUsbCamCtrlIntfDevStructPtr->QueuedVideoBufferListHead);
+                spin_lock_init(&TomUsbCamCtrlIntfDevStructPtr->QueuedVideoBufferListLock);
+
+                // A non-zero value is returned upon failure.
+                if (vb2_queue_init(&TomUsbCamCtrlIntfDevStructPtr->TomUsbCamV4l2Queue))
+                {
+                    pr_err("TomUsbCamProbe error: vb2_queue_init() failed");
+                    goto CtrlIntfErrorFreeControlHandler;
+                }
+
+                // The still node shares the lock and the buffer list lock set up above.
+                if (TomUsbCamInitStillCapture(TomUsbCamCtrlIntfDevStructPtr, DeviceIdx))
+                {
+                    pr_err("TomUsbCamProbe error: still image vb2_queue_init() failed");
+                    goto CtrlIntfErrorReleaseQueue;
+                }
+
                 __u8 DriverName[] = "TomUsbCam";
                 strlcpy(TomUsbCamCtrlIntfDevStructPtr->VideoDevice.name, DriverName, 
                         sizeof(TomUsbCamCtrlIntfDevStructPtr->VideoDevice.name));
                 
                 // The video_device_release_empty() function is defined in v4l2_dev.h. It is a stub function when no release
-                // activity needs to occur. The release function cannot be left unset though.
+                // activity needs to occur. The release function cannot be left unset though. The video_device lives in
+                // the struct, which TomUsbCamV4l2DeviceRelease() frees once both nodes are released.
                 TomUsbCamCtrlIntfDevStructPtr->VideoDevice.release = video_device_release_empty;
                 
                 TomUsbCamCtrlIntfDevStructPtr->VideoDevice.fops = &TomUsbCamV4l2FileOps;
@@ -597,6 +525,8 @@ return -1;
                 // Save this alternate interface address. It might be the low-speed image address.
                 // The control interface address is known to always default to 0x0.            
                 TomUsbCamCtrlIntfDevStructPtr->CtrlIntfEndpointAlternateAddr = TempEndPointPtr->bEndpointAddress;             
+
+                continue;
             }
             else
             {
@@ -604,30 +534,36 @@ return -1;
                 if (EndPointIsForInput)
                 {
 
-                    // Only the video interface will have the desired 1023-byte interface. 
-                    // The audio interface max size is 64 bytes.
+                    // Only an interface with an isochronous input endpoint can stream video.
                     if (!CorrectIsochronousIntfFound)
                     {
-                        pr_err("TomUsbCamProbe ignoring audio interface for now");
+                        pr_err("TomUsbCamProbe error: no isochronous input endpoint found");
                         break;
                     }
 
                     pr_info("TomUsbCamProbe adding isochronouse input interface");
-                
-                    TomUsbCamIsochronousInputDevStructPtr->IsochronousInputBufferSize = BufferSize;
-                    
+
+                    TomUsbCamIsochronousInputDevStructPtr->IsochronousInputBufferSize =
+                        usb_endpoint_maxp(TempEndPointPtr) * usb_endpoint_maxp_mult(TempEndPointPtr);
+
                     TomUsbCamIsochronousInputDevStructPtr->IsochronousInputEndpointAddr = TempEndPointPtr->bEndpointAddress;
-                    
-                    TomUsbCamIsochronousInputDevStructPtr->IsochronousInputBuffer = kmalloc(BufferSize, GFP_KERNEL);
-                    
-                    // If memory wasn't allocated, do not continue
-        			if (TomUsbCamIsochronousInputDevStructPtr->IsochronousInputBuffer) 
+
+                    TomUsbCamIsochronousInputDevStructPtr->IsochronousInputInterfaceNumber = UsbIntfPtr->desc.bInterfaceNumber;
+
+                    TomUsbCamIsochronousInputDevStructPtr->IsochronousInputAltSetting = SelectedAltSettingIdx;
+
+                    // Isochronous bInterval is an exponent for both full and high speed, see table 9-13 of the Usb 2.0 spec.
+                    TomUsbCamIsochronousInputDevStructPtr->IsochronousInputInterval =
+                        1 << (clamp_val(TempEndPointPtr->bInterval, 1, 16) - 1);
+
+                    // Allocate the Urb ring now, sized for the largest alternate setting, so it can be reused for every stream.
+        			if (TomUsbCamAllocIsochronousUrbs(TomUsbCamIsochronousInputDevStructPtr) == 0)
         			{
         			    IsochronousInBufferAllocated = true;
     			    }
         			else
         			{
-			            pr_err("TomUsbCamProbe error: TomUsbCamIsochronousInputDevStructPtr->IsochronousInputBuffer allocation failed");
+			            pr_err("TomUsbCamProbe error: TomUsbCamAllocIsochronousUrbs() failed");
 			            break;
 			        }
     			} 
@@ -643,27 +579,47 @@ return -1;
 	        {
 
                 // Register the v4l2 video device instead of the Usb device.
-                // Use "VFL_TYPE_GRABBER" instead of "VFL_TYPE_VIDEO" per:
+                // "VFL_TYPE_VIDEO" is what used to be "VFL_TYPE_GRABBER", which was renamed in 5.7 and is gone since, see:
                 // https://github.com/Isaac-Lozano/GV-USB2-Driver/issues/2
-                // and 
-                // https://lwn.net/Articles/204545/
+                // The driver needs 5.10 for vb2_video_unregister_device() anyway, so there's no point keeping the old name.
                 // The last "-1" indicates to use the first available minor number.
-                DeviceProbeSuccessStatus = video_register_device(&TomUsbCamCtrlIntfDevStructPtr->VideoDevice, VFL_TYPE_GRABBER, -1);
+#ifdef CONFIG_MEDIA_CONTROLLER
+                // The video device registers its entity with the media device, so the media device has to be set up first.
+                media_device_usb_init(&TomUsbCamCtrlIntfDevStructPtr->MediaDev, TomUsbCamCtrlIntfDevStructPtr->UsbDevStructPtr, "TomUsbCam");
+                TomUsbCamCtrlIntfDevStructPtr->MediaDev.ops = &TomUsbCamMediaOps;
+                TomUsbCamCtrlIntfDevStructPtr->V4l2DevStruct.mdev = &TomUsbCamCtrlIntfDevStructPtr->MediaDev;
+#endif
+
+                DeviceProbeSuccessStatus = video_register_device(&TomUsbCamCtrlIntfDevStructPtr->VideoDevice, VFL_TYPE_VIDEO, -1);
+
+                if (DeviceProbeSuccessStatus)
+                {
+                    pr_err("TomUsbCamProbe error: control interface video_register_device() failed");
+                    goto CtrlIntfErrorCleanupMediaDevice;
+                }
+
+#ifdef CONFIG_MEDIA_CONTROLLER
+                // Without the media device, streaming works as before, just without requests.
+                if (media_device_register(&TomUsbCamCtrlIntfDevStructPtr->MediaDev))
+                {
+                    pr_warn("TomUsbCamProbe: media_device_register() failed, media requests won't be available");
+                }
+#endif
+
+                // The video node works the same without the still node.
+                if (video_register_device(&TomUsbCamCtrlIntfDevStructPtr->StillCaptureForThisCameraStruct.VideoDevice, VFL_TYPE_VIDEO, -1))
+                {
+                    pr_warn("TomUsbCamProbe: still image video_register_device() failed, still capture won't be available");
+                }
+
+                // The camera's controls are queried in the background, see TomUsbCamQueryControlsWork().
+                queue_work(system_long_wq, &TomUsbCamCtrlIntfDevStructPtr->DeferredQueriesForThisCameraStruct.QueryWork);
 
 	            // Save the user-defined data struct in the passed-in interface pointer. This same pointer is accessed
 	            // in other functions so a global variable doesn't have to be retained for TomUsbCamCtrlIntfDevStructPtr.
 	            // Both the isochronous and control interaces have their own structs, so they are essentially treated
 	            // as 2 instances of this same driver.
                 usb_set_intfdata(UsbDevInterfaceStructPtr, TomUsbCamCtrlIntfDevStructPtr);
-                
-                if (DeviceProbeSuccessStatus) 
-                {
-	                
-	                pr_err("TomUsbCamProbe error: control interface video_register_device() failed");
-
-	                // Reset the saved user-defined data to be nothing.
-	                usb_set_intfdata(UsbDevInterfaceStructPtr, NULL);	                
-                }	                           
             }
         }
         else
@@ -691,23 +647,34 @@ return -1;
     if (IntfIsForCtrl)
     {    
 	
-        // Decrement the driver reference count if something in the course of the probe() function failed
-        if ((MemoryAllocatedForDev == false) || (CtrlIntfBufferAllocated == false) || (DeviceProbeSuccessStatus))
+        // Nothing was set up without the struct. Without the control buffer, only what came before the endpoint loop.
+        if (MemoryAllocatedForDev == false)
         {
-        
-            if (TomUsbCamCtrlIntfDevStructPtr)
-            {
-	            kref_put(&TomUsbCamCtrlIntfDevStructPtr->KernelRefCountStruct, TomUsbCamCtrlIntfDelete);
-            }
+            TomUsbCamPutDevice(TomUsbCamDeviceStructPtr);
+        }
+        else if (CtrlIntfBufferAllocated == false)
+        {
+            goto CtrlIntfErrorFreeStruct;
         }
         else
         {
+
+            TomUsbCamAttachInterface(TomUsbCamDeviceStructPtr, TomUsbCamCtrlIntfDevStructPtr, NULL);
+
+            TomUsbCamCreateDebugfs(TomUsbCamCtrlIntfDevStructPtr);
          
             // After video_register_device(), the user-defined device is accessible through this interface.
             // dev_info() is the same as pr_info() but provides info about the associated device too. Show the minor 
             // number obtained from the call to usb_register_dev() to the user.   
             dev_info(&TomUsbCamCtrlIntfDevStructPtr->VideoDevice.dev, "TomUsbCam device control interface now attached to video%d (TomUsbCam)", 
                      TomUsbCamCtrlIntfDevStructPtr->VideoDevice.minor);
+
+            if (video_is_registered(&TomUsbCamCtrlIntfDevStructPtr->StillCaptureForThisCameraStruct.VideoDevice))
+            {
+                dev_info(&TomUsbCamCtrlIntfDevStructPtr->VideoDevice.dev, "TomUsbCam still images on video%d, still capture method %d",
+                         TomUsbCamCtrlIntfDevStructPtr->StillCaptureForThisCameraStruct.VideoDevice.minor,
+                         TomUsbCamCtrlIntfDevStructPtr->StillCaptureForThisCameraStruct.Method);
+            }
         }
 	}
 	else
@@ -720,9 +687,13 @@ return -1;
             {
 	            kref_put(&TomUsbCamIsochronousInputDevStructPtr->KernelRefCountStruct, TomUsbCamIsochronousInputDelete);
             }
+
+            TomUsbCamPutDevice(TomUsbCamDeviceStructPtr);
         }
         else
         {
+
+            TomUsbCamAttachInterface(TomUsbCamDeviceStructPtr, NULL, TomUsbCamIsochronousInputDevStructPtr);
             
             dev_info(&UsbDevInterfaceStructPtr->dev, "TomUsbCam device isochronous interface now attached to video%d (TomUsbCam)", 
                      UsbDevInterfaceStructPtr->minor);
@@ -730,15 +701,47 @@ return -1;
 	}
     	        
     return DeviceProbeSuccessStatus;	
+
+    // A failed step of the control interface setup jumps into this ladder, which undoes the steps before it in reverse
+    // order and then frees the struct.
+CtrlIntfErrorCleanupMediaDevice:
+#ifdef CONFIG_MEDIA_CONTROLLER
+    media_device_cleanup(&TomUsbCamCtrlIntfDevStructPtr->MediaDev);
+#endif
+
+    // Nothing was queued on either node yet, so this only frees the queues' own bookkeeping.
+    vb2_queue_release(&TomUsbCamCtrlIntfDevStructPtr->StillCaptureForThisCameraStruct.V4l2Queue);
+
+CtrlIntfErrorReleaseQueue:
+    vb2_queue_release(&TomUsbCamCtrlIntfDevStructPtr->TomUsbCamV4l2Queue);
+
+CtrlIntfErrorFreeControlHandler:
+    TomUsbCamCtrlIntfDevStructPtr->V4l2DevStruct.ctrl_handler = NULL;
+    v4l2_ctrl_handler_free(&TomUsbCamCtrlIntfDevStructPtr->V4l2CtrlHandler);
+
+CtrlIntfErrorFreeAsyncControls:
+    TomUsbCamFreeAsyncControls(TomUsbCamCtrlIntfDevStructPtr);
+
+CtrlIntfErrorUnregisterV4l2Device:
+    v4l2_device_unregister(&TomUsbCamCtrlIntfDevStructPtr->V4l2DevStruct);
+
+CtrlIntfErrorFreeBuffer:
+    kfree(TomUsbCamCtrlIntfDevStructPtr->CtrlIntfBuffer);
+
+CtrlIntfErrorFreeStruct:
+    TomUsbCamFreeCtrlIntf(TomUsbCamCtrlIntfDevStructPtr);
+    TomUsbCamPutDevice(TomUsbCamDeviceStructPtr);
+
+    return DeviceProbeSuccessStatus;
 }
 
 // V4l2-specific functions
 //-----------------------------------------------------------------------------------------------
 
-// Handle camera control requests coming from user space. The v4l2 driver still calls the "VIDIOC_S_CTRL"
-// function within itself, but the actual communication with the Usb device is handled here. I guess the 
-// VIDIOC_S_CTRL activity is just an internal bookkeeping function. I'm not sure if the device can retain
-// settings statically, but if it could then it seems the v4l2 driver and the actual device would be out of sync.
+// Handle camera control requests coming from user space. The v4l2 control framework has already checked the value
+// against the range queried from the camera, so all that's left is getting it to the camera. That happens on the
+// control Urb without waiting for it, and without stopping the stream, so dragging a slider doesn't cost frames.
+// For a cluster this is called once for the master, and every control of the cluster that changed is sent as one batch.
 static int TomUsbCamSetV4l2Control(struct v4l2_ctrl *V4l2ControlReq)
 {
     
@@ -747,218 +750,102 @@ static int TomUsbCamSetV4l2Control(struct v4l2_ctrl *V4l2ControlReq)
 	struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr = 
 	        container_of(V4l2ControlReq->handler, struct TomUsbCamCtrlIntfDevStruct, V4l2CtrlHandler);
 
-    // Make sure to always disable and re-enable the camera when changing parameters, otherwise they won't take.
-	switch (V4l2ControlReq->id) 
-	{
-		
-		// Comments for brightness generally apply to other settings as well.	    
-	    case V4L2_CID_BRIGHTNESS:
+    int ErrorValue = 0;
 
-            if (TomUsbCamCtrlIntfDevStructPtr->BrightnessChangeSupported)
-            {
+    // The value came from the camera in the first place.
+    if (TomUsbCamCtrlIntfDevStructPtr->AsyncControlForThisCameraStruct.ResyncInProgress)
+    {
+        return 0;
+    }
 
-                // Brightness value is 2 little-endian bytes.
-                TomUsbCamCtrlIntfDevStructPtr->CtrlIntfBuffer[0] = V4l2ControlReq->val & 0xff;
-                TomUsbCamCtrlIntfDevStructPtr->CtrlIntfBuffer[1] = (V4l2ControlReq->val & 0xff00) >> 8;
-
-                DisableCamera(TomUsbCamCtrlIntfDevStructPtr->UsbDevStructPtr);
-                                        
-                // Read the before and after brightness value to ensure it was set correctly.                              
-                // Read to the 3rd byte since the new brightness value occupies the first 2 bytes.                                            
-                ReadFromCamera(TomUsbCamCtrlIntfDevStructPtr->UsbDevStructPtr,
-                               GetCurrentSelectorControlRequest,
-                               ClassTypeRequestType,
-                               InterfaceRecipientRequestType,
-                               BrightnessValue,
-                               SelectorOutputTerminalIndex,
-                               InterfaceVideoControlIndex,
-                               &TomUsbCamCtrlIntfDevStructPtr->CtrlIntfBuffer[3],
-                               BrightnessControlPacketLen,
-                               FiveSecTimeoutInMsecs);
-                                                      
-                int PreviousBrightnessValue = (signed char) (TomUsbCamCtrlIntfDevStructPtr->CtrlIntfBuffer[4] << 8) |
-                                              TomUsbCamCtrlIntfDevStructPtr->CtrlIntfBuffer[3];
-
-                // All the fields for this Usb message are defined here. 
-                // The other Usb messages follow roughly the same format.
-                // Message direction: host->device (set request) 
-                // Request type: class 
-                // Recipient: control interface (SC_VIDEOCONTROL), per table A.2.
-                // Value: brightness control setting (PU_BRIGHTNESS_CONTROL), per table A.13.
-                // Index: output terminal selector (VC_OUTPUT_TERMINAL), per table A.5, &
-                //        video control interface (VC_CONTROL_UNDEFINED), per table A.9.
-                // Usb data to send is the brightness level in 2 bytes.
-                WriteToCamera(TomUsbCamCtrlIntfDevStructPtr->UsbDevStructPtr,
-                              SetCurrentSelectorControlRequest,
-                              ClassTypeRequestType,
-                              InterfaceRecipientRequestType,
-                              BrightnessValue,
-                              SelectorOutputTerminalIndex,
-                              InterfaceVideoControlIndex,
-                              TomUsbCamCtrlIntfDevStructPtr->CtrlIntfBuffer,
-                              BrightnessControlPacketLen,
-                              FiveSecTimeoutInMsecs); 
-                                                                                                         
-                ReadFromCamera(TomUsbCamCtrlIntfDevStructPtr->UsbDevStructPtr,
-                               GetCurrentSelectorControlRequest,
-                               ClassTypeRequestType,
-                               InterfaceRecipientRequestType,
-                               BrightnessValue,
-                               SelectorOutputTerminalIndex,
-                               InterfaceVideoControlIndex,
-                               &TomUsbCamCtrlIntfDevStructPtr->CtrlIntfBuffer[3],
-                               BrightnessControlPacketLen,
-                               FiveSecTimeoutInMsecs);
-                                                      
-                int CurrentBrightnessValue = (signed char) (TomUsbCamCtrlIntfDevStructPtr->CtrlIntfBuffer[4] << 8) |
-                                             TomUsbCamCtrlIntfDevStructPtr->CtrlIntfBuffer[3];
-                                                      
-                pr_info("V4L2_CID_BRIGHTNESS value (requested/previous/current): %d / %d / %d", 
-                        V4l2ControlReq->val,
-                        PreviousBrightnessValue,
-                        CurrentBrightnessValue);
-
-                EnableCamera(TomUsbCamCtrlIntfDevStructPtr->UsbDevStructPtr);
-
-		        break;
-	        }
-	        else
-	        {
-	            return -EINVAL;
-	        }		      
-		    
-	    case V4L2_CID_CONTRAST:
+    TomUsbCamHoldControlWrites(TomUsbCamCtrlIntfDevStructPtr, true);
 
-            if (TomUsbCamCtrlIntfDevStructPtr->ContrastChangeSupported)
-            {
+    for (unsigned int ClusterIdx = 0; (ClusterIdx < V4l2ControlReq->ncontrols) && !ErrorValue; ClusterIdx++)
+    {
 
-                TomUsbCamCtrlIntfDevStructPtr->CtrlIntfBuffer[0] = V4l2ControlReq->val & 0xff;
-                TomUsbCamCtrlIntfDevStructPtr->CtrlIntfBuffer[1] = (V4l2ControlReq->val & 0xff00) >> 8;
-
-                DisableCamera(TomUsbCamCtrlIntfDevStructPtr->UsbDevStructPtr);
-                                           
-                ReadFromCamera(TomUsbCamCtrlIntfDevStructPtr->UsbDevStructPtr,
-                               GetCurrentSelectorControlRequest,
-                               ClassTypeRequestType,
-                               InterfaceRecipientRequestType,
-                               ContrastValue,
-                               SelectorOutputTerminalIndex,
-                               InterfaceVideoControlIndex,
-                               &TomUsbCamCtrlIntfDevStructPtr->CtrlIntfBuffer[3],
-                               ContrastControlPacketLen,
-                               FiveSecTimeoutInMsecs);
-                                                      
-                int PreviousContrastValue = (signed char) (TomUsbCamCtrlIntfDevStructPtr->CtrlIntfBuffer[4] << 8) |
-                                            TomUsbCamCtrlIntfDevStructPtr->CtrlIntfBuffer[3];
-
-                WriteToCamera(TomUsbCamCtrlIntfDevStructPtr->UsbDevStructPtr,
-                              SetCurrentSelectorControlRequest,
-                              ClassTypeRequestType,
-                              InterfaceRecipientRequestType,
-                              ContrastValue,
-                              SelectorOutputTerminalIndex,
-                              InterfaceVideoControlIndex,
-                              TomUsbCamCtrlIntfDevStructPtr->CtrlIntfBuffer,
-                              ContrastControlPacketLen,
-                              FiveSecTimeoutInMsecs); 
-                                                                                                         
-                ReadFromCamera(TomUsbCamCtrlIntfDevStructPtr->UsbDevStructPtr,
-                               GetCurrentSelectorControlRequest,
-                               ClassTypeRequestType,
-                               InterfaceRecipientRequestType,
-                               ContrastValue,
-                               SelectorOutputTerminalIndex,
-                               InterfaceVideoControlIndex,
-                               &TomUsbCamCtrlIntfDevStructPtr->CtrlIntfBuffer[3],
-                               ContrastControlPacketLen,
-                               FiveSecTimeoutInMsecs);
-                                                      
-                int CurrentContrastValue = (signed char) (TomUsbCamCtrlIntfDevStructPtr->CtrlIntfBuffer[4] << 8) |
-                                           TomUsbCamCtrlIntfDevStructPtr->CtrlIntfBuffer[3];
-                                                      
-                pr_info("V4L2_CID_CONTRAST value (requested/previous/current): %d / %d / %d", 
-                        V4l2ControlReq->val,
-                        PreviousContrastValue,
-                        CurrentContrastValue);
-
-                EnableCamera(TomUsbCamCtrlIntfDevStructPtr->UsbDevStructPtr);
-
-		        break;
-	        }
-	        else
-	        {
-	            return -EINVAL;
-	        }
-		    
-	    case V4L2_CID_HUE:
-            
-            if (TomUsbCamCtrlIntfDevStructPtr->HueChangeSupported)
-            {
-            
-                TomUsbCamCtrlIntfDevStructPtr->CtrlIntfBuffer[0] = V4l2ControlReq->val & 0xff;
-                TomUsbCamCtrlIntfDevStructPtr->CtrlIntfBuffer[1] = (V4l2ControlReq->val & 0xff00) >> 8;
-
-                DisableCamera(TomUsbCamCtrlIntfDevStructPtr->UsbDevStructPtr);
-                                           
-                ReadFromCamera(TomUsbCamCtrlIntfDevStructPtr->UsbDevStructPtr,
-                               GetCurrentSelectorControlRequest,
-                               ClassTypeRequestType,
-                               InterfaceRecipientRequestType,
-                               HueValue,
-                               SelectorOutputTerminalIndex,
-                               InterfaceVideoControlIndex,
-                               &TomUsbCamCtrlIntfDevStructPtr->CtrlIntfBuffer[3],
-                               HueControlPacketLen,
-                               FiveSecTimeoutInMsecs);
-                                                      
-                int PreviousHueValue = (signed char) (TomUsbCamCtrlIntfDevStructPtr->CtrlIntfBuffer[4] << 8) |
-                                       TomUsbCamCtrlIntfDevStructPtr->CtrlIntfBuffer[3];
-
-                WriteToCamera(TomUsbCamCtrlIntfDevStructPtr->UsbDevStructPtr,
-                              SetCurrentSelectorControlRequest,
-                              ClassTypeRequestType,
-                              InterfaceRecipientRequestType,
-                              HueValue,
-                              SelectorOutputTerminalIndex,
-                              InterfaceVideoControlIndex,
-                              TomUsbCamCtrlIntfDevStructPtr->CtrlIntfBuffer,
-                              HueControlPacketLen,
-                              FiveSecTimeoutInMsecs); 
-                                                                                                         
-                ReadFromCamera(TomUsbCamCtrlIntfDevStructPtr->UsbDevStructPtr,
-                               GetCurrentSelectorControlRequest,
-                               ClassTypeRequestType,
-                               InterfaceRecipientRequestType,
-                               HueValue,
-                               SelectorOutputTerminalIndex,
-                               InterfaceVideoControlIndex,
-                               &TomUsbCamCtrlIntfDevStructPtr->CtrlIntfBuffer[3],
-                               HueControlPacketLen,
-                               FiveSecTimeoutInMsecs);
-                                                      
-                int CurrentHueValue = (signed char) (TomUsbCamCtrlIntfDevStructPtr->CtrlIntfBuffer[4] << 8) |
-                                      TomUsbCamCtrlIntfDevStructPtr->CtrlIntfBuffer[3];
-                                                      
-                pr_info("V4L2_CID_HUE value (requested/previous/current): %d / %d / %d", 
-                        V4l2ControlReq->val,
-                        PreviousHueValue,
-                        CurrentHueValue);
-
-                EnableCamera(TomUsbCamCtrlIntfDevStructPtr->UsbDevStructPtr);
-
-		        break;
-	        }
-	        else
-	        {
-	            return -EINVAL;
-	        }
-		    
-	    default:
-		    
-		    return -EINVAL;
-	}
-	
-	return 0;
+        struct v4l2_ctrl *ClusterControlPtr = V4l2ControlReq->cluster[ClusterIdx];
+
+        if (ClusterControlPtr && ClusterControlPtr->is_new)
+        {
+            ErrorValue = TomUsbCamWriteControl(TomUsbCamCtrlIntfDevStructPtr, ClusterControlPtr);
+        }
+    }
+
+    TomUsbCamHoldControlWrites(TomUsbCamCtrlIntfDevStructPtr, false);
+
+    return ErrorValue;
+}
+
+// Queue the SET_CUR for one control's new value, unless the camera already has it.
+static int TomUsbCamWriteControl(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr, struct v4l2_ctrl *V4l2ControlPtr)
+{
+
+    struct ControlTableStruct *ControlTablePtr = &TomUsbCamCtrlIntfDevStructPtr->ControlTableForThisCameraStruct;
+
+    struct ControlStateStruct *ControlStatePtr = TomUsbCamFindControl(TomUsbCamCtrlIntfDevStructPtr, V4l2ControlPtr->id);
+
+    if (!ControlStatePtr)
+    {
+        return -EINVAL;
+    }
+
+    if (ControlStatePtr->Cur == V4l2ControlPtr->val)
+    {
+        return 0;
+    }
+
+    // A control that packs several fields is always written whole, so take the other fields from the cache.
+    const struct UvcControlMappingStruct *MappingPtr = ControlStatePtr->MappingPtr;
+
+    u32 ControlValue = 0;
+
+    for (unsigned int ControlIdx = 0; ControlIdx < ControlTablePtr->ControlCount; ControlIdx++)
+    {
+
+        struct ControlStateStruct *FieldStatePtr = &ControlTablePtr->Controls[ControlIdx];
+
+        if (FieldStatePtr->MappingPtr->Selector == MappingPtr->Selector)
+        {
+            u32 FieldMask = (FieldStatePtr->MappingPtr->FieldLen < 4) ? ((1U << (8 * FieldStatePtr->MappingPtr->FieldLen)) - 1) : ~0U;
+            s32 FieldValue = (FieldStatePtr == ControlStatePtr) ? V4l2ControlPtr->val : FieldStatePtr->Cur;
+
+            ControlValue |= ((u32) FieldValue & FieldMask) << (8 * FieldStatePtr->MappingPtr->FieldOffset);
+        }
+    }
+
+    // All the fields for the Usb message are defined here. 
+    // Message direction: host->device (set request) 
+    // Request type: class 
+    // Recipient: control interface (SC_VIDEOCONTROL), per table A.2.
+    // Value: the control selector, e.g. brightness (PU_BRIGHTNESS_CONTROL), per table A.13.
+    // Index: the processing unit Id & video control interface (VC_CONTROL_UNDEFINED), per table A.9.
+    // Usb data to send is the control value in little-endian bytes.
+    int WriteErrorValue = TomUsbCamQueueControlWrite(TomUsbCamCtrlIntfDevStructPtr, V4l2ControlPtr->id, MappingPtr->Selector << 8,
+                                                    (ControlTablePtr->ProcessingUnitId << 8) | InterfaceVideoControlIndex,
+                                                    MappingPtr->ControlLen, (s32) ControlValue);
+
+    // Only cache the value once the write is on its way, or retrying the same value would never reach the camera.
+    if (WriteErrorValue == 0)
+    {
+        ControlStatePtr->Cur = V4l2ControlPtr->val;
+    }
+
+    return WriteErrorValue;
+}
+
+// The video node is registered before the camera's controls have been queried, so an open that comes in early waits
+// for them. Everything else (formats, frame sizes) comes from the descriptors and is ready at probe.
+static int TomUsbCamV4l2Open(struct file *File)
+{
+
+	struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr = video_drvdata(File);
+
+    if (wait_for_completion_killable(&TomUsbCamCtrlIntfDevStructPtr->DeferredQueriesForThisCameraStruct.QueriesDone))
+    {
+        return -ERESTARTSYS;
+    }
+
+    return v4l2_fh_open(File);
 }
 
 // This function seems to be required when using v4l2. For example, when using the v4l2-ctl program to set a control,
@@ -982,9 +869,8 @@ static int TomUsbCamQueryCapability(struct file *File, void *Priv, struct v4l2_c
     __u8 DeviceName[] = "Generic Web Cam";
     strlcpy(V4l2CapabilitiesStructPtr->card, DeviceName, sizeof(V4l2CapabilitiesStructPtr->card));
     
-    //  Tom report bus location here.
-    __u8 DeviceBusLocation[] = "usb-0";
-    strlcpy(V4l2CapabilitiesStructPtr->bus_info, DeviceBusLocation, sizeof(V4l2CapabilitiesStructPtr->bus_info));
+    // Tells cameras of the same model apart, e.g. "usb-0000:00:14.0-2".
+    strlcpy(V4l2CapabilitiesStructPtr->bus_info, TomUsbCamCtrlIntfDevStructPtr->DeviceStructPtr->BusInfo, sizeof(V4l2CapabilitiesStructPtr->bus_info));
     
     // Use a made-up version of 1.2.3 for now.
     __u32 KernelVersion = (1 << 16) + (2 << 8) + 3;
@@ -998,11 +884,8 @@ static int TomUsbCamQueryCapability(struct file *File, void *Priv, struct v4l2_c
                          V4L2_CAP_DEVICE_CAPS;
     V4l2CapabilitiesStructPtr->capabilities = Capabilities;
 		
-    __u32 DeviceCapabilities = V4L2_CAP_VIDEO_CAPTURE | 
-                               V4L2_CAP_READWRITE |
-                               V4L2_CAP_AUDIO |
-                               V4L2_CAP_STREAMING;
-    V4l2CapabilitiesStructPtr->device_caps = DeviceCapabilities;
+    // The still node shares this handler and has fewer capabilities than the video node, so report the node's own.
+    V4l2CapabilitiesStructPtr->device_caps = video_devdata(File)->device_caps;
                                              
     // strlcpy(V4l2CapabilitiesStructPtr->reserved, {'\0', '\0', '\0'}, sizeof(V4l2CapabilitiesStructPtr->reserved));
 		 
@@ -1035,59 +918,253 @@ static int TomUsbCamSetFormat(struct file *File, void *Priv, struct v4l2_format
     
         return FormatterErrorValue;
     }
-   
-   
-   
-   
-   
-    
-    
-// Use the Usb comms method from TomUsbCamSetV4l2Control here as well to update the image format
-    
 
+    // Negotiate the new frame size with the camera right away so a mode it can't do is rejected here instead of
+    // on STREAMON. The frame interval stays whatever was last asked for with S_PARM.
+    FormatterErrorValue = TomUsbCamNegotiateStreamingParameters(TomUsbCamCtrlIntfDevStructPtr,
+                                                                V4l2ImageFormatStructPtr->fmt.pix.pixelformat,
+                                                                V4l2ImageFormatStructPtr->fmt.pix.width,
+                                                                V4l2ImageFormatStructPtr->fmt.pix.height,
+                                                                TomUsbCamCtrlIntfDevStructPtr->StreamingParametersForThisCameraStruct.FrameInterval);
 
+    if (FormatterErrorValue != 0)
+    {
+        return FormatterErrorValue;
+    }
 
+    uint32_t MaxVideoFrameSize =
+        get_unaligned_le32(&TomUsbCamCtrlIntfDevStructPtr->StreamingParametersForThisCameraStruct.ProbeControlBlock[ProbeControlMaxVideoFrameSizeOffset]);
 
+    V4l2ImageFormatStructPtr->fmt.pix.sizeimage =
+        TomUsbCamFormatSizeImage(GetStreamingFormat(TomUsbCamCtrlIntfDevStructPtr, V4l2ImageFormatStructPtr->fmt.pix.pixelformat),
+                                 V4l2ImageFormatStructPtr->fmt.pix.sizeimage, MaxVideoFrameSize);
 
-//Does this setting conflict with the previous V4l2PixFormatStruct settings, i.e. the settings around
-//line 300?
     TomUsbCamCtrlIntfDevStructPtr->V4l2PixFormatStruct = V4l2ImageFormatStructPtr->fmt.pix;
  
     return FormatterErrorValue;   
 }
 
-// Tom this is a stub for now
 static int TomUsbCamGetFormat(struct file *File, void *Priv, struct v4l2_format *V4l2ImageFormatStructPtr)
 {
-    return -1;
+
+    struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr = video_drvdata(File);
+
+    V4l2ImageFormatStructPtr->fmt.pix = TomUsbCamCtrlIntfDevStructPtr->V4l2PixFormatStruct;
+
+    return 0;
 }
 
-// Make sure only Yuyv pixel formats are attempted right now.
+// Adjust the requested format to the closest mode in the mode table. Per the V4l2 spec TRY_FMT shouldn't fail just
+// because the exact mode isn't supported, so an unknown pixel format falls back to the 1st one the camera has.
 static int TomUsbCamTryFormat(struct file *File, void *Priv, struct v4l2_format *V4l2ImageFormatStructPtr)
 {
 
     struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr = video_drvdata(File);
 
     struct v4l2_pix_format *V4l2PixelFormat = &V4l2ImageFormatStructPtr->fmt.pix;
-    
-    int FormatterErrorValue = 0;
-    
-    // Only Yuyv data is supported right now.
-	if (V4l2PixelFormat->pixelformat != V4L2_PIX_FMT_YUYV)
-	{
-	    FormatterErrorValue = -EINVAL;
-	}
-	
-	return FormatterErrorValue;
-}
 
-// WriteToCamera() & ReadFromCamera() are just wrappers around usb_control_msg().
-static int WriteToCamera(struct usb_device *UsbDevStructPtr, __u8 UsbMsgRequest, 
-                         __u8 UsbMsgRequestType, __u8 UsbMsgRequestTypeRecipient, 
-                         __u16 UsbMsgValue, __u16 UsbMsgIndexDestination, __u16 UsbMsgIndexId, 
+    struct StreamingFormatStruct *FormatPtr = GetStreamingFormat(TomUsbCamCtrlIntfDevStructPtr, V4l2PixelFormat->pixelformat);
+
+    if (!FormatPtr)
+    {
+        FormatPtr = &TomUsbCamCtrlIntfDevStructPtr->StreamingModeTableForThisCameraStruct.Formats[0];
+    }
+
+    struct StreamingFrameStruct *BestFramePtr = GetClosestStreamingFrame(FormatPtr->Frames, FormatPtr->FrameCount,
+                                                                         V4l2PixelFormat->width, V4l2PixelFormat->height);
+
+    FillPixFormatFromStreamingMode(FormatPtr, BestFramePtr, V4l2PixelFormat);
+
+    return 0;
+}
+
+// The enumeration ioctls below only read the mode table built at probe time.
+static int TomUsbCamEnumFormat(struct file *File, void *Priv, struct v4l2_fmtdesc *V4l2FmtDescStructPtr)
+{
+
+    struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr = video_drvdata(File);
+    struct StreamingModeTableStruct *StreamingModeTableStructPtr = &TomUsbCamCtrlIntfDevStructPtr->StreamingModeTableForThisCameraStruct;
+
+    if (V4l2FmtDescStructPtr->index >= StreamingModeTableStructPtr->FormatCount)
+    {
+        return -EINVAL;
+    }
+
+    struct StreamingFormatStruct *FormatPtr = &StreamingModeTableStructPtr->Formats[V4l2FmtDescStructPtr->index];
+
+    V4l2FmtDescStructPtr->flags = (FormatPtr->Conversion != TOM_USB_CAM_CONVERSION_NONE) ? V4L2_FMT_FLAG_EMULATED : 0;
+    V4l2FmtDescStructPtr->pixelformat = FormatPtr->PixelFormat;
+    strlcpy(V4l2FmtDescStructPtr->description, FormatPtr->Description, sizeof(V4l2FmtDescStructPtr->description));
+
+    return 0;
+}
+
+static int TomUsbCamEnumFrameSizes(struct file *File, void *Priv, struct v4l2_frmsizeenum *V4l2FrmSizeEnumStructPtr)
+{
+
+    struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr = video_drvdata(File);
+
+    struct StreamingFormatStruct *FormatPtr = GetStreamingFormat(TomUsbCamCtrlIntfDevStructPtr, V4l2FrmSizeEnumStructPtr->pixel_format);
+
+    if (!FormatPtr || (V4l2FrmSizeEnumStructPtr->index >= FormatPtr->FrameCount))
+    {
+        return -EINVAL;
+    }
+
+    V4l2FrmSizeEnumStructPtr->type = V4L2_FRMSIZE_TYPE_DISCRETE;
+    V4l2FrmSizeEnumStructPtr->discrete.width = FormatPtr->Frames[V4l2FrmSizeEnumStructPtr->index].Width;
+    V4l2FrmSizeEnumStructPtr->discrete.height = FormatPtr->Frames[V4l2FrmSizeEnumStructPtr->index].Height;
+
+    return 0;
+}
+
+static int TomUsbCamEnumFrameIntervals(struct file *File, void *Priv, struct v4l2_frmivalenum *V4l2FrmIvalEnumStructPtr)
+{
+
+    struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr = video_drvdata(File);
+    struct StreamingFormatStruct *FormatPtr;
+    struct StreamingFrameStruct *FramePtr;
+
+    if (GetStreamingMode(TomUsbCamCtrlIntfDevStructPtr, V4l2FrmIvalEnumStructPtr->pixel_format, V4l2FrmIvalEnumStructPtr->width,
+                         V4l2FrmIvalEnumStructPtr->height, &FormatPtr, &FramePtr))
+    {
+        return -EINVAL;
+    }
+
+    if (FramePtr->ContinuousFrameIntervals)
+    {
+
+        // A continuous range is reported as a single stepwise entry.
+        if (V4l2FrmIvalEnumStructPtr->index != 0)
+        {
+            return -EINVAL;
+        }
+
+        V4l2FrmIvalEnumStructPtr->type = V4L2_FRMIVAL_TYPE_STEPWISE;
+        V4l2FrmIvalEnumStructPtr->stepwise.min.numerator = FramePtr->FrameIntervals[0];
+        V4l2FrmIvalEnumStructPtr->stepwise.min.denominator = FrameIntervalUnitsPerSec;
+        V4l2FrmIvalEnumStructPtr->stepwise.max.numerator = FramePtr->FrameIntervals[1];
+        V4l2FrmIvalEnumStructPtr->stepwise.max.denominator = FrameIntervalUnitsPerSec;
+        V4l2FrmIvalEnumStructPtr->stepwise.step.numerator = FramePtr->FrameIntervals[2];
+        V4l2FrmIvalEnumStructPtr->stepwise.step.denominator = FrameIntervalUnitsPerSec;
+    }
+    else
+    {
+
+        if (V4l2FrmIvalEnumStructPtr->index >= FramePtr->FrameIntervalCount)
+        {
+            return -EINVAL;
+        }
+
+        V4l2FrmIvalEnumStructPtr->type = V4L2_FRMIVAL_TYPE_DISCRETE;
+        V4l2FrmIvalEnumStructPtr->discrete.numerator = FramePtr->FrameIntervals[V4l2FrmIvalEnumStructPtr->index];
+        V4l2FrmIvalEnumStructPtr->discrete.denominator = FrameIntervalUnitsPerSec;
+    }
+
+    return 0;
+}
+
+// Report the frame interval of the current mode. V4l2 wants it as a fraction of a second, and Uvc intervals are
+// already in 100 ns units, so no rounding is needed.
+static int TomUsbCamGetStreamParameters(struct file *File, void *Priv, struct v4l2_streamparm *V4l2StreamParmStructPtr)
+{
+
+    struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr = video_drvdata(File);
+    struct StreamingParametersStruct *StreamingParametersStructPtr = &TomUsbCamCtrlIntfDevStructPtr->StreamingParametersForThisCameraStruct;
+
+    if (V4l2StreamParmStructPtr->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
+    {
+        return -EINVAL;
+    }
+
+    uint32_t FrameInterval = StreamingParametersStructPtr->FrameInterval;
+
+    if (StreamingParametersStructPtr->ProbeControlBlockValid)
+    {
+        FrameInterval = get_unaligned_le32(&StreamingParametersStructPtr->ProbeControlBlock[ProbeControlFrameIntervalOffset]);
+    }
+    else if (FrameInterval == 0)
+    {
+
+        struct StreamingFormatStruct *FormatPtr;
+        struct StreamingFrameStruct *FramePtr;
+
+        if (!GetStreamingMode(TomUsbCamCtrlIntfDevStructPtr, TomUsbCamCtrlIntfDevStructPtr->V4l2PixFormatStruct.pixelformat,
+                              TomUsbCamCtrlIntfDevStructPtr->V4l2PixFormatStruct.width, TomUsbCamCtrlIntfDevStructPtr->V4l2PixFormatStruct.height,
+                              &FormatPtr, &FramePtr))
+        {
+            FrameInterval = FramePtr->DefaultFrameInterval;
+        }
+    }
+
+    memset(&V4l2StreamParmStructPtr->parm, 0, sizeof(V4l2StreamParmStructPtr->parm));
+
+    V4l2StreamParmStructPtr->parm.capture.capability = V4L2_CAP_TIMEPERFRAME;
+    V4l2StreamParmStructPtr->parm.capture.timeperframe.numerator = FrameInterval;
+    V4l2StreamParmStructPtr->parm.capture.timeperframe.denominator = FrameIntervalUnitsPerSec;
+
+    return 0;
+}
+
+// Change the frame interval. The camera picks the closest interval it supports for the current frame size during
+// the probe negotiation, and that is what gets reported back.
+static int TomUsbCamSetStreamParameters(struct file *File, void *Priv, struct v4l2_streamparm *V4l2StreamParmStructPtr)
+{
+
+    struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr = video_drvdata(File);
+    struct v4l2_fract *TimePerFramePtr = &V4l2StreamParmStructPtr->parm.capture.timeperframe;
+
+    if (V4l2StreamParmStructPtr->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
+    {
+        return -EINVAL;
+    }
+
+    // The committed mode can't change under a running stream.
+    if (vb2_is_streaming(&TomUsbCamCtrlIntfDevStructPtr->TomUsbCamV4l2Queue))
+    {
+        return -EBUSY;
+    }
+
+    // A 0 numerator or denominator means "use the default", which is what a 0 interval means to the negotiation.
+    uint32_t FrameInterval = 0;
+
+    if (TimePerFramePtr->numerator && TimePerFramePtr->denominator)
+    {
+        FrameInterval = (uint32_t) min_t(u64, div_u64((u64) TimePerFramePtr->numerator * FrameIntervalUnitsPerSec, TimePerFramePtr->denominator),
+                                         U32_MAX);
+    }
+
+    int NegotiationErrorValue = TomUsbCamNegotiateStreamingParameters(TomUsbCamCtrlIntfDevStructPtr,
+                                                                      TomUsbCamCtrlIntfDevStructPtr->V4l2PixFormatStruct.pixelformat,
+                                                                      TomUsbCamCtrlIntfDevStructPtr->V4l2PixFormatStruct.width,
+                                                                      TomUsbCamCtrlIntfDevStructPtr->V4l2PixFormatStruct.height,
+                                                                      FrameInterval);
+
+    if (NegotiationErrorValue)
+    {
+        return NegotiationErrorValue;
+    }
+
+    TomUsbCamCtrlIntfDevStructPtr->StreamingParametersForThisCameraStruct.FrameInterval = FrameInterval;
+
+    return TomUsbCamGetStreamParameters(File, Priv, V4l2StreamParmStructPtr);
+}
+
+// WriteToCamera() & ReadFromCamera() are just wrappers around usb_control_msg(), which trace the transfer on both sides
+// and add how long it took to the control latency histogram.
+static int WriteToCamera(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr, __u8 UsbMsgRequest, 
+                         __u8 UsbMsgRequestType, __u8 UsbMsgRequestTypeRecipient, 
+                         __u16 UsbMsgValue, __u16 UsbMsgIndexDestination, __u16 UsbMsgIndexId, 
                          unsigned char *UsbMsgData, __u16 UsbMsgDataSize, int UsbMsgTimeout)
 {
 
+    struct usb_device *UsbDevStructPtr = TomUsbCamCtrlIntfDevStructPtr->UsbDevStructPtr;
+
+    trace_tomusbcam_control_start(TomUsbCamCtrlIntfDevStructPtr, HostToDeviceDataPhaseTransferDirectionRequestType | UsbMsgRequestType | UsbMsgRequestTypeRecipient,
+                                  UsbMsgRequest, UsbMsgValue, UsbMsgIndexDestination | UsbMsgIndexId, UsbMsgDataSize);
+
+    u64 RequestedNs = ktime_get_ns();
+
     int BytesRcvdOrErrorCode = usb_control_msg(UsbDevStructPtr,
                                                usb_sndctrlpipe(UsbDevStructPtr, 
                                                                HostToDeviceDataPhaseTransferDirectionRequestType),                                                               
@@ -1101,15 +1178,28 @@ static int WriteToCamera(struct usb_device *UsbDevStructPtr, __u8 UsbMsgRequest,
                                                UsbMsgDataSize,
                                                UsbMsgTimeout);
 
+    trace_tomusbcam_control_end(TomUsbCamCtrlIntfDevStructPtr, HostToDeviceDataPhaseTransferDirectionRequestType | UsbMsgRequestType | UsbMsgRequestTypeRecipient,
+                                UsbMsgRequest, UsbMsgValue, UsbMsgIndexDestination | UsbMsgIndexId, BytesRcvdOrErrorCode);
+
+    TomUsbCamRecordLatency(TomUsbCamCtrlIntfDevStructPtr->StreamStatsForThisCameraStruct.CountersPtr, TOM_USB_CAM_LATENCY_CONTROL,
+                           RequestedNs, ktime_get_ns());
+
     return BytesRcvdOrErrorCode;
 }
 
-static int ReadFromCamera(struct usb_device *UsbDevStructPtr, __u8 UsbMsgRequest, 
+static int ReadFromCamera(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr, __u8 UsbMsgRequest, 
                          __u8 UsbMsgRequestType, __u8 UsbMsgRequestTypeRecipient, 
                          __u16 UsbMsgValue, __u16 UsbMsgIndexDestination, __u16 UsbMsgIndexId,
                          unsigned char *UsbMsgData, __u16 UsbMsgDataSize, int UsbMsgTimeout)
 {
 
+    struct usb_device *UsbDevStructPtr = TomUsbCamCtrlIntfDevStructPtr->UsbDevStructPtr;
+
+    trace_tomusbcam_control_start(TomUsbCamCtrlIntfDevStructPtr, DeviceToHostDataPhaseTransferDirectionRequestType | UsbMsgRequestType | UsbMsgRequestTypeRecipient,
+                                  UsbMsgRequest, UsbMsgValue, UsbMsgIndexDestination | UsbMsgIndexId, UsbMsgDataSize);
+
+    u64 RequestedNs = ktime_get_ns();
+
     int BytesRcvdOrErrorCode = usb_control_msg(UsbDevStructPtr,
                                                usb_rcvctrlpipe(UsbDevStructPtr, 
                                                                DeviceToHostDataPhaseTransferDirectionRequestType),                                                               
@@ -1123,530 +1213,5292 @@ static int ReadFromCamera(struct usb_device *UsbDevStructPtr, __u8 UsbMsgRequest
                                                UsbMsgDataSize,
                                                UsbMsgTimeout);
 
+    trace_tomusbcam_control_end(TomUsbCamCtrlIntfDevStructPtr, DeviceToHostDataPhaseTransferDirectionRequestType | UsbMsgRequestType | UsbMsgRequestTypeRecipient,
+                                UsbMsgRequest, UsbMsgValue, UsbMsgIndexDestination | UsbMsgIndexId, BytesRcvdOrErrorCode);
+
+    TomUsbCamRecordLatency(TomUsbCamCtrlIntfDevStructPtr->StreamStatsForThisCameraStruct.CountersPtr, TOM_USB_CAM_LATENCY_CONTROL,
+                           RequestedNs, ktime_get_ns());
+
     return BytesRcvdOrErrorCode;
 }
 
-// Query the max/min/step/default values of the camera before adding the V4l2 controls.
-// The ResetToDefault flag is used to restore the specific queried value.
-static int QueryCameraFactoryValues(struct usb_device *UsbDevStructPtr, __u16 UsbMsgValue, __u16 UsbMsgDataSize,
-                                    unsigned char *UsbMsgData, int *Max, int *Min, int *Step, int *Default, bool ResetToDefault)
+// Set up the control Urb and its Dma-able setup packet and data buffer. Returns 0 on success.
+static int TomUsbCamInitAsyncControls(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr)
 {
 
-    DisableCamera(UsbDevStructPtr);
+    struct AsyncControlStruct *AsyncControlPtr = &TomUsbCamCtrlIntfDevStructPtr->AsyncControlForThisCameraStruct;
 
-    int BytesRcvdOrErrorCode = 0;
+    spin_lock_init(&AsyncControlPtr->AsyncControlLock);
+    INIT_WORK(&AsyncControlPtr->ResyncWork, TomUsbCamResyncControlsWork);
+
+    INIT_WORK(&TomUsbCamCtrlIntfDevStructPtr->RequestControlsForThisCameraStruct.ApplyWork, TomUsbCamApplyRequestControlsWork);
+    INIT_WORK(&TomUsbCamCtrlIntfDevStructPtr->RequestControlsForThisCameraStruct.DoneWork, TomUsbCamDoneBuffersWork);
+    INIT_LIST_HEAD(&TomUsbCamCtrlIntfDevStructPtr->RequestControlsForThisCameraStruct.DoneBufferListHead);
 
-    BytesRcvdOrErrorCode |= ReadFromCamera(UsbDevStructPtr,
-                                           GetMinSelectorControlRequest,
-                                           ClassTypeRequestType,
-                                           InterfaceRecipientRequestType,
-                                           UsbMsgValue,
-                                           SelectorOutputTerminalIndex,
-                                           InterfaceVideoControlIndex,
-                                           UsbMsgData,
-                                           UsbMsgDataSize,
-                                           FiveSecTimeoutInMsecs);
-                      
-    if (UsbMsgDataSize == 1)
+    AsyncControlPtr->ControlUrbPtr = usb_alloc_urb(0, GFP_KERNEL);
+    AsyncControlPtr->ControlSetupPtr = kzalloc(sizeof(*AsyncControlPtr->ControlSetupPtr), GFP_KERNEL);
+    AsyncControlPtr->ControlDataPtr = kzalloc(TOM_USB_CAM_MAX_CONTROL_LEN, GFP_KERNEL);
+
+    if (!AsyncControlPtr->ControlUrbPtr || !AsyncControlPtr->ControlSetupPtr || !AsyncControlPtr->ControlDataPtr)
     {
-        *Min = (int8_t) UsbMsgData[0];
+        TomUsbCamFreeAsyncControls(TomUsbCamCtrlIntfDevStructPtr);
+
+        return -ENOMEM;
     }
-    else if (UsbMsgDataSize == 2)
+
+    return 0;
+}
+
+// Wait for the control Urb and the work item, then free everything. Writes still waiting are dropped.
+static void TomUsbCamFreeAsyncControls(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr)
+{
+
+    struct AsyncControlStruct *AsyncControlPtr = &TomUsbCamCtrlIntfDevStructPtr->AsyncControlForThisCameraStruct;
+
+    unsigned long SpinLockFlags;
+
+    // Keep the completion handler from submitting the next write.
+    spin_lock_irqsave(&AsyncControlPtr->AsyncControlLock, SpinLockFlags);
+    AsyncControlPtr->Stopped = true;
+    spin_unlock_irqrestore(&AsyncControlPtr->AsyncControlLock, SpinLockFlags);
+
+    if (AsyncControlPtr->ControlUrbPtr)
     {
-        *Min = (int16_t) (UsbMsgData[0] |
-                          UsbMsgData[1] << 8);                     
+        usb_kill_urb(AsyncControlPtr->ControlUrbPtr);
     }
-    
-    BytesRcvdOrErrorCode |= ReadFromCamera(UsbDevStructPtr,
-                                           GetMaxSelectorControlRequest,
-                                           ClassTypeRequestType,
-                                           InterfaceRecipientRequestType,
-                                           UsbMsgValue,
-                                           SelectorOutputTerminalIndex,
-                                           InterfaceVideoControlIndex,
-                                           UsbMsgData,
-                                           UsbMsgDataSize,
-                                           FiveSecTimeoutInMsecs);
-                              
-    if (UsbMsgDataSize == 1)
-    {
-        *Max = (int8_t) UsbMsgData[0];
-    }
-    else if (UsbMsgDataSize == 2)
-    {
-        *Max = (int16_t) (UsbMsgData[0] |
-                          UsbMsgData[1] << 8);
-    }    
-    
-    BytesRcvdOrErrorCode |= ReadFromCamera(UsbDevStructPtr,
-                                           GetResolutionSelectorControlRequest,
-                                           ClassTypeRequestType,
-                                           InterfaceRecipientRequestType,
-                                           UsbMsgValue,
-                                           SelectorOutputTerminalIndex,
-                                           InterfaceVideoControlIndex,
-                                           UsbMsgData,
-                                           UsbMsgDataSize,
-                                           FiveSecTimeoutInMsecs);
-                              
-    if (UsbMsgDataSize == 1)
-    {
-        *Step = (int8_t) UsbMsgData[0];
-    }
-    else if (UsbMsgDataSize == 2)
-    {
-        *Step = (int16_t) (UsbMsgData[0] |
-                           UsbMsgData[1] << 8);
-    }            
-
-    BytesRcvdOrErrorCode |= ReadFromCamera(UsbDevStructPtr,
-                                           GetDefaultSelectorControlRequest,
-                                           ClassTypeRequestType,
-                                           InterfaceRecipientRequestType,
-                                           UsbMsgValue,
-                                           SelectorOutputTerminalIndex,
-                                           InterfaceVideoControlIndex,
-                                           UsbMsgData,
-                                           UsbMsgDataSize,
-                                           FiveSecTimeoutInMsecs);
-                              
-    if (UsbMsgDataSize == 1)
-    {
-        *Default = (int8_t) UsbMsgData[0];
-    }
-    else if (UsbMsgDataSize == 2)
-    {
-        *Default = (int16_t) (UsbMsgData[0] |
-                              UsbMsgData[1] << 8);
+
+    cancel_work_sync(&TomUsbCamCtrlIntfDevStructPtr->RequestControlsForThisCameraStruct.ApplyWork);
+    TomUsbCamDrainRequestControls(TomUsbCamCtrlIntfDevStructPtr);
+
+    cancel_work_sync(&AsyncControlPtr->ResyncWork);
+
+    usb_free_urb(AsyncControlPtr->ControlUrbPtr);
+    kfree(AsyncControlPtr->ControlSetupPtr);
+    kfree(AsyncControlPtr->ControlDataPtr);
+
+    AsyncControlPtr->ControlUrbPtr = NULL;
+    AsyncControlPtr->ControlSetupPtr = NULL;
+    AsyncControlPtr->ControlDataPtr = NULL;
+}
+
+// Queue a SET_CUR for a control and send it right away if the control Urb is free. A control that is already
+// waiting just gets the new value, so a fast moving slider only sends the values the camera has time for.
+// Returns 0 if the write was queued.
+static int TomUsbCamQueueControlWrite(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr, u32 V4l2Id,
+                                      __u16 UsbMsgValue, __u16 UsbMsgIndex, __u16 UsbMsgDataSize, s32 ControlValue)
+{
+
+    struct AsyncControlStruct *AsyncControlPtr = &TomUsbCamCtrlIntfDevStructPtr->AsyncControlForThisCameraStruct;
+    struct ControlWriteStruct *ControlWritePtr = NULL;
+
+    int ErrorValue = 0;
+
+    unsigned long SpinLockFlags;
+
+    if (UsbMsgDataSize > TOM_USB_CAM_MAX_CONTROL_LEN)
+    {
+        return -EINVAL;
     }
-    
-    if (ResetToDefault)
-    {
-        WriteToCamera(UsbDevStructPtr,
-                      SetInterfaceRequest,
-                      ClassTypeRequestType,
-                      InterfaceRecipientRequestType,
-                      UsbMsgValue,
-                      SelectorOutputTerminalIndex,
-                      InterfaceVideoControlIndex,
-                      UsbMsgData,
-                      UsbMsgDataSize,
-                      FiveSecTimeoutInMsecs);    
+
+    spin_lock_irqsave(&AsyncControlPtr->AsyncControlLock, SpinLockFlags);
+
+    for (int WriteIdx = 0; WriteIdx < TOM_USB_CAM_NUM_PENDING_CONTROL_WRITES; WriteIdx++)
+    {
+
+        struct ControlWriteStruct *CandidatePtr = &AsyncControlPtr->PendingWrites[WriteIdx];
+
+        if (CandidatePtr->Pending && (CandidatePtr->Value == UsbMsgValue) && (CandidatePtr->Index == UsbMsgIndex))
+        {
+            ControlWritePtr = CandidatePtr;
+            break;
+        }
+
+        if (!CandidatePtr->Pending && !ControlWritePtr)
+        {
+            ControlWritePtr = CandidatePtr;
+        }
+    }
+
+    if (AsyncControlPtr->Stopped)
+    {
+        ErrorValue = -ENODEV;
+    }
+    else if (!ControlWritePtr)
+    {
+        ErrorValue = -EBUSY;
+    }
+    else
+    {
+
+        // A control already waiting keeps the time it was first asked for.
+        if (!ControlWritePtr->Pending)
+        {
+            ControlWritePtr->RequestedNs = ktime_get_ns();
+        }
+
+        ControlWritePtr->Pending = true;
+        ControlWritePtr->V4l2Id = V4l2Id;
+        ControlWritePtr->Value = UsbMsgValue;
+        ControlWritePtr->Index = UsbMsgIndex;
+        ControlWritePtr->Len = UsbMsgDataSize;
+
+        // Control values are little-endian on the wire.
+        for (int ByteIdx = 0; ByteIdx < UsbMsgDataSize; ByteIdx++)
+        {
+            ControlWritePtr->Data[ByteIdx] = (ControlValue >> (8 * ByteIdx)) & 0xff;
+        }
+
+        if (!AsyncControlPtr->ControlUrbBusy && !AsyncControlPtr->HoldWrites)
+        {
+            ErrorValue = TomUsbCamSubmitNextControlWrite(TomUsbCamCtrlIntfDevStructPtr);
+        }
+    }
+
+    spin_unlock_irqrestore(&AsyncControlPtr->AsyncControlLock, SpinLockFlags);
+
+    return ErrorValue;
+}
+
+// Hold back control writes while a batch is queued, then send them back to back.
+static void TomUsbCamHoldControlWrites(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr, bool HoldWrites)
+{
+
+    struct AsyncControlStruct *AsyncControlPtr = &TomUsbCamCtrlIntfDevStructPtr->AsyncControlForThisCameraStruct;
+
+    unsigned long SpinLockFlags;
+
+    spin_lock_irqsave(&AsyncControlPtr->AsyncControlLock, SpinLockFlags);
+
+    AsyncControlPtr->HoldWrites = HoldWrites;
+
+    if (!HoldWrites && !AsyncControlPtr->ControlUrbBusy && !AsyncControlPtr->Stopped)
+    {
+        TomUsbCamSubmitNextControlWrite(TomUsbCamCtrlIntfDevStructPtr);
+    }
+
+    spin_unlock_irqrestore(&AsyncControlPtr->AsyncControlLock, SpinLockFlags);
+}
+
+// Send the first waiting write on the control Urb. Called with AsyncControlLock held and the Urb idle. A write that
+// can't be submitted goes on to be read back, the same as one the camera refused, since the control framework already
+// holds its value. Most callers are in the completion handler or let go of a batch, where nobody sees the error.
+static int TomUsbCamSubmitNextControlWrite(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr)
+{
+
+    struct AsyncControlStruct *AsyncControlPtr = &TomUsbCamCtrlIntfDevStructPtr->AsyncControlForThisCameraStruct;
+    struct usb_device *UsbDevStructPtr = TomUsbCamCtrlIntfDevStructPtr->UsbDevStructPtr;
+
+    int SubmitReturnCode = 0;
+
+    for (int WriteIdx = 0; WriteIdx < TOM_USB_CAM_NUM_PENDING_CONTROL_WRITES; WriteIdx++)
+    {
+
+        struct ControlWriteStruct *ControlWritePtr = &AsyncControlPtr->PendingWrites[WriteIdx];
+
+        if (!ControlWritePtr->Pending)
+        {
+            continue;
+        }
+
+        AsyncControlPtr->InFlightWrite = *ControlWritePtr;
+
+        AsyncControlPtr->ControlSetupPtr->bRequestType = HostToDeviceDataPhaseTransferDirectionRequestType |
+                                                         ClassTypeRequestType |
+                                                         InterfaceRecipientRequestType;
+        AsyncControlPtr->ControlSetupPtr->bRequest = SetCurrentSelectorControlRequest;
+        AsyncControlPtr->ControlSetupPtr->wValue = cpu_to_le16(ControlWritePtr->Value);
+        AsyncControlPtr->ControlSetupPtr->wIndex = cpu_to_le16(ControlWritePtr->Index);
+        AsyncControlPtr->ControlSetupPtr->wLength = cpu_to_le16(ControlWritePtr->Len);
+
+        memcpy(AsyncControlPtr->ControlDataPtr, ControlWritePtr->Data, ControlWritePtr->Len);
+
+        usb_fill_control_urb(AsyncControlPtr->ControlUrbPtr,
+                             UsbDevStructPtr,
+                             usb_sndctrlpipe(UsbDevStructPtr, 0),
+                             (unsigned char *) AsyncControlPtr->ControlSetupPtr,
+                             AsyncControlPtr->ControlDataPtr,
+                             ControlWritePtr->Len,
+                             TomUsbCamControlUrbComplete,
+                             TomUsbCamCtrlIntfDevStructPtr);
+
+        trace_tomusbcam_control_start(TomUsbCamCtrlIntfDevStructPtr, AsyncControlPtr->ControlSetupPtr->bRequestType,
+                                      AsyncControlPtr->ControlSetupPtr->bRequest, ControlWritePtr->Value, ControlWritePtr->Index,
+                                      ControlWritePtr->Len);
+
+        SubmitReturnCode = usb_submit_urb(AsyncControlPtr->ControlUrbPtr, GFP_ATOMIC);
+
+        // Either way the write is accounted for now, on the Urb or to be read back.
+        ControlWritePtr->Pending = false;
+
+        if (SubmitReturnCode == 0)
+        {
+
+            AsyncControlPtr->ControlUrbBusy = true;
+
+            return 0;
+        }
+
+        pr_err("TomUsbCamSubmitNextControlWrite error: control 0x%x usb_submit_urb() returned %d", AsyncControlPtr->InFlightWrite.V4l2Id,
+               SubmitReturnCode);
+
+        // The camera is gone, so a read back wouldn't get anywhere either.
+        if ((SubmitReturnCode == -ENODEV) || (SubmitReturnCode == -ESHUTDOWN))
+        {
+
+            AsyncControlPtr->Stopped = true;
+
+            return SubmitReturnCode;
+        }
+
+        // Try the next waiting write, as this one may have failed for reasons of its own.
+        TomUsbCamResyncFailedControlWrite(TomUsbCamCtrlIntfDevStructPtr);
+    }
+
+    return SubmitReturnCode;
+}
+
+// Have the write in InFlightWrite read back by ResyncWork. Called with AsyncControlLock held.
+static void TomUsbCamResyncFailedControlWrite(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr)
+{
+
+    struct AsyncControlStruct *AsyncControlPtr = &TomUsbCamCtrlIntfDevStructPtr->AsyncControlForThisCameraStruct;
+
+    for (int WriteIdx = 0; WriteIdx < TOM_USB_CAM_NUM_PENDING_CONTROL_WRITES; WriteIdx++)
+    {
+
+        if (!AsyncControlPtr->FailedWrites[WriteIdx].Pending ||
+            (AsyncControlPtr->FailedWrites[WriteIdx].V4l2Id == AsyncControlPtr->InFlightWrite.V4l2Id))
+        {
+            AsyncControlPtr->FailedWrites[WriteIdx] = AsyncControlPtr->InFlightWrite;
+            break;
+        }
+    }
+
+    schedule_work(&AsyncControlPtr->ResyncWork);
+}
+
+// Runs in interrupt context when the camera has taken (or refused) a control write. Send the next waiting write,
+// and have a failed one read back so the control framework shows what the camera is really using.
+static void TomUsbCamControlUrbComplete(struct urb *UrbPtr)
+{
+
+    struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr = UrbPtr->context;
+    struct AsyncControlStruct *AsyncControlPtr = &TomUsbCamCtrlIntfDevStructPtr->AsyncControlForThisCameraStruct;
+
+    unsigned long SpinLockFlags;
+
+    trace_tomusbcam_control_end(TomUsbCamCtrlIntfDevStructPtr, AsyncControlPtr->ControlSetupPtr->bRequestType,
+                                AsyncControlPtr->ControlSetupPtr->bRequest, AsyncControlPtr->InFlightWrite.Value,
+                                AsyncControlPtr->InFlightWrite.Index, UrbPtr->status ? UrbPtr->status : UrbPtr->actual_length);
+
+    spin_lock_irqsave(&AsyncControlPtr->AsyncControlLock, SpinLockFlags);
+
+    AsyncControlPtr->ControlUrbBusy = false;
+
+    switch (UrbPtr->status)
+    {
+
+        case 0:
+            TomUsbCamRecordLatency(TomUsbCamCtrlIntfDevStructPtr->StreamStatsForThisCameraStruct.CountersPtr, TOM_USB_CAM_LATENCY_CONTROL,
+                                   AsyncControlPtr->InFlightWrite.RequestedNs, ktime_get_ns());
+            break;
+
+        // The Urb was killed or the device went away.
+        case -ENOENT:
+        case -ECONNRESET:
+        case -ESHUTDOWN:
+            AsyncControlPtr->Stopped = true;
+            break;
+
+        default:
+
+            pr_warn_ratelimited("TomUsbCamControlUrbComplete error: control 0x%x write failed with status %d",
+                                AsyncControlPtr->InFlightWrite.V4l2Id, UrbPtr->status);
+
+            TomUsbCamResyncFailedControlWrite(TomUsbCamCtrlIntfDevStructPtr);
+            break;
+    }
+
+    if (!AsyncControlPtr->Stopped && !AsyncControlPtr->HoldWrites)
+    {
+        TomUsbCamSubmitNextControlWrite(TomUsbCamCtrlIntfDevStructPtr);
+    }
+
+    spin_unlock_irqrestore(&AsyncControlPtr->AsyncControlLock, SpinLockFlags);
+}
+
+// Read back every control whose write failed and hand the camera's value to the control framework, which also
+// sends V4L2_EVENT_CTRL to anyone subscribed.
+static void TomUsbCamResyncControlsWork(struct work_struct *WorkPtr)
+{
+
+    struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr =
+            container_of(WorkPtr, struct TomUsbCamCtrlIntfDevStruct, AsyncControlForThisCameraStruct.ResyncWork);
+    struct AsyncControlStruct *AsyncControlPtr = &TomUsbCamCtrlIntfDevStructPtr->AsyncControlForThisCameraStruct;
+
+    unsigned char *ControlDataPtr = kmalloc(TOM_USB_CAM_MAX_CONTROL_LEN, GFP_KERNEL);
+
+    if (!ControlDataPtr)
+    {
+        return;
+    }
+
+    for (int WriteIdx = 0; WriteIdx < TOM_USB_CAM_NUM_PENDING_CONTROL_WRITES; WriteIdx++)
+    {
+
+        struct ControlWriteStruct FailedWrite;
+
+        unsigned long SpinLockFlags;
+
+        spin_lock_irqsave(&AsyncControlPtr->AsyncControlLock, SpinLockFlags);
+        FailedWrite = AsyncControlPtr->FailedWrites[WriteIdx];
+        AsyncControlPtr->FailedWrites[WriteIdx].Pending = false;
+        spin_unlock_irqrestore(&AsyncControlPtr->AsyncControlLock, SpinLockFlags);
+
+        if (!FailedWrite.Pending)
+        {
+            continue;
+        }
+
+        int BytesRcvdOrErrorCode = ReadFromCamera(TomUsbCamCtrlIntfDevStructPtr,
+                                                  GetCurrentSelectorControlRequest,
+                                                  ClassTypeRequestType,
+                                                  InterfaceRecipientRequestType,
+                                                  FailedWrite.Value,
+                                                  FailedWrite.Index,
+                                                  0x0,
+                                                  ControlDataPtr,
+                                                  FailedWrite.Len,
+                                                  FiveSecTimeoutInMsecs);
+
+        if (BytesRcvdOrErrorCode != FailedWrite.Len)
+        {
+            pr_err("TomUsbCamResyncControlsWork error: couldn't read back control 0x%x (%d)", FailedWrite.V4l2Id, BytesRcvdOrErrorCode);
+            continue;
+        }
+
+        TomUsbCamUpdateControlsFromCamera(TomUsbCamCtrlIntfDevStructPtr, FailedWrite.Value >> 8, ControlDataPtr);
+    }
+
+    kfree(ControlDataPtr);
+}
+
+// Add a v4l2 control for every entry of UvcControlMappingTable whose bmControls bit the processing unit descriptor
+// sets. Any problem with a single control just leaves it out, since the v4l2 control handler refuses to work at all
+// once one control fails to be added. Runs from TomUsbCamQueryControlsWork(), after the video node is registered.
+static void TomUsbCamBuildControlTable(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr)
+{
+
+    struct ControlTableStruct *ControlTablePtr = &TomUsbCamCtrlIntfDevStructPtr->ControlTableForThisCameraStruct;
+
+    uint32_t CameraControlCapabilities = 0;
+
+    ControlTablePtr->ControlCount = 0;
+
+    // Check which controls this specific camera actually supports. This information is contained
+    // in the device descriptor data that was saved when the camera was plugged in.
+    // Parent interface #0 is the control interface, the processing unit selector describes the supported
+    // capabilites.
+    uint8_t ParentInterfaceAssoc = 0, VideoInterfaceSubtype = InterfaceProcessingUnitIndex;
+    int8_t DescriptorReadSuccess;
+
+    struct VideoInterfaceDescriptorStruct *VideoInterfaceDescriptorStructPtr;
+
+    GetVideoInterfaceDescriptorStruct(TomUsbCamCtrlIntfDevStructPtr, ParentInterfaceAssoc, VideoInterfaceSubtype,
+                                      &VideoInterfaceDescriptorStructPtr, &DescriptorReadSuccess);
+
+    // VarData starts after bDescriptorSubtype.
+    if ((DescriptorReadSuccess == 1) && (VideoInterfaceDescriptorStructPtr->bLength >= ProcessingUnitDescriptorMinLen + 3))
+    {
+
+        uint8_t *VarData = VideoInterfaceDescriptorStructPtr->VarData;
+        uint8_t ControlSize = min_t(uint8_t, VarData[ProcessingUnitDescriptorControlSizeOffset], sizeof(CameraControlCapabilities));
+
+        ControlSize = min_t(uint8_t, ControlSize, VideoInterfaceDescriptorStructPtr->bLength - 3 - ProcessingUnitDescriptorControlsOffset);
+
+        ControlTablePtr->ProcessingUnitId = VarData[ProcessingUnitDescriptorUnitIdOffset];
+
+        // Section 3.7.2.5 of [5] enumerates what the bmControls bits translate to.
+        for (int ByteIdx = 0; ByteIdx < ControlSize; ByteIdx++)
+        {
+            CameraControlCapabilities |= (uint32_t) VarData[ProcessingUnitDescriptorControlsOffset + ByteIdx] << (8 * ByteIdx);
+        }
+    }
+    else
+    {
+        pr_warn("TomUsbCamBuildControlTable: no processing unit descriptor, so no controls");
+    }
+
+    // The streaming interface is already at alt setting 0 after probe. This runs after the video node is up, so
+    // don't touch it here: a stream may have been started in the meantime.
+
+    for (int MappingIdx = 0; MappingIdx < ARRAY_SIZE(UvcControlMappingTable); MappingIdx++)
+    {
+
+        const struct UvcControlMappingStruct *MappingPtr = &UvcControlMappingTable[MappingIdx];
+
+        struct ControlStateStruct *ControlStatePtr = &ControlTablePtr->Controls[ControlTablePtr->ControlCount];
+
+        if (!(CameraControlCapabilities & BIT(MappingPtr->BmControlsBit)))
+        {
+            continue;
+        }
+
+        // The camera is going away, don't wait out the timeouts of the remaining queries.
+        if (READ_ONCE(TomUsbCamCtrlIntfDevStructPtr->DeferredQueriesForThisCameraStruct.Abort))
+        {
+            break;
+        }
+
+        ControlStatePtr->MappingPtr = MappingPtr;
+
+        if (QueryCameraFactoryValues(TomUsbCamCtrlIntfDevStructPtr, ControlStatePtr))
+        {
+            pr_warn("TomUsbCamBuildControlTable: couldn't query control 0x%x, leaving it out", MappingPtr->V4l2Id);
+            continue;
+        }
+
+        // Last 4 parameters are s32 min, s32 max, u32 step, s32 default.
+        if (MappingPtr->V4l2Type == V4L2_CTRL_TYPE_MENU)
+        {
+            ControlStatePtr->V4l2CtrlPtr = v4l2_ctrl_new_std_menu(&TomUsbCamCtrlIntfDevStructPtr->V4l2CtrlHandler, &TomUsbCamV4l2ControlOps,
+                                                                  MappingPtr->V4l2Id, ControlStatePtr->Max, 0, ControlStatePtr->Def);
+        }
+        else
+        {
+            ControlStatePtr->V4l2CtrlPtr = v4l2_ctrl_new_std(&TomUsbCamCtrlIntfDevStructPtr->V4l2CtrlHandler, &TomUsbCamV4l2ControlOps,
+                                                             MappingPtr->V4l2Id, ControlStatePtr->Min, ControlStatePtr->Max,
+                                                             ControlStatePtr->Res, ControlStatePtr->Def);
+        }
+
+        if (!ControlStatePtr->V4l2CtrlPtr)
+        {
+            break;
+        }
+
+        ControlTablePtr->ControlCount++;
+    }
+
+    for (int ClusterIdx = 0; ClusterIdx < ARRAY_SIZE(UvcAutoClusterTable); ClusterIdx++)
+    {
+
+        struct ControlStateStruct *AutoStatePtr = TomUsbCamFindControl(TomUsbCamCtrlIntfDevStructPtr, UvcAutoClusterTable[ClusterIdx][0]);
+        struct ControlStateStruct *ManualStatePtr = TomUsbCamFindControl(TomUsbCamCtrlIntfDevStructPtr, UvcAutoClusterTable[ClusterIdx][1]);
+
+        if (AutoStatePtr && ManualStatePtr)
+        {
+
+            ControlTablePtr->AutoClusters[ClusterIdx][0] = AutoStatePtr->V4l2CtrlPtr;
+            ControlTablePtr->AutoClusters[ClusterIdx][1] = ManualStatePtr->V4l2CtrlPtr;
+
+            // The manual control is used while the auto control is 0.
+            v4l2_ctrl_auto_cluster(2, ControlTablePtr->AutoClusters[ClusterIdx], 0, false);
+        }
+    }
+
+    // v4l2 starts every control at its default, so tell it what the camera is actually using. The values equal
+    // the cached ones, so this doesn't send anything back to the camera.
+    for (unsigned int ControlIdx = 0; ControlIdx < ControlTablePtr->ControlCount; ControlIdx++)
+    {
+        v4l2_ctrl_s_ctrl(ControlTablePtr->Controls[ControlIdx].V4l2CtrlPtr, ControlTablePtr->Controls[ControlIdx].Cur);
+    }
+}
+
+// Query the camera's controls and add them to the handler, then let the opens waiting on them through.
+static void TomUsbCamQueryControlsWork(struct work_struct *WorkPtr)
+{
+
+    struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr =
+            container_of(WorkPtr, struct TomUsbCamCtrlIntfDevStruct, DeferredQueriesForThisCameraStruct.QueryWork);
+
+    // Possible controls are listed here: 
+    // https://www.kernel.org/doc/html/v4.9/media/uapi/v4l/control.html
+    TomUsbCamBuildControlTable(TomUsbCamCtrlIntfDevStructPtr);
+
+    // The controls that were added before the error still work.
+    if (TomUsbCamCtrlIntfDevStructPtr->V4l2CtrlHandler.error) 
+    {
+        pr_err("TomUsbCamQueryControlsWork error: v4l2_ctrl_handler error number: %d", TomUsbCamCtrlIntfDevStructPtr->V4l2CtrlHandler.error);
+    }
+
+    complete_all(&TomUsbCamCtrlIntfDevStructPtr->DeferredQueriesForThisCameraStruct.QueriesDone);
+}
+
+// Stop the control queries at disconnect, whether or not they have started yet.
+static void TomUsbCamCancelDeferredQueries(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr)
+{
+
+    WRITE_ONCE(TomUsbCamCtrlIntfDevStructPtr->DeferredQueriesForThisCameraStruct.Abort, true);
+
+    cancel_work_sync(&TomUsbCamCtrlIntfDevStructPtr->DeferredQueriesForThisCameraStruct.QueryWork);
+
+    complete_all(&TomUsbCamCtrlIntfDevStructPtr->DeferredQueriesForThisCameraStruct.QueriesDone);
+}
+
+// Query the min/max/step/default and current values of a control, and fix up whatever v4l2 wouldn't accept.
+// Returns 0 on success.
+static int QueryCameraFactoryValues(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr, struct ControlStateStruct *ControlStatePtr)
+{
+
+    const struct UvcControlMappingStruct *MappingPtr = ControlStatePtr->MappingPtr;
+
+    // Boolean and menu controls don't have to support GET_MIN, GET_MAX or GET_RES.
+    bool HasRange = (MappingPtr->V4l2Type == V4L2_CTRL_TYPE_INTEGER);
+
+    static const __u8 RangeRequests[] = {GetMinSelectorControlRequest, GetMaxSelectorControlRequest, GetResolutionSelectorControlRequest,
+                                         GetDefaultSelectorControlRequest, GetCurrentSelectorControlRequest};
+
+    s32 *RangeValues[] = {&ControlStatePtr->Min, &ControlStatePtr->Max, &ControlStatePtr->Res, &ControlStatePtr->Def, &ControlStatePtr->Cur};
+
+    unsigned char *UsbMsgData = (unsigned char *) TomUsbCamCtrlIntfDevStructPtr->CtrlIntfBuffer;
+
+    // Power line frequency is the only menu. Its GET_MAX is asked for below, but a camera that doesn't support it gets
+    // the UVC 1.1 choices of disabled, 50 Hz and 60 Hz.
+    bool IsMenu = (MappingPtr->V4l2Type == V4L2_CTRL_TYPE_MENU);
+
+    if (IsMenu)
+    {
+        ControlStatePtr->Min = 0;
+        ControlStatePtr->Max = V4L2_CID_POWER_LINE_FREQUENCY_60HZ;
+        ControlStatePtr->Res = 1;
+    }
+    else if (MappingPtr->V4l2Type == V4L2_CTRL_TYPE_BOOLEAN)
+    {
+        ControlStatePtr->Min = 0;
+        ControlStatePtr->Max = 1;
+        ControlStatePtr->Res = 1;
+    }
+
+    for (int RequestIdx = 0; RequestIdx < ARRAY_SIZE(RangeRequests); RequestIdx++)
+    {
+
+        bool IsMenuMax = IsMenu && (RangeRequests[RequestIdx] == GetMaxSelectorControlRequest);
+
+        if (!HasRange && !IsMenuMax && (RequestIdx < 3))
+        {
+            continue;
+        }
+
+        int BytesRcvdOrErrorCode = ReadFromCamera(TomUsbCamCtrlIntfDevStructPtr,
+                                                  RangeRequests[RequestIdx],
+                                                  ClassTypeRequestType,
+                                                  InterfaceRecipientRequestType,
+                                                  MappingPtr->Selector << 8,
+                                                  TomUsbCamCtrlIntfDevStructPtr->ControlTableForThisCameraStruct.ProcessingUnitId << 8,
+                                                  InterfaceVideoControlIndex,
+                                                  UsbMsgData,
+                                                  MappingPtr->ControlLen,
+                                                  FiveSecTimeoutInMsecs);
+
+        if (IsMenuMax && (BytesRcvdOrErrorCode != MappingPtr->ControlLen))
+        {
+            continue;
+        }
+
+        if (BytesRcvdOrErrorCode != MappingPtr->ControlLen)
+        {
+            return (BytesRcvdOrErrorCode < 0) ? BytesRcvdOrErrorCode : -EIO;
+        }
+
+        u32 RawValue = 0;
+
+        for (int ByteIdx = 0; ByteIdx < MappingPtr->FieldLen; ByteIdx++)
+        {
+            RawValue |= (u32) UsbMsgData[MappingPtr->FieldOffset + ByteIdx] << (8 * ByteIdx);
+        }
+
+        *RangeValues[RequestIdx] = MappingPtr->Signed ? sign_extend32(RawValue, 8 * MappingPtr->FieldLen - 1) : (s32) RawValue;
+    }
+
+    // UVC 1.5 cameras may offer auto as well, which is as far as the v4l2 menu goes.
+    if (IsMenu)
+    {
+        ControlStatePtr->Max = min_t(s32, ControlStatePtr->Max, V4L2_CID_POWER_LINE_FREQUENCY_AUTO);
+    }
+
+    if (ControlStatePtr->Max < ControlStatePtr->Min)
+    {
+        return -ERANGE;
+    }
+
+    // Some cameras report a resolution of 0 for controls that take any value in their range.
+    if (ControlStatePtr->Res <= 0)
+    {
+        ControlStatePtr->Res = 1;
+    }
+
+    ControlStatePtr->Def = clamp(ControlStatePtr->Def, ControlStatePtr->Min, ControlStatePtr->Max);
+    ControlStatePtr->Cur = clamp(ControlStatePtr->Cur, ControlStatePtr->Min, ControlStatePtr->Max);
+
+    return 0;
+}
+
+// Find the cached state of a v4l2 control, or NULL if the camera doesn't have it.
+static struct ControlStateStruct *TomUsbCamFindControl(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr, u32 V4l2Id)
+{
+
+    struct ControlTableStruct *ControlTablePtr = &TomUsbCamCtrlIntfDevStructPtr->ControlTableForThisCameraStruct;
+
+    for (unsigned int ControlIdx = 0; ControlIdx < ControlTablePtr->ControlCount; ControlIdx++)
+    {
+
+        if (ControlTablePtr->Controls[ControlIdx].MappingPtr->V4l2Id == V4l2Id)
+        {
+            return &ControlTablePtr->Controls[ControlIdx];
+        }
+    }
+
+    return NULL;
+}
+
+// Hand a value read from the camera to every v4l2 control backed by that processing unit control. The control
+// framework sends V4L2_EVENT_CTRL to anyone subscribed.
+static void TomUsbCamUpdateControlsFromCamera(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr, uint8_t Selector,
+                                              const unsigned char *ControlDataPtr)
+{
+
+    struct ControlTableStruct *ControlTablePtr = &TomUsbCamCtrlIntfDevStructPtr->ControlTableForThisCameraStruct;
+
+    for (unsigned int ControlIdx = 0; ControlIdx < ControlTablePtr->ControlCount; ControlIdx++)
+    {
+
+        struct ControlStateStruct *ControlStatePtr = &ControlTablePtr->Controls[ControlIdx];
+        const struct UvcControlMappingStruct *MappingPtr = ControlStatePtr->MappingPtr;
+
+        if (MappingPtr->Selector != Selector)
+        {
+            continue;
+        }
+
+        u32 RawValue = 0;
+
+        for (int ByteIdx = 0; ByteIdx < MappingPtr->FieldLen; ByteIdx++)
+        {
+            RawValue |= (u32) ControlDataPtr[MappingPtr->FieldOffset + ByteIdx] << (8 * ByteIdx);
+        }
+
+        s32 ControlValue = MappingPtr->Signed ? sign_extend32(RawValue, 8 * MappingPtr->FieldLen - 1) : (s32) RawValue;
+
+        v4l2_ctrl_lock(ControlStatePtr->V4l2CtrlPtr);
+
+        ControlStatePtr->Cur = ControlValue;
+
+        TomUsbCamCtrlIntfDevStructPtr->AsyncControlForThisCameraStruct.ResyncInProgress = true;
+        __v4l2_ctrl_s_ctrl(ControlStatePtr->V4l2CtrlPtr, ControlValue);
+        TomUsbCamCtrlIntfDevStructPtr->AsyncControlForThisCameraStruct.ResyncInProgress = false;
+
+        v4l2_ctrl_unlock(ControlStatePtr->V4l2CtrlPtr);
+    }
+}
+
+// Save a list of structs containing all the Usb descriptor information. usbcore already read every descriptor of the
+// active configuration while enumerating the camera, so they are parsed from its cached copy instead of asking the
+// camera again. Nothing here touches the bus.
+static int SaveAllDescriptors(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr)
+{
+
+    // Tom see section 2.3.4.7 of [6] & 3.7.2.5 of [5] for querying the camera capabilites before attempting
+    // to set their values.
+
+    struct UsbDescriptorsStruct *UsbDescriptorsPtr = &TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct;
+    struct DescriptorParseStateStruct ParseState = { 0 };
+    
+    if (!TomUsbCamCtrlIntfDevStructPtr->UsbDevStructPtr->actconfig)
+    {
+    
+        pr_err("SaveAllDescriptors error: the device has no active configuration");
+        
+        return -ENODEV;
+    }
+    
+    // First figure out the descriptor count in each catergory for memory allocation.
+    WalkCachedDescriptors(TomUsbCamCtrlIntfDevStructPtr, &ParseState);
+    
+    // Lay out everything in one arena: the descriptor arrays, the lookup indexes and finally the VarData bytes.
+    // Note that (sizeof *x) is the the dereferenced size, i.e. the size of the struct, not the size of the pointer.
+    size_t VideoInterfaceArrayOffset = 0;
+    size_t EndpointArrayOffset = ALIGN(VideoInterfaceArrayOffset + ParseState.VideoCount * sizeof *UsbDescriptorsPtr->VideoInterfaceDescriptorStructPtr,
+                                       sizeof(void *));
+    size_t ConfigurationArrayOffset = ALIGN(EndpointArrayOffset + ParseState.EndpointCount * sizeof *UsbDescriptorsPtr->EndpointDescriptorStructPtr,
+                                            sizeof(void *));
+    size_t InterfaceArrayOffset = ALIGN(ConfigurationArrayOffset + ParseState.ConfigurationCount * sizeof *UsbDescriptorsPtr->ConfigurationDescriptorStructPtr,
+                                        sizeof(void *));
+    size_t EndpointIndexOffset = ALIGN(InterfaceArrayOffset + ParseState.InterfaceCount * sizeof *UsbDescriptorsPtr->InterfaceDescriptorStructPtr,
+                                       sizeof(void *));
+    size_t VideoInterfaceIndexOffset = EndpointIndexOffset + ParseState.IndexedInterfaceCount * ParseState.IndexedAlternateSettingCount * sizeof(int16_t);
+    size_t VarDataOffset = VideoInterfaceIndexOffset + ParseState.IndexedInterfaceCount * ParseState.IndexedSubtypeCount * sizeof(int16_t);
+    
+    uint8_t *DescriptorArenaPtr = kzalloc(VarDataOffset + ParseState.VarDataLen, GFP_KERNEL);
+    
+    if (!DescriptorArenaPtr)
+    {
+    
+        pr_err("SaveAllDescriptors error: descriptor arena allocation failed");
+        
+        return -ENOMEM;
+    }
+    
+    UsbDescriptorsPtr->DescriptorArenaPtr = DescriptorArenaPtr;
+    UsbDescriptorsPtr->VideoInterfaceDescriptorStructPtr = (struct VideoInterfaceDescriptorStruct *) &DescriptorArenaPtr[VideoInterfaceArrayOffset];
+    UsbDescriptorsPtr->EndpointDescriptorStructPtr = (struct EndpointDescriptorStruct *) &DescriptorArenaPtr[EndpointArrayOffset];
+    UsbDescriptorsPtr->ConfigurationDescriptorStructPtr = (struct ConfigurationDescriptorStruct *) &DescriptorArenaPtr[ConfigurationArrayOffset];
+    UsbDescriptorsPtr->InterfaceDescriptorStructPtr = (struct InterfaceDescriptorStruct *) &DescriptorArenaPtr[InterfaceArrayOffset];
+    UsbDescriptorsPtr->EndpointIndexPtr = (int16_t *) &DescriptorArenaPtr[EndpointIndexOffset];
+    UsbDescriptorsPtr->VideoInterfaceIndexPtr = (int16_t *) &DescriptorArenaPtr[VideoInterfaceIndexOffset];
+    UsbDescriptorsPtr->IndexedInterfaceCount = ParseState.IndexedInterfaceCount;
+    UsbDescriptorsPtr->IndexedAlternateSettingCount = ParseState.IndexedAlternateSettingCount;
+    UsbDescriptorsPtr->IndexedSubtypeCount = ParseState.IndexedSubtypeCount;
+    
+    // -1 in every byte is -1 in every int16_t, i.e. no descriptor.
+    memset(UsbDescriptorsPtr->EndpointIndexPtr, 0xff, VarDataOffset - EndpointIndexOffset);
+
+    // Walk the same descriptors again to actually divy them up. The index sizes stay as counted above.
+    struct DescriptorParseStateStruct FillState = { 0 };
+    
+    FillState.Fill = true;
+    FillState.IndexedInterfaceCount = ParseState.IndexedInterfaceCount;
+    FillState.IndexedAlternateSettingCount = ParseState.IndexedAlternateSettingCount;
+    FillState.IndexedSubtypeCount = ParseState.IndexedSubtypeCount;
+    FillState.NextVarDataPtr = &DescriptorArenaPtr[VarDataOffset];
+    
+    WalkCachedDescriptors(TomUsbCamCtrlIntfDevStructPtr, &FillState);
+    
+    // Keep track of the counts to avoid having to constantly re-querying the device.
+    UsbDescriptorsPtr->ConfigurationDescriptorStructCount = FillState.ConfigurationCount;
+    UsbDescriptorsPtr->InterfaceDescriptorStructCount = FillState.InterfaceCount;
+    UsbDescriptorsPtr->EndpointDescriptorStructCount = FillState.EndpointCount;
+    UsbDescriptorsPtr->VideoDescriptorStructCount = FillState.VideoCount;
+    
+    return 0;                  
+}
+
+// Feed the cached descriptors of the active configuration to ParseDescriptorBlob() in the order the camera sent
+// them: each interface alternate setting is followed by its class-specific descriptors (extra), then its endpoints
+// each followed by their own extra. That keeps the parent associations the same as parsing the raw config blob.
+static void WalkCachedDescriptors(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr, struct DescriptorParseStateStruct *ParseStatePtr)
+{
+
+    // usb_host_config defined here: [2]
+    struct usb_host_config *UsbConfigPtr = TomUsbCamCtrlIntfDevStructPtr->UsbDevStructPtr->actconfig;
+    
+    ParseDescriptorBlob(TomUsbCamCtrlIntfDevStructPtr, ParseStatePtr, (const uint8_t *) &UsbConfigPtr->desc, 
+                        min_t(int, UsbConfigPtr->desc.bLength, sizeof(UsbConfigPtr->desc)));
+    ParseDescriptorBlob(TomUsbCamCtrlIntfDevStructPtr, ParseStatePtr, UsbConfigPtr->extra, UsbConfigPtr->extralen);
+    
+    for (int IntfIdx = 0; IntfIdx < UsbConfigPtr->desc.bNumInterfaces; IntfIdx++)
+    {
+    
+        struct usb_interface *UsbInterfacePtr = UsbConfigPtr->interface[IntfIdx];
+        
+        if (!UsbInterfacePtr)
+        {
+            continue;
+        }
+    
+        for (int AltSettingIdx = 0; AltSettingIdx < UsbInterfacePtr->num_altsetting; AltSettingIdx++)
+        {
+        
+            struct usb_host_interface *UsbAltSettingPtr = &UsbInterfacePtr->altsetting[AltSettingIdx];
+            
+            ParseDescriptorBlob(TomUsbCamCtrlIntfDevStructPtr, ParseStatePtr, (const uint8_t *) &UsbAltSettingPtr->desc, 
+                                min_t(int, UsbAltSettingPtr->desc.bLength, sizeof(UsbAltSettingPtr->desc)));
+            ParseDescriptorBlob(TomUsbCamCtrlIntfDevStructPtr, ParseStatePtr, UsbAltSettingPtr->extra, UsbAltSettingPtr->extralen);
+            
+            for (int EndPointNum = 0; EndPointNum < UsbAltSettingPtr->desc.bNumEndpoints; EndPointNum++)
+            {
+            
+                struct usb_host_endpoint *UsbEndpointPtr = &UsbAltSettingPtr->endpoint[EndPointNum];
+                
+                ParseDescriptorBlob(TomUsbCamCtrlIntfDevStructPtr, ParseStatePtr, (const uint8_t *) &UsbEndpointPtr->desc, 
+                                    min_t(int, UsbEndpointPtr->desc.bLength, sizeof(UsbEndpointPtr->desc)));
+                ParseDescriptorBlob(TomUsbCamCtrlIntfDevStructPtr, ParseStatePtr, UsbEndpointPtr->extra, UsbEndpointPtr->extralen);
+            }
+        }
+    }
+}
+
+// Parse a run of descriptors. While counting, only the counts and index sizes are updated; with Fill set, each
+// descriptor is also copied into its slot in the arena and entered in the lookup indexes.
+static void ParseDescriptorBlob(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr, struct DescriptorParseStateStruct *ParseStatePtr,
+                                const uint8_t *AllDescriptorsPtr, int AllDescriptorsPacketLen)
+{
+
+    struct UsbDescriptorsStruct *UsbDescriptorsPtr = &TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct;
+
+    int CurrentDescriptorsPacketLoc = 0;
+    
+    // It seems everything is reported in order, such that each parent config is followed by its children
+    // interface and endpoint descriptors. Rely on this to make all of the associations.
+    while (AllDescriptorsPtr && (CurrentDescriptorsPacketLoc + 1 < AllDescriptorsPacketLen))
+    {
+                
+        // bLength & bDescriptorType are always the first 2 bytes.
+        uint8_t bLength = AllDescriptorsPtr[CurrentDescriptorsPacketLoc];
+        uint8_t bDescriptorType = AllDescriptorsPtr[CurrentDescriptorsPacketLoc + 1];
+        
+        // A descriptor that is too short or runs past the end would throw off everything after it.
+        if ((bLength < 3) || (CurrentDescriptorsPacketLoc + bLength > AllDescriptorsPacketLen))
+        {
+        
+            if (!ParseStatePtr->Fill)
+            {
+                pr_err("ParseDescriptorBlob error: bad descriptor length %d at offset %d, ignoring the rest", bLength, CurrentDescriptorsPacketLoc);
+            }
+            
+            break;
+        }
+        
+        const uint8_t *DescriptorPtr = &AllDescriptorsPtr[CurrentDescriptorsPacketLoc];
+        
+        // You could use memcpy() to fill all these structs but I am assigning explicit bytes when a struct has uint16_t's
+        // due to byte-ordering of the uint16_t and also struct padding problems from the compiler. See:
+        // https://stackoverflow.com/questions/58633342/c-memcpy-to-struct-allocation
+        if ((bDescriptorType == DescriptorTypeConfiguration) && (bLength >= USB_DT_CONFIG_SIZE))
+        {
+        
+            if (ParseStatePtr->Fill)
+            {
+            
+                struct ConfigurationDescriptorStruct *ConfigurationDescriptorStructPtr = 
+                    &UsbDescriptorsPtr->ConfigurationDescriptorStructPtr[ParseStatePtr->ConfigurationCount];
+
+                ConfigurationDescriptorStructPtr->bLength = DescriptorPtr[0];
+                ConfigurationDescriptorStructPtr->bDescriptorType = DescriptorPtr[1];
+                   
+                // Fix the reverse byte ordering for 2-byte values (uint16_t).
+                ConfigurationDescriptorStructPtr->wTotalLength = get_unaligned_le16(&DescriptorPtr[2]);
+
+                ConfigurationDescriptorStructPtr->bNumInterfaces = DescriptorPtr[4];  
+                ConfigurationDescriptorStructPtr->bConfigurationValue = DescriptorPtr[5];  
+                ConfigurationDescriptorStructPtr->iConfiguration = DescriptorPtr[6];  
+                ConfigurationDescriptorStructPtr->bmAttributes = DescriptorPtr[7];
+                ConfigurationDescriptorStructPtr->bMaxPower = DescriptorPtr[8];
+            }
+
+            ParseStatePtr->CurrentConfiguration = DescriptorPtr[5];
+
+            ParseStatePtr->ConfigurationCount += 1;         
+        }
+        
+        if ((bDescriptorType == DescriptorTypeInterface) && (bLength >= USB_DT_INTERFACE_SIZE))
+        {
+        
+            if (ParseStatePtr->Fill)
+            {
+            
+                struct InterfaceDescriptorStruct *InterfaceDescriptorStructPtr = 
+                    &UsbDescriptorsPtr->InterfaceDescriptorStructPtr[ParseStatePtr->InterfaceCount];
+        
+                InterfaceDescriptorStructPtr->ConfigurationAssoc = ParseStatePtr->CurrentConfiguration;
+        
+                memcpy(&InterfaceDescriptorStructPtr->bLength, DescriptorPtr, USB_DT_INTERFACE_SIZE);
+            }
+            else
+            {
+                ParseStatePtr->IndexedInterfaceCount = max_t(uint8_t, ParseStatePtr->IndexedInterfaceCount, DescriptorPtr[2] + 1);
+                ParseStatePtr->IndexedAlternateSettingCount = max_t(uint8_t, ParseStatePtr->IndexedAlternateSettingCount, DescriptorPtr[3] + 1);
+            }
+
+            ParseStatePtr->CurrentInterfaceNumber = DescriptorPtr[2];
+            ParseStatePtr->CurrentAlternateSetting = DescriptorPtr[3];
+
+            ParseStatePtr->InterfaceCount += 1;         
+        }  
+        
+        if ((bDescriptorType == DescriptorTypeEndpoint) && (bLength >= USB_DT_ENDPOINT_SIZE))
+        {
+        
+            if (ParseStatePtr->Fill)
+            {
+            
+                struct EndpointDescriptorStruct *EndpointDescriptorStructPtr = 
+                    &UsbDescriptorsPtr->EndpointDescriptorStructPtr[ParseStatePtr->EndpointCount];
+        
+                EndpointDescriptorStructPtr->ConfigurationAssoc = ParseStatePtr->CurrentConfiguration;
+                EndpointDescriptorStructPtr->ParentInterfaceAssoc = ParseStatePtr->CurrentInterfaceNumber;   
+                EndpointDescriptorStructPtr->AlternateSettingAssoc = ParseStatePtr->CurrentAlternateSetting;                                  
+
+                EndpointDescriptorStructPtr->bLength = DescriptorPtr[0];
+                EndpointDescriptorStructPtr->bDescriptorType = DescriptorPtr[1];
+                EndpointDescriptorStructPtr->bEndpointAddress = DescriptorPtr[2];
+                EndpointDescriptorStructPtr->bmAttributes = DescriptorPtr[3];                                                
+           
+                // Fix the byte ordering for uint16_t
+                EndpointDescriptorStructPtr->wMaxPacketSize = get_unaligned_le16(&DescriptorPtr[4]);
+                
+                EndpointDescriptorStructPtr->bInterval = DescriptorPtr[6];
+            
+                // The last endpoint of an alternate setting wins, same as the old linear search.
+                if (ParseStatePtr->CurrentInterfaceNumber < ParseStatePtr->IndexedInterfaceCount)
+                {
+                    UsbDescriptorsPtr->EndpointIndexPtr[ParseStatePtr->CurrentInterfaceNumber * ParseStatePtr->IndexedAlternateSettingCount + 
+                                                        ParseStatePtr->CurrentAlternateSetting] = ParseStatePtr->EndpointCount;
+                }
+            }
+
+            ParseStatePtr->EndpointCount += 1;         
+        } 
+        
+        if (bDescriptorType == DescriptorTypeVideoInterface)
+        {
+        
+            if (ParseStatePtr->Fill)
+            {
+            
+                struct VideoInterfaceDescriptorStruct *VideoInterfaceDescriptorStructPtr = 
+                    &UsbDescriptorsPtr->VideoInterfaceDescriptorStructPtr[ParseStatePtr->VideoCount];
+        
+                VideoInterfaceDescriptorStructPtr->ConfigurationAssoc = ParseStatePtr->CurrentConfiguration;
+                VideoInterfaceDescriptorStructPtr->ParentInterfaceAssoc = ParseStatePtr->CurrentInterfaceNumber;          
+        
+                // Only the 1st 3 fields (bytes) are consistent for the VideoControl descriptors.        
+                memcpy(&VideoInterfaceDescriptorStructPtr->bLength, DescriptorPtr, 3);
+                   
+                // The rest is carved off the end of the arena.
+                VideoInterfaceDescriptorStructPtr->VarData = ParseStatePtr->NextVarDataPtr;                      
+                                     
+                memcpy(ParseStatePtr->NextVarDataPtr, &DescriptorPtr[3], (bLength - 3));
+            
+                ParseStatePtr->NextVarDataPtr += bLength - 3;
+            
+                if (ParseStatePtr->CurrentInterfaceNumber < ParseStatePtr->IndexedInterfaceCount)
+                {
+                    UsbDescriptorsPtr->VideoInterfaceIndexPtr[ParseStatePtr->CurrentInterfaceNumber * ParseStatePtr->IndexedSubtypeCount + 
+                                                              VideoInterfaceDescriptorStructPtr->bDescriptorSubtype] = ParseStatePtr->VideoCount;
+                }
+            }
+            else
+            {
+            
+                ParseStatePtr->VarDataLen += bLength - 3;
+            
+                ParseStatePtr->IndexedSubtypeCount = max_t(uint8_t, ParseStatePtr->IndexedSubtypeCount, DescriptorPtr[2] + 1);
+            }
+
+            ParseStatePtr->VideoCount += 1;         
+        }                        
+        
+        CurrentDescriptorsPacketLoc += bLength;
+    }
+}
+
+// Return a user-requested descriptor so the user can extract whatever values they want. Configurations are only 
+// enumerated by their index. It seems their is only ever one configuration descriptor for cameras anyways.
+static void GetConfigurationDescriptorStruct(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr, uint8_t DescriptorIndex, 
+                                             struct ConfigurationDescriptorStruct **ConfigurationDescriptorStructPtr, int8_t *DescriptorReadSuccess)
+{
+
+    *DescriptorReadSuccess = -1;     
+
+    if (DescriptorIndex < TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.ConfigurationDescriptorStructCount)
+    {
+
+        *ConfigurationDescriptorStructPtr = &TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.ConfigurationDescriptorStructPtr[DescriptorIndex];
+
+        *DescriptorReadSuccess = 1;
+    }
+}
+
+static void GetInterfaceDescriptorStruct(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr, uint8_t DescriptorIndex,
+                                         struct InterfaceDescriptorStruct **InterfaceDescriptorStructPtr, int8_t *DescriptorReadSuccess)
+{
+
+    *DescriptorReadSuccess = -1;
+    
+    if (DescriptorIndex < TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.InterfaceDescriptorStructCount)
+    {
+
+        *InterfaceDescriptorStructPtr = &TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.InterfaceDescriptorStructPtr[DescriptorIndex];
+
+        *DescriptorReadSuccess = 1;
+    }    
+}
+
+// Endpoints and VideoInterface descriptors are looked up on the format and alternate setting paths, so these go
+// straight through the indexes built by SaveAllDescriptors() instead of searching.
+static void GetEndpointDescriptorStruct(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr, uint8_t ParentInterfaceAssoc,
+                                        uint8_t AlternateSettingAssoc, struct EndpointDescriptorStruct **EndpointDescriptorStructPtr, 
+                                        int8_t *DescriptorReadSuccess)
+{
+
+    struct UsbDescriptorsStruct *UsbDescriptorsPtr = &TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct;
+
+    *DescriptorReadSuccess = -1;
+    
+    if ((ParentInterfaceAssoc < UsbDescriptorsPtr->IndexedInterfaceCount) && (AlternateSettingAssoc < UsbDescriptorsPtr->IndexedAlternateSettingCount))
+    {
+    
+        int16_t EndpointIdx = UsbDescriptorsPtr->EndpointIndexPtr[ParentInterfaceAssoc * UsbDescriptorsPtr->IndexedAlternateSettingCount + AlternateSettingAssoc];
+        
+        if (EndpointIdx >= 0)
+        {
+
+            *EndpointDescriptorStructPtr = &UsbDescriptorsPtr->EndpointDescriptorStructPtr[EndpointIdx];
+            
+            *DescriptorReadSuccess = 1;  
+        }
+    }
+}
+
+static void GetVideoInterfaceDescriptorStruct(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr, uint8_t ParentInterfaceAssoc,
+                                              uint8_t VideoInterfaceSubtype, struct VideoInterfaceDescriptorStruct **VideoInterfaceDescriptorStructPtr, 
+                                              int8_t *DescriptorReadSuccess)
+{
+
+    struct UsbDescriptorsStruct *UsbDescriptorsPtr = &TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct;
+
+    *DescriptorReadSuccess = -1;
+    
+    if ((ParentInterfaceAssoc < UsbDescriptorsPtr->IndexedInterfaceCount) && (VideoInterfaceSubtype < UsbDescriptorsPtr->IndexedSubtypeCount))
+    {
+    
+        int16_t VideoInterfaceIdx = UsbDescriptorsPtr->VideoInterfaceIndexPtr[ParentInterfaceAssoc * UsbDescriptorsPtr->IndexedSubtypeCount + VideoInterfaceSubtype];
+        
+        if (VideoInterfaceIdx >= 0)
+        {
+
+            *VideoInterfaceDescriptorStructPtr = &UsbDescriptorsPtr->VideoInterfaceDescriptorStructPtr[VideoInterfaceIdx];
+            
+            *DescriptorReadSuccess = 1;  
+        }
+    }
+}
+
+// Parse the uncompressed format, frame and color matching descriptors of the streaming interface into the mode
+// table, and start out in the 1st format's default frame size. Everything the format ioctls report comes out of
+// this table, so none of them cause any Usb traffic. Returns 0 if at least 1 usable format was found.
+static int BuildStreamingModeTable(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr)
+{
+
+    struct StreamingModeTableStruct *StreamingModeTableStructPtr = &TomUsbCamCtrlIntfDevStructPtr->StreamingModeTableForThisCameraStruct;
+    struct StreamingFormatStruct *CurrentFormatPtr = NULL;
+    uint8_t DefaultFrameIndex = 0;
+
+    memset(StreamingModeTableStructPtr, 0, sizeof(*StreamingModeTableStructPtr));
+
+    // The frame and color matching descriptors follow the format descriptor they belong to.
+    for (int idx = 0; idx < TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.VideoDescriptorStructCount; idx++)
+    {
+
+        struct VideoInterfaceDescriptorStruct *VideoInterfaceDescriptorStructPtr =
+            &TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.VideoInterfaceDescriptorStructPtr[idx];
+        uint8_t *VarData = VideoInterfaceDescriptorStructPtr->VarData;
+
+        if (VideoInterfaceDescriptorStructPtr->ParentInterfaceAssoc != InterfaceVideoStreamingIndex)
+        {
+            continue;
+        }
+
+        if (VideoInterfaceDescriptorStructPtr->bDescriptorSubtype == VideoStreamingFormatUncompressedSubtype)
+        {
+
+            const struct UncompressedFormatGuidStruct *UncompressedFormatGuidStructPtr = NULL;
+
+            CurrentFormatPtr = NULL;
+
+            if (VideoInterfaceDescriptorStructPtr->bLength < FormatDescriptorMinLen)
+            {
+                continue;
+            }
+
+            for (int GuidIdx = 0; GuidIdx < ARRAY_SIZE(UncompressedFormatGuidTable); GuidIdx++)
+            {
+                if (!memcmp(&VarData[FormatDescriptorGuidOffset], UncompressedFormatGuidTable[GuidIdx].Guid, 16))
+                {
+                    UncompressedFormatGuidStructPtr = &UncompressedFormatGuidTable[GuidIdx];
+                }
+            }
+
+            if (!UncompressedFormatGuidStructPtr)
+            {
+                pr_warn("BuildStreamingModeTable: skipping format %d with unknown Guid %pUl", VarData[FormatDescriptorFormatIndexOffset],
+                        &VarData[FormatDescriptorGuidOffset]);
+                continue;
+            }
+
+            if (StreamingModeTableStructPtr->FormatCount == TOM_USB_CAM_MAX_STREAMING_FORMATS)
+            {
+                pr_warn("BuildStreamingModeTable: skipping format %d, table is full", VarData[FormatDescriptorFormatIndexOffset]);
+                continue;
+            }
+
+            CurrentFormatPtr = &StreamingModeTableStructPtr->Formats[StreamingModeTableStructPtr->FormatCount];
+            StreamingModeTableStructPtr->FormatCount += 1;
+
+            CurrentFormatPtr->FormatIndex = VarData[FormatDescriptorFormatIndexOffset];
+            CurrentFormatPtr->PixelFormat = UncompressedFormatGuidStructPtr->PixelFormat;
+            CurrentFormatPtr->Description = UncompressedFormatGuidStructPtr->Description;
+            CurrentFormatPtr->Planar = UncompressedFormatGuidStructPtr->Planar;
+            CurrentFormatPtr->BitsPerPixel = VarData[FormatDescriptorBitsPerPixelOffset];
+
+            // Without a color matching descriptor the Uvc defaults of BT.709 primaries & transfer and BT.601 matrix apply.
+            CurrentFormatPtr->Colorspace = ColorPrimariesToV4l2Colorspace[1];
+            CurrentFormatPtr->XferFunc = TransferCharacteristicsToV4l2XferFunc[1];
+            CurrentFormatPtr->YcbcrEncoding = MatrixCoefficientsToV4l2YcbcrEncoding[4];
+
+            DefaultFrameIndex = VarData[FormatDescriptorDefaultFrameIndexOffset];
+        }
+        else if ((VideoInterfaceDescriptorStructPtr->bDescriptorSubtype == VideoStreamingFrameUncompressedSubtype) && CurrentFormatPtr)
+        {
+
+            if (VideoInterfaceDescriptorStructPtr->bLength < FrameDescriptorMinLen)
+            {
+                continue;
+            }
+
+            uint16_t Width = get_unaligned_le16(&VarData[FrameDescriptorWidthOffset]);
+            uint16_t Height = get_unaligned_le16(&VarData[FrameDescriptorHeightOffset]);
+            bool DuplicateFrameSize = false;
+
+            // Some cameras, including this one, list the same frame size twice. Only report it once.
+            for (int FrameIdx = 0; FrameIdx < CurrentFormatPtr->FrameCount; FrameIdx++)
+            {
+                if ((CurrentFormatPtr->Frames[FrameIdx].Width == Width) && (CurrentFormatPtr->Frames[FrameIdx].Height == Height))
+                {
+                    DuplicateFrameSize = true;
+                }
+            }
+
+            if (DuplicateFrameSize)
+            {
+                continue;
+            }
+
+            if (CurrentFormatPtr->FrameCount == TOM_USB_CAM_MAX_FRAMES_PER_FORMAT)
+            {
+                pr_warn("BuildStreamingModeTable: skipping %ux%u frame, table is full", Width, Height);
+                continue;
+            }
+
+            struct StreamingFrameStruct *FramePtr = &CurrentFormatPtr->Frames[CurrentFormatPtr->FrameCount];
+
+            FramePtr->FrameIndex = VarData[FrameDescriptorFrameIndexOffset];
+            FramePtr->Width = Width;
+            FramePtr->Height = Height;
+
+            // Planar formats report the stride of the full resolution luma plane.
+            FramePtr->BytesPerLine = CurrentFormatPtr->Planar ? Width : Width * CurrentFormatPtr->BitsPerPixel / 8;
+            FramePtr->SizeImage = Width * Height * CurrentFormatPtr->BitsPerPixel / 8;
+            FramePtr->DefaultFrameInterval = get_unaligned_le32(&VarData[FrameDescriptorDefaultFrameIntervalOffset]);
+
+            // A bFrameIntervalType of 0 means a continuous min/max/step range follows, otherwise it is the number of
+            // discrete intervals that follow.
+            uint8_t FrameIntervalType = VarData[FrameDescriptorFrameIntervalTypeOffset];
+            int FrameIntervalCount = FrameIntervalType ? min_t(int, FrameIntervalType, TOM_USB_CAM_MAX_FRAME_INTERVALS) : 3;
+
+            FrameIntervalCount = min_t(int, FrameIntervalCount, (VideoInterfaceDescriptorStructPtr->bLength - FrameDescriptorMinLen) / 4);
+
+            FramePtr->ContinuousFrameIntervals = (FrameIntervalType == 0) && (FrameIntervalCount == 3);
+
+            for (int IntervalIdx = 0; IntervalIdx < FrameIntervalCount; IntervalIdx++)
+            {
+                FramePtr->FrameIntervals[IntervalIdx] = get_unaligned_le32(&VarData[FrameDescriptorFrameIntervalsOffset + 4 * IntervalIdx]);
+            }
+
+            FramePtr->FrameIntervalCount = FramePtr->ContinuousFrameIntervals ? 3 : (FrameIntervalType ? FrameIntervalCount : 0);
+
+            // A truncated descriptor still has a default interval to report.
+            if (FramePtr->FrameIntervalCount == 0)
+            {
+                FramePtr->FrameIntervals[0] = FramePtr->DefaultFrameInterval;
+                FramePtr->FrameIntervalCount = 1;
+            }
+
+            if (FramePtr->FrameIndex == DefaultFrameIndex)
+            {
+                CurrentFormatPtr->DefaultFrameIdx = CurrentFormatPtr->FrameCount;
+            }
+
+            CurrentFormatPtr->FrameCount += 1;
+        }
+        else if ((VideoInterfaceDescriptorStructPtr->bDescriptorSubtype == VideoStreamingColorFormatSubtype) && CurrentFormatPtr &&
+                 (VideoInterfaceDescriptorStructPtr->bLength >= ColorFormatDescriptorMinLen))
+        {
+
+            uint8_t ColorPrimaries = VarData[ColorFormatDescriptorColorPrimariesOffset];
+            uint8_t TransferCharacteristics = VarData[ColorFormatDescriptorTransferCharacteristicsOffset];
+            uint8_t MatrixCoefficients = VarData[ColorFormatDescriptorMatrixCoefficientsOffset];
+
+            if (ColorPrimaries < ARRAY_SIZE(ColorPrimariesToV4l2Colorspace))
+            {
+                CurrentFormatPtr->Colorspace = ColorPrimariesToV4l2Colorspace[ColorPrimaries];
+            }
+
+            if (TransferCharacteristics < ARRAY_SIZE(TransferCharacteristicsToV4l2XferFunc))
+            {
+                CurrentFormatPtr->XferFunc = TransferCharacteristicsToV4l2XferFunc[TransferCharacteristics];
+            }
+
+            if (MatrixCoefficients < ARRAY_SIZE(MatrixCoefficientsToV4l2YcbcrEncoding))
+            {
+                CurrentFormatPtr->YcbcrEncoding = MatrixCoefficientsToV4l2YcbcrEncoding[MatrixCoefficients];
+            }
+        }
+    }
+
+    // Drop any format that ended up without a usable frame size so ENUM_FMT never reports one.
+    int KeptFormatCount = 0;
+
+    for (int FormatIdx = 0; FormatIdx < StreamingModeTableStructPtr->FormatCount; FormatIdx++)
+    {
+
+        if (StreamingModeTableStructPtr->Formats[FormatIdx].FrameCount == 0)
+        {
+            continue;
+        }
+
+        if (FormatIdx != KeptFormatCount)
+        {
+            StreamingModeTableStructPtr->Formats[KeptFormatCount] = StreamingModeTableStructPtr->Formats[FormatIdx];
+        }
+
+        KeptFormatCount += 1;
+    }
+
+    StreamingModeTableStructPtr->FormatCount = KeptFormatCount;
+
+    if (StreamingModeTableStructPtr->FormatCount == 0)
+    {
+        return -ENODEV;
+    }
+
+    AddConvertedFormats(TomUsbCamCtrlIntfDevStructPtr);
+
+    FillPixFormatFromStreamingMode(&StreamingModeTableStructPtr->Formats[0],
+                                   &StreamingModeTableStructPtr->Formats[0].Frames[StreamingModeTableStructPtr->Formats[0].DefaultFrameIdx],
+                                   &TomUsbCamCtrlIntfDevStructPtr->V4l2PixFormatStruct);
+
+    BuildStillImageTable(TomUsbCamCtrlIntfDevStructPtr);
+
+    return 0;
+}
+
+// Offer the formats in ConvertedFormatTable for the camera's Yuyv format, with the same frame sizes and intervals,
+// unless the camera streams them itself. Formats that don't fit in the table any more are left out.
+static void AddConvertedFormats(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr)
+{
+
+    struct StreamingModeTableStruct *StreamingModeTableStructPtr = &TomUsbCamCtrlIntfDevStructPtr->StreamingModeTableForThisCameraStruct;
+
+    struct StreamingFormatStruct *YuyvFormatPtr = GetStreamingFormat(TomUsbCamCtrlIntfDevStructPtr, V4L2_PIX_FMT_YUYV);
+
+    if (!YuyvFormatPtr)
+    {
+        return;
+    }
+
+    for (int ConvertedIdx = 0; ConvertedIdx < ARRAY_SIZE(ConvertedFormatTable); ConvertedIdx++)
+    {
+
+        const struct ConvertedFormatStruct *ConvertedFormatPtr = &ConvertedFormatTable[ConvertedIdx];
+
+        if (GetStreamingFormat(TomUsbCamCtrlIntfDevStructPtr, ConvertedFormatPtr->PixelFormat))
+        {
+            continue;
+        }
+
+        if (StreamingModeTableStructPtr->FormatCount == TOM_USB_CAM_MAX_STREAMING_FORMATS)
+        {
+            pr_warn("AddConvertedFormats: skipping %s, table is full", ConvertedFormatPtr->Description);
+            continue;
+        }
+
+        struct StreamingFormatStruct *FormatPtr = &StreamingModeTableStructPtr->Formats[StreamingModeTableStructPtr->FormatCount];
+        StreamingModeTableStructPtr->FormatCount += 1;
+
+        *FormatPtr = *YuyvFormatPtr;
+        FormatPtr->PixelFormat = ConvertedFormatPtr->PixelFormat;
+        FormatPtr->Description = ConvertedFormatPtr->Description;
+        FormatPtr->BitsPerPixel = ConvertedFormatPtr->BitsPerPixel;
+        FormatPtr->Planar = ConvertedFormatPtr->Planar;
+        FormatPtr->Conversion = ConvertedFormatPtr->Conversion;
+
+        for (int FrameIdx = 0; FrameIdx < FormatPtr->FrameCount; FrameIdx++)
+        {
+
+            struct StreamingFrameStruct *FramePtr = &FormatPtr->Frames[FrameIdx];
+
+            FramePtr->BytesPerLine = FormatPtr->Planar ? FramePtr->Width : FramePtr->Width * FormatPtr->BitsPerPixel / 8;
+            FramePtr->SizeImage = FramePtr->Width * FramePtr->Height * FormatPtr->BitsPerPixel / 8;
+        }
+    }
+}
+
+static struct StreamingFormatStruct *GetStreamingFormat(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr, uint32_t PixelFormat)
+{
+
+    struct StreamingModeTableStruct *StreamingModeTableStructPtr = &TomUsbCamCtrlIntfDevStructPtr->StreamingModeTableForThisCameraStruct;
+
+    for (int FormatIdx = 0; FormatIdx < StreamingModeTableStructPtr->FormatCount; FormatIdx++)
+    {
+        if (StreamingModeTableStructPtr->Formats[FormatIdx].PixelFormat == PixelFormat)
+        {
+            return &StreamingModeTableStructPtr->Formats[FormatIdx];
+        }
+    }
+
+    return NULL;
+}
+
+// Look up the exact mode for a pixel format and frame size. Returns 0 if the camera supports it.
+static int GetStreamingMode(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr, uint32_t PixelFormat, uint32_t Width, uint32_t Height,
+                            struct StreamingFormatStruct **FormatPtr, struct StreamingFrameStruct **FramePtr)
+{
+
+    *FormatPtr = GetStreamingFormat(TomUsbCamCtrlIntfDevStructPtr, PixelFormat);
+
+    if (!*FormatPtr)
+    {
+        return -EINVAL;
+    }
+
+    for (int FrameIdx = 0; FrameIdx < (*FormatPtr)->FrameCount; FrameIdx++)
+    {
+        if (((*FormatPtr)->Frames[FrameIdx].Width == Width) && ((*FormatPtr)->Frames[FrameIdx].Height == Height))
+        {
+
+            *FramePtr = &(*FormatPtr)->Frames[FrameIdx];
+
+            return 0;
+        }
+    }
+
+    return -EINVAL;
+}
+
+// Pick the frame size that overlaps the requested one the most, i.e. the smallest non-overlapping area.
+static struct StreamingFrameStruct *GetClosestStreamingFrame(struct StreamingFrameStruct *Frames, uint8_t FrameCount, uint32_t Width, uint32_t Height)
+{
+
+    struct StreamingFrameStruct *BestFramePtr = &Frames[0];
+    uint64_t BestAreaDifference = U64_MAX;
+
+    for (int FrameIdx = 0; FrameIdx < FrameCount; FrameIdx++)
+    {
+
+        struct StreamingFrameStruct *FramePtr = &Frames[FrameIdx];
+
+        uint64_t OverlapArea = (uint64_t) min_t(uint32_t, FramePtr->Width, Width) * min_t(uint32_t, FramePtr->Height, Height);
+
+        uint64_t AreaDifference = (uint64_t) FramePtr->Width * FramePtr->Height + (uint64_t) Width * Height - 2 * OverlapArea;
+
+        if (AreaDifference < BestAreaDifference)
+        {
+            BestAreaDifference = AreaDifference;
+            BestFramePtr = FramePtr;
+        }
+    }
+
+    return BestFramePtr;
+}
+
+// The camera always sends Yuyv, 16 bits a pixel, so a converted format takes its own bits per pixel out of every 16
+// bytes the camera sends. Scale a length in Yuyv bytes to the bytes it takes in the format.
+static size_t TomUsbCamFormatLen(struct StreamingFormatStruct *FormatPtr, size_t YuyvLen)
+{
+
+    if (FormatPtr->Conversion == TOM_USB_CAM_CONVERSION_NONE)
+    {
+        return YuyvLen;
+    }
+
+    return div_u64((u64) YuyvLen * FormatPtr->BitsPerPixel, 16);
+}
+
+// Make the buffers big enough for whatever frame size the camera said it will send, in case it is larger than the
+// plain image. dwMaxVideoFrameSize counts the Yuyv bytes the camera sends, so it is scaled for converted formats.
+static uint32_t TomUsbCamFormatSizeImage(struct StreamingFormatStruct *FormatPtr, uint32_t SizeImage, uint32_t MaxVideoFrameSize)
+{
+    return max_t(uint32_t, SizeImage, TomUsbCamFormatLen(FormatPtr, MaxVideoFrameSize));
+}
+
+static void FillPixFormatFromStreamingMode(struct StreamingFormatStruct *FormatPtr, struct StreamingFrameStruct *FramePtr,
+                                           struct v4l2_pix_format *V4l2PixFormatStructPtr)
+{
+
+    V4l2PixFormatStructPtr->width = FramePtr->Width;
+    V4l2PixFormatStructPtr->height = FramePtr->Height;
+    V4l2PixFormatStructPtr->pixelformat = FormatPtr->PixelFormat;
+    
+    // Return the entire, non-interleaved, image.
+    V4l2PixFormatStructPtr->field = V4L2_FIELD_NONE;
+    V4l2PixFormatStructPtr->bytesperline = FramePtr->BytesPerLine;
+    V4l2PixFormatStructPtr->sizeimage = FramePtr->SizeImage;
+    V4l2PixFormatStructPtr->colorspace = FormatPtr->Colorspace;
+    V4l2PixFormatStructPtr->xfer_func = FormatPtr->XferFunc;
+    V4l2PixFormatStructPtr->ycbcr_enc = FormatPtr->YcbcrEncoding;
+    V4l2PixFormatStructPtr->quantization = V4L2_QUANTIZATION_DEFAULT;
+    V4l2PixFormatStructPtr->priv = 0;
+}
+
+// Run the VS_PROBE_CONTROL half of the negotiation in section 4.3.1.1.1 of [5] for a frame size and interval: SET_CUR
+// the requested block, then GET_CUR what the camera is actually willing to do. The result becomes the current probe
+// control block and is cached, so asking for the same mode again doesn't touch the bus. Returns 0 on success.
+static int TomUsbCamNegotiateStreamingParameters(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr, uint32_t PixelFormat,
+                                                 uint32_t Width, uint32_t Height, uint32_t FrameInterval)
+{
+
+    struct StreamingParametersStruct *StreamingParametersStructPtr = &TomUsbCamCtrlIntfDevStructPtr->StreamingParametersForThisCameraStruct;
+    struct StreamingFormatStruct *FormatPtr;
+    struct StreamingFrameStruct *FramePtr;
+
+    if (GetStreamingMode(TomUsbCamCtrlIntfDevStructPtr, PixelFormat, Width, Height, &FormatPtr, &FramePtr))
+    {
+        pr_err("TomUsbCamNegotiateStreamingParameters error: no frame descriptor for %ux%u", Width, Height);
+
+        return -EINVAL;
+    }
+
+    uint8_t FormatIndex = FormatPtr->FormatIndex;
+    uint8_t FrameIndex = FramePtr->FrameIndex;
+
+    if (FrameInterval == 0)
+    {
+        FrameInterval = FramePtr->DefaultFrameInterval;
+    }
+
+    for (int CacheIdx = 0; CacheIdx < TOM_USB_CAM_NUM_PROBE_CONTROL_CACHE_ENTRIES; CacheIdx++)
+    {
+
+        struct ProbeControlCacheEntryStruct *CacheEntryPtr = &StreamingParametersStructPtr->ProbeControlCacheEntries[CacheIdx];
+
+        if (CacheEntryPtr->Valid && (CacheEntryPtr->FormatIndex == FormatIndex) && (CacheEntryPtr->FrameIndex == FrameIndex) &&
+            (CacheEntryPtr->FrameInterval == FrameInterval))
+        {
+
+            memcpy(StreamingParametersStructPtr->ProbeControlBlock, CacheEntryPtr->ProbeControlBlock, VideoStreamingProbeControlPacketLen);
+            StreamingParametersStructPtr->ProbeControlBlockValid = true;
+
+            return 0;
+        }
+    }
+
+    // Control transfer data has to be in DMA-able memory, so don't use the stack.
+    unsigned char *ProbeControlPtr = kzalloc(VideoStreamingProbeControlPacketLen, GFP_KERNEL);
+
+    if (!ProbeControlPtr)
+    {
+        return -ENOMEM;
+    }
+
+    // Leave every field the host doesn't care about as 0 so the camera fills in its own values.
+    put_unaligned_le16(ProbeControlHintFrameInterval, &ProbeControlPtr[ProbeControlHintOffset]);
+    ProbeControlPtr[ProbeControlFormatIndexOffset] = FormatIndex;
+    ProbeControlPtr[ProbeControlFrameIndexOffset] = FrameIndex;
+    put_unaligned_le32(FrameInterval, &ProbeControlPtr[ProbeControlFrameIntervalOffset]);
+
+    int NegotiationErrorValue = 0;
+
+    int BytesSentOrErrorCode = WriteToCamera(TomUsbCamCtrlIntfDevStructPtr,
+                                             SetCurrentSelectorControlRequest,
+                                             ClassTypeRequestType,
+                                             InterfaceRecipientRequestType,
+                                             VideoStreamingProbeControlValue,
+                                             0x0,
+                                             InterfaceVideoStreamingIndex,
+                                             ProbeControlPtr,
+                                             VideoStreamingProbeControlPacketLen,
+                                             FiveSecTimeoutInMsecs);
+
+    int BytesRcvdOrErrorCode = 0;
+
+    if (BytesSentOrErrorCode == VideoStreamingProbeControlPacketLen)
+    {
+        BytesRcvdOrErrorCode = ReadFromCamera(TomUsbCamCtrlIntfDevStructPtr,
+                                              GetCurrentSelectorControlRequest,
+                                              ClassTypeRequestType,
+                                              InterfaceRecipientRequestType,
+                                              VideoStreamingProbeControlValue,
+                                              0x0,
+                                              InterfaceVideoStreamingIndex,
+                                              ProbeControlPtr,
+                                              VideoStreamingProbeControlPacketLen,
+                                              FiveSecTimeoutInMsecs);
+    }
+
+    if ((BytesSentOrErrorCode != VideoStreamingProbeControlPacketLen) || (BytesRcvdOrErrorCode != VideoStreamingProbeControlPacketLen))
+    {
+        pr_err("TomUsbCamNegotiateStreamingParameters error: probe control SET_CUR returned %d, GET_CUR returned %d",
+               BytesSentOrErrorCode, BytesRcvdOrErrorCode);
+
+        NegotiationErrorValue = -EIO;
+    }
+
+    // The camera is allowed to answer with a different format or frame than the one asked for if it can't do it.
+    else if ((ProbeControlPtr[ProbeControlFormatIndexOffset] != FormatIndex) || (ProbeControlPtr[ProbeControlFrameIndexOffset] != FrameIndex))
+    {
+        pr_err("TomUsbCamNegotiateStreamingParameters error: asked for format %d frame %d, camera answered format %d frame %d",
+               FormatIndex, FrameIndex, ProbeControlPtr[ProbeControlFormatIndexOffset], ProbeControlPtr[ProbeControlFrameIndexOffset]);
+
+        NegotiationErrorValue = -EINVAL;
+    }
+    else
+    {
+
+        struct ProbeControlCacheEntryStruct *CacheEntryPtr =
+            &StreamingParametersStructPtr->ProbeControlCacheEntries[StreamingParametersStructPtr->NextProbeControlCacheEntryIdx];
+
+        CacheEntryPtr->Valid = true;
+        CacheEntryPtr->FormatIndex = FormatIndex;
+        CacheEntryPtr->FrameIndex = FrameIndex;
+        CacheEntryPtr->FrameInterval = FrameInterval;
+        memcpy(CacheEntryPtr->ProbeControlBlock, ProbeControlPtr, VideoStreamingProbeControlPacketLen);
+
+        StreamingParametersStructPtr->NextProbeControlCacheEntryIdx =
+            (StreamingParametersStructPtr->NextProbeControlCacheEntryIdx + 1) % TOM_USB_CAM_NUM_PROBE_CONTROL_CACHE_ENTRIES;
+
+        memcpy(StreamingParametersStructPtr->ProbeControlBlock, ProbeControlPtr, VideoStreamingProbeControlPacketLen);
+        StreamingParametersStructPtr->ProbeControlBlockValid = true;
+    }
+
+    kfree(ProbeControlPtr);
+
+    return NegotiationErrorValue;
+}
+
+// Send the current probe control block back as VS_COMMIT_CONTROL so the camera actually switches to it. This has to
+// happen while the streaming interface is still at its zero bandwidth setting. Returns 0 on success.
+static int TomUsbCamCommitStreamingParameters(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr)
+{
+
+    struct StreamingParametersStruct *StreamingParametersStructPtr = &TomUsbCamCtrlIntfDevStructPtr->StreamingParametersForThisCameraStruct;
+
+    // Nothing was negotiated yet if S_FMT was never called, so negotiate the format that probe() set up.
+    if (!StreamingParametersStructPtr->ProbeControlBlockValid)
+    {
+
+        int NegotiationErrorValue = TomUsbCamNegotiateStreamingParameters(TomUsbCamCtrlIntfDevStructPtr,
+                                                                          TomUsbCamCtrlIntfDevStructPtr->V4l2PixFormatStruct.pixelformat,
+                                                                          TomUsbCamCtrlIntfDevStructPtr->V4l2PixFormatStruct.width,
+                                                                          TomUsbCamCtrlIntfDevStructPtr->V4l2PixFormatStruct.height,
+                                                                          StreamingParametersStructPtr->FrameInterval);
+
+        if (NegotiationErrorValue)
+        {
+            return NegotiationErrorValue;
+        }
+    }
+
+    unsigned char *CommitControlPtr = kmemdup(StreamingParametersStructPtr->ProbeControlBlock, VideoStreamingProbeControlPacketLen, GFP_KERNEL);
+
+    if (!CommitControlPtr)
+    {
+        return -ENOMEM;
+    }
+
+    int BytesSentOrErrorCode = WriteToCamera(TomUsbCamCtrlIntfDevStructPtr,
+                                             SetCurrentSelectorControlRequest,
+                                             ClassTypeRequestType,
+                                             InterfaceRecipientRequestType,
+                                             VideoStreamingCommitControlValue,
+                                             0x0,
+                                             InterfaceVideoStreamingIndex,
+                                             CommitControlPtr,
+                                             VideoStreamingProbeControlPacketLen,
+                                             FiveSecTimeoutInMsecs);
+
+    kfree(CommitControlPtr);
+
+    if (BytesSentOrErrorCode != VideoStreamingProbeControlPacketLen)
+    {
+        pr_err("TomUsbCamCommitStreamingParameters error: commit control SET_CUR returned %d", BytesSentOrErrorCode);
+
+        // Don't trust the cached block for this mode any more in case the camera's state changed underneath it.
+        StreamingParametersStructPtr->ProbeControlBlockValid = false;
+
+        return -EIO;
+    }
+
+    return 0;
+}
+
+// Pick the alternate setting whose isochronous packet is the smallest one that still holds MaxPayloadTransferSize bytes.
+// Grabbing the largest setting every time reserves bandwidth the stream never uses and can keep a 2nd camera on the
+// same bus from streaming at all. A MaxPayloadTransferSize of 0 means it's unknown, so fall back to the largest setting.
+// Settings taking more than AvailableBandwidth bytes per (micro)frame are skipped. Returns 0 and updates the isochronous
+// struct if a usable setting was found, or -ENOSPC if the payloads only fit in settings the bus has no room for.
+static int SelectStreamingAltSetting(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr, uint32_t MaxPayloadTransferSize,
+                                     uint32_t AvailableBandwidth, struct TomUsbCamIsochronousInputDevStruct *TomUsbCamIsochronousInputDevStructPtr)
+{
+
+    // The Urb ring was sized for the largest setting at probe time, so nothing bigger than that can be used.
+    size_t LargestUsablePacketSize = TomUsbCamIsochronousInputDevStructPtr->IsochronousUrbBufferSize / TOM_USB_CAM_PACKETS_PER_ISOCHRONOUS_URB;
+
+    struct EndpointDescriptorStruct *SelectedEndpointDescriptorStructPtr = NULL;
+    struct EndpointDescriptorStruct *LargestEndpointDescriptorStructPtr = NULL;
+    size_t SelectedPacketSize = 0;
+    size_t LargestPacketSize = 0;
+    bool IsochronousSettingFound = false;
+    bool PayloadFitsOverBudget = false;
+
+    for (int idx = 0; idx < TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.InterfaceDescriptorStructCount; idx++)
+    {
+
+        struct InterfaceDescriptorStruct *InterfaceDescriptorStructPtr;
+        struct EndpointDescriptorStruct *EndpointDescriptorStructPtr;
+        int8_t DescriptorReadSuccess;
+
+        GetInterfaceDescriptorStruct(TomUsbCamCtrlIntfDevStructPtr, idx, &InterfaceDescriptorStructPtr, &DescriptorReadSuccess);
+
+        // Alternate setting 0 of the streaming interface has no endpoints.
+        if ((DescriptorReadSuccess < 0) ||
+            (InterfaceDescriptorStructPtr->bInterfaceNumber != TomUsbCamIsochronousInputDevStructPtr->IsochronousInputInterfaceNumber) ||
+            (InterfaceDescriptorStructPtr->bNumEndpoints == 0))
+        {
+            continue;
+        }
+
+        GetEndpointDescriptorStruct(TomUsbCamCtrlIntfDevStructPtr, InterfaceDescriptorStructPtr->bInterfaceNumber,
+                                    InterfaceDescriptorStructPtr->bAlternateSetting, &EndpointDescriptorStructPtr, &DescriptorReadSuccess);
+
+        if ((DescriptorReadSuccess < 0) ||
+            ((EndpointDescriptorStructPtr->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) != USB_ENDPOINT_XFER_ISOC) ||
+            !(EndpointDescriptorStructPtr->bEndpointAddress & USB_DIR_IN))
+        {
+            continue;
+        }
+
+        // High-bandwidth endpoints move up to 3 transactions per microframe, e.g. 0x13fc is 3 x 1020 bytes.
+        size_t PacketSize = (EndpointDescriptorStructPtr->wMaxPacketSize & EndpointMaxPacketSizeMask) *
+                            (((EndpointDescriptorStructPtr->wMaxPacketSize >> EndpointAdditionalTransactionsShift) &
+                              EndpointAdditionalTransactionsMask) + 1);
+
+        if (PacketSize > LargestUsablePacketSize)
+        {
+            continue;
+        }
+
+        IsochronousSettingFound = true;
+
+        // A packet every 2^(bInterval - 1) (micro)frames only takes that fraction of each one.
+        uint32_t Bandwidth = DIV_ROUND_UP(PacketSize, 1 << (clamp_val(EndpointDescriptorStructPtr->bInterval, 1, 16) - 1));
+
+        bool HoldsPayload = (MaxPayloadTransferSize != 0) && (PacketSize >= MaxPayloadTransferSize);
+
+        if (Bandwidth > AvailableBandwidth)
+        {
+            PayloadFitsOverBudget |= HoldsPayload;
+
+            continue;
+        }
+
+        if (PacketSize > LargestPacketSize)
+        {
+            LargestEndpointDescriptorStructPtr = EndpointDescriptorStructPtr;
+            LargestPacketSize = PacketSize;
+        }
+
+        if (HoldsPayload && (!SelectedEndpointDescriptorStructPtr || (PacketSize < SelectedPacketSize)))
+        {
+            SelectedEndpointDescriptorStructPtr = EndpointDescriptorStructPtr;
+            SelectedPacketSize = PacketSize;
+        }
+    }
+
+    if (!IsochronousSettingFound)
+    {
+        pr_err("SelectStreamingAltSetting error: no isochronous alternate setting found");
+
+        return -ENODEV;
+    }
+
+    // A setting too small for the payloads would lose part of every frame, so let the caller pick a cheaper mode instead.
+    if (!LargestEndpointDescriptorStructPtr || (!SelectedEndpointDescriptorStructPtr && PayloadFitsOverBudget))
+    {
+        pr_info("SelectStreamingAltSetting: %u byte payloads don't fit in the %u bytes per (micro)frame left on the bus",
+                MaxPayloadTransferSize, AvailableBandwidth);
+
+        return -ENOSPC;
+    }
+
+    if (!SelectedEndpointDescriptorStructPtr)
+    {
+
+        if (MaxPayloadTransferSize != 0)
+        {
+            pr_warn("SelectStreamingAltSetting: no alternate setting holds %u byte payloads, using the largest one", MaxPayloadTransferSize);
+        }
+
+        SelectedEndpointDescriptorStructPtr = LargestEndpointDescriptorStructPtr;
+        SelectedPacketSize = LargestPacketSize;
+    }
+
+    TomUsbCamIsochronousInputDevStructPtr->IsochronousInputAltSetting = SelectedEndpointDescriptorStructPtr->AlternateSettingAssoc;
+    TomUsbCamIsochronousInputDevStructPtr->IsochronousInputEndpointAddr = SelectedEndpointDescriptorStructPtr->bEndpointAddress;
+    TomUsbCamIsochronousInputDevStructPtr->IsochronousInputBufferSize = SelectedPacketSize;
+    TomUsbCamIsochronousInputDevStructPtr->IsochronousInputInterval = 1 << (clamp_val(SelectedEndpointDescriptorStructPtr->bInterval, 1, 16) - 1);
+
+    pr_info("SelectStreamingAltSetting: alternate setting %d, %zu bytes per packet for %u byte payloads",
+            TomUsbCamIsochronousInputDevStructPtr->IsochronousInputAltSetting, SelectedPacketSize, MaxPayloadTransferSize);
+
+    return 0;
+}
+
+// V4l2-specific functions for the queue
+//***********************************************************************************************
+
+// Check the camera to see if a packed/interleaved format or planar format is used. "NumImagePlanes" will
+// be "1" for an interleaved format. See:
+// "Other videobuf2 callbacks" here: https://lwn.net/Articles/447435/
+// Since we're using yuyv for this camera, which is a a packed format, NumImagePlanes == 1.
+static int TomUsbCamV4l2QueueSetup(struct vb2_queue *VideoBufferQueue,
+		                           unsigned int *NumBuffers, unsigned int *NumImagePlanes,
+		                           unsigned int ImageSizes[], struct device *alloc_devs[])
+{
+
+    // The pointer to the containing struct was previously saved in this struct's "private data" section.
+    struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr = vb2_get_drv_priv(VideoBufferQueue);
+
+    unsigned int ImageSizeInBytes = TomUsbCamCtrlIntfDevStructPtr->V4l2PixFormatStruct.sizeimage;
+
+    // VIDIOC_CREATE_BUFS passes in its own plane count and size, which only has to be big enough to hold a frame.
+    if (*NumImagePlanes)
+    {
+        return (ImageSizes[0] < ImageSizeInBytes) ? -EINVAL : 0;
+    }
+
+    *NumImagePlanes = 1;
+    ImageSizes[0] = ImageSizeInBytes;
+
+    return 0;
+}
+
+// Called each time a buffer is queued from user space, before it is handed to buffer_queue().
+static int buffer_prepare(struct vb2_buffer *vb)
+{
+
+    struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr = vb2_get_drv_priv(vb->vb2_queue);
+
+    // The format could have grown since the buffer was allocated.
+    if (vb2_plane_size(vb, 0) < TomUsbCamCtrlIntfDevStructPtr->V4l2PixFormatStruct.sizeimage)
+    {
+        pr_err("buffer_prepare error: buffer too small (%lu < %u)", vb2_plane_size(vb, 0),
+               TomUsbCamCtrlIntfDevStructPtr->V4l2PixFormatStruct.sizeimage);
+
+        return -EINVAL;
+    }
+
+    struct StreamingFormatStruct *FormatPtr = GetStreamingFormat(TomUsbCamCtrlIntfDevStructPtr,
+                                                                 TomUsbCamCtrlIntfDevStructPtr->V4l2PixFormatStruct.pixelformat);
+
+    // An imported dma-buf or user buffer that couldn't be mapped into the kernel can't be copied into. Page lists
+    // are written one page at a time and never need the whole buffer mapped, so don't ask vb2 to map it, unless the
+    // frames are converted. Those write to each plane at once, and the mapping has to be made here, outside of the
+    // Urb completion handler.
+    bool WholeBufferMapped = (TomUsbCamCtrlIntfDevStructPtr->BufferBackend != TOM_USB_CAM_BUFFER_BACKEND_DMA_SG) ||
+                             (FormatPtr && (FormatPtr->Conversion != TOM_USB_CAM_CONVERSION_NONE));
+
+    if (WholeBufferMapped ? !vb2_plane_vaddr(vb, 0) : !vb2_dma_sg_plane_desc(vb, 0))
+    {
+        pr_err("buffer_prepare error: buffer has no kernel mapping");
+
+        return -EINVAL;
+    }
+
+    vb2_set_plane_payload(vb, 0, 0);
+
+    return 0;
+}
+
+// Called by vb2 as user space dequeues a buffer, and for every prepared buffer when streaming stops, which isn't
+// counted. Records how long the filled buffer waited to be picked up.
+static void buffer_finish(struct vb2_buffer *vb)
+{
+
+    struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr = vb2_get_drv_priv(vb->vb2_queue);
+
+    struct TomUsbCamV4l2VideoBufferContainer *VideoBufferContainerPtr =
+        container_of(to_vb2_v4l2_buffer(vb), struct TomUsbCamV4l2VideoBufferContainer, TomUsbCamV4l2VideoBuffer);
+
+    if (VideoBufferContainerPtr->DoneNs && vb2_is_streaming(vb->vb2_queue))
+    {
+        TomUsbCamRecordLatency(TomUsbCamCtrlIntfDevStructPtr->StreamStatsForThisCameraStruct.CountersPtr, TOM_USB_CAM_LATENCY_DEQUEUE,
+                               VideoBufferContainerPtr->DoneNs, ktime_get_ns());
+    }
+
+    VideoBufferContainerPtr->DoneNs = 0;
+}
+
+// Hand an empty buffer to the driver. It sits on the queued list until the isochronous completion handler
+// starts filling it with the next frame.
+static void buffer_queue(struct vb2_buffer *vb)
+{
+
+    struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr = vb2_get_drv_priv(vb->vb2_queue);
+
+    struct TomUsbCamV4l2VideoBufferContainer *VideoBufferContainerPtr =
+        container_of(to_vb2_v4l2_buffer(vb), struct TomUsbCamV4l2VideoBufferContainer, TomUsbCamV4l2VideoBuffer);
+
+    unsigned long SpinLockFlags;
+
+    VideoBufferContainerPtr->EofNs = 0;
+    VideoBufferContainerPtr->PtsHostNs = 0;
+    VideoBufferContainerPtr->DoneNs = 0;
+
+    spin_lock_irqsave(&TomUsbCamCtrlIntfDevStructPtr->QueuedVideoBufferListLock, SpinLockFlags);
+
+    list_add_tail(&VideoBufferContainerPtr->TomUsbCamV4l2VideoBufferListHead, &TomUsbCamCtrlIntfDevStructPtr->QueuedVideoBufferListHead);
+
+    spin_unlock_irqrestore(&TomUsbCamCtrlIntfDevStructPtr->QueuedVideoBufferListLock, SpinLockFlags);
+}
+
+// Called by vb2 for a buffer whose request is cancelled before the buffer reached the driver.
+static void buffer_request_complete(struct vb2_buffer *vb)
+{
+
+    struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr = vb2_get_drv_priv(vb->vb2_queue);
+
+    v4l2_ctrl_request_complete(vb->req_obj.req, &TomUsbCamCtrlIntfDevStructPtr->V4l2CtrlHandler);
+}
+
+// Called on VIDIOC_STREAMON once at least min_buffers_needed buffers are queued. Switch the streaming interface
+// to its isochronous alternate setting and submit the whole Urb ring.
+static int start_streaming(struct vb2_queue *vq, unsigned int count)
+{
+
+    struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr = vb2_get_drv_priv(vq);
+
+    // The isochronous interface was probed separately. This holds a reference so its struct and Urbs stay around
+    // until streaming stops.
+    struct TomUsbCamIsochronousInputDevStruct *TomUsbCamIsochronousInputDevStructPtr = TomUsbCamGetStreamingInterface(TomUsbCamCtrlIntfDevStructPtr);
+
+    int StreamingErrorValue = 0;
+
+    if (!TomUsbCamIsochronousInputDevStructPtr)
+    {
+        pr_err("start_streaming error: isochronous interface not attached");
+
+        // Buffers must be given back in the queued state if streaming fails to start.
+        TomUsbCamReturnAllBuffers(TomUsbCamCtrlIntfDevStructPtr, VB2_BUF_STATE_QUEUED);
+
+        return -ENODEV;
+    }
+
+    TomUsbCamIsochronousInputDevStructPtr->CtrlIntfDevStructPtr = TomUsbCamCtrlIntfDevStructPtr;
+    TomUsbCamCtrlIntfDevStructPtr->IsochronousInputDevStructPtr = TomUsbCamIsochronousInputDevStructPtr;
+
+    TomUsbCamCtrlIntfDevStructPtr->FrameAssemblyForThisCameraStruct.OpsPtr = &TomUsbCamFrameAssemblyOps;
+    TomUsbCamCtrlIntfDevStructPtr->FrameAssemblyForThisCameraStruct.CurrentBufferPtr = NULL;
+    TomUsbCamCtrlIntfDevStructPtr->FrameAssemblyForThisCameraStruct.Sequence = 0;
+
+    TomUsbCamResetFrameAssembly(&TomUsbCamCtrlIntfDevStructPtr->FrameAssemblyForThisCameraStruct);
+
+    TomUsbCamResetClockRecovery(TomUsbCamCtrlIntfDevStructPtr);
+
+    // A processing stage that can't be set up just means the payloads get processed in the completion handler.
+    TomUsbCamStartProcessingStage(TomUsbCamIsochronousInputDevStructPtr, TomUsbCamCtrlIntfDevStructPtr->ProcessingStage);
+
+    StreamingErrorValue = TomUsbCamStartIsochronousStream(TomUsbCamCtrlIntfDevStructPtr, TomUsbCamIsochronousInputDevStructPtr);
+
+    // Other cameras on the same bus got there first. Rather than failing, stream a cheaper mode if that's allowed.
+    if ((StreamingErrorValue == -ENOSPC) && (TomUsbCamCtrlIntfDevStructPtr->BandwidthFallback != TOM_USB_CAM_BANDWIDTH_FALLBACK_NONE))
+    {
+        StreamingErrorValue = TomUsbCamStartFallbackStream(TomUsbCamCtrlIntfDevStructPtr, TomUsbCamIsochronousInputDevStructPtr);
+    }
+
+    if (StreamingErrorValue)
+    {
+        TomUsbCamStopIsochronousStream(TomUsbCamCtrlIntfDevStructPtr, VB2_BUF_STATE_QUEUED);
+    }
+
+    return StreamingErrorValue;
+}
+
+// Called on VIDIOC_STREAMOFF or when the file is closed. Every buffer the driver still owns has to be given back.
+static void stop_streaming(struct vb2_queue *vb)
+{
+
+    struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr = vb2_get_drv_priv(vb);
+
+    TomUsbCamStopIsochronousStream(TomUsbCamCtrlIntfDevStructPtr, VB2_BUF_STATE_ERROR);
+}
+
+//***********************************************************************************************
+
+// Isochronous streaming functions
+//***********************************************************************************************
+
+// Allocate the Urbs and their coherent transfer buffers, sized for the largest alternate setting so the same ring
+// works whichever setting is used to stream. Returns 0 on success.
+static int TomUsbCamAllocIsochronousUrbs(struct TomUsbCamIsochronousInputDevStruct *TomUsbCamIsochronousInputDevStructPtr)
+{
+
+    TomUsbCamIsochronousInputDevStructPtr->IsochronousUrbBufferSize =
+        TOM_USB_CAM_PACKETS_PER_ISOCHRONOUS_URB * TomUsbCamIsochronousInputDevStructPtr->IsochronousInputBufferSize;
+
+    for (int UrbIdx = 0; UrbIdx < TOM_USB_CAM_NUM_ISOCHRONOUS_URBS; UrbIdx++)
+    {
+
+        // Isochronous Urbs need room for a descriptor per packet.
+        struct urb *UrbPtr = usb_alloc_urb(TOM_USB_CAM_PACKETS_PER_ISOCHRONOUS_URB, GFP_KERNEL);
+
+        if (!UrbPtr)
+        {
+            pr_err("TomUsbCamAllocIsochronousUrbs error: usb_alloc_urb() failed");
+
+            TomUsbCamFreeIsochronousUrbs(TomUsbCamIsochronousInputDevStructPtr);
+
+            return -ENOMEM;
+        }
+
+        // Coherent memory avoids mapping and unmapping the buffer for every single transfer.
+        UrbPtr->transfer_buffer = usb_alloc_coherent(TomUsbCamIsochronousInputDevStructPtr->UsbDevStructPtr,
+                                                     TomUsbCamIsochronousInputDevStructPtr->IsochronousUrbBufferSize,
+                                                     GFP_KERNEL | __GFP_NOWARN,
+                                                     &UrbPtr->transfer_dma);
+
+        if (!UrbPtr->transfer_buffer)
+        {
+            pr_err("TomUsbCamAllocIsochronousUrbs error: usb_alloc_coherent() failed");
+
+            usb_free_urb(UrbPtr);
+
+            TomUsbCamFreeIsochronousUrbs(TomUsbCamIsochronousInputDevStructPtr);
+
+            return -ENOMEM;
+        }
+
+        TomUsbCamIsochronousInputDevStructPtr->IsochronousUrbPtrs[UrbIdx] = UrbPtr;
+    }
+
+    return 0;
+}
+
+// Fill in the Urb fields that depend on the alternate setting being streamed from. Called before every stream.
+static void TomUsbCamPrepareIsochronousUrbs(struct TomUsbCamIsochronousInputDevStruct *TomUsbCamIsochronousInputDevStructPtr)
+{
+
+    size_t PacketSize = TomUsbCamIsochronousInputDevStructPtr->IsochronousInputBufferSize;
+
+    for (int UrbIdx = 0; UrbIdx < TOM_USB_CAM_NUM_ISOCHRONOUS_URBS; UrbIdx++)
+    {
+
+        struct urb *UrbPtr = TomUsbCamIsochronousInputDevStructPtr->IsochronousUrbPtrs[UrbIdx];
+
+        UrbPtr->dev = TomUsbCamIsochronousInputDevStructPtr->UsbDevStructPtr;
+        UrbPtr->pipe = usb_rcvisocpipe(TomUsbCamIsochronousInputDevStructPtr->UsbDevStructPtr,
+                                       TomUsbCamIsochronousInputDevStructPtr->IsochronousInputEndpointAddr);
+        TomUsbCamIsochronousInputDevStructPtr->IsochronousUrbContexts[UrbIdx].UrbPtr = UrbPtr;
+        TomUsbCamIsochronousInputDevStructPtr->IsochronousUrbContexts[UrbIdx].IsochronousInputDevStructPtr = TomUsbCamIsochronousInputDevStructPtr;
+
+        // The Urbs were poisoned when the last stream stopped.
+        usb_unpoison_urb(UrbPtr);
+
+        UrbPtr->context = &TomUsbCamIsochronousInputDevStructPtr->IsochronousUrbContexts[UrbIdx];
+        UrbPtr->complete = TomUsbCamIsochronousUrbComplete;
+        UrbPtr->interval = TomUsbCamIsochronousInputDevStructPtr->IsochronousInputInterval;
+
+        // Let the host controller schedule the first packet as soon as possible, and don't let usbcore map
+        // the already-coherent buffer.
+        UrbPtr->transfer_flags = URB_ISO_ASAP | URB_NO_TRANSFER_DMA_MAP;
+        UrbPtr->number_of_packets = TOM_USB_CAM_PACKETS_PER_ISOCHRONOUS_URB;
+        UrbPtr->transfer_buffer_length = TOM_USB_CAM_PACKETS_PER_ISOCHRONOUS_URB * PacketSize;
+
+        for (int PacketIdx = 0; PacketIdx < TOM_USB_CAM_PACKETS_PER_ISOCHRONOUS_URB; PacketIdx++)
+        {
+            UrbPtr->iso_frame_desc[PacketIdx].offset = PacketIdx * PacketSize;
+            UrbPtr->iso_frame_desc[PacketIdx].length = PacketSize;
+        }
+    }
+}
+
+static void TomUsbCamFreeIsochronousUrbs(struct TomUsbCamIsochronousInputDevStruct *TomUsbCamIsochronousInputDevStructPtr)
+{
+
+    for (int UrbIdx = 0; UrbIdx < TOM_USB_CAM_NUM_ISOCHRONOUS_URBS; UrbIdx++)
+    {
+
+        struct urb *UrbPtr = TomUsbCamIsochronousInputDevStructPtr->IsochronousUrbPtrs[UrbIdx];
+
+        if (UrbPtr)
+        {
+
+            usb_free_coherent(TomUsbCamIsochronousInputDevStructPtr->UsbDevStructPtr,
+                              TomUsbCamIsochronousInputDevStructPtr->IsochronousUrbBufferSize,
+                              UrbPtr->transfer_buffer,
+                              UrbPtr->transfer_dma);
+
+            usb_free_urb(UrbPtr);
+
+            TomUsbCamIsochronousInputDevStructPtr->IsochronousUrbPtrs[UrbIdx] = NULL;
+        }
+    }
+}
+
+// usb_poison_urb() waits for a running completion handler to finish and, unlike usb_kill_urb(), keeps rejecting
+// resubmits afterwards. That matters when a processing kthread or work item still holds a completed Urb.
+static void TomUsbCamKillIsochronousUrbs(struct TomUsbCamIsochronousInputDevStruct *TomUsbCamIsochronousInputDevStructPtr)
+{
+
+    for (int UrbIdx = 0; UrbIdx < TOM_USB_CAM_NUM_ISOCHRONOUS_URBS; UrbIdx++)
+    {
+
+        if (TomUsbCamIsochronousInputDevStructPtr->IsochronousUrbPtrs[UrbIdx])
+        {
+            usb_poison_urb(TomUsbCamIsochronousInputDevStructPtr->IsochronousUrbPtrs[UrbIdx]);
+        }
+    }
+}
+
+// Runs in interrupt context each time the host controller finishes an isochronous Urb. Either pass every received
+// packet on to the frame assembler and hand the Urb straight back to the host controller, or queue the Urb for the
+// processing stage, which does both from process context.
+static void TomUsbCamIsochronousUrbComplete(struct urb *UrbPtr)
+{
+
+    struct IsochronousUrbContextStruct *UrbContextPtr = UrbPtr->context;
+
+    struct TomUsbCamIsochronousInputDevStruct *TomUsbCamIsochronousInputDevStructPtr = UrbContextPtr->IsochronousInputDevStructPtr;
+
+    trace_tomusbcam_urb_complete(TomUsbCamIsochronousInputDevStructPtr->CtrlIntfDevStructPtr, UrbPtr);
+
+    switch (UrbPtr->status)
+    {
+
+        case 0:
+            break;
+
+        // The Urb was killed or the device went away, so don't resubmit it.
+        case -ENOENT:
+        case -ECONNRESET:
+        case -ESHUTDOWN:
+            return;
+
+        default:
+            pr_warn_ratelimited("TomUsbCamIsochronousUrbComplete error: Urb status %d", UrbPtr->status);
+            break;
+    }
+
+    this_cpu_inc(TomUsbCamIsochronousInputDevStructPtr->CtrlIntfDevStructPtr->StreamStatsForThisCameraStruct.CountersPtr->UrbsCompleted);
+
+    if (TomUsbCamIsochronousInputDevStructPtr->ProcessingStage == TOM_USB_CAM_PROCESSING_STAGE_KTHREAD)
+    {
+
+        llist_add(&UrbContextPtr->PendingUrbNode, &TomUsbCamIsochronousInputDevStructPtr->PendingUrbList);
+
+        wake_up_process(TomUsbCamIsochronousInputDevStructPtr->ProcessingThreadPtr);
+
+        return;
+    }
+
+    if (TomUsbCamIsochronousInputDevStructPtr->ProcessingStage == TOM_USB_CAM_PROCESSING_STAGE_WORKQUEUE)
+    {
+
+        llist_add(&UrbContextPtr->PendingUrbNode, &TomUsbCamIsochronousInputDevStructPtr->PendingUrbList);
+
+        queue_work(TomUsbCamIsochronousInputDevStructPtr->ProcessingWorkQueuePtr, &TomUsbCamIsochronousInputDevStructPtr->ProcessingWork);
+
+        return;
+    }
+
+    TomUsbCamProcessUrbPackets(TomUsbCamIsochronousInputDevStructPtr->CtrlIntfDevStructPtr, UrbPtr);
+
+    int SubmitReturnCode = usb_submit_urb(UrbPtr, GFP_ATOMIC);
+
+    trace_tomusbcam_urb_submit(TomUsbCamIsochronousInputDevStructPtr->CtrlIntfDevStructPtr, UrbPtr, SubmitReturnCode);
+
+    if (SubmitReturnCode)
+    {
+        pr_err_ratelimited("TomUsbCamIsochronousUrbComplete error: usb_submit_urb() returned %d", SubmitReturnCode);
+    }
+    else
+    {
+        this_cpu_inc(TomUsbCamIsochronousInputDevStructPtr->CtrlIntfDevStructPtr->StreamStatsForThisCameraStruct.CountersPtr->UrbsResubmitted);
+    }
+}
+
+static void TomUsbCamProcessUrbPackets(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr, struct urb *UrbPtr)
+{
+
+    u64 BytesReceived = 0;
+
+    for (int PacketIdx = 0; PacketIdx < UrbPtr->number_of_packets; PacketIdx++)
+    {
+
+        struct usb_iso_packet_descriptor *PacketPtr = &UrbPtr->iso_frame_desc[PacketIdx];
+
+        // Isochronous transfers aren't retried, so a bad packet is just lost, and with it part of a frame. Which frame
+        // is only known once the next payload arrives.
+        if (PacketPtr->status < 0)
+        {
+            TomUsbCamCtrlIntfDevStructPtr->FrameAssemblyForThisCameraStruct.PendingErrorFlags |= TOM_USB_CAM_FRAME_ERROR_PACKET;
+            TomUsbCamCountPacketError(TomUsbCamCtrlIntfDevStructPtr->StreamStatsForThisCameraStruct.CountersPtr, PacketPtr->status);
+            continue;
+        }
+
+        BytesReceived += PacketPtr->actual_length;
+
+        TomUsbCamProcessPayload(&TomUsbCamCtrlIntfDevStructPtr->FrameAssemblyForThisCameraStruct,
+                                (unsigned char *) UrbPtr->transfer_buffer + PacketPtr->offset,
+                                PacketPtr->actual_length);
+    }
+
+    this_cpu_add(TomUsbCamCtrlIntfDevStructPtr->StreamStatsForThisCameraStruct.CountersPtr->BytesReceived, BytesReceived);
+}
+
+// Set up the processing stage the first time streaming starts, and let it run. Returns 0 on success, otherwise
+// payloads are processed in the completion handler.
+static int TomUsbCamStartProcessingStage(struct TomUsbCamIsochronousInputDevStruct *TomUsbCamIsochronousInputDevStructPtr, int ProcessingStage)
+{
+
+    struct TomUsbCamIsochronousInputDevStruct *IsoPtr = TomUsbCamIsochronousInputDevStructPtr;
+
+    IsoPtr->ProcessingStage = TOM_USB_CAM_PROCESSING_STAGE_URB_COMPLETION;
+
+    if (ProcessingStage == TOM_USB_CAM_PROCESSING_STAGE_KTHREAD)
+    {
+
+        if (!IsoPtr->ProcessingThreadPtr)
+        {
+
+            struct task_struct *ThreadPtr = kthread_create(TomUsbCamProcessingThread, IsoPtr, "tomusbcam-%s",
+                                                           dev_name(&IsoPtr->UsbDevStructPtr->dev));
+
+            if (IS_ERR(ThreadPtr))
+            {
+                pr_warn("TomUsbCamStartProcessingStage: kthread_create() returned %ld", PTR_ERR(ThreadPtr));
+
+                return PTR_ERR(ThreadPtr);
+            }
+
+            // Keep the copies off the cpus handling other latency sensitive devices if asked to.
+            if (TomUsbCamProcessingCpus && *TomUsbCamProcessingCpus)
+            {
+
+                cpumask_var_t ProcessingCpuMask;
+
+                if (zalloc_cpumask_var(&ProcessingCpuMask, GFP_KERNEL))
+                {
+
+                    if (!cpulist_parse(TomUsbCamProcessingCpus, ProcessingCpuMask) && !cpumask_empty(ProcessingCpuMask))
+                    {
+                        set_cpus_allowed_ptr(ThreadPtr, ProcessingCpuMask);
+                    }
+                    else
+                    {
+                        pr_warn("TomUsbCamStartProcessingStage: ignoring bad processing_cpus \"%s\"", TomUsbCamProcessingCpus);
+                    }
+
+                    free_cpumask_var(ProcessingCpuMask);
+                }
+            }
+
+            IsoPtr->ProcessingThreadPtr = ThreadPtr;
+
+            wake_up_process(ThreadPtr);
+        }
+        else
+        {
+            kthread_unpark(IsoPtr->ProcessingThreadPtr);
+        }
+    }
+    else if (ProcessingStage == TOM_USB_CAM_PROCESSING_STAGE_WORKQUEUE)
+    {
+
+        if (!IsoPtr->ProcessingWorkQueuePtr)
+        {
+
+            // WQ_SYSFS exposes the cpumask of the unbound workers under /sys/devices/virtual/workqueue/.
+            IsoPtr->ProcessingWorkQueuePtr = alloc_workqueue("tomusbcam-%s", WQ_UNBOUND | WQ_HIGHPRI | WQ_SYSFS, 1,
+                                                             dev_name(&IsoPtr->UsbDevStructPtr->dev));
+
+            if (!IsoPtr->ProcessingWorkQueuePtr)
+            {
+                pr_warn("TomUsbCamStartProcessingStage: alloc_workqueue() failed");
+
+                return -ENOMEM;
+            }
+
+            INIT_WORK(&IsoPtr->ProcessingWork, TomUsbCamProcessingWork);
+        }
+    }
+    else
+    {
+        return 0;
+    }
+
+    init_llist_head(&IsoPtr->PendingUrbList);
+
+    IsoPtr->ProcessingStage = ProcessingStage;
+
+    return 0;
+}
+
+// Wait for the processing stage to go idle and drop any Urbs it didn't get to. The Urbs must already be poisoned so
+// nothing new can be queued, and nothing still being processed can be resubmitted.
+static void TomUsbCamStopProcessingStage(struct TomUsbCamIsochronousInputDevStruct *TomUsbCamIsochronousInputDevStructPtr)
+{
+
+    if (TomUsbCamIsochronousInputDevStructPtr->ProcessingStage == TOM_USB_CAM_PROCESSING_STAGE_KTHREAD)
+    {
+        kthread_park(TomUsbCamIsochronousInputDevStructPtr->ProcessingThreadPtr);
+    }
+    else if (TomUsbCamIsochronousInputDevStructPtr->ProcessingStage == TOM_USB_CAM_PROCESSING_STAGE_WORKQUEUE)
+    {
+        cancel_work_sync(&TomUsbCamIsochronousInputDevStructPtr->ProcessingWork);
+    }
+
+    llist_del_all(&TomUsbCamIsochronousInputDevStructPtr->PendingUrbList);
+}
+
+static void TomUsbCamDestroyProcessingStage(struct TomUsbCamIsochronousInputDevStruct *TomUsbCamIsochronousInputDevStructPtr)
+{
+
+    if (TomUsbCamIsochronousInputDevStructPtr->ProcessingThreadPtr)
+    {
+        kthread_stop(TomUsbCamIsochronousInputDevStructPtr->ProcessingThreadPtr);
+        TomUsbCamIsochronousInputDevStructPtr->ProcessingThreadPtr = NULL;
+    }
+
+    if (TomUsbCamIsochronousInputDevStructPtr->ProcessingWorkQueuePtr)
+    {
+        destroy_workqueue(TomUsbCamIsochronousInputDevStructPtr->ProcessingWorkQueuePtr);
+        TomUsbCamIsochronousInputDevStructPtr->ProcessingWorkQueuePtr = NULL;
+    }
+}
+
+// Sleeps until the completion handler queues an Urb. Parked while not streaming.
+static int TomUsbCamProcessingThread(void *Data)
+{
+
+    struct TomUsbCamIsochronousInputDevStruct *TomUsbCamIsochronousInputDevStructPtr = Data;
+
+    while (!kthread_should_stop())
+    {
+
+        if (kthread_should_park())
+        {
+            kthread_parkme();
+            continue;
+        }
+
+        // Set the state before checking the list so a wake up in between isn't lost.
+        set_current_state(TASK_INTERRUPTIBLE);
+
+        if (llist_empty(&TomUsbCamIsochronousInputDevStructPtr->PendingUrbList) && !kthread_should_stop() && !kthread_should_park())
+        {
+            schedule();
+        }
+
+        __set_current_state(TASK_RUNNING);
+
+        TomUsbCamProcessPendingUrbs(TomUsbCamIsochronousInputDevStructPtr);
+    }
+
+    return 0;
+}
+
+static void TomUsbCamProcessingWork(struct work_struct *WorkPtr)
+{
+    TomUsbCamProcessPendingUrbs(container_of(WorkPtr, struct TomUsbCamIsochronousInputDevStruct, ProcessingWork));
+}
+
+// Take every Urb the completion handler queued, oldest first, process its packets and give it back to the host controller.
+static void TomUsbCamProcessPendingUrbs(struct TomUsbCamIsochronousInputDevStruct *TomUsbCamIsochronousInputDevStructPtr)
+{
+
+    // llist_add() pushes onto the front, so reverse the list to get the Urbs back in the order they completed.
+    struct llist_node *PendingUrbNodePtr = llist_reverse_order(llist_del_all(&TomUsbCamIsochronousInputDevStructPtr->PendingUrbList));
+
+    while (PendingUrbNodePtr)
+    {
+
+        struct IsochronousUrbContextStruct *UrbContextPtr = llist_entry(PendingUrbNodePtr, struct IsochronousUrbContextStruct, PendingUrbNode);
+
+        // The node is reused as soon as the Urb completes again, so step past it before resubmitting.
+        PendingUrbNodePtr = PendingUrbNodePtr->next;
+
+        TomUsbCamProcessUrbPackets(TomUsbCamIsochronousInputDevStructPtr->CtrlIntfDevStructPtr, UrbContextPtr->UrbPtr);
+
+        int SubmitReturnCode = usb_submit_urb(UrbContextPtr->UrbPtr, GFP_KERNEL);
+
+        trace_tomusbcam_urb_submit(TomUsbCamIsochronousInputDevStructPtr->CtrlIntfDevStructPtr, UrbContextPtr->UrbPtr, SubmitReturnCode);
+
+        // -EPERM just means the stream is being stopped and the Urb was poisoned.
+        if (SubmitReturnCode && (SubmitReturnCode != -EPERM))
+        {
+            pr_err_ratelimited("TomUsbCamProcessPendingUrbs error: usb_submit_urb() returned %d", SubmitReturnCode);
+        }
+        else if (!SubmitReturnCode)
+        {
+            this_cpu_inc(TomUsbCamIsochronousInputDevStructPtr->CtrlIntfDevStructPtr->StreamStatsForThisCameraStruct.CountersPtr->UrbsResubmitted);
+        }
+    }
+}
+
+// Every isochronous packet carries one payload: a header followed by a chunk of the frame. Returns 0 and fills in
+// PayloadHeaderPtr, -ENODATA for the zero-length packets the camera sends when it has nothing to send in a
+// microframe, or -EPROTO if the header doesn't fit in the payload. See section 2.4.3.3 of [5].
+static int TomUsbCamParsePayloadHeader(const unsigned char *PayloadPtr, unsigned int PayloadLen, struct PayloadHeaderStruct *PayloadHeaderPtr)
+{
+
+    if (PayloadLen < PayloadHeaderMinLen)
+    {
+        return -ENODATA;
+    }
+
+    PayloadHeaderPtr->HeaderLen = PayloadPtr[0];
+    PayloadHeaderPtr->HeaderInfo = PayloadPtr[1];
+    PayloadHeaderPtr->PtsValid = false;
+    PayloadHeaderPtr->ScrPtr = NULL;
+
+    if ((PayloadHeaderPtr->HeaderLen < PayloadHeaderMinLen) || (PayloadHeaderPtr->HeaderLen > PayloadLen))
+    {
+        return -EPROTO;
+    }
+
+    // The Pts and Scr fields are optional, and the Scr comes after the Pts when both are there.
+    unsigned int ScrOffset = PayloadHeaderPtsOffset;
+
+    if (PayloadHeaderPtr->HeaderInfo & PayloadHeaderPresentationTimeBit)
+    {
+
+        if (PayloadHeaderPtr->HeaderLen >= PayloadHeaderPtsOffset + PayloadHeaderPtsLen)
+        {
+            PayloadHeaderPtr->Pts = get_unaligned_le32(PayloadPtr + PayloadHeaderPtsOffset);
+            PayloadHeaderPtr->PtsValid = true;
+        }
+
+        ScrOffset += PayloadHeaderPtsLen;
+    }
+
+    if ((PayloadHeaderPtr->HeaderInfo & PayloadHeaderSourceClockBit) && (PayloadHeaderPtr->HeaderLen >= ScrOffset + PayloadHeaderScrLen))
+    {
+        PayloadHeaderPtr->ScrPtr = PayloadPtr + ScrOffset;
+    }
+
+    return 0;
+}
+
+// Piece frames together from the payloads. The frame Id bit of the header toggles each time a new frame starts,
+// and the end-of-frame bit is set on the last payload of a frame. Buffers come from and go back to the
+// FrameAssemblyOpsStruct functions.
+static void TomUsbCamProcessPayload(struct FrameAssemblyStruct *FrameAssemblyPtr, const unsigned char *PayloadPtr, unsigned int PayloadLen)
+{
+
+    struct PayloadHeaderStruct PayloadHeader;
+
+    int ParseReturnCode = TomUsbCamParsePayloadHeader(PayloadPtr, PayloadLen, &PayloadHeader);
+
+    if (ParseReturnCode == -ENODATA)
+    {
+        return;
+    }
+
+    // Without a frame Id there's no telling which frame the payload belonged to, so it counts as lost.
+    if (ParseReturnCode)
+    {
+        FrameAssemblyPtr->PendingErrorFlags |= TOM_USB_CAM_FRAME_ERROR_HEADER;
+        return;
+    }
+
+    int8_t FrameId = PayloadHeader.HeaderInfo & PayloadHeaderFrameIdBit;
+
+    unsigned int PendingErrorFlags = FrameAssemblyPtr->PendingErrorFlags;
+
+    FrameAssemblyPtr->PendingErrorFlags = 0;
+
+    if (FrameId != FrameAssemblyPtr->LastFrameId)
+    {
+
+        // Payloads lost right before the toggle were the tail of the previous frame if it came up short. Otherwise
+        // that frame ended or was complete, and they were the head of the one starting now.
+        if (FrameAssemblyPtr->FrameActive && (FrameAssemblyPtr->BytesUsed < FrameAssemblyPtr->FrameLen))
+        {
+            FrameAssemblyPtr->ErrorFlags |= PendingErrorFlags;
+            PendingErrorFlags = 0;
+        }
+
+        // A new frame started before the previous one saw its end-of-frame bit. Hand over what was received.
+        if (FrameAssemblyPtr->FrameActive)
+        {
+            FrameAssemblyPtr->ErrorFlags |= TOM_USB_CAM_FRAME_ERROR_NO_EOF;
+            TomUsbCamEndFrame(FrameAssemblyPtr);
+        }
+
+        // Method 2 still images come between the video frames, with the still image bit set in every payload.
+        FrameAssemblyPtr->StillImage = (PayloadHeader.HeaderInfo & PayloadHeaderStillImageBit) != 0;
+
+        // Don't start filling a buffer in the middle of whatever frame was in flight when streaming started.
+        if (FrameAssemblyPtr->LastFrameId != -1)
+        {
+            FrameAssemblyPtr->BytesUsed = 0;
+            FrameAssemblyPtr->FrameActive = FrameAssemblyPtr->OpsPtr->StartFrame(FrameAssemblyPtr);
+
+            // A frame skipped for want of a buffer still takes its sequence number, so user space sees the gap. The
+            // frame won't reach TomUsbCamEndFrame(), which counts all the others.
+            if (!FrameAssemblyPtr->FrameActive && !FrameAssemblyPtr->StillImage)
+            {
+                FrameAssemblyPtr->Sequence++;
+            }
+        }
+
+        FrameAssemblyPtr->LastFrameId = FrameId;
+        FrameAssemblyPtr->PtsValid = false;
+        FrameAssemblyPtr->ClockSampled = false;
+        FrameAssemblyPtr->ErrorFlags = PendingErrorFlags;
+    }
+    else if (!FrameAssemblyPtr->FrameActive && (PayloadLen == PayloadHeader.HeaderLen))
+    {
+
+        // A header-only payload after the end-of-frame bit says nothing about the frame to come, so whatever was
+        // lost before it may still be that frame's head.
+        FrameAssemblyPtr->PendingErrorFlags = PendingErrorFlags;
+    }
+    else
+    {
+        FrameAssemblyPtr->ErrorFlags |= PendingErrorFlags;
+    }
+
+    // The camera flags payloads it knows are bad, e.g. when its fifo overran.
+    if (PayloadHeader.HeaderInfo & PayloadHeaderErrorBit)
+    {
+        FrameAssemblyPtr->ErrorFlags |= TOM_USB_CAM_FRAME_ERROR_HEADER;
+    }
+
+    // The Pts is the same in every payload of a frame, so the first one that has it is enough.
+    if (PayloadHeader.PtsValid && !FrameAssemblyPtr->PtsValid)
+    {
+        FrameAssemblyPtr->Pts = PayloadHeader.Pts;
+        FrameAssemblyPtr->PtsValid = true;
+    }
+
+    // One clock sample per frame keeps the fit window at about a second of video.
+    if (PayloadHeader.ScrPtr && !FrameAssemblyPtr->ClockSampled)
+    {
+        FrameAssemblyPtr->OpsPtr->AddClockSample(FrameAssemblyPtr, PayloadHeader.ScrPtr);
+        FrameAssemblyPtr->ClockSampled = true;
+    }
+
+    // If user space didn't have a buffer queued when this frame started, the whole frame is skipped.
+    if (FrameAssemblyPtr->FrameActive)
+    {
+
+        TomUsbCamCopyToFrame(FrameAssemblyPtr, PayloadPtr + PayloadHeader.HeaderLen, PayloadLen - PayloadHeader.HeaderLen);
+
+        if (PayloadHeader.HeaderInfo & PayloadHeaderEndOfFrameBit)
+        {
+            TomUsbCamEndFrame(FrameAssemblyPtr);
+        }
+    }
+}
+
+// Append payload data to the frame being assembled, dropping whatever doesn't fit. Vmalloc'd and imported buffers
+// have a single kernel mapping. Page lists are written a page at a time through a cursor that is kept between
+// payloads, so finding where the next payload goes doesn't mean walking the list from the start.
+static void TomUsbCamCopyToFrame(struct FrameAssemblyStruct *FrameAssemblyPtr, const unsigned char *DataPtr, size_t DataLen)
+{
+
+    if (FrameAssemblyPtr->Conversion != TOM_USB_CAM_CONVERSION_NONE)
+    {
+
+        // buffer_prepare() made sure the buffer is big enough for a whole converted frame and mapped.
+        size_t BytesToConvert = min_t(size_t, DataLen, FrameAssemblyPtr->FrameLen - FrameAssemblyPtr->BytesUsed);
+
+        if (BytesToConvert < DataLen)
+        {
+            FrameAssemblyPtr->ErrorFlags |= TOM_USB_CAM_FRAME_ERROR_OVERFLOW;
+        }
+
+        TomUsbCamConvertYuyv(FrameAssemblyPtr, FrameAssemblyPtr->DstVaddr, DataPtr, FrameAssemblyPtr->BytesUsed, BytesToConvert);
+
+        FrameAssemblyPtr->BytesUsed += BytesToConvert;
+
+        return;
+    }
+
+    size_t BytesToCopy = min_t(size_t, DataLen, FrameAssemblyPtr->DstSize - FrameAssemblyPtr->BytesUsed);
+
+    if (BytesToCopy < DataLen)
+    {
+        FrameAssemblyPtr->ErrorFlags |= TOM_USB_CAM_FRAME_ERROR_OVERFLOW;
+    }
+
+    if (FrameAssemblyPtr->DstVaddr)
+    {
+
+        memcpy(FrameAssemblyPtr->DstVaddr + FrameAssemblyPtr->BytesUsed, DataPtr, BytesToCopy);
+
+        FrameAssemblyPtr->BytesUsed += BytesToCopy;
+
+        return;
+    }
+
+    // Start at the head of the page list for every new frame.
+    if (FrameAssemblyPtr->BytesUsed == 0)
+    {
+        FrameAssemblyPtr->CurrentSgPtr = FrameAssemblyPtr->DstSgTablePtr->sgl;
+        FrameAssemblyPtr->CurrentSgOffset = 0;
+    }
+
+    while (BytesToCopy && FrameAssemblyPtr->CurrentSgPtr)
+    {
+
+        struct scatterlist *SgPtr = FrameAssemblyPtr->CurrentSgPtr;
+
+        // A list entry can cover several physically contiguous pages, and each one has to be mapped on its own.
+        size_t OffsetInEntry = SgPtr->offset + FrameAssemblyPtr->CurrentSgOffset;
+        struct page *PagePtr = nth_page(sg_page(SgPtr), OffsetInEntry >> PAGE_SHIFT);
+        size_t OffsetInPage = offset_in_page(OffsetInEntry);
+
+        size_t ChunkLen = min3(BytesToCopy, (size_t) (PAGE_SIZE - OffsetInPage), (size_t) (SgPtr->length - FrameAssemblyPtr->CurrentSgOffset));
+
+        // This runs in the Urb completion handler, so the mapping has to be atomic.
+        unsigned char *PageAddrPtr = kmap_atomic(PagePtr);
+
+        memcpy(PageAddrPtr + OffsetInPage, DataPtr, ChunkLen);
+
+        kunmap_atomic(PageAddrPtr);
+
+        DataPtr += ChunkLen;
+        BytesToCopy -= ChunkLen;
+        FrameAssemblyPtr->BytesUsed += ChunkLen;
+        FrameAssemblyPtr->CurrentSgOffset += ChunkLen;
+
+        if (FrameAssemblyPtr->CurrentSgOffset == SgPtr->length)
+        {
+            FrameAssemblyPtr->CurrentSgPtr = sg_next(SgPtr);
+            FrameAssemblyPtr->CurrentSgOffset = 0;
+        }
+    }
+}
+
+// Convert DataLen bytes of a Yuyv frame, starting SourceOffset bytes into it, straight into the buffer at DstPtr in
+// the format user space asked for. Every Yuyv line is its luma bytes interleaved with its Cb/Cr bytes, i.e. the even
+// bytes go to the luma plane and the odd ones to the chroma plane, both at half their offset in the line. Packets can
+// end anywhere, even in the middle of a pixel, so each byte is placed by its offset in the frame.
+static void TomUsbCamConvertYuyv(struct FrameAssemblyStruct *FrameAssemblyPtr, unsigned char *DstPtr,
+                                 const unsigned char *SrcPtr, size_t SourceOffset, size_t DataLen)
+{
+
+    int Conversion = FrameAssemblyPtr->Conversion;
+    size_t Width = FrameAssemblyPtr->Width;
+    size_t Height = FrameAssemblyPtr->Height;
+    size_t SourceBytesPerLine = Width * 2;
+
+    while (DataLen)
+    {
+
+        size_t Line = SourceOffset / SourceBytesPerLine;
+        size_t LineOffset = SourceOffset % SourceBytesPerLine;
+        size_t SegmentLen = min(DataLen, SourceBytesPerLine - LineOffset);
+
+        const unsigned char *SegmentEndPtr = SrcPtr + SegmentLen;
+        unsigned char *LumaPtr = DstPtr + Line * Width;
+        unsigned char *ChromaPtr = NULL;
+
+        // Nv16 keeps every line's chroma, Nv12 only every other line's.
+        if (Conversion == TOM_USB_CAM_CONVERSION_NV16)
+        {
+            ChromaPtr = DstPtr + Width * Height + Line * Width;
+        }
+        else if ((Conversion == TOM_USB_CAM_CONVERSION_NV12) && !(Line & 1))
+        {
+            ChromaPtr = DstPtr + Width * Height + (Line / 2) * Width;
+        }
+
+        size_t Idx = LineOffset;
+
+        // The last packet ended between the luma and the chroma byte of a pixel.
+        if (Idx & 1)
+        {
+
+            if (ChromaPtr)
+            {
+                ChromaPtr[Idx >> 1] = *SrcPtr;
+            }
+
+            SrcPtr++;
+            Idx++;
+        }
+
+        if (ChromaPtr)
+        {
+
+            for (; SrcPtr + 2 <= SegmentEndPtr; SrcPtr += 2, Idx += 2)
+            {
+                LumaPtr[Idx >> 1] = SrcPtr[0];
+                ChromaPtr[Idx >> 1] = SrcPtr[1];
+            }
+        }
+        else
+        {
+
+            for (; SrcPtr + 2 <= SegmentEndPtr; SrcPtr += 2, Idx += 2)
+            {
+                LumaPtr[Idx >> 1] = SrcPtr[0];
+            }
+        }
+
+        // This packet ends between the luma and the chroma byte of a pixel.
+        if (SrcPtr < SegmentEndPtr)
+        {
+            LumaPtr[Idx >> 1] = *SrcPtr;
+            SrcPtr++;
+        }
+
+        SourceOffset += SegmentLen;
+        DataLen -= SegmentLen;
+    }
+}
+
+// The current frame is finished, one way or the other. Hand it over and get ready for the next one.
+static void TomUsbCamEndFrame(struct FrameAssemblyStruct *FrameAssemblyPtr)
+{
+
+    // Every mode is uncompressed, so a whole frame is always exactly FrameLen long.
+    if (FrameAssemblyPtr->BytesUsed < FrameAssemblyPtr->FrameLen)
+    {
+        FrameAssemblyPtr->ErrorFlags |= TOM_USB_CAM_FRAME_ERROR_SHORT;
+    }
+
+    if (FrameAssemblyPtr->ErrorFlags)
+    {
+        pr_debug("TomUsbCamEndFrame: frame %u damaged (0x%x), %zu of %zu bytes", FrameAssemblyPtr->Sequence,
+                 FrameAssemblyPtr->ErrorFlags, FrameAssemblyPtr->BytesUsed, FrameAssemblyPtr->FrameLen);
+    }
+
+    FrameAssemblyPtr->OpsPtr->CompleteFrame(FrameAssemblyPtr);
+
+    // Count damaged frames that get dropped too, so user space can see the gap in the sequence numbers, the same as
+    // for frames skipped without a buffer. Still images sent between the video frames aren't part of the video stream
+    // though.
+    if (!FrameAssemblyPtr->StillImage)
+    {
+        FrameAssemblyPtr->Sequence++;
+    }
+
+    FrameAssemblyPtr->FrameActive = false;
+    FrameAssemblyPtr->BytesUsed = 0;
+    FrameAssemblyPtr->ErrorFlags = 0;
+}
+
+// Take the next queued vb2 buffer for a new frame, and point the frame assembler at its memory.
+static bool TomUsbCamStartFrame(struct FrameAssemblyStruct *FrameAssemblyPtr)
+{
+
+    struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr = container_of(FrameAssemblyPtr, struct TomUsbCamCtrlIntfDevStruct,
+                                                                                     FrameAssemblyForThisCameraStruct);
+
+    struct StillCaptureStruct *StillCaptureStructPtr = &TomUsbCamCtrlIntfDevStructPtr->StillCaptureForThisCameraStruct;
+
+    // While the stream is switched over to the still frame size, every frame is a still image.
+    if (FrameAssemblyPtr->StillImage || StillCaptureStructPtr->SwitchActive)
+    {
+        return TomUsbCamStartStillFrame(TomUsbCamCtrlIntfDevStructPtr, FrameAssemblyPtr);
+    }
+
+    // The frame before may have been a still image, which has a layout of its own.
+    FrameAssemblyPtr->Conversion = StillCaptureStructPtr->VideoConversion;
+    FrameAssemblyPtr->FrameLen = StillCaptureStructPtr->VideoFrameLen;
+
+    TomUsbCamMeasureFrameInterval(TomUsbCamCtrlIntfDevStructPtr);
+
+    FrameAssemblyPtr->CurrentBufferPtr = TomUsbCamGetNextQueuedBuffer(TomUsbCamCtrlIntfDevStructPtr);
+
+    TomUsbCamScheduleRequestControls(TomUsbCamCtrlIntfDevStructPtr);
+
+    trace_tomusbcam_frame_start(TomUsbCamCtrlIntfDevStructPtr, FrameAssemblyPtr->CurrentBufferPtr != NULL);
+
+    if (!FrameAssemblyPtr->CurrentBufferPtr)
+    {
+        this_cpu_inc(TomUsbCamCtrlIntfDevStructPtr->StreamStatsForThisCameraStruct.CountersPtr->QueueUnderruns);
+        return false;
+    }
+
+    struct vb2_buffer *Vb2BufferPtr = &FrameAssemblyPtr->CurrentBufferPtr->TomUsbCamV4l2VideoBuffer.vb2_buf;
+
+    FrameAssemblyPtr->DstSize = vb2_plane_size(Vb2BufferPtr, 0);
+
+    // Converted frames are always written through the kernel mapping, buffer_prepare() made sure there is one.
+    if ((TomUsbCamCtrlIntfDevStructPtr->BufferBackend == TOM_USB_CAM_BUFFER_BACKEND_DMA_SG) &&
+        (FrameAssemblyPtr->Conversion == TOM_USB_CAM_CONVERSION_NONE))
+    {
+        FrameAssemblyPtr->DstVaddr = NULL;
+        FrameAssemblyPtr->DstSgTablePtr = vb2_dma_sg_plane_desc(Vb2BufferPtr, 0);
+    }
+    else
+    {
+        FrameAssemblyPtr->DstVaddr = vb2_plane_vaddr(Vb2BufferPtr, 0);
+        FrameAssemblyPtr->DstSgTablePtr = NULL;
+    }
+
+    return true;
+}
+
+// Give the filled buffer back to vb2 so user space can dequeue it. A damaged frame is either flagged with
+// V4L2_BUF_FLAG_ERROR, with bytesused saying how much of it arrived, or dropped and its buffer reused.
+static void TomUsbCamCompleteFrame(struct FrameAssemblyStruct *FrameAssemblyPtr)
+{
+
+    struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr = container_of(FrameAssemblyPtr, struct TomUsbCamCtrlIntfDevStruct,
+                                                                                     FrameAssemblyForThisCameraStruct);
+
+    struct vb2_v4l2_buffer *V4l2BufferPtr = &FrameAssemblyPtr->CurrentBufferPtr->TomUsbCamV4l2VideoBuffer;
+
+    if (TomUsbCamIsStillBuffer(TomUsbCamCtrlIntfDevStructPtr, FrameAssemblyPtr->CurrentBufferPtr))
+    {
+        TomUsbCamCompleteStillFrame(TomUsbCamCtrlIntfDevStructPtr, FrameAssemblyPtr);
+        return;
+    }
+
+    trace_tomusbcam_frame_end(TomUsbCamCtrlIntfDevStructPtr);
+
+    u64 EofNs = ktime_get_ns();
+
+    TomUsbCamRecordLatency(TomUsbCamCtrlIntfDevStructPtr->StreamStatsForThisCameraStruct.CountersPtr, TOM_USB_CAM_LATENCY_ASSEMBLY,
+                           TomUsbCamCtrlIntfDevStructPtr->StreamStatsForThisCameraStruct.LastFrameStartNs, EofNs);
+
+    size_t PayloadLen = FrameAssemblyPtr->BytesUsed;
+
+    // Converted frames are counted in Yuyv bytes. sizeimage may be larger than the converted frame, so don't go by it.
+    if (FrameAssemblyPtr->Conversion != TOM_USB_CAM_CONVERSION_NONE)
+    {
+        PayloadLen = TomUsbCamFormatLen(GetStreamingFormat(TomUsbCamCtrlIntfDevStructPtr, TomUsbCamCtrlIntfDevStructPtr->V4l2PixFormatStruct.pixelformat),
+                                        FrameAssemblyPtr->BytesUsed);
+    }
+
+    struct StreamCountersStruct __percpu *CountersPtr = TomUsbCamCtrlIntfDevStructPtr->StreamStatsForThisCameraStruct.CountersPtr;
+
+    if (FrameAssemblyPtr->ErrorFlags && (TomUsbCamCtrlIntfDevStructPtr->DamagedFramePolicy == TOM_USB_CAM_DAMAGED_FRAMES_DROP))
+    {
+        this_cpu_inc(CountersPtr->FramesDropped);
+        TomUsbCamRequeueBuffer(TomUsbCamCtrlIntfDevStructPtr, FrameAssemblyPtr->CurrentBufferPtr);
+    }
+    else
+    {
+
+        if (FrameAssemblyPtr->ErrorFlags)
+        {
+            this_cpu_inc(CountersPtr->FramesErrored);
+        }
+        else
+        {
+            this_cpu_inc(CountersPtr->FramesCompleted);
+        }
+
+        vb2_set_plane_payload(&V4l2BufferPtr->vb2_buf, 0, PayloadLen);
+
+        V4l2BufferPtr->field = V4L2_FIELD_NONE;
+        V4l2BufferPtr->sequence = FrameAssemblyPtr->Sequence;
+
+        // Without a Pts or enough clock samples, the completion time is the best there is.
+        if (!FrameAssemblyPtr->PtsValid ||
+            !TomUsbCamPtsToHostTime(TomUsbCamCtrlIntfDevStructPtr, FrameAssemblyPtr->Pts, &V4l2BufferPtr->vb2_buf.timestamp))
+        {
+            V4l2BufferPtr->vb2_buf.timestamp = EofNs;
+            FrameAssemblyPtr->CurrentBufferPtr->PtsHostNs = 0;
+        }
+        else
+        {
+            FrameAssemblyPtr->CurrentBufferPtr->PtsHostNs = V4l2BufferPtr->vb2_buf.timestamp;
+        }
+
+        FrameAssemblyPtr->CurrentBufferPtr->EofNs = EofNs;
+
+        // vb2 sets V4L2_BUF_FLAG_ERROR for buffers completed in the error state, and keeps the payload size.
+        TomUsbCamFinishBuffer(TomUsbCamCtrlIntfDevStructPtr, FrameAssemblyPtr->CurrentBufferPtr,
+                              FrameAssemblyPtr->ErrorFlags ? VB2_BUF_STATE_ERROR : VB2_BUF_STATE_DONE);
+    }
+
+    FrameAssemblyPtr->CurrentBufferPtr = NULL;
+}
+
+// Put a buffer whose frame was dropped back at the head of the queued list, so it is the next one filled.
+static void TomUsbCamRequeueBuffer(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr,
+                                   struct TomUsbCamV4l2VideoBufferContainer *VideoBufferContainerPtr)
+{
+
+    unsigned long SpinLockFlags;
+
+    spin_lock_irqsave(&TomUsbCamCtrlIntfDevStructPtr->QueuedVideoBufferListLock, SpinLockFlags);
+
+    list_add(&VideoBufferContainerPtr->TomUsbCamV4l2VideoBufferListHead, &TomUsbCamCtrlIntfDevStructPtr->QueuedVideoBufferListHead);
+
+    spin_unlock_irqrestore(&TomUsbCamCtrlIntfDevStructPtr->QueuedVideoBufferListLock, SpinLockFlags);
+}
+
+// Take the oldest buffer off the queued list, or return NULL if user space hasn't queued any.
+static struct TomUsbCamV4l2VideoBufferContainer *TomUsbCamGetNextQueuedBuffer(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr)
+{
+
+    struct TomUsbCamV4l2VideoBufferContainer *VideoBufferContainerPtr;
+
+    unsigned long SpinLockFlags;
+
+    spin_lock_irqsave(&TomUsbCamCtrlIntfDevStructPtr->QueuedVideoBufferListLock, SpinLockFlags);
+
+    VideoBufferContainerPtr = list_first_entry_or_null(&TomUsbCamCtrlIntfDevStructPtr->QueuedVideoBufferListHead,
+                                                       struct TomUsbCamV4l2VideoBufferContainer,
+                                                       TomUsbCamV4l2VideoBufferListHead);
+
+    if (VideoBufferContainerPtr)
+    {
+        list_del(&VideoBufferContainerPtr->TomUsbCamV4l2VideoBufferListHead);
+    }
+
+    spin_unlock_irqrestore(&TomUsbCamCtrlIntfDevStructPtr->QueuedVideoBufferListLock, SpinLockFlags);
+
+    return VideoBufferContainerPtr;
+}
+
+// Give every queued buffer back to vb2 in the requested state. Called from process context only.
+static void TomUsbCamReturnAllBuffers(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr, enum vb2_buffer_state BufferState)
+{
+
+    struct TomUsbCamV4l2VideoBufferContainer *VideoBufferContainerPtr, *NextVideoBufferContainerPtr;
+
+    LIST_HEAD(ReturnedBufferListHead);
+
+    unsigned long SpinLockFlags;
+
+    // Completing a request's controls can sleep, so take the buffers off the list first.
+    spin_lock_irqsave(&TomUsbCamCtrlIntfDevStructPtr->QueuedVideoBufferListLock, SpinLockFlags);
+    list_splice_init(&TomUsbCamCtrlIntfDevStructPtr->QueuedVideoBufferListHead, &ReturnedBufferListHead);
+    spin_unlock_irqrestore(&TomUsbCamCtrlIntfDevStructPtr->QueuedVideoBufferListLock, SpinLockFlags);
+
+    list_for_each_entry_safe(VideoBufferContainerPtr, NextVideoBufferContainerPtr, &ReturnedBufferListHead, TomUsbCamV4l2VideoBufferListHead)
+    {
+
+        list_del(&VideoBufferContainerPtr->TomUsbCamV4l2VideoBufferListHead);
+
+        TomUsbCamBufferDone(TomUsbCamCtrlIntfDevStructPtr, VideoBufferContainerPtr, BufferState);
+    }
+}
+
+// Switch the streaming interface to another alternate setting, and keep the alt_setting file in debugfs up to date.
+// Returns what usb_set_interface() did.
+static int TomUsbCamSetAltSetting(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr,
+                                  struct TomUsbCamIsochronousInputDevStruct *TomUsbCamIsochronousInputDevStructPtr, int AltSetting)
+{
+
+    int ReturnCode = usb_set_interface(TomUsbCamIsochronousInputDevStructPtr->UsbDevStructPtr,
+                                       TomUsbCamIsochronousInputDevStructPtr->IsochronousInputInterfaceNumber,
+                                       AltSetting);
+
+    trace_tomusbcam_alt_setting(TomUsbCamCtrlIntfDevStructPtr, TomUsbCamIsochronousInputDevStructPtr->IsochronousInputInterfaceNumber,
+                                AltSetting, ReturnCode);
+
+    if (!ReturnCode)
+    {
+        TomUsbCamCtrlIntfDevStructPtr->StreamStatsForThisCameraStruct.AltSetting = AltSetting;
+    }
+
+    return ReturnCode;
+}
+
+// Kill the Urb ring, drop the streaming interface back to zero bandwidth and return every buffer the driver owns.
+// Safe to call when streaming never fully started.
+static void TomUsbCamStopIsochronousStream(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr, enum vb2_buffer_state BufferState)
+{
+
+    struct TomUsbCamIsochronousInputDevStruct *TomUsbCamIsochronousInputDevStructPtr = TomUsbCamCtrlIntfDevStructPtr->IsochronousInputDevStructPtr;
+
+    if (TomUsbCamIsochronousInputDevStructPtr)
+    {
+
+        // The buffer being filled goes back on its queued list, so it is returned below with the others.
+        TomUsbCamPauseIsochronousStream(TomUsbCamCtrlIntfDevStructPtr, TomUsbCamIsochronousInputDevStructPtr);
+
+        TomUsbCamIsochronousInputDevStructPtr->CtrlIntfDevStructPtr = NULL;
+        TomUsbCamCtrlIntfDevStructPtr->IsochronousInputDevStructPtr = NULL;
+
+        kref_put(&TomUsbCamIsochronousInputDevStructPtr->KernelRefCountStruct, TomUsbCamIsochronousInputDelete);
+    }
+
+    // Buffers already filled go back first so user space still gets them in order.
+    flush_work(&TomUsbCamCtrlIntfDevStructPtr->RequestControlsForThisCameraStruct.DoneWork);
+
+    TomUsbCamReturnAllBuffers(TomUsbCamCtrlIntfDevStructPtr, BufferState);
+
+    // Requests of buffers that were never filled don't need their controls any more.
+    TomUsbCamDrainRequestControls(TomUsbCamCtrlIntfDevStructPtr);
+
+    TomUsbCamRestoreRequestedMode(TomUsbCamCtrlIntfDevStructPtr);
+}
+
+// Kill the Urb ring and drop the streaming interface back to zero bandwidth, but keep the streaming interface and the
+// buffers so the stream can be started again in another mode. The buffer being filled goes back at the head of its
+// queued list, so it is the next one filled.
+static void TomUsbCamPauseIsochronousStream(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr,
+                                            struct TomUsbCamIsochronousInputDevStruct *TomUsbCamIsochronousInputDevStructPtr)
+{
+
+    struct FrameAssemblyStruct *FrameAssemblyPtr = &TomUsbCamCtrlIntfDevStructPtr->FrameAssemblyForThisCameraStruct;
+
+    // After this no completion handler or processing stage can be running, so the frame assembly state is safe to touch.
+    TomUsbCamKillIsochronousUrbs(TomUsbCamIsochronousInputDevStructPtr);
+    TomUsbCamStopProcessingStage(TomUsbCamIsochronousInputDevStructPtr);
+
+    TomUsbCamSetAltSetting(TomUsbCamCtrlIntfDevStructPtr, TomUsbCamIsochronousInputDevStructPtr, ZeroBandwidthInterfaceValue);
+
+    TomUsbCamResetFrameInterval(TomUsbCamCtrlIntfDevStructPtr);
+
+    TomUsbCamReleaseBandwidth(TomUsbCamCtrlIntfDevStructPtr);
+
+    if (FrameAssemblyPtr->CurrentBufferPtr)
+    {
+
+        if (TomUsbCamIsStillBuffer(TomUsbCamCtrlIntfDevStructPtr, FrameAssemblyPtr->CurrentBufferPtr))
+        {
+            TomUsbCamRequeueStillBuffer(TomUsbCamCtrlIntfDevStructPtr, FrameAssemblyPtr->CurrentBufferPtr);
+        }
+        else
+        {
+            TomUsbCamRequeueBuffer(TomUsbCamCtrlIntfDevStructPtr, FrameAssemblyPtr->CurrentBufferPtr);
+        }
+
+        FrameAssemblyPtr->CurrentBufferPtr = NULL;
+    }
+
+    FrameAssemblyPtr->FrameActive = false;
+}
+
+// Forget the frame in flight, so the assembler starts over at the next frame Id toggle like it does when streaming
+// starts. Whatever buffer it was filling has to have been taken back already.
+static void TomUsbCamResetFrameAssembly(struct FrameAssemblyStruct *FrameAssemblyPtr)
+{
+
+    FrameAssemblyPtr->FrameActive = false;
+    FrameAssemblyPtr->BytesUsed = 0;
+    FrameAssemblyPtr->LastFrameId = -1;
+    FrameAssemblyPtr->StillImage = false;
+    FrameAssemblyPtr->ErrorFlags = 0;
+    FrameAssemblyPtr->PendingErrorFlags = 0;
+}
+
+// Hand the whole Urb ring to the host controller. Returns 0 on success or what usb_submit_urb() returned, in which case
+// the Urbs submitted before the failing one are still in flight.
+static int TomUsbCamSubmitIsochronousUrbs(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr,
+                                          struct TomUsbCamIsochronousInputDevStruct *TomUsbCamIsochronousInputDevStructPtr)
+{
+
+    int SubmitErrorValue = 0;
+
+    TomUsbCamPrepareIsochronousUrbs(TomUsbCamIsochronousInputDevStructPtr);
+
+    for (int UrbIdx = 0; UrbIdx < TOM_USB_CAM_NUM_ISOCHRONOUS_URBS; UrbIdx++)
+    {
+
+        SubmitErrorValue = usb_submit_urb(TomUsbCamIsochronousInputDevStructPtr->IsochronousUrbPtrs[UrbIdx], GFP_KERNEL);
+
+        trace_tomusbcam_urb_submit(TomUsbCamCtrlIntfDevStructPtr, TomUsbCamIsochronousInputDevStructPtr->IsochronousUrbPtrs[UrbIdx],
+                                   SubmitErrorValue);
+
+        if (SubmitErrorValue)
+        {
+            pr_err("TomUsbCamSubmitIsochronousUrbs error: usb_submit_urb() returned %d", SubmitErrorValue);
+            break;
+        }
+    }
+
+    return SubmitErrorValue;
+}
+
+//***********************************************************************************************
+
+// Bandwidth admission functions
+//***********************************************************************************************
+
+// Periodic bandwidth the camera could still reserve on its bus, in bytes per (micro)frame: the budget less what the
+// other cameras there are holding. Devices that aren't cameras are only accounted for by lowering periodic_budget, and
+// by the host controller's own check. The caller holds TomUsbCamDeviceListLock.
+static uint32_t TomUsbCamAvailableBandwidth(struct TomUsbCamDeviceStruct *TomUsbCamDeviceStructPtr)
+{
+
+    struct usb_device *UsbDevStructPtr = TomUsbCamDeviceStructPtr->UsbDevStructPtr;
+    struct TomUsbCamDeviceStruct *OtherDeviceStructPtr;
+    uint32_t PeriodicBudget = TomUsbCamPeriodicBudget;
+    uint32_t ReservedBandwidth = 0;
+
+    if (PeriodicBudget == 0)
+    {
+
+        // SuperSpeed buses have room for many times what a Usb 2.0 bus has, so leave those to the host controller.
+        if (UsbDevStructPtr->speed >= USB_SPEED_SUPER)
+        {
+            return U32_MAX;
+        }
+
+        PeriodicBudget = (UsbDevStructPtr->speed == USB_SPEED_HIGH) ? TOM_USB_CAM_HIGH_SPEED_PERIODIC_BUDGET : TOM_USB_CAM_FULL_SPEED_PERIODIC_BUDGET;
+    }
+
+    list_for_each_entry(OtherDeviceStructPtr, &TomUsbCamDeviceListHead, DeviceListHead)
+    {
+
+        if ((OtherDeviceStructPtr != TomUsbCamDeviceStructPtr) && (OtherDeviceStructPtr->UsbDevStructPtr->bus == UsbDevStructPtr->bus))
+        {
+            ReservedBandwidth += OtherDeviceStructPtr->ReservedBandwidth;
+        }
+    }
+
+    return (ReservedBandwidth < PeriodicBudget) ? (PeriodicBudget - ReservedBandwidth) : 0;
+}
+
+// Pick the alternate setting for the committed mode out of what is left on the bus, and hold its bandwidth so other
+// cameras starting at the same time see it as taken. Returns 0 on success or -ENOSPC if the mode doesn't fit.
+static int TomUsbCamReserveBandwidth(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr,
+                                     struct TomUsbCamIsochronousInputDevStruct *TomUsbCamIsochronousInputDevStructPtr)
+{
+
+    struct TomUsbCamDeviceStruct *TomUsbCamDeviceStructPtr = TomUsbCamCtrlIntfDevStructPtr->DeviceStructPtr;
+
+    uint32_t MaxPayloadTransferSize =
+        get_unaligned_le32(&TomUsbCamCtrlIntfDevStructPtr->StreamingParametersForThisCameraStruct.ProbeControlBlock[ProbeControlMaxPayloadTransferSizeOffset]);
+
+    mutex_lock(&TomUsbCamDeviceListLock);
+
+    int ReservationErrorValue = SelectStreamingAltSetting(TomUsbCamCtrlIntfDevStructPtr, MaxPayloadTransferSize,
+                                                          TomUsbCamAvailableBandwidth(TomUsbCamDeviceStructPtr),
+                                                          TomUsbCamIsochronousInputDevStructPtr);
+
+    // If there's no isochronous setting to select, stream with whatever setting was used last, which is the largest
+    // one picked at probe time.
+    if (ReservationErrorValue == -ENODEV)
+    {
+        ReservationErrorValue = 0;
+    }
+
+    if (!ReservationErrorValue)
+    {
+        TomUsbCamDeviceStructPtr->ReservedBandwidth = DIV_ROUND_UP(TomUsbCamIsochronousInputDevStructPtr->IsochronousInputBufferSize,
+                                                                   TomUsbCamIsochronousInputDevStructPtr->IsochronousInputInterval);
+    }
+
+    mutex_unlock(&TomUsbCamDeviceListLock);
+
+    return ReservationErrorValue;
+}
+
+// Give the bandwidth back once the streaming interface is at its zero bandwidth setting again.
+static void TomUsbCamReleaseBandwidth(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr)
+{
+
+    mutex_lock(&TomUsbCamDeviceListLock);
+
+    TomUsbCamCtrlIntfDevStructPtr->DeviceStructPtr->ReservedBandwidth = 0;
+
+    mutex_unlock(&TomUsbCamDeviceListLock);
+}
+
+// Stream the mode in the current probe control block: commit it, reserve the bandwidth it needs, switch the streaming
+// interface to the selected alternate setting and submit the whole Urb ring. On failure the interface is back at its
+// zero bandwidth setting with nothing reserved, so another mode can be tried. Returns -ENOSPC if the bus has no room.
+static int TomUsbCamStartIsochronousStream(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr,
+                                           struct TomUsbCamIsochronousInputDevStruct *TomUsbCamIsochronousInputDevStructPtr)
+{
+
+    // The camera has to be told which mode to stream before the bandwidth is switched on.
+    int StreamingErrorValue = TomUsbCamCommitStreamingParameters(TomUsbCamCtrlIntfDevStructPtr);
+
+    if (StreamingErrorValue)
+    {
+        return StreamingErrorValue;
+    }
+
+    StreamingErrorValue = TomUsbCamReserveBandwidth(TomUsbCamCtrlIntfDevStructPtr, TomUsbCamIsochronousInputDevStructPtr);
+
+    if (StreamingErrorValue)
+    {
+        return StreamingErrorValue;
+    }
+
+    // The frame assembler has to know how to fill the buffers before the first Urb completes.
+    struct v4l2_pix_format *V4l2PixFormatStructPtr = &TomUsbCamCtrlIntfDevStructPtr->V4l2PixFormatStruct;
+    struct StreamingFormatStruct *FormatPtr = GetStreamingFormat(TomUsbCamCtrlIntfDevStructPtr, V4l2PixFormatStructPtr->pixelformat);
+
+    struct FrameAssemblyStruct *FrameAssemblyPtr = &TomUsbCamCtrlIntfDevStructPtr->FrameAssemblyForThisCameraStruct;
+
+    FrameAssemblyPtr->Conversion = FormatPtr ? FormatPtr->Conversion : TOM_USB_CAM_CONVERSION_NONE;
+    FrameAssemblyPtr->Width = V4l2PixFormatStructPtr->width;
+    FrameAssemblyPtr->Height = V4l2PixFormatStructPtr->height;
+
+    // The camera always sends Yuyv for converted formats, whatever bytesperline says about the converted frame.
+    if (FrameAssemblyPtr->Conversion != TOM_USB_CAM_CONVERSION_NONE)
+    {
+        FrameAssemblyPtr->FrameLen = (size_t) V4l2PixFormatStructPtr->width * 2 * V4l2PixFormatStructPtr->height;
+    }
+    else
+    {
+        FrameAssemblyPtr->FrameLen = (size_t) V4l2PixFormatStructPtr->bytesperline * V4l2PixFormatStructPtr->height;
+    }
+
+    // Still images between the video frames change these, and each video frame puts them back.
+    TomUsbCamCtrlIntfDevStructPtr->StillCaptureForThisCameraStruct.VideoConversion = FrameAssemblyPtr->Conversion;
+    TomUsbCamCtrlIntfDevStructPtr->StillCaptureForThisCameraStruct.VideoFrameLen = FrameAssemblyPtr->FrameLen;
+
+    TomUsbCamResetFrameInterval(TomUsbCamCtrlIntfDevStructPtr);
+
+    // "0" is returned on success. The host controller does its own bandwidth check either here or when the Urbs are
+    // submitted, and it knows about devices that aren't cameras, so -ENOSPC from it is treated like our own.
+    StreamingErrorValue = TomUsbCamSetAltSetting(TomUsbCamCtrlIntfDevStructPtr, TomUsbCamIsochronousInputDevStructPtr,
+                                                 TomUsbCamIsochronousInputDevStructPtr->IsochronousInputAltSetting);
+
+    if (StreamingErrorValue)
+    {
+        pr_err("TomUsbCamStartIsochronousStream error: usb_set_interface() returned %d", StreamingErrorValue);
+    }
+    else
+    {
+        StreamingErrorValue = TomUsbCamSubmitIsochronousUrbs(TomUsbCamCtrlIntfDevStructPtr, TomUsbCamIsochronousInputDevStructPtr);
+    }
+
+    if (StreamingErrorValue)
+    {
+
+        TomUsbCamKillIsochronousUrbs(TomUsbCamIsochronousInputDevStructPtr);
+
+        TomUsbCamSetAltSetting(TomUsbCamCtrlIntfDevStructPtr, TomUsbCamIsochronousInputDevStructPtr, ZeroBandwidthInterfaceValue);
+
+        TomUsbCamResetFrameInterval(TomUsbCamCtrlIntfDevStructPtr);
+
+        TomUsbCamReleaseBandwidth(TomUsbCamCtrlIntfDevStructPtr);
+    }
+
+    return StreamingErrorValue;
+}
+
+// Called when the bus has no room for the requested mode. Try the other frame sizes and frame intervals of the current
+// format that fit in the buffers already allocated, in the order bandwidth_fallback asks for, and stream the first one
+// the bus can take. The granted mode stands in for the format and frame interval user space set until streaming stops.
+// Returns 0 on success or -ENOSPC if no mode fits.
+static int TomUsbCamStartFallbackStream(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr,
+                                        struct TomUsbCamIsochronousInputDevStruct *TomUsbCamIsochronousInputDevStructPtr)
+{
+
+    struct StreamingParametersStruct *StreamingParametersStructPtr = &TomUsbCamCtrlIntfDevStructPtr->StreamingParametersForThisCameraStruct;
+    struct v4l2_pix_format *V4l2PixFormatStructPtr = &TomUsbCamCtrlIntfDevStructPtr->V4l2PixFormatStruct;
+    struct StreamingFormatStruct *FormatPtr;
+    struct StreamingFrameStruct *RequestedFramePtr;
+    struct FallbackModeStruct *FallbackModes;
+    int FallbackModeCount = 0;
+    int StreamingErrorValue = -ENOSPC;
+
+    if (GetStreamingMode(TomUsbCamCtrlIntfDevStructPtr, V4l2PixFormatStructPtr->pixelformat, V4l2PixFormatStructPtr->width,
+                         V4l2PixFormatStructPtr->height, &FormatPtr, &RequestedFramePtr))
+    {
+        return -ENOSPC;
+    }
+
+    // What the camera agreed to for the requested mode. Only intervals at least this long, i.e. lower frame rates, are tried.
+    uint32_t RequestedFrameInterval = get_unaligned_le32(&StreamingParametersStructPtr->ProbeControlBlock[ProbeControlFrameIntervalOffset]);
+
+    FallbackModes = kcalloc(TOM_USB_CAM_MAX_FRAMES_PER_FORMAT * TOM_USB_CAM_MAX_FRAME_INTERVALS, sizeof(*FallbackModes), GFP_KERNEL);
+
+    if (!FallbackModes)
+    {
+        return -ENOMEM;
+    }
+
+    for (int FrameIdx = 0; FrameIdx < FormatPtr->FrameCount; FrameIdx++)
+    {
+
+        struct StreamingFrameStruct *FramePtr = &FormatPtr->Frames[FrameIdx];
+        const uint32_t *FrameIntervalPtr = FramePtr->FrameIntervals;
+        int FrameIntervalCount = FramePtr->FrameIntervalCount;
+        uint32_t RangeEnds[2];
+
+        // Anything bigger wouldn't fit in the buffers user space already has.
+        if ((FramePtr->Width > RequestedFramePtr->Width) || (FramePtr->Height > RequestedFramePtr->Height) ||
+            (FramePtr->SizeImage > V4l2PixFormatStructPtr->sizeimage))
+        {
+            continue;
+        }
+
+        // Only try the ends of a continuous range: as close to the requested interval as it gets, and the longest.
+        if (FramePtr->ContinuousFrameIntervals)
+        {
+            RangeEnds[0] = clamp_val(RequestedFrameInterval, FramePtr->FrameIntervals[0], FramePtr->FrameIntervals[1]);
+            RangeEnds[1] = FramePtr->FrameIntervals[1];
+
+            FrameIntervalPtr = RangeEnds;
+            FrameIntervalCount = 2;
+        }
+
+        for (int IntervalIdx = 0; IntervalIdx < FrameIntervalCount; IntervalIdx++)
+        {
+
+            if ((FrameIntervalPtr[IntervalIdx] < RequestedFrameInterval) ||
+                ((IntervalIdx > 0) && (FrameIntervalPtr[IntervalIdx] == FrameIntervalPtr[IntervalIdx - 1])) ||
+                ((FramePtr == RequestedFramePtr) && (FrameIntervalPtr[IntervalIdx] == RequestedFrameInterval)))
+            {
+                continue;
+            }
+
+            FallbackModes[FallbackModeCount].FramePtr = FramePtr;
+            FallbackModes[FallbackModeCount].FrameInterval = FrameIntervalPtr[IntervalIdx];
+            FallbackModeCount++;
+        }
+    }
+
+    sort(FallbackModes, FallbackModeCount, sizeof(*FallbackModes),
+         (TomUsbCamCtrlIntfDevStructPtr->BandwidthFallback == TOM_USB_CAM_BANDWIDTH_FALLBACK_SIZE_FIRST) ?
+         TomUsbCamCompareFallbackSizeFirst : TomUsbCamCompareFallbackIntervalFirst, NULL);
+
+    StreamingParametersStructPtr->RequestedPixFormat = *V4l2PixFormatStructPtr;
+    StreamingParametersStructPtr->RequestedFrameInterval = StreamingParametersStructPtr->FrameInterval;
+    StreamingParametersStructPtr->FallbackActive = true;
+
+    for (int ModeIdx = 0; ModeIdx < FallbackModeCount; ModeIdx++)
+    {
+
+        struct FallbackModeStruct *FallbackModePtr = &FallbackModes[ModeIdx];
+
+        if (TomUsbCamNegotiateStreamingParameters(TomUsbCamCtrlIntfDevStructPtr, FormatPtr->PixelFormat, FallbackModePtr->FramePtr->Width,
+                                                  FallbackModePtr->FramePtr->Height, FallbackModePtr->FrameInterval))
+        {
+            continue;
+        }
+
+        // The frame assembler checks frames against the format, so it has to describe the mode before any Urb completes.
+        FillPixFormatFromStreamingMode(FormatPtr, FallbackModePtr->FramePtr, V4l2PixFormatStructPtr);
+        StreamingParametersStructPtr->FrameInterval = FallbackModePtr->FrameInterval;
+
+        StreamingErrorValue = TomUsbCamStartIsochronousStream(TomUsbCamCtrlIntfDevStructPtr, TomUsbCamIsochronousInputDevStructPtr);
+
+        if (StreamingErrorValue != -ENOSPC)
+        {
+            break;
+        }
+    }
+
+    if (!StreamingErrorValue)
+    {
+        pr_warn("start_streaming: not enough bus bandwidth for %ux%u at %u00 ns per frame, streaming %ux%u at %u00 ns per frame instead",
+                StreamingParametersStructPtr->RequestedPixFormat.width, StreamingParametersStructPtr->RequestedPixFormat.height,
+                RequestedFrameInterval, V4l2PixFormatStructPtr->width, V4l2PixFormatStructPtr->height,
+                get_unaligned_le32(&StreamingParametersStructPtr->ProbeControlBlock[ProbeControlFrameIntervalOffset]));
+    }
+    else
+    {
+        pr_err("start_streaming error: no mode of %ux%u or smaller fits in the bus bandwidth left", RequestedFramePtr->Width, RequestedFramePtr->Height);
+
+        TomUsbCamRestoreRequestedMode(TomUsbCamCtrlIntfDevStructPtr);
+    }
+
+    kfree(FallbackModes);
+
+    return StreamingErrorValue;
+}
+
+// Sort order for TOM_USB_CAM_BANDWIDTH_FALLBACK_INTERVAL_FIRST: the biggest frame first, and the shortest interval first
+// for each frame.
+static int TomUsbCamCompareFallbackIntervalFirst(const void *FallbackModeAPtr, const void *FallbackModeBPtr)
+{
+
+    const struct FallbackModeStruct *ModeAPtr = FallbackModeAPtr;
+    const struct FallbackModeStruct *ModeBPtr = FallbackModeBPtr;
+
+    uint32_t AreaA = ModeAPtr->FramePtr->Width * ModeAPtr->FramePtr->Height;
+    uint32_t AreaB = ModeBPtr->FramePtr->Width * ModeBPtr->FramePtr->Height;
+
+    if (AreaA != AreaB)
+    {
+        return (AreaA > AreaB) ? -1 : 1;
+    }
+
+    if (ModeAPtr->FrameInterval != ModeBPtr->FrameInterval)
+    {
+        return (ModeAPtr->FrameInterval < ModeBPtr->FrameInterval) ? -1 : 1;
+    }
+
+    return 0;
+}
+
+// Sort order for TOM_USB_CAM_BANDWIDTH_FALLBACK_SIZE_FIRST: the shortest interval first, and the biggest frame first for
+// each interval.
+static int TomUsbCamCompareFallbackSizeFirst(const void *FallbackModeAPtr, const void *FallbackModeBPtr)
+{
+
+    const struct FallbackModeStruct *ModeAPtr = FallbackModeAPtr;
+    const struct FallbackModeStruct *ModeBPtr = FallbackModeBPtr;
+
+    uint32_t AreaA = ModeAPtr->FramePtr->Width * ModeAPtr->FramePtr->Height;
+    uint32_t AreaB = ModeBPtr->FramePtr->Width * ModeBPtr->FramePtr->Height;
+
+    if (ModeAPtr->FrameInterval != ModeBPtr->FrameInterval)
+    {
+        return (ModeAPtr->FrameInterval < ModeBPtr->FrameInterval) ? -1 : 1;
+    }
+
+    if (AreaA != AreaB)
+    {
+        return (AreaA > AreaB) ? -1 : 1;
+    }
+
+    return 0;
+}
+
+// Put back the format and frame interval user space asked for once a fallback mode stops streaming. The probe control
+// block still holds the fallback mode, so have the next STREAMON negotiate the requested one again.
+static void TomUsbCamRestoreRequestedMode(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr)
+{
+
+    struct StreamingParametersStruct *StreamingParametersStructPtr = &TomUsbCamCtrlIntfDevStructPtr->StreamingParametersForThisCameraStruct;
+
+    if (!StreamingParametersStructPtr->FallbackActive)
+    {
+        return;
+    }
+
+    TomUsbCamCtrlIntfDevStructPtr->V4l2PixFormatStruct = StreamingParametersStructPtr->RequestedPixFormat;
+    StreamingParametersStructPtr->FrameInterval = StreamingParametersStructPtr->RequestedFrameInterval;
+    StreamingParametersStructPtr->ProbeControlBlockValid = false;
+    StreamingParametersStructPtr->FallbackActive = false;
+}
+
+//***********************************************************************************************
+
+// Media request functions
+//***********************************************************************************************
+
+// Called at each frame boundary once the buffer for the new frame has been picked. Schedule the controls of that
+// buffer's request if it hasn't been done yet, e.g. because it was queued late, and those of the next queued buffer,
+// so they reach the camera a frame before the buffer is filled.
+static void TomUsbCamScheduleRequestControls(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr)
+{
+
+    struct RequestControlsStruct *RequestControlsPtr = &TomUsbCamCtrlIntfDevStructPtr->RequestControlsForThisCameraStruct;
+
+    struct TomUsbCamV4l2VideoBufferContainer *CandidatePtrs[2];
+
+    bool ApplyScheduled = false;
+
+    unsigned long SpinLockFlags;
+
+    spin_lock_irqsave(&TomUsbCamCtrlIntfDevStructPtr->QueuedVideoBufferListLock, SpinLockFlags);
+
+    CandidatePtrs[0] = TomUsbCamCtrlIntfDevStructPtr->FrameAssemblyForThisCameraStruct.CurrentBufferPtr;
+    CandidatePtrs[1] = list_first_entry_or_null(&TomUsbCamCtrlIntfDevStructPtr->QueuedVideoBufferListHead,
+                                                struct TomUsbCamV4l2VideoBufferContainer,
+                                                TomUsbCamV4l2VideoBufferListHead);
+
+    for (int CandidateIdx = 0; CandidateIdx < ARRAY_SIZE(CandidatePtrs); CandidateIdx++)
+    {
+
+        struct TomUsbCamV4l2VideoBufferContainer *VideoBufferContainerPtr = CandidatePtrs[CandidateIdx];
+
+        if (!VideoBufferContainerPtr || VideoBufferContainerPtr->RequestControlsScheduled)
+        {
+            continue;
+        }
+
+        struct media_request *RequestPtr = VideoBufferContainerPtr->TomUsbCamV4l2VideoBuffer.vb2_buf.req_obj.req;
+
+        // A full list just means this buffer is looked at again at the next frame boundary.
+        if (!RequestPtr || (RequestControlsPtr->DueRequestCount == TOM_USB_CAM_NUM_DUE_REQUESTS))
+        {
+            continue;
+        }
+
+        media_request_get(RequestPtr);
+
+        RequestControlsPtr->DueRequests[RequestControlsPtr->DueRequestCount++] = RequestPtr;
+        VideoBufferContainerPtr->RequestControlsScheduled = true;
+
+        ApplyScheduled = true;
+    }
+
+    spin_unlock_irqrestore(&TomUsbCamCtrlIntfDevStructPtr->QueuedVideoBufferListLock, SpinLockFlags);
+
+    if (ApplyScheduled)
+    {
+        schedule_work(&RequestControlsPtr->ApplyWork);
+    }
+}
+
+// Apply the controls of every due request, oldest first, each as one batch of control writes.
+static void TomUsbCamApplyRequestControlsWork(struct work_struct *WorkPtr)
+{
+
+    struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr =
+            container_of(WorkPtr, struct TomUsbCamCtrlIntfDevStruct, RequestControlsForThisCameraStruct.ApplyWork);
+    struct RequestControlsStruct *RequestControlsPtr = &TomUsbCamCtrlIntfDevStructPtr->RequestControlsForThisCameraStruct;
+
+    while (true)
+    {
+
+        struct media_request *RequestPtr = NULL;
+
+        unsigned long SpinLockFlags;
+
+        spin_lock_irqsave(&TomUsbCamCtrlIntfDevStructPtr->QueuedVideoBufferListLock, SpinLockFlags);
+
+        if (RequestControlsPtr->DueRequestCount)
+        {
+
+            RequestPtr = RequestControlsPtr->DueRequests[0];
+
+            RequestControlsPtr->DueRequestCount--;
+            memmove(&RequestControlsPtr->DueRequests[0], &RequestControlsPtr->DueRequests[1],
+                    RequestControlsPtr->DueRequestCount * sizeof(RequestControlsPtr->DueRequests[0]));
+        }
+
+        spin_unlock_irqrestore(&TomUsbCamCtrlIntfDevStructPtr->QueuedVideoBufferListLock, SpinLockFlags);
+
+        if (!RequestPtr)
+        {
+            break;
+        }
+
+        // v4l2_ctrl_request_setup() calls s_ctrl for every cluster the request changes.
+        TomUsbCamHoldControlWrites(TomUsbCamCtrlIntfDevStructPtr, true);
+
+        int ErrorValue = v4l2_ctrl_request_setup(RequestPtr, &TomUsbCamCtrlIntfDevStructPtr->V4l2CtrlHandler);
+
+        TomUsbCamHoldControlWrites(TomUsbCamCtrlIntfDevStructPtr, false);
+
+        if (ErrorValue)
+        {
+            pr_err("TomUsbCamApplyRequestControlsWork error: v4l2_ctrl_request_setup() returned %d", ErrorValue);
+        }
+
+        media_request_put(RequestPtr);
+    }
+}
+
+// Drop the references to requests whose controls weren't applied, e.g. when streaming stops.
+static void TomUsbCamDrainRequestControls(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr)
+{
+
+    struct RequestControlsStruct *RequestControlsPtr = &TomUsbCamCtrlIntfDevStructPtr->RequestControlsForThisCameraStruct;
+
+    struct media_request *DueRequests[TOM_USB_CAM_NUM_DUE_REQUESTS];
+    unsigned int DueRequestCount;
+
+    unsigned long SpinLockFlags;
+
+    spin_lock_irqsave(&TomUsbCamCtrlIntfDevStructPtr->QueuedVideoBufferListLock, SpinLockFlags);
+
+    DueRequestCount = RequestControlsPtr->DueRequestCount;
+    memcpy(DueRequests, RequestControlsPtr->DueRequests, sizeof(DueRequests));
+    RequestControlsPtr->DueRequestCount = 0;
+
+    spin_unlock_irqrestore(&TomUsbCamCtrlIntfDevStructPtr->QueuedVideoBufferListLock, SpinLockFlags);
+
+    for (unsigned int RequestIdx = 0; RequestIdx < DueRequestCount; RequestIdx++)
+    {
+        media_request_put(DueRequests[RequestIdx]);
+    }
+}
+
+// Hand a filled buffer back to vb2. A buffer that belongs to a request, or that follows one still waiting, is
+// completed from the work item, since completing a request's controls needs process context.
+static void TomUsbCamFinishBuffer(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr,
+                                  struct TomUsbCamV4l2VideoBufferContainer *VideoBufferContainerPtr, enum vb2_buffer_state BufferState)
+{
+
+    struct RequestControlsStruct *RequestControlsPtr = &TomUsbCamCtrlIntfDevStructPtr->RequestControlsForThisCameraStruct;
+
+    bool DoneDeferred = false;
+
+    unsigned long SpinLockFlags;
+
+    spin_lock_irqsave(&TomUsbCamCtrlIntfDevStructPtr->QueuedVideoBufferListLock, SpinLockFlags);
+
+    if (VideoBufferContainerPtr->TomUsbCamV4l2VideoBuffer.vb2_buf.req_obj.req || !list_empty(&RequestControlsPtr->DoneBufferListHead))
+    {
+
+        VideoBufferContainerPtr->DoneState = BufferState;
+
+        list_add_tail(&VideoBufferContainerPtr->TomUsbCamV4l2VideoBufferListHead, &RequestControlsPtr->DoneBufferListHead);
+
+        DoneDeferred = true;
+    }
+
+    spin_unlock_irqrestore(&TomUsbCamCtrlIntfDevStructPtr->QueuedVideoBufferListLock, SpinLockFlags);
+
+    if (DoneDeferred)
+    {
+        schedule_work(&RequestControlsPtr->DoneWork);
+    }
+    else
+    {
+        trace_tomusbcam_buffer_done(TomUsbCamCtrlIntfDevStructPtr, &VideoBufferContainerPtr->TomUsbCamV4l2VideoBuffer, BufferState);
+        TomUsbCamRecordBufferDone(TomUsbCamCtrlIntfDevStructPtr, VideoBufferContainerPtr, BufferState);
+        vb2_buffer_done(&VideoBufferContainerPtr->TomUsbCamV4l2VideoBuffer.vb2_buf, BufferState);
+    }
+}
+
+// Give a buffer back to vb2, recording the control values its request was applied with. Process context only.
+// Buffers given back as queued go back to vb2's own queue along with their request, which isn't finished yet.
+static void TomUsbCamBufferDone(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr,
+                                struct TomUsbCamV4l2VideoBufferContainer *VideoBufferContainerPtr, enum vb2_buffer_state BufferState)
+{
+
+    struct media_request *RequestPtr = VideoBufferContainerPtr->TomUsbCamV4l2VideoBuffer.vb2_buf.req_obj.req;
+
+    if (RequestPtr && (BufferState != VB2_BUF_STATE_QUEUED))
+    {
+        v4l2_ctrl_request_complete(RequestPtr, &TomUsbCamCtrlIntfDevStructPtr->V4l2CtrlHandler);
+    }
+
+    VideoBufferContainerPtr->RequestControlsScheduled = false;
+
+    trace_tomusbcam_buffer_done(TomUsbCamCtrlIntfDevStructPtr, &VideoBufferContainerPtr->TomUsbCamV4l2VideoBuffer, BufferState);
+    TomUsbCamRecordBufferDone(TomUsbCamCtrlIntfDevStructPtr, VideoBufferContainerPtr, BufferState);
+
+    vb2_buffer_done(&VideoBufferContainerPtr->TomUsbCamV4l2VideoBuffer.vb2_buf, BufferState);
+}
+
+static void TomUsbCamDoneBuffersWork(struct work_struct *WorkPtr)
+{
+
+    struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr =
+            container_of(WorkPtr, struct TomUsbCamCtrlIntfDevStruct, RequestControlsForThisCameraStruct.DoneWork);
+
+    struct TomUsbCamV4l2VideoBufferContainer *VideoBufferContainerPtr, *NextVideoBufferContainerPtr;
+
+    LIST_HEAD(DoneBufferListHead);
+
+    unsigned long SpinLockFlags;
+
+    spin_lock_irqsave(&TomUsbCamCtrlIntfDevStructPtr->QueuedVideoBufferListLock, SpinLockFlags);
+    list_splice_init(&TomUsbCamCtrlIntfDevStructPtr->RequestControlsForThisCameraStruct.DoneBufferListHead, &DoneBufferListHead);
+    spin_unlock_irqrestore(&TomUsbCamCtrlIntfDevStructPtr->QueuedVideoBufferListLock, SpinLockFlags);
+
+    list_for_each_entry_safe(VideoBufferContainerPtr, NextVideoBufferContainerPtr, &DoneBufferListHead, TomUsbCamV4l2VideoBufferListHead)
+    {
+
+        list_del(&VideoBufferContainerPtr->TomUsbCamV4l2VideoBufferListHead);
+
+        TomUsbCamBufferDone(TomUsbCamCtrlIntfDevStructPtr, VideoBufferContainerPtr, VideoBufferContainerPtr->DoneState);
+    }
+}
+
+//***********************************************************************************************
+
+// Still image capture functions
+//***********************************************************************************************
+
+// Set up the still node and its queue, which share TomUsbCamLock and QueuedVideoBufferListLock with the video node.
+// Called from probe once those are initialized. Returns 0 on success.
+static int TomUsbCamInitStillCapture(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr, int DeviceIdx)
+{
+
+    struct StillCaptureStruct *StillCaptureStructPtr = &TomUsbCamCtrlIntfDevStructPtr->StillCaptureForThisCameraStruct;
+    struct vb2_queue *StillQueuePtr = &StillCaptureStructPtr->V4l2Queue;
+    struct video_device *StillVideoDevicePtr = &StillCaptureStructPtr->VideoDevice;
+
+    StillCaptureStructPtr->StillCapture = TomUsbCamDeviceParam(TomUsbCamStillCapture, DeviceIdx, TOM_USB_CAM_STILL_CAPTURE_CAMERA);
+
+    INIT_LIST_HEAD(&StillCaptureStructPtr->QueuedBufferListHead);
+    init_waitqueue_head(&StillCaptureStructPtr->DeliveredWaitQueue);
+    INIT_WORK(&StillCaptureStructPtr->CaptureWork, TomUsbCamStillCaptureWork);
+
+    // Still images are few and always written through the kernel mapping, so they stay in vmalloc'd buffers whatever
+    // buffer_backend says.
+    StillQueuePtr->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    StillQueuePtr->io_modes = VB2_MMAP | VB2_USERPTR | VB2_DMABUF;
+    StillQueuePtr->dev = &TomUsbCamCtrlIntfDevStructPtr->UsbDevStructPtr->dev;
+    StillQueuePtr->drv_priv = TomUsbCamCtrlIntfDevStructPtr;
+    StillQueuePtr->buf_struct_size = sizeof(struct TomUsbCamV4l2VideoBufferContainer);
+    StillQueuePtr->ops = &TomUsbCamStillV4l2QueueOps;
+    StillQueuePtr->mem_ops = &vb2_vmalloc_memops;
+    StillQueuePtr->timestamp_flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC | V4L2_BUF_FLAG_TSTAMP_SRC_SOE;
+    StillQueuePtr->lock = &TomUsbCamCtrlIntfDevStructPtr->TomUsbCamLock;
+
+    int InitErrorValue = vb2_queue_init(StillQueuePtr);
+
+    if (InitErrorValue)
+    {
+        return InitErrorValue;
+    }
+
+    strlcpy(StillVideoDevicePtr->name, "TomUsbCam still", sizeof(StillVideoDevicePtr->name));
+    StillVideoDevicePtr->release = video_device_release_empty;
+    StillVideoDevicePtr->fops = &TomUsbCamV4l2FileOps;
+    StillVideoDevicePtr->ioctl_ops = &TomUsbCamStillV4l2IoctlOps;
+    StillVideoDevicePtr->device_caps = V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_STREAMING;
+    StillVideoDevicePtr->lock = &TomUsbCamCtrlIntfDevStructPtr->TomUsbCamLock;
+    StillVideoDevicePtr->queue = StillQueuePtr;
+    StillVideoDevicePtr->v4l2_dev = &TomUsbCamCtrlIntfDevStructPtr->V4l2DevStruct;
+
+    video_set_drvdata(StillVideoDevicePtr, TomUsbCamCtrlIntfDevStructPtr);
+
+    return 0;
+}
+
+// Find the still capture method in the input header and the image sizes in the still image frame descriptor, see
+// sections 3.9.2.1 and 3.9.2.5 of [5]. The images come in the format whose frame descriptors the still image frame
+// descriptor follows. Without one, the still node offers the frame sizes of the first format, and as methods 2 and 3
+// need the descriptor, always switches the stream over. Called at the end of BuildStreamingModeTable().
+static void BuildStillImageTable(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr)
+{
+
+    struct StillCaptureStruct *StillCaptureStructPtr = &TomUsbCamCtrlIntfDevStructPtr->StillCaptureForThisCameraStruct;
+    struct StreamingModeTableStruct *StreamingModeTableStructPtr = &TomUsbCamCtrlIntfDevStructPtr->StreamingModeTableForThisCameraStruct;
+    struct StreamingFormatStruct *StillFormatPtr = NULL;
+    uint8_t CurrentFormatIndex = 0;
+
+    StillCaptureStructPtr->Method = TOM_USB_CAM_STILL_METHOD_NONE;
+    StillCaptureStructPtr->BulkEndpointAddr = 0;
+    StillCaptureStructPtr->CompressionCount = 0;
+    StillCaptureStructPtr->FrameCount = 0;
+
+    for (int idx = 0; idx < TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.VideoDescriptorStructCount; idx++)
+    {
+
+        struct VideoInterfaceDescriptorStruct *VideoInterfaceDescriptorStructPtr =
+            &TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.VideoInterfaceDescriptorStructPtr[idx];
+        uint8_t *VarData = VideoInterfaceDescriptorStructPtr->VarData;
+
+        if (VideoInterfaceDescriptorStructPtr->ParentInterfaceAssoc != InterfaceVideoStreamingIndex)
+        {
+            continue;
+        }
+
+        if ((VideoInterfaceDescriptorStructPtr->bDescriptorSubtype == VideoStreamingInputHeaderSubtype) &&
+            (VideoInterfaceDescriptorStructPtr->bLength >= InputHeaderMinLen))
+        {
+
+            if (VarData[InputHeaderStillCaptureMethodOffset] <= TOM_USB_CAM_STILL_METHOD_BULK)
+            {
+                StillCaptureStructPtr->Method = VarData[InputHeaderStillCaptureMethodOffset];
+            }
+        }
+        else if ((VideoInterfaceDescriptorStructPtr->bDescriptorSubtype == VideoStreamingFormatUncompressedSubtype) &&
+                 (VideoInterfaceDescriptorStructPtr->bLength >= FormatDescriptorMinLen))
+        {
+            CurrentFormatIndex = VarData[FormatDescriptorFormatIndexOffset];
+        }
+        else if ((VideoInterfaceDescriptorStructPtr->bDescriptorSubtype == VideoStreamingStillImageFrameSubtype) && !StillFormatPtr &&
+                 (VideoInterfaceDescriptorStructPtr->bLength >= StillFrameDescriptorMinLen))
+        {
+
+            // The camera's own format comes before the converted ones sharing its FormatIndex.
+            for (int FormatIdx = 0; FormatIdx < StreamingModeTableStructPtr->FormatCount; FormatIdx++)
+            {
+                if (StreamingModeTableStructPtr->Formats[FormatIdx].FormatIndex == CurrentFormatIndex)
+                {
+                    StillFormatPtr = &StreamingModeTableStructPtr->Formats[FormatIdx];
+                    break;
+                }
+            }
+
+            if (!StillFormatPtr)
+            {
+                continue;
+            }
+
+            int PatternCount = min_t(int, VarData[StillFrameDescriptorNumImageSizePatternsOffset],
+                                     (VideoInterfaceDescriptorStructPtr->bLength - StillFrameDescriptorMinLen) / 4);
+
+            StillCaptureStructPtr->BulkEndpointAddr = VarData[StillFrameDescriptorEndpointAddressOffset];
+
+            if (StillFrameDescriptorMinLen + 4 * PatternCount < VideoInterfaceDescriptorStructPtr->bLength)
+            {
+                StillCaptureStructPtr->CompressionCount = VarData[StillFrameDescriptorImageSizePatternsOffset + 4 * PatternCount];
+            }
+
+            for (int PatternIdx = 0; PatternIdx < PatternCount; PatternIdx++)
+            {
+
+                uint16_t Width = get_unaligned_le16(&VarData[StillFrameDescriptorImageSizePatternsOffset + 4 * PatternIdx]);
+                uint16_t Height = get_unaligned_le16(&VarData[StillFrameDescriptorImageSizePatternsOffset + 4 * PatternIdx + 2]);
+
+                if (StillCaptureStructPtr->FrameCount == TOM_USB_CAM_MAX_FRAMES_PER_FORMAT)
+                {
+                    pr_warn("BuildStillImageTable: skipping %ux%u still image, table is full", Width, Height);
+                    break;
+                }
+
+                struct StreamingFrameStruct *FramePtr = &StillCaptureStructPtr->Frames[StillCaptureStructPtr->FrameCount];
+
+                // The still probe control takes the 1-based position in the descriptor's list.
+                FramePtr->FrameIndex = PatternIdx + 1;
+                FramePtr->Width = Width;
+                FramePtr->Height = Height;
+                FramePtr->BytesPerLine = StillFormatPtr->Planar ? Width : Width * StillFormatPtr->BitsPerPixel / 8;
+                FramePtr->SizeImage = Width * Height * StillFormatPtr->BitsPerPixel / 8;
+
+                StillCaptureStructPtr->FrameCount += 1;
+            }
+        }
+    }
+
+    if (!StillFormatPtr || (StillCaptureStructPtr->FrameCount == 0))
+    {
+
+        StillFormatPtr = &StreamingModeTableStructPtr->Formats[0];
+
+        memcpy(StillCaptureStructPtr->Frames, StillFormatPtr->Frames, sizeof(StillCaptureStructPtr->Frames));
+        StillCaptureStructPtr->FrameCount = StillFormatPtr->FrameCount;
+        StillCaptureStructPtr->BulkEndpointAddr = 0;
+        StillCaptureStructPtr->CompressionCount = 0;
+        StillCaptureStructPtr->Method = min_t(int, StillCaptureStructPtr->Method, TOM_USB_CAM_STILL_METHOD_VIDEO_FRAME);
+    }
+
+    StillCaptureStructPtr->PixelFormat = StillFormatPtr->PixelFormat;
+    StillCaptureStructPtr->FormatIndex = StillFormatPtr->FormatIndex;
+
+    // Default to the largest image, which is what a still node is for.
+    struct StreamingFrameStruct *LargestFramePtr = &StillCaptureStructPtr->Frames[0];
+
+    for (int FrameIdx = 1; FrameIdx < StillCaptureStructPtr->FrameCount; FrameIdx++)
+    {
+        if ((uint64_t) StillCaptureStructPtr->Frames[FrameIdx].Width * StillCaptureStructPtr->Frames[FrameIdx].Height >
+            (uint64_t) LargestFramePtr->Width * LargestFramePtr->Height)
+        {
+            LargestFramePtr = &StillCaptureStructPtr->Frames[FrameIdx];
+        }
+    }
+
+    FillPixFormatFromStreamingMode(StillFormatPtr, LargestFramePtr, &StillCaptureStructPtr->V4l2PixFormatStruct);
+}
+
+// Whether the still images come from the camera's own method 2 or 3, rather than from switching the stream over.
+static bool TomUsbCamStillUsesCamera(struct StillCaptureStruct *StillCaptureStructPtr)
+{
+
+    if (StillCaptureStructPtr->StillCapture != TOM_USB_CAM_STILL_CAPTURE_CAMERA)
+    {
+        return false;
+    }
+
+    return (StillCaptureStructPtr->Method == TOM_USB_CAM_STILL_METHOD_INTERLEAVED) ||
+           ((StillCaptureStructPtr->Method == TOM_USB_CAM_STILL_METHOD_BULK) && StillCaptureStructPtr->BulkEndpointAddr);
+}
+
+// The still node has exactly one format, the one the still image frame descriptor belongs to.
+static int TomUsbCamStillEnumFormat(struct file *File, void *Priv, struct v4l2_fmtdesc *V4l2FmtDescStructPtr)
+{
+
+    struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr = video_drvdata(File);
+    struct StillCaptureStruct *StillCaptureStructPtr = &TomUsbCamCtrlIntfDevStructPtr->StillCaptureForThisCameraStruct;
+
+    if (V4l2FmtDescStructPtr->index > 0)
+    {
+        return -EINVAL;
+    }
+
+    struct StreamingFormatStruct *FormatPtr = GetStreamingFormat(TomUsbCamCtrlIntfDevStructPtr, StillCaptureStructPtr->PixelFormat);
+
+    V4l2FmtDescStructPtr->flags = 0;
+    V4l2FmtDescStructPtr->pixelformat = FormatPtr->PixelFormat;
+    strlcpy(V4l2FmtDescStructPtr->description, FormatPtr->Description, sizeof(V4l2FmtDescStructPtr->description));
+
+    return 0;
+}
+
+static int TomUsbCamStillEnumFrameSizes(struct file *File, void *Priv, struct v4l2_frmsizeenum *V4l2FrmSizeEnumStructPtr)
+{
+
+    struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr = video_drvdata(File);
+    struct StillCaptureStruct *StillCaptureStructPtr = &TomUsbCamCtrlIntfDevStructPtr->StillCaptureForThisCameraStruct;
+
+    if ((V4l2FrmSizeEnumStructPtr->pixel_format != StillCaptureStructPtr->PixelFormat) ||
+        (V4l2FrmSizeEnumStructPtr->index >= StillCaptureStructPtr->FrameCount))
+    {
+        return -EINVAL;
+    }
+
+    V4l2FrmSizeEnumStructPtr->type = V4L2_FRMSIZE_TYPE_DISCRETE;
+    V4l2FrmSizeEnumStructPtr->discrete.width = StillCaptureStructPtr->Frames[V4l2FrmSizeEnumStructPtr->index].Width;
+    V4l2FrmSizeEnumStructPtr->discrete.height = StillCaptureStructPtr->Frames[V4l2FrmSizeEnumStructPtr->index].Height;
+
+    return 0;
+}
+
+static int TomUsbCamStillTryFormat(struct file *File, void *Priv, struct v4l2_format *V4l2ImageFormatStructPtr)
+{
+
+    struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr = video_drvdata(File);
+    struct StillCaptureStruct *StillCaptureStructPtr = &TomUsbCamCtrlIntfDevStructPtr->StillCaptureForThisCameraStruct;
+
+    struct v4l2_pix_format *V4l2PixelFormat = &V4l2ImageFormatStructPtr->fmt.pix;
+
+    struct StreamingFrameStruct *BestFramePtr = GetClosestStreamingFrame(StillCaptureStructPtr->Frames, StillCaptureStructPtr->FrameCount,
+                                                                         V4l2PixelFormat->width, V4l2PixelFormat->height);
+
+    FillPixFormatFromStreamingMode(GetStreamingFormat(TomUsbCamCtrlIntfDevStructPtr, StillCaptureStructPtr->PixelFormat), BestFramePtr,
+                                   V4l2PixelFormat);
+
+    return 0;
+}
+
+static int TomUsbCamStillSetFormat(struct file *File, void *Priv, struct v4l2_format *V4l2ImageFormatStructPtr)
+{
+
+    struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr = video_drvdata(File);
+    struct StillCaptureStruct *StillCaptureStructPtr = &TomUsbCamCtrlIntfDevStructPtr->StillCaptureForThisCameraStruct;
+
+    int FormatterErrorValue = TomUsbCamStillTryFormat(File, Priv, V4l2ImageFormatStructPtr);
+
+    if (FormatterErrorValue != 0)
+    {
+        return FormatterErrorValue;
+    }
+
+    if (vb2_is_busy(&StillCaptureStructPtr->V4l2Queue))
+    {
+        return -EBUSY;
+    }
+
+    StillCaptureStructPtr->V4l2PixFormatStruct = V4l2ImageFormatStructPtr->fmt.pix;
+    StillCaptureStructPtr->ProbeControlBlockValid = false;
+
+    // When the camera sends the images itself, make the buffers big enough for whatever it says it will send. If it
+    // won't agree to the size, the stream is switched over for it instead.
+    if (TomUsbCamStillUsesCamera(StillCaptureStructPtr) && !TomUsbCamNegotiateStillParameters(TomUsbCamCtrlIntfDevStructPtr))
+    {
+
+        uint32_t MaxVideoFrameSize = get_unaligned_le32(&StillCaptureStructPtr->ProbeControlBlock[StillProbeControlMaxVideoFrameSizeOffset]);
+
+        V4l2ImageFormatStructPtr->fmt.pix.sizeimage = max(V4l2ImageFormatStructPtr->fmt.pix.sizeimage, MaxVideoFrameSize);
+        StillCaptureStructPtr->V4l2PixFormatStruct.sizeimage = V4l2ImageFormatStructPtr->fmt.pix.sizeimage;
+    }
+
+    return 0;
+}
+
+static int TomUsbCamStillGetFormat(struct file *File, void *Priv, struct v4l2_format *V4l2ImageFormatStructPtr)
+{
+
+    struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr = video_drvdata(File);
+
+    V4l2ImageFormatStructPtr->fmt.pix = TomUsbCamCtrlIntfDevStructPtr->StillCaptureForThisCameraStruct.V4l2PixFormatStruct;
+
+    return 0;
+}
+
+// The VS_STILL_PROBE_CONTROL half of the still image negotiation in section 4.3.1.2 of [5]: SET_CUR the format and
+// image size, then GET_CUR what the camera is willing to send. Returns 0 on success.
+static int TomUsbCamNegotiateStillParameters(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr)
+{
+
+    struct StillCaptureStruct *StillCaptureStructPtr = &TomUsbCamCtrlIntfDevStructPtr->StillCaptureForThisCameraStruct;
+    struct StreamingFrameStruct *FramePtr = NULL;
+
+    StillCaptureStructPtr->ProbeControlBlockValid = false;
+
+    for (int FrameIdx = 0; FrameIdx < StillCaptureStructPtr->FrameCount; FrameIdx++)
+    {
+        if ((StillCaptureStructPtr->Frames[FrameIdx].Width == StillCaptureStructPtr->V4l2PixFormatStruct.width) &&
+            (StillCaptureStructPtr->Frames[FrameIdx].Height == StillCaptureStructPtr->V4l2PixFormatStruct.height))
+        {
+            FramePtr = &StillCaptureStructPtr->Frames[FrameIdx];
+        }
+    }
+
+    if (!FramePtr)
+    {
+        return -EINVAL;
+    }
+
+    // Control transfer data has to be in DMA-able memory, so don't use the stack.
+    unsigned char *StillProbeControlPtr = kzalloc(VideoStreamingStillProbeControlPacketLen, GFP_KERNEL);
+
+    if (!StillProbeControlPtr)
+    {
+        return -ENOMEM;
+    }
+
+    // Uncompressed formats have no compression patterns to pick from, but take the first one if the camera lists any.
+    StillProbeControlPtr[StillProbeControlFormatIndexOffset] = StillCaptureStructPtr->FormatIndex;
+    StillProbeControlPtr[StillProbeControlFrameIndexOffset] = FramePtr->FrameIndex;
+    StillProbeControlPtr[StillProbeControlCompressionIndexOffset] = StillCaptureStructPtr->CompressionCount ? 1 : 0;
+
+    int NegotiationErrorValue = 0;
+
+    int BytesSentOrErrorCode = WriteToCamera(TomUsbCamCtrlIntfDevStructPtr,
+                                             SetCurrentSelectorControlRequest,
+                                             ClassTypeRequestType,
+                                             InterfaceRecipientRequestType,
+                                             VideoStreamingStillProbeControlValue,
+                                             0x0,
+                                             InterfaceVideoStreamingIndex,
+                                             StillProbeControlPtr,
+                                             VideoStreamingStillProbeControlPacketLen,
+                                             FiveSecTimeoutInMsecs);
+
+    int BytesRcvdOrErrorCode = 0;
+
+    if (BytesSentOrErrorCode == VideoStreamingStillProbeControlPacketLen)
+    {
+        BytesRcvdOrErrorCode = ReadFromCamera(TomUsbCamCtrlIntfDevStructPtr,
+                                              GetCurrentSelectorControlRequest,
+                                              ClassTypeRequestType,
+                                              InterfaceRecipientRequestType,
+                                              VideoStreamingStillProbeControlValue,
+                                              0x0,
+                                              InterfaceVideoStreamingIndex,
+                                              StillProbeControlPtr,
+                                              VideoStreamingStillProbeControlPacketLen,
+                                              FiveSecTimeoutInMsecs);
+    }
+
+    if ((BytesSentOrErrorCode != VideoStreamingStillProbeControlPacketLen) ||
+        (BytesRcvdOrErrorCode != VideoStreamingStillProbeControlPacketLen))
+    {
+        pr_err("TomUsbCamNegotiateStillParameters error: still probe control SET_CUR returned %d, GET_CUR returned %d",
+               BytesSentOrErrorCode, BytesRcvdOrErrorCode);
+
+        NegotiationErrorValue = -EIO;
+    }
+    else if ((StillProbeControlPtr[StillProbeControlFormatIndexOffset] != StillCaptureStructPtr->FormatIndex) ||
+             (StillProbeControlPtr[StillProbeControlFrameIndexOffset] != FramePtr->FrameIndex))
+    {
+        pr_err("TomUsbCamNegotiateStillParameters error: asked for format %d image %d, camera answered format %d image %d",
+               StillCaptureStructPtr->FormatIndex, FramePtr->FrameIndex, StillProbeControlPtr[StillProbeControlFormatIndexOffset],
+               StillProbeControlPtr[StillProbeControlFrameIndexOffset]);
+
+        NegotiationErrorValue = -EINVAL;
+    }
+    else
+    {
+        memcpy(StillCaptureStructPtr->ProbeControlBlock, StillProbeControlPtr, VideoStreamingStillProbeControlPacketLen);
+        StillCaptureStructPtr->ProbeControlBlockValid = true;
+    }
+
+    kfree(StillProbeControlPtr);
+
+    return NegotiationErrorValue;
+}
+
+// Send the still probe control block back as VS_STILL_COMMIT_CONTROL. Unlike the video commit this can happen while
+// the video stream is running. Returns 0 on success, and otherwise leaves the block invalid.
+static int TomUsbCamCommitStillParameters(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr)
+{
+
+    struct StillCaptureStruct *StillCaptureStructPtr = &TomUsbCamCtrlIntfDevStructPtr->StillCaptureForThisCameraStruct;
+
+    if (!StillCaptureStructPtr->ProbeControlBlockValid)
+    {
+
+        int NegotiationErrorValue = TomUsbCamNegotiateStillParameters(TomUsbCamCtrlIntfDevStructPtr);
+
+        if (NegotiationErrorValue)
+        {
+            return NegotiationErrorValue;
+        }
+    }
+
+    unsigned char *StillCommitControlPtr = kmemdup(StillCaptureStructPtr->ProbeControlBlock, VideoStreamingStillProbeControlPacketLen, GFP_KERNEL);
+
+    if (!StillCommitControlPtr)
+    {
+        StillCaptureStructPtr->ProbeControlBlockValid = false;
+
+        return -ENOMEM;
+    }
+
+    int BytesSentOrErrorCode = WriteToCamera(TomUsbCamCtrlIntfDevStructPtr,
+                                             SetCurrentSelectorControlRequest,
+                                             ClassTypeRequestType,
+                                             InterfaceRecipientRequestType,
+                                             VideoStreamingStillCommitControlValue,
+                                             0x0,
+                                             InterfaceVideoStreamingIndex,
+                                             StillCommitControlPtr,
+                                             VideoStreamingStillProbeControlPacketLen,
+                                             FiveSecTimeoutInMsecs);
+
+    kfree(StillCommitControlPtr);
+
+    if (BytesSentOrErrorCode != VideoStreamingStillProbeControlPacketLen)
+    {
+        pr_err("TomUsbCamCommitStillParameters error: still commit control SET_CUR returned %d", BytesSentOrErrorCode);
+
+        StillCaptureStructPtr->ProbeControlBlockValid = false;
+
+        return -EIO;
+    }
+
+    return 0;
+}
+
+static int TomUsbCamStillQueueSetup(struct vb2_queue *StillBufferQueue,
+		                            unsigned int *NumBuffers, unsigned int *NumImagePlanes,
+		                            unsigned int ImageSizes[], struct device *alloc_devs[])
+{
+
+    struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr = vb2_get_drv_priv(StillBufferQueue);
+
+    unsigned int ImageSizeInBytes = TomUsbCamCtrlIntfDevStructPtr->StillCaptureForThisCameraStruct.V4l2PixFormatStruct.sizeimage;
+
+    if (*NumImagePlanes)
+    {
+        return (ImageSizes[0] < ImageSizeInBytes) ? -EINVAL : 0;
+    }
+
+    *NumImagePlanes = 1;
+    ImageSizes[0] = ImageSizeInBytes;
+
+    return 0;
+}
+
+static int still_buffer_prepare(struct vb2_buffer *vb)
+{
+
+    struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr = vb2_get_drv_priv(vb->vb2_queue);
+
+    if (vb2_plane_size(vb, 0) < TomUsbCamCtrlIntfDevStructPtr->StillCaptureForThisCameraStruct.V4l2PixFormatStruct.sizeimage)
+    {
+        pr_err("still_buffer_prepare error: buffer too small (%lu < %u)", vb2_plane_size(vb, 0),
+               TomUsbCamCtrlIntfDevStructPtr->StillCaptureForThisCameraStruct.V4l2PixFormatStruct.sizeimage);
+
+        return -EINVAL;
+    }
+
+    if (!vb2_plane_vaddr(vb, 0))
+    {
+        pr_err("still_buffer_prepare error: buffer has no kernel mapping");
+
+        return -EINVAL;
+    }
+
+    vb2_set_plane_payload(vb, 0, 0);
+
+    return 0;
+}
+
+// Every buffer queued on the still node asks for one still image. Getting it means talking to the camera and can
+// take a few frames, so it is done by the capture work item.
+static void still_buffer_queue(struct vb2_buffer *vb)
+{
+
+    struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr = vb2_get_drv_priv(vb->vb2_queue);
+    struct StillCaptureStruct *StillCaptureStructPtr = &TomUsbCamCtrlIntfDevStructPtr->StillCaptureForThisCameraStruct;
+
+    struct TomUsbCamV4l2VideoBufferContainer *VideoBufferContainerPtr =
+        container_of(to_vb2_v4l2_buffer(vb), struct TomUsbCamV4l2VideoBufferContainer, TomUsbCamV4l2VideoBuffer);
+
+    unsigned long SpinLockFlags;
+
+    VideoBufferContainerPtr->EofNs = 0;
+    VideoBufferContainerPtr->PtsHostNs = 0;
+    VideoBufferContainerPtr->DoneNs = 0;
+
+    spin_lock_irqsave(&TomUsbCamCtrlIntfDevStructPtr->QueuedVideoBufferListLock, SpinLockFlags);
+
+    list_add_tail(&VideoBufferContainerPtr->TomUsbCamV4l2VideoBufferListHead, &StillCaptureStructPtr->QueuedBufferListHead);
+
+    spin_unlock_irqrestore(&TomUsbCamCtrlIntfDevStructPtr->QueuedVideoBufferListLock, SpinLockFlags);
+
+    queue_work(system_long_wq, &StillCaptureStructPtr->CaptureWork);
+}
+
+// Nothing streams until a buffer asks for an image, but the camera is told the image size now if it sends the images
+// itself. If it won't take it, the images are captured by switching the stream over instead.
+static int still_start_streaming(struct vb2_queue *vq, unsigned int count)
+{
+
+    struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr = vb2_get_drv_priv(vq);
+    struct StillCaptureStruct *StillCaptureStructPtr = &TomUsbCamCtrlIntfDevStructPtr->StillCaptureForThisCameraStruct;
+
+    StillCaptureStructPtr->Sequence = 0;
+
+    if (TomUsbCamStillUsesCamera(StillCaptureStructPtr) && TomUsbCamCommitStillParameters(TomUsbCamCtrlIntfDevStructPtr))
+    {
+        pr_warn("still_start_streaming: camera didn't take the still image size, switching the stream for still images instead");
+    }
+
+    return 0;
+}
+
+// Give back every still buffer. One being filled from the video stream has to be taken off the frame assembler
+// first, which means stopping the Urb ring for a moment. The video frame in flight is lost, nothing else.
+static void still_stop_streaming(struct vb2_queue *vq)
+{
+
+    struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr = vb2_get_drv_priv(vq);
+    struct StillCaptureStruct *StillCaptureStructPtr = &TomUsbCamCtrlIntfDevStructPtr->StillCaptureForThisCameraStruct;
+    struct TomUsbCamIsochronousInputDevStruct *TomUsbCamIsochronousInputDevStructPtr = TomUsbCamCtrlIntfDevStructPtr->IsochronousInputDevStructPtr;
+    struct FrameAssemblyStruct *FrameAssemblyPtr = &TomUsbCamCtrlIntfDevStructPtr->FrameAssemblyForThisCameraStruct;
+    struct TomUsbCamV4l2VideoBufferContainer *VideoBufferContainerPtr, *NextVideoBufferContainerPtr;
+
+    LIST_HEAD(ReturnedBufferListHead);
+
+    unsigned long SpinLockFlags;
+
+    spin_lock_irqsave(&TomUsbCamCtrlIntfDevStructPtr->QueuedVideoBufferListLock, SpinLockFlags);
+    list_splice_init(&StillCaptureStructPtr->QueuedBufferListHead, &ReturnedBufferListHead);
+    bool FrameInProgress = StillCaptureStructPtr->FrameInProgress;
+    spin_unlock_irqrestore(&TomUsbCamCtrlIntfDevStructPtr->QueuedVideoBufferListLock, SpinLockFlags);
+
+    if (FrameInProgress && TomUsbCamIsochronousInputDevStructPtr)
+    {
+
+        TomUsbCamKillIsochronousUrbs(TomUsbCamIsochronousInputDevStructPtr);
+        TomUsbCamStopProcessingStage(TomUsbCamIsochronousInputDevStructPtr);
+
+        // The image may have been finished before the Urbs stopped, and a video frame started since.
+        if (FrameAssemblyPtr->CurrentBufferPtr && TomUsbCamIsStillBuffer(TomUsbCamCtrlIntfDevStructPtr, FrameAssemblyPtr->CurrentBufferPtr))
+        {
+
+            list_add(&FrameAssemblyPtr->CurrentBufferPtr->TomUsbCamV4l2VideoBufferListHead, &ReturnedBufferListHead);
+
+            spin_lock_irqsave(&TomUsbCamCtrlIntfDevStructPtr->QueuedVideoBufferListLock, SpinLockFlags);
+            StillCaptureStructPtr->FrameInProgress = false;
+            spin_unlock_irqrestore(&TomUsbCamCtrlIntfDevStructPtr->QueuedVideoBufferListLock, SpinLockFlags);
+        }
+        else if (FrameAssemblyPtr->CurrentBufferPtr)
+        {
+            TomUsbCamRequeueBuffer(TomUsbCamCtrlIntfDevStructPtr, FrameAssemblyPtr->CurrentBufferPtr);
+        }
+
+        // The Urbs killed mid-frame took the rest of it with them, so start over at the next frame like STREAMON does.
+        FrameAssemblyPtr->CurrentBufferPtr = NULL;
+        TomUsbCamResetFrameAssembly(FrameAssemblyPtr);
+
+        TomUsbCamStartProcessingStage(TomUsbCamIsochronousInputDevStructPtr, TomUsbCamCtrlIntfDevStructPtr->ProcessingStage);
+
+        if (TomUsbCamSubmitIsochronousUrbs(TomUsbCamCtrlIntfDevStructPtr, TomUsbCamIsochronousInputDevStructPtr))
+        {
+            pr_err("still_stop_streaming error: video stream didn't restart");
+
+            TomUsbCamStopIsochronousStream(TomUsbCamCtrlIntfDevStructPtr, VB2_BUF_STATE_ERROR);
+            vb2_queue_error(&TomUsbCamCtrlIntfDevStructPtr->TomUsbCamV4l2Queue);
+        }
+    }
+
+    list_for_each_entry_safe(VideoBufferContainerPtr, NextVideoBufferContainerPtr, &ReturnedBufferListHead, TomUsbCamV4l2VideoBufferListHead)
+    {
+
+        list_del(&VideoBufferContainerPtr->TomUsbCamV4l2VideoBufferListHead);
+
+        trace_tomusbcam_buffer_done(TomUsbCamCtrlIntfDevStructPtr, &VideoBufferContainerPtr->TomUsbCamV4l2VideoBuffer, VB2_BUF_STATE_ERROR);
+        vb2_buffer_done(&VideoBufferContainerPtr->TomUsbCamV4l2VideoBuffer.vb2_buf, VB2_BUF_STATE_ERROR);
+    }
+}
+
+static bool TomUsbCamIsStillBuffer(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr,
+                                   struct TomUsbCamV4l2VideoBufferContainer *VideoBufferContainerPtr)
+{
+    return VideoBufferContainerPtr->TomUsbCamV4l2VideoBuffer.vb2_buf.vb2_queue == &TomUsbCamCtrlIntfDevStructPtr->StillCaptureForThisCameraStruct.V4l2Queue;
+}
+
+// Whether still buffers are waiting for an image, counting the one being filled if IncludeInProgress is set.
+static bool TomUsbCamStillImagesWaiting(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr, bool IncludeInProgress)
+{
+
+    struct StillCaptureStruct *StillCaptureStructPtr = &TomUsbCamCtrlIntfDevStructPtr->StillCaptureForThisCameraStruct;
+
+    unsigned long SpinLockFlags;
+
+    spin_lock_irqsave(&TomUsbCamCtrlIntfDevStructPtr->QueuedVideoBufferListLock, SpinLockFlags);
+
+    bool ImagesWaiting = !list_empty(&StillCaptureStructPtr->QueuedBufferListHead) ||
+                         (IncludeInProgress && StillCaptureStructPtr->FrameInProgress);
+
+    spin_unlock_irqrestore(&TomUsbCamCtrlIntfDevStructPtr->QueuedVideoBufferListLock, SpinLockFlags);
+
+    return ImagesWaiting;
+}
+
+// A still image started, from the video stream or the bulk endpoint. Take the oldest still buffer for it, and point
+// the frame assembler at its memory. Still images are never converted, and don't count as video frames.
+static bool TomUsbCamStartStillFrame(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr, struct FrameAssemblyStruct *FrameAssemblyPtr)
+{
+
+    struct StillCaptureStruct *StillCaptureStructPtr = &TomUsbCamCtrlIntfDevStructPtr->StillCaptureForThisCameraStruct;
+    struct TomUsbCamV4l2VideoBufferContainer *VideoBufferContainerPtr;
+
+    unsigned long SpinLockFlags;
+
+    spin_lock_irqsave(&TomUsbCamCtrlIntfDevStructPtr->QueuedVideoBufferListLock, SpinLockFlags);
+
+    VideoBufferContainerPtr = list_first_entry_or_null(&StillCaptureStructPtr->QueuedBufferListHead,
+                                                       struct TomUsbCamV4l2VideoBufferContainer,
+                                                       TomUsbCamV4l2VideoBufferListHead);
+
+    if (VideoBufferContainerPtr)
+    {
+        list_del(&VideoBufferContainerPtr->TomUsbCamV4l2VideoBufferListHead);
+        StillCaptureStructPtr->FrameInProgress = true;
+    }
+
+    spin_unlock_irqrestore(&TomUsbCamCtrlIntfDevStructPtr->QueuedVideoBufferListLock, SpinLockFlags);
+
+    FrameAssemblyPtr->CurrentBufferPtr = VideoBufferContainerPtr;
+
+    trace_tomusbcam_frame_start(TomUsbCamCtrlIntfDevStructPtr, VideoBufferContainerPtr != NULL);
+
+    // Nobody asked for this one, e.g. the camera's snapshot button was pressed.
+    if (!VideoBufferContainerPtr)
+    {
+        return false;
+    }
+
+    struct vb2_buffer *Vb2BufferPtr = &VideoBufferContainerPtr->TomUsbCamV4l2VideoBuffer.vb2_buf;
+    struct v4l2_pix_format *StillPixFormatPtr = &StillCaptureStructPtr->V4l2PixFormatStruct;
+
+    FrameAssemblyPtr->DstVaddr = vb2_plane_vaddr(Vb2BufferPtr, 0);
+    FrameAssemblyPtr->DstSgTablePtr = NULL;
+    FrameAssemblyPtr->DstSize = vb2_plane_size(Vb2BufferPtr, 0);
+
+    FrameAssemblyPtr->Conversion = TOM_USB_CAM_CONVERSION_NONE;
+    FrameAssemblyPtr->Width = StillPixFormatPtr->width;
+    FrameAssemblyPtr->Height = StillPixFormatPtr->height;
+    FrameAssemblyPtr->FrameLen = (size_t) StillPixFormatPtr->bytesperline * StillPixFormatPtr->height;
+
+    return true;
+}
+
+// Give the still image to user space and wake the capture work item. Damaged images are dropped and taken again
+// if the damaged_frames parameter says so, like video frames.
+static void TomUsbCamCompleteStillFrame(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr, struct FrameAssemblyStruct *FrameAssemblyPtr)
+{
+
+    struct StillCaptureStruct *StillCaptureStructPtr = &TomUsbCamCtrlIntfDevStructPtr->StillCaptureForThisCameraStruct;
+    struct TomUsbCamV4l2VideoBufferContainer *VideoBufferContainerPtr = FrameAssemblyPtr->CurrentBufferPtr;
+    struct vb2_v4l2_buffer *V4l2BufferPtr = &VideoBufferContainerPtr->TomUsbCamV4l2VideoBuffer;
+
+    unsigned long SpinLockFlags;
+
+    FrameAssemblyPtr->CurrentBufferPtr = NULL;
+
+    if (FrameAssemblyPtr->ErrorFlags && (TomUsbCamCtrlIntfDevStructPtr->DamagedFramePolicy == TOM_USB_CAM_DAMAGED_FRAMES_DROP))
+    {
+        TomUsbCamRequeueStillBuffer(TomUsbCamCtrlIntfDevStructPtr, VideoBufferContainerPtr);
+        return;
+    }
+
+    u64 EofNs = ktime_get_ns();
+
+    vb2_set_plane_payload(&V4l2BufferPtr->vb2_buf, 0, FrameAssemblyPtr->BytesUsed);
+
+    V4l2BufferPtr->field = V4L2_FIELD_NONE;
+    V4l2BufferPtr->sequence = StillCaptureStructPtr->Sequence++;
+
+    if (!FrameAssemblyPtr->PtsValid ||
+        !TomUsbCamPtsToHostTime(TomUsbCamCtrlIntfDevStructPtr, FrameAssemblyPtr->Pts, &V4l2BufferPtr->vb2_buf.timestamp))
+    {
+        V4l2BufferPtr->vb2_buf.timestamp = EofNs;
+    }
+
+    enum vb2_buffer_state BufferState = FrameAssemblyPtr->ErrorFlags ? VB2_BUF_STATE_ERROR : VB2_BUF_STATE_DONE;
+
+    trace_tomusbcam_buffer_done(TomUsbCamCtrlIntfDevStructPtr, V4l2BufferPtr, BufferState);
+    vb2_buffer_done(&V4l2BufferPtr->vb2_buf, BufferState);
+
+    spin_lock_irqsave(&TomUsbCamCtrlIntfDevStructPtr->QueuedVideoBufferListLock, SpinLockFlags);
+    StillCaptureStructPtr->FrameInProgress = false;
+    StillCaptureStructPtr->ImagesDelivered++;
+    spin_unlock_irqrestore(&TomUsbCamCtrlIntfDevStructPtr->QueuedVideoBufferListLock, SpinLockFlags);
+
+    wake_up(&StillCaptureStructPtr->DeliveredWaitQueue);
+}
+
+// Put a still buffer whose image was dropped or cut short back at the head of the still queue.
+static void TomUsbCamRequeueStillBuffer(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr,
+                                        struct TomUsbCamV4l2VideoBufferContainer *VideoBufferContainerPtr)
+{
+
+    unsigned long SpinLockFlags;
+
+    spin_lock_irqsave(&TomUsbCamCtrlIntfDevStructPtr->QueuedVideoBufferListLock, SpinLockFlags);
+
+    list_add(&VideoBufferContainerPtr->TomUsbCamV4l2VideoBufferListHead,
+             &TomUsbCamCtrlIntfDevStructPtr->StillCaptureForThisCameraStruct.QueuedBufferListHead);
+
+    TomUsbCamCtrlIntfDevStructPtr->StillCaptureForThisCameraStruct.FrameInProgress = false;
+
+    spin_unlock_irqrestore(&TomUsbCamCtrlIntfDevStructPtr->QueuedVideoBufferListLock, SpinLockFlags);
+}
+
+// Give the oldest waiting still buffer back to vb2 without an image.
+static void TomUsbCamReturnStillBuffer(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr, enum vb2_buffer_state BufferState)
+{
+
+    struct TomUsbCamV4l2VideoBufferContainer *VideoBufferContainerPtr;
+
+    unsigned long SpinLockFlags;
+
+    spin_lock_irqsave(&TomUsbCamCtrlIntfDevStructPtr->QueuedVideoBufferListLock, SpinLockFlags);
+
+    VideoBufferContainerPtr = list_first_entry_or_null(&TomUsbCamCtrlIntfDevStructPtr->StillCaptureForThisCameraStruct.QueuedBufferListHead,
+                                                       struct TomUsbCamV4l2VideoBufferContainer,
+                                                       TomUsbCamV4l2VideoBufferListHead);
+
+    if (VideoBufferContainerPtr)
+    {
+        list_del(&VideoBufferContainerPtr->TomUsbCamV4l2VideoBufferListHead);
+    }
+
+    spin_unlock_irqrestore(&TomUsbCamCtrlIntfDevStructPtr->QueuedVideoBufferListLock, SpinLockFlags);
+
+    if (VideoBufferContainerPtr)
+    {
+        trace_tomusbcam_buffer_done(TomUsbCamCtrlIntfDevStructPtr, &VideoBufferContainerPtr->TomUsbCamV4l2VideoBuffer, BufferState);
+        vb2_buffer_done(&VideoBufferContainerPtr->TomUsbCamV4l2VideoBuffer.vb2_buf, BufferState);
+    }
+}
+
+// The frame assembler ops for method 3 still images, which only differ in where the struct lives.
+static bool TomUsbCamStartBulkStillFrame(struct FrameAssemblyStruct *FrameAssemblyPtr)
+{
+
+    struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr = container_of(FrameAssemblyPtr, struct TomUsbCamCtrlIntfDevStruct,
+                                                                                     StillCaptureForThisCameraStruct.BulkFrameAssembly);
+
+    return TomUsbCamStartStillFrame(TomUsbCamCtrlIntfDevStructPtr, FrameAssemblyPtr);
+}
+
+// The clock samples belong to the video stream's completion path, which may be running alongside, so the bulk
+// payloads don't add any.
+static void TomUsbCamAddBulkStillClockSample(struct FrameAssemblyStruct *FrameAssemblyPtr, const unsigned char *ScrPtr)
+{
+}
+
+static void TomUsbCamCompleteBulkStillFrame(struct FrameAssemblyStruct *FrameAssemblyPtr)
+{
+
+    struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr = container_of(FrameAssemblyPtr, struct TomUsbCamCtrlIntfDevStruct,
+                                                                                     StillCaptureForThisCameraStruct.BulkFrameAssembly);
+
+    TomUsbCamCompleteStillFrame(TomUsbCamCtrlIntfDevStructPtr, FrameAssemblyPtr);
+}
+
+// Send VS_STILL_IMAGE_TRIGGER_CONTROL, section 4.3.1.3 of [5]. Returns 0 on success.
+static int TomUsbCamTriggerStillImage(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr, uint8_t Trigger)
+{
+
+    unsigned char *TriggerControlPtr = kmalloc(StillImageTriggerControlPacketLen, GFP_KERNEL);
+
+    if (!TriggerControlPtr)
+    {
+        return -ENOMEM;
+    }
+
+    *TriggerControlPtr = Trigger;
+
+    int BytesSentOrErrorCode = WriteToCamera(TomUsbCamCtrlIntfDevStructPtr,
+                                             SetCurrentSelectorControlRequest,
+                                             ClassTypeRequestType,
+                                             InterfaceRecipientRequestType,
+                                             VideoStreamingStillImageTriggerControlValue,
+                                             0x0,
+                                             InterfaceVideoStreamingIndex,
+                                             TriggerControlPtr,
+                                             StillImageTriggerControlPacketLen,
+                                             FiveSecTimeoutInMsecs);
+
+    kfree(TriggerControlPtr);
+
+    if (BytesSentOrErrorCode != StillImageTriggerControlPacketLen)
+    {
+        pr_err("TomUsbCamTriggerStillImage error: still image trigger %d SET_CUR returned %d", Trigger, BytesSentOrErrorCode);
+
+        return -EIO;
+    }
+
+    return 0;
+}
+
+// Method 2: the camera sends the image between two video frames of the stream that is already running, with the still
+// image bit set, and the frame assembler hands it to the still node. Called with TomUsbCamLock held, which is let go
+// while waiting so the video node carries on as usual. Returns 0 once an image went to user space.
+static int TomUsbCamCaptureInterleavedStillImage(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr)
+{
+
+    struct StillCaptureStruct *StillCaptureStructPtr = &TomUsbCamCtrlIntfDevStructPtr->StillCaptureForThisCameraStruct;
+    struct TomUsbCamIsochronousInputDevStruct *TomUsbCamIsochronousInputDevStructPtr = TomUsbCamCtrlIntfDevStructPtr->IsochronousInputDevStructPtr;
+
+    uint32_t MaxPayloadTransferSize = get_unaligned_le32(&StillCaptureStructPtr->ProbeControlBlock[StillProbeControlMaxPayloadTransferSizeOffset]);
+
+    // The image needs a video stream to go out with, and its payloads have to fit in the packets of the alt setting
+    // the video mode picked.
+    if (!TomUsbCamIsochronousInputDevStructPtr ||
+        (MaxPayloadTransferSize > TomUsbCamIsochronousInputDevStructPtr->IsochronousInputBufferSize))
+    {
+        return -EINVAL;
+    }
+
+    unsigned int ImagesDelivered = READ_ONCE(StillCaptureStructPtr->ImagesDelivered);
+
+    int CaptureErrorValue = TomUsbCamTriggerStillImage(TomUsbCamCtrlIntfDevStructPtr, StillImageTriggerTransmit);
+
+    if (CaptureErrorValue)
+    {
+        return CaptureErrorValue;
+    }
+
+    // An image that is still being filled when the wait runs out gets one more.
+    for (int WaitIdx = 0; WaitIdx < 2; WaitIdx++)
+    {
+
+        mutex_unlock(&TomUsbCamCtrlIntfDevStructPtr->TomUsbCamLock);
+
+        wait_event_timeout(StillCaptureStructPtr->DeliveredWaitQueue, READ_ONCE(StillCaptureStructPtr->ImagesDelivered) != ImagesDelivered,
+                           msecs_to_jiffies(TOM_USB_CAM_STILL_TIMEOUT_MS));
+
+        mutex_lock(&TomUsbCamCtrlIntfDevStructPtr->TomUsbCamLock);
+
+        if (READ_ONCE(StillCaptureStructPtr->ImagesDelivered) != ImagesDelivered)
+        {
+            return 0;
+        }
+
+        if (!READ_ONCE(StillCaptureStructPtr->FrameInProgress))
+        {
+            break;
+        }
+    }
+
+    return -ETIMEDOUT;
+}
+
+// Method 3: the camera sends the image on its bulk still endpoint, which is read here payload by payload into a frame
+// assembler of its own. Called with TomUsbCamLock held. Returns 0 once an image went to user space.
+static int TomUsbCamCaptureBulkStillImage(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr)
+{
+
+    struct StillCaptureStruct *StillCaptureStructPtr = &TomUsbCamCtrlIntfDevStructPtr->StillCaptureForThisCameraStruct;
+    struct FrameAssemblyStruct *FrameAssemblyPtr = &StillCaptureStructPtr->BulkFrameAssembly;
+
+    uint32_t MaxPayloadTransferSize = get_unaligned_le32(&StillCaptureStructPtr->ProbeControlBlock[StillProbeControlMaxPayloadTransferSizeOffset]);
+
+    if (!MaxPayloadTransferSize)
+    {
+        return -EINVAL;
+    }
+
+    unsigned char *PayloadPtr = kmalloc(MaxPayloadTransferSize, GFP_KERNEL);
+
+    if (!PayloadPtr)
+    {
+        return -ENOMEM;
+    }
+
+    // Nothing else comes down the bulk pipe, so unlike the video stream the very first payload starts an image.
+    memset(FrameAssemblyPtr, 0, sizeof(*FrameAssemblyPtr));
+    FrameAssemblyPtr->OpsPtr = &TomUsbCamBulkStillFrameAssemblyOps;
+    FrameAssemblyPtr->LastFrameId = -2;
+
+    unsigned int ImagesDelivered = READ_ONCE(StillCaptureStructPtr->ImagesDelivered);
+    unsigned long Deadline = jiffies + msecs_to_jiffies(TOM_USB_CAM_STILL_TIMEOUT_MS);
+
+    int CaptureErrorValue = TomUsbCamTriggerStillImage(TomUsbCamCtrlIntfDevStructPtr, StillImageTriggerTransmitBulk);
+
+    while (!CaptureErrorValue && (READ_ONCE(StillCaptureStructPtr->ImagesDelivered) == ImagesDelivered))
+    {
+
+        int PayloadLen = 0;
+
+        if (time_after(jiffies, Deadline))
+        {
+            CaptureErrorValue = -ETIMEDOUT;
+            break;
+        }
+
+        CaptureErrorValue = usb_bulk_msg(TomUsbCamCtrlIntfDevStructPtr->UsbDevStructPtr,
+                                         usb_rcvbulkpipe(TomUsbCamCtrlIntfDevStructPtr->UsbDevStructPtr, StillCaptureStructPtr->BulkEndpointAddr),
+                                         PayloadPtr, MaxPayloadTransferSize, &PayloadLen, TOM_USB_CAM_STILL_TIMEOUT_MS);
+
+        if (!CaptureErrorValue)
+        {
+            TomUsbCamProcessPayload(FrameAssemblyPtr, PayloadPtr, PayloadLen);
+        }
+    }
+
+    // An image cut short goes back to be taken again.
+    if (FrameAssemblyPtr->CurrentBufferPtr)
+    {
+        TomUsbCamRequeueStillBuffer(TomUsbCamCtrlIntfDevStructPtr, FrameAssemblyPtr->CurrentBufferPtr);
+        FrameAssemblyPtr->CurrentBufferPtr = NULL;
+    }
+
+    if (CaptureErrorValue)
+    {
+        pr_err("TomUsbCamCaptureBulkStillImage error: bulk still image transfer failed (%d)", CaptureErrorValue);
+
+        TomUsbCamTriggerStillImage(TomUsbCamCtrlIntfDevStructPtr, StillImageTriggerAbort);
+    }
+
+    kfree(PayloadPtr);
+
+    return CaptureErrorValue;
+}
+
+// Stream the still image size until the waiting still buffers are filled, then go back to the video mode, much like
+// STREAMOFF, S_FMT and STREAMON would but without user space or the video buffers noticing. The video node sees a
+// gap in its sequence numbers. Works whether or not the video node is streaming. Called with TomUsbCamLock held
+// throughout, so nothing else starts or stops the stream meanwhile. Returns 0 once the images went to user space.
+static int TomUsbCamCaptureSwitchedStillImage(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr)
+{
+
+    struct StillCaptureStruct *StillCaptureStructPtr = &TomUsbCamCtrlIntfDevStructPtr->StillCaptureForThisCameraStruct;
+    struct StreamingParametersStruct *StreamingParametersStructPtr = &TomUsbCamCtrlIntfDevStructPtr->StreamingParametersForThisCameraStruct;
+    struct FrameAssemblyStruct *FrameAssemblyPtr = &TomUsbCamCtrlIntfDevStructPtr->FrameAssemblyForThisCameraStruct;
+    struct TomUsbCamIsochronousInputDevStruct *TomUsbCamIsochronousInputDevStructPtr = TomUsbCamCtrlIntfDevStructPtr->IsochronousInputDevStructPtr;
+    bool VideoStreaming = (TomUsbCamIsochronousInputDevStructPtr != NULL);
+    struct StreamingFormatStruct *FormatPtr;
+    struct StreamingFrameStruct *FramePtr;
+
+    if (GetStreamingMode(TomUsbCamCtrlIntfDevStructPtr, StillCaptureStructPtr->PixelFormat, StillCaptureStructPtr->V4l2PixFormatStruct.width,
+                         StillCaptureStructPtr->V4l2PixFormatStruct.height, &FormatPtr, &FramePtr))
+    {
+        pr_err("TomUsbCamCaptureSwitchedStillImage error: no video mode for a %ux%u still image", StillCaptureStructPtr->V4l2PixFormatStruct.width,
+               StillCaptureStructPtr->V4l2PixFormatStruct.height);
+
+        return -EINVAL;
+    }
+
+    if (VideoStreaming)
+    {
+        TomUsbCamPauseIsochronousStream(TomUsbCamCtrlIntfDevStructPtr, TomUsbCamIsochronousInputDevStructPtr);
+    }
+    else
+    {
+
+        TomUsbCamIsochronousInputDevStructPtr = TomUsbCamGetStreamingInterface(TomUsbCamCtrlIntfDevStructPtr);
+
+        if (!TomUsbCamIsochronousInputDevStructPtr)
+        {
+            return -ENODEV;
+        }
+
+        TomUsbCamIsochronousInputDevStructPtr->CtrlIntfDevStructPtr = TomUsbCamCtrlIntfDevStructPtr;
+        TomUsbCamCtrlIntfDevStructPtr->IsochronousInputDevStructPtr = TomUsbCamIsochronousInputDevStructPtr;
+
+        FrameAssemblyPtr->OpsPtr = &TomUsbCamFrameAssemblyOps;
+        FrameAssemblyPtr->CurrentBufferPtr = NULL;
+
+        TomUsbCamResetClockRecovery(TomUsbCamCtrlIntfDevStructPtr);
+    }
+
+    // Everything the video mode needs to start again afterwards.
+    struct v4l2_pix_format VideoPixFormat = TomUsbCamCtrlIntfDevStructPtr->V4l2PixFormatStruct;
+    uint32_t VideoFrameInterval = StreamingParametersStructPtr->FrameInterval;
+    bool VideoProbeControlBlockValid = StreamingParametersStructPtr->ProbeControlBlockValid;
+    unsigned char VideoProbeControlBlock[VideoStreamingProbeControlPacketLen];
+
+    memcpy(VideoProbeControlBlock, StreamingParametersStructPtr->ProbeControlBlock, VideoStreamingProbeControlPacketLen);
+
+    // The shortest frame interval gets the image here soonest.
+    uint32_t ShortestFrameInterval = FramePtr->FrameIntervals[0];
+
+    for (int IntervalIdx = 1; !FramePtr->ContinuousFrameIntervals && (IntervalIdx < FramePtr->FrameIntervalCount); IntervalIdx++)
+    {
+        ShortestFrameInterval = min(ShortestFrameInterval, FramePtr->FrameIntervals[IntervalIdx]);
+    }
+
+    FillPixFormatFromStreamingMode(FormatPtr, FramePtr, &TomUsbCamCtrlIntfDevStructPtr->V4l2PixFormatStruct);
+
+    int CaptureErrorValue = TomUsbCamNegotiateStreamingParameters(TomUsbCamCtrlIntfDevStructPtr, FormatPtr->PixelFormat, FramePtr->Width,
+                                                                  FramePtr->Height, ShortestFrameInterval);
+
+    if (!CaptureErrorValue)
+    {
+
+        StillCaptureStructPtr->SwitchActive = true;
+
+        // The frame in flight when the stream starts is skipped as usual.
+        TomUsbCamResetFrameAssembly(FrameAssemblyPtr);
+
+        TomUsbCamStartProcessingStage(TomUsbCamIsochronousInputDevStructPtr, TomUsbCamCtrlIntfDevStructPtr->ProcessingStage);
+
+        CaptureErrorValue = TomUsbCamStartIsochronousStream(TomUsbCamCtrlIntfDevStructPtr, TomUsbCamIsochronousInputDevStructPtr);
+    }
+
+    // Every still buffer waiting gets a full timeout for its image.
+    while (!CaptureErrorValue && TomUsbCamStillImagesWaiting(TomUsbCamCtrlIntfDevStructPtr, true))
+    {
+
+        unsigned int ImagesDelivered = READ_ONCE(StillCaptureStructPtr->ImagesDelivered);
+
+        if (!wait_event_timeout(StillCaptureStructPtr->DeliveredWaitQueue,
+                                READ_ONCE(StillCaptureStructPtr->ImagesDelivered) != ImagesDelivered,
+                                msecs_to_jiffies(TOM_USB_CAM_STILL_TIMEOUT_MS)))
+        {
+            CaptureErrorValue = -ETIMEDOUT;
+        }
+    }
+
+    // A still image cut short goes back on the still queue either way.
+    if (VideoStreaming)
+    {
+        TomUsbCamPauseIsochronousStream(TomUsbCamCtrlIntfDevStructPtr, TomUsbCamIsochronousInputDevStructPtr);
+    }
+    else
+    {
+        TomUsbCamStopIsochronousStream(TomUsbCamCtrlIntfDevStructPtr, VB2_BUF_STATE_ERROR);
+    }
+
+    StillCaptureStructPtr->SwitchActive = false;
+
+    TomUsbCamCtrlIntfDevStructPtr->V4l2PixFormatStruct = VideoPixFormat;
+    StreamingParametersStructPtr->FrameInterval = VideoFrameInterval;
+    StreamingParametersStructPtr->ProbeControlBlockValid = VideoProbeControlBlockValid;
+    memcpy(StreamingParametersStructPtr->ProbeControlBlock, VideoProbeControlBlock, VideoStreamingProbeControlPacketLen);
+
+    if (VideoStreaming)
+    {
+
+        TomUsbCamResetFrameAssembly(FrameAssemblyPtr);
+
+        TomUsbCamStartProcessingStage(TomUsbCamIsochronousInputDevStructPtr, TomUsbCamCtrlIntfDevStructPtr->ProcessingStage);
+
+        int RestartErrorValue = TomUsbCamStartIsochronousStream(TomUsbCamCtrlIntfDevStructPtr, TomUsbCamIsochronousInputDevStructPtr);
+
+        // The video buffers go back flagged, and the next QBUF or DQBUF on the video node fails with -EIO.
+        if (RestartErrorValue)
+        {
+            pr_err("TomUsbCamCaptureSwitchedStillImage error: video stream didn't restart (%d)", RestartErrorValue);
+
+            TomUsbCamStopIsochronousStream(TomUsbCamCtrlIntfDevStructPtr, VB2_BUF_STATE_ERROR);
+            vb2_queue_error(&TomUsbCamCtrlIntfDevStructPtr->TomUsbCamV4l2Queue);
+        }
+    }
+
+    return CaptureErrorValue;
+}
+
+// Get an image for every buffer waiting on the still node, by the camera's own method if it has one and by switching
+// the stream over otherwise, or if that failed. A buffer that can't be filled either way goes back with an error.
+static void TomUsbCamStillCaptureWork(struct work_struct *WorkPtr)
+{
+
+    struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr = container_of(WorkPtr, struct TomUsbCamCtrlIntfDevStruct,
+                                                                                     StillCaptureForThisCameraStruct.CaptureWork);
+    struct StillCaptureStruct *StillCaptureStructPtr = &TomUsbCamCtrlIntfDevStructPtr->StillCaptureForThisCameraStruct;
+
+    mutex_lock(&TomUsbCamCtrlIntfDevStructPtr->TomUsbCamLock);
+
+    while (vb2_is_streaming(&StillCaptureStructPtr->V4l2Queue) && TomUsbCamStillImagesWaiting(TomUsbCamCtrlIntfDevStructPtr, false))
+    {
+
+        int CaptureErrorValue = -EINVAL;
+
+        if (TomUsbCamStillUsesCamera(StillCaptureStructPtr) && StillCaptureStructPtr->ProbeControlBlockValid)
+        {
+
+            if (StillCaptureStructPtr->Method == TOM_USB_CAM_STILL_METHOD_INTERLEAVED)
+            {
+                CaptureErrorValue = TomUsbCamCaptureInterleavedStillImage(TomUsbCamCtrlIntfDevStructPtr);
+            }
+            else
+            {
+                CaptureErrorValue = TomUsbCamCaptureBulkStillImage(TomUsbCamCtrlIntfDevStructPtr);
+            }
+
+            trace_tomusbcam_still(TomUsbCamCtrlIntfDevStructPtr, StillCaptureStructPtr->Method, CaptureErrorValue);
+        }
+
+        // The method 2 wait lets go of the lock, so the still node may have stopped streaming since.
+        if (CaptureErrorValue && vb2_is_streaming(&StillCaptureStructPtr->V4l2Queue) &&
+            TomUsbCamStillImagesWaiting(TomUsbCamCtrlIntfDevStructPtr, false))
+        {
+
+            CaptureErrorValue = TomUsbCamCaptureSwitchedStillImage(TomUsbCamCtrlIntfDevStructPtr);
+
+            trace_tomusbcam_still(TomUsbCamCtrlIntfDevStructPtr, TOM_USB_CAM_STILL_METHOD_VIDEO_FRAME, CaptureErrorValue);
+
+            // Don't leave user space waiting for an image that isn't coming.
+            if (CaptureErrorValue)
+            {
+                pr_err("TomUsbCamStillCaptureWork error: still image capture failed (%d)", CaptureErrorValue);
+
+                TomUsbCamReturnStillBuffer(TomUsbCamCtrlIntfDevStructPtr, VB2_BUF_STATE_ERROR);
+            }
+        }
+    }
+
+    mutex_unlock(&TomUsbCamCtrlIntfDevStructPtr->TomUsbCamLock);
+}
+
+//***********************************************************************************************
+
+// Clock recovery functions
+//***********************************************************************************************
+
+static void TomUsbCamResetClockRecovery(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr)
+{
+
+    TomUsbCamCtrlIntfDevStructPtr->ClockRecoveryForThisCameraStruct.NextSampleIdx = 0;
+    TomUsbCamCtrlIntfDevStructPtr->ClockRecoveryForThisCameraStruct.SampleCount = 0;
+
+    TomUsbCamCtrlIntfDevStructPtr->FrameAssemblyForThisCameraStruct.PtsValid = false;
+    TomUsbCamCtrlIntfDevStructPtr->FrameAssemblyForThisCameraStruct.ClockSampled = false;
+}
+
+// Pair the device clock value of a source clock reference with the host time of the Usb frame it was taken in.
+static void TomUsbCamAddClockSample(struct FrameAssemblyStruct *FrameAssemblyPtr, const unsigned char *ScrPtr)
+{
+
+    struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr = container_of(FrameAssemblyPtr, struct TomUsbCamCtrlIntfDevStruct,
+                                                                                     FrameAssemblyForThisCameraStruct);
+
+    struct ClockRecoveryStruct *ClockRecoveryPtr = &TomUsbCamCtrlIntfDevStructPtr->ClockRecoveryForThisCameraStruct;
+
+    uint32_t DeviceClock = get_unaligned_le32(ScrPtr);
+    uint16_t DeviceSof = get_unaligned_le16(ScrPtr + PayloadHeaderScrSofOffset) & PayloadHeaderScrSofMask;
+
+    // Read both host clocks back to back so they describe the same instant.
+    u64 HostNs = ktime_get_ns();
+    int HostSof = usb_get_current_frame_number(TomUsbCamCtrlIntfDevStructPtr->UsbDevStructPtr);
+
+    if (HostSof < 0)
+    {
+        return;
+    }
+
+    // The payload can only be older than the host frame, so this also copes with either frame number wrapping. Like
+    // uvcvideo, compare the low 8 bits only, as that is all every host controller keeps.
+    unsigned int SofDelay = (HostSof - DeviceSof) & UsbFrameNumberDelayMask;
+
+    // A payload that waited long to be processed, or a frame number the host controller got wrong, would pull the
+    // fit off. Allow for the payload coming at the start of its Urb, 4 ms of video at high speed and 32 ms at full
+    // speed, and drop anything older.
+    struct TomUsbCamIsochronousInputDevStruct *TomUsbCamIsochronousInputDevStructPtr = TomUsbCamCtrlIntfDevStructPtr->IsochronousInputDevStructPtr;
+
+    unsigned int MaxSofDelay = UsbClockSampleSofDelayMargin;
+
+    if (TomUsbCamIsochronousInputDevStructPtr)
+    {
+        MaxSofDelay += DIV_ROUND_UP(TOM_USB_CAM_PACKETS_PER_ISOCHRONOUS_URB * TomUsbCamIsochronousInputDevStructPtr->IsochronousInputInterval,
+                                    (TomUsbCamCtrlIntfDevStructPtr->UsbDevStructPtr->speed >= USB_SPEED_HIGH) ? 8 : 1);
+    }
+
+    // Past half the 8 bit range a delay can't be told apart from a wrapped frame number.
+    if (SofDelay > min_t(unsigned int, MaxSofDelay, UsbFrameNumberDelayMask / 2))
+    {
+        return;
+    }
+
+    u64 SofDelayNs = (u64) SofDelay * UsbFrameLenNs;
+
+    u64 DeviceTicks;
+
+    if (ClockRecoveryPtr->SampleCount == 0)
+    {
+        DeviceTicks = DeviceClock;
+    }
+    else
+    {
+
+        unsigned int NewestIdx = (ClockRecoveryPtr->NextSampleIdx + TOM_USB_CAM_NUM_CLOCK_SAMPLES - 1) % TOM_USB_CAM_NUM_CLOCK_SAMPLES;
+
+        // Samples are a frame apart, far less than the 32 bit clock takes to wrap.
+        DeviceTicks = ClockRecoveryPtr->Samples[NewestIdx].DeviceTicks + (uint32_t) (DeviceClock - ClockRecoveryPtr->LastDeviceClock);
+    }
+
+    ClockRecoveryPtr->Samples[ClockRecoveryPtr->NextSampleIdx].DeviceTicks = DeviceTicks;
+    ClockRecoveryPtr->Samples[ClockRecoveryPtr->NextSampleIdx].HostNs = HostNs - SofDelayNs;
+
+    ClockRecoveryPtr->NextSampleIdx = (ClockRecoveryPtr->NextSampleIdx + 1) % TOM_USB_CAM_NUM_CLOCK_SAMPLES;
+
+    if (ClockRecoveryPtr->SampleCount < TOM_USB_CAM_NUM_CLOCK_SAMPLES)
+    {
+        ClockRecoveryPtr->SampleCount++;
+    }
+
+    ClockRecoveryPtr->LastDeviceClock = DeviceClock;
+}
+
+// Convert a presentation time stamp to CLOCK_MONOTONIC ns. The fit is the line through the average sample of the
+// older half of the window and the average sample of the newer half. Averaging takes out most of the up to 1 ms
+// error of each sample's Usb frame number, and the line follows the drift between the two clocks. Returns false
+// until there are enough samples.
+static bool TomUsbCamPtsToHostTime(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr, uint32_t Pts, u64 *HostNsPtr)
+{
+
+    struct ClockRecoveryStruct *ClockRecoveryPtr = &TomUsbCamCtrlIntfDevStructPtr->ClockRecoveryForThisCameraStruct;
+
+    if (ClockRecoveryPtr->SampleCount < 4)
+    {
+        return false;
+    }
+
+    unsigned int HalfCount = ClockRecoveryPtr->SampleCount / 2;
+    unsigned int OldestIdx = (ClockRecoveryPtr->NextSampleIdx + TOM_USB_CAM_NUM_CLOCK_SAMPLES - ClockRecoveryPtr->SampleCount) %
+                             TOM_USB_CAM_NUM_CLOCK_SAMPLES;
+
+    // Sum relative to the oldest sample so nothing overflows.
+    struct ClockSampleStruct *OldestSamplePtr = &ClockRecoveryPtr->Samples[OldestIdx];
+
+    u64 OlderTicksSum = 0, OlderNsSum = 0, NewerTicksSum = 0, NewerNsSum = 0;
+
+    for (unsigned int SampleNum = 0; SampleNum < 2 * HalfCount; SampleNum++)
+    {
+
+        // With an odd count the newest sample is left out, so both halves are the same size.
+        struct ClockSampleStruct *SamplePtr = &ClockRecoveryPtr->Samples[(OldestIdx + SampleNum) % TOM_USB_CAM_NUM_CLOCK_SAMPLES];
+
+        if (SampleNum < HalfCount)
+        {
+            OlderTicksSum += SamplePtr->DeviceTicks - OldestSamplePtr->DeviceTicks;
+            OlderNsSum += SamplePtr->HostNs - OldestSamplePtr->HostNs;
+        }
+        else
+        {
+            NewerTicksSum += SamplePtr->DeviceTicks - OldestSamplePtr->DeviceTicks;
+            NewerNsSum += SamplePtr->HostNs - OldestSamplePtr->HostNs;
+        }
+    }
+
+    u64 OlderTicks = div_u64(OlderTicksSum, HalfCount);
+    u64 NewerTicks = div_u64(NewerTicksSum, HalfCount);
+    u64 NewerNs = div_u64(NewerNsSum, HalfCount);
+    s64 SpanNs = (s64) NewerNs - (s64) div_u64(OlderNsSum, HalfCount);
+
+    if ((NewerTicks <= OlderTicks) || (SpanNs <= 0))
+    {
+        return false;
+    }
+
+    // Ns per device tick as fixed point with 24 fraction bits, which leaves room for windows of minutes at low frame rates.
+    u64 NsPerTick = div64_u64((u64) SpanNs << 24, NewerTicks - OlderTicks);
+
+    // The Pts is within half a wrap of the newest device clock value, which places it on the unwrapped time line.
+    unsigned int NewestIdx = (ClockRecoveryPtr->NextSampleIdx + TOM_USB_CAM_NUM_CLOCK_SAMPLES - 1) % TOM_USB_CAM_NUM_CLOCK_SAMPLES;
+
+    s64 PtsTicks = (s64) (ClockRecoveryPtr->Samples[NewestIdx].DeviceTicks - OldestSamplePtr->DeviceTicks) +
+                   (int32_t) (Pts - ClockRecoveryPtr->LastDeviceClock);
+
+    s64 TicksFromNewer = PtsTicks - (s64) NewerTicks;
+
+    u64 NsFromNewer = mul_u64_u64_shr(abs(TicksFromNewer), NsPerTick, 24);
+
+    u64 PtsNs = OldestSamplePtr->HostNs + NewerNs;
+
+    *HostNsPtr = (TicksFromNewer < 0) ? PtsNs - NsFromNewer : PtsNs + NsFromNewer;
+
+    return true;
+}
+
+//***********************************************************************************************
+
+// Streaming statistics functions
+//***********************************************************************************************
+
+// Bump the counter for a failed isochronous packet's status.
+static void TomUsbCamCountPacketError(struct StreamCountersStruct __percpu *CountersPtr, int Status)
+{
+
+    int StatusIdx;
+
+    // Falls out of the loop at TOM_USB_CAM_NUM_PACKET_ERROR_STATUSES, the "other" counter, if the status isn't listed.
+    for (StatusIdx = 0; StatusIdx < TOM_USB_CAM_NUM_PACKET_ERROR_STATUSES; StatusIdx++)
+    {
+
+        if (PacketErrorStatusTable[StatusIdx].Status == Status)
+        {
+            break;
+        }
+    }
+
+    this_cpu_inc(CountersPtr->PacketErrors[StatusIdx]);
+}
+
+// Called at the start of every frame the camera sends, whether or not there is a buffer for it. Keeps a moving
+// average of the time between frames that weighs the latest one by 1/8, which settles within a second or so.
+static void TomUsbCamMeasureFrameInterval(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr)
+{
+
+    struct StreamStatsStruct *StreamStatsPtr = &TomUsbCamCtrlIntfDevStructPtr->StreamStatsForThisCameraStruct;
+
+    u64 NowNs = ktime_get_ns();
+
+    if (StreamStatsPtr->LastFrameStartNs)
+    {
+
+        u64 IntervalNs = NowNs - StreamStatsPtr->LastFrameStartNs;
+
+        u64 AverageNs = StreamStatsPtr->FrameIntervalNs;
+
+        AverageNs = AverageNs ? AverageNs - (AverageNs >> 3) + (IntervalNs >> 3) : IntervalNs;
+
+        // The fps file reads this without any lock.
+        WRITE_ONCE(StreamStatsPtr->FrameIntervalNs, AverageNs);
+    }
+
+    StreamStatsPtr->LastFrameStartNs = NowNs;
+}
+
+// The frame rate starts over with every stream, so a stopped camera reads 0 fps.
+static void TomUsbCamResetFrameInterval(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr)
+{
+
+    TomUsbCamCtrlIntfDevStructPtr->StreamStatsForThisCameraStruct.LastFrameStartNs = 0;
+
+    WRITE_ONCE(TomUsbCamCtrlIntfDevStructPtr->StreamStatsForThisCameraStruct.FrameIntervalNs, 0);
+}
+
+// Read callback of every counter file. DataPtr is the per cpu address of one StreamCountersStruct field, and the value
+// is the sum of it over all the cpus. A counter may be bumped while it is being added up, which is fine for statistics.
+static int TomUsbCamGetStatsCounter(void *DataPtr, u64 *ValuePtr)
+{
+
+    u64 __percpu *CounterPtr = (u64 __force __percpu *) DataPtr;
+
+    u64 Sum = 0;
+
+    int Cpu;
+
+    for_each_possible_cpu(Cpu)
+    {
+        Sum += *per_cpu_ptr(CounterPtr, Cpu);
+    }
+
+    *ValuePtr = Sum;
+
+    return 0;
+}
+
+static int TomUsbCamShowFps(struct seq_file *SeqFilePtr, void *UnusedPtr)
+{
+
+    struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr = SeqFilePtr->private;
+
+    u64 IntervalNs = READ_ONCE(TomUsbCamCtrlIntfDevStructPtr->StreamStatsForThisCameraStruct.FrameIntervalNs);
+
+    // Hundredths of a frame per second, rounded.
+    u64 CentiFps = IntervalNs ? div64_u64(100 * NSEC_PER_SEC + IntervalNs / 2, IntervalNs) : 0;
+
+    seq_printf(SeqFilePtr, "%llu.%02llu\n", CentiFps / 100, CentiFps % 100);
+
+    return 0;
+}
+
+static int TomUsbCamOpenFps(struct inode *InodePtr, struct file *FilePtr)
+{
+    return single_open(FilePtr, TomUsbCamShowFps, InodePtr->i_private);
+}
+
+// Add one latency to its log2 histogram. A latency that comes out negative, e.g. a Pts the clock recovery put a little
+// in the future, counts as 0.
+static void TomUsbCamRecordLatency(struct StreamCountersStruct __percpu *CountersPtr, int Latency, u64 StartNs, u64 EndNs)
+{
+
+    u64 LatencyUs = (EndNs > StartNs) ? div_u64(EndNs - StartNs, NSEC_PER_USEC) : 0;
+
+    int BucketIdx = LatencyUs ? min(ilog2(LatencyUs) + 1, TOM_USB_CAM_NUM_LATENCY_BUCKETS - 1) : 0;
+
+    this_cpu_inc(CountersPtr->LatencyBuckets[Latency][BucketIdx]);
+}
+
+// Called just before a buffer goes back to vb2. Only buffers holding a frame count, not ones given back empty when
+// streaming stops.
+static void TomUsbCamRecordBufferDone(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr,
+                                      struct TomUsbCamV4l2VideoBufferContainer *VideoBufferContainerPtr, enum vb2_buffer_state BufferState)
+{
+
+    struct StreamCountersStruct __percpu *CountersPtr = TomUsbCamCtrlIntfDevStructPtr->StreamStatsForThisCameraStruct.CountersPtr;
+
+    if (!VideoBufferContainerPtr->EofNs || (BufferState == VB2_BUF_STATE_QUEUED))
+    {
+        return;
+    }
+
+    u64 NowNs = ktime_get_ns();
+
+    TomUsbCamRecordLatency(CountersPtr, TOM_USB_CAM_LATENCY_DELIVERY, VideoBufferContainerPtr->EofNs, NowNs);
+
+    if (VideoBufferContainerPtr->PtsHostNs)
+    {
+        TomUsbCamRecordLatency(CountersPtr, TOM_USB_CAM_LATENCY_PTS, VideoBufferContainerPtr->PtsHostNs, NowNs);
+    }
+
+    // Set before vb2_buffer_done(), as user space may dequeue the buffer straight away.
+    VideoBufferContainerPtr->DoneNs = NowNs;
+}
+
+// Print a latency histogram like the bcc tools do, from bucket 0 up to the last one with anything in it. The private
+// data is the per cpu address of the histogram's buckets.
+static int TomUsbCamShowLatency(struct seq_file *SeqFilePtr, void *UnusedPtr)
+{
+
+    u64 __percpu *BucketsPtr = (u64 __force __percpu *) SeqFilePtr->private;
+
+    u64 BucketCounts[TOM_USB_CAM_NUM_LATENCY_BUCKETS] = { 0 };
+
+    int LastBucketIdx = -1;
+
+    for (int BucketIdx = 0; BucketIdx < TOM_USB_CAM_NUM_LATENCY_BUCKETS; BucketIdx++)
+    {
+
+        int Cpu;
+
+        for_each_possible_cpu(Cpu)
+        {
+            BucketCounts[BucketIdx] += *per_cpu_ptr(BucketsPtr + BucketIdx, Cpu);
+        }
+
+        if (BucketCounts[BucketIdx])
+        {
+            LastBucketIdx = BucketIdx;
+        }
+    }
+
+    seq_printf(SeqFilePtr, "%24s : count\n", "usecs");
+
+    for (int BucketIdx = 0; BucketIdx <= LastBucketIdx; BucketIdx++)
+    {
+
+        u64 LowUs = BucketIdx ? 1ULL << (BucketIdx - 1) : 0;
+
+        if (BucketIdx == TOM_USB_CAM_NUM_LATENCY_BUCKETS - 1)
+        {
+            seq_printf(SeqFilePtr, "%10llu -> %-10s : %llu\n", LowUs, "...", BucketCounts[BucketIdx]);
+        }
+        else
+        {
+            seq_printf(SeqFilePtr, "%10llu -> %-10llu : %llu\n", LowUs, 1ULL << BucketIdx, BucketCounts[BucketIdx]);
+        }
+    }
+
+    return 0;
+}
+
+static int TomUsbCamOpenLatency(struct inode *InodePtr, struct file *FilePtr)
+{
+    return single_open(FilePtr, TomUsbCamShowLatency, InodePtr->i_private);
+}
+
+// Create /sys/kernel/debug/TomUsbCam/<camera index>/ once the camera is up. The directory is named after the index of
+// the per-camera module parameters, which the cameras parameter lists next to the video node. Nothing here can make
+// the probe fail, debugfs just ignores files it couldn't create a directory for.
+static void TomUsbCamCreateDebugfs(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr)
+{
+
+    struct StreamStatsStruct *StreamStatsPtr = &TomUsbCamCtrlIntfDevStructPtr->StreamStatsForThisCameraStruct;
+
+    struct StreamCountersStruct __percpu *CountersPtr = StreamStatsPtr->CountersPtr;
+
+    char DirName[12];
+
+    snprintf(DirName, sizeof(DirName), "%d", TomUsbCamCtrlIntfDevStructPtr->DeviceStructPtr->DeviceIdx);
+
+    StreamStatsPtr->DebugfsDirPtr = debugfs_create_dir(DirName, TomUsbCamDebugfsRootPtr);
+
+    struct dentry *DirPtr = StreamStatsPtr->DebugfsDirPtr;
+
+    // The counter files carry the per cpu address of their field, see TomUsbCamGetStatsCounter().
+    debugfs_create_file_unsafe("urbs_completed", 0444, DirPtr, (void __force *) &CountersPtr->UrbsCompleted, &TomUsbCamStatsCounterFops);
+    debugfs_create_file_unsafe("urbs_resubmitted", 0444, DirPtr, (void __force *) &CountersPtr->UrbsResubmitted, &TomUsbCamStatsCounterFops);
+    debugfs_create_file_unsafe("bytes_received", 0444, DirPtr, (void __force *) &CountersPtr->BytesReceived, &TomUsbCamStatsCounterFops);
+    debugfs_create_file_unsafe("frames_completed", 0444, DirPtr, (void __force *) &CountersPtr->FramesCompleted, &TomUsbCamStatsCounterFops);
+    debugfs_create_file_unsafe("frames_errored", 0444, DirPtr, (void __force *) &CountersPtr->FramesErrored, &TomUsbCamStatsCounterFops);
+    debugfs_create_file_unsafe("frames_dropped", 0444, DirPtr, (void __force *) &CountersPtr->FramesDropped, &TomUsbCamStatsCounterFops);
+    debugfs_create_file_unsafe("queue_underruns", 0444, DirPtr, (void __force *) &CountersPtr->QueueUnderruns, &TomUsbCamStatsCounterFops);
+
+    // One file per packet status in packet_errors/.
+    struct dentry *PacketErrorsDirPtr = debugfs_create_dir("packet_errors", DirPtr);
+
+    for (int StatusIdx = 0; StatusIdx <= TOM_USB_CAM_NUM_PACKET_ERROR_STATUSES; StatusIdx++)
+    {
+
+        const char *FileName = (StatusIdx < TOM_USB_CAM_NUM_PACKET_ERROR_STATUSES) ? PacketErrorStatusTable[StatusIdx].Name : "other";
+
+        debugfs_create_file_unsafe(FileName, 0444, PacketErrorsDirPtr, (void __force *) &CountersPtr->PacketErrors[StatusIdx],
+                                   &TomUsbCamStatsCounterFops);
+    }
+
+    // One log2 histogram per latency in latency/, counted since the camera was plugged in. These cover the driver's
+    // part of getting a frame to user space without having to trace it.
+    struct dentry *LatencyDirPtr = debugfs_create_dir("latency", DirPtr);
+
+    for (int Latency = 0; Latency < TOM_USB_CAM_NUM_LATENCIES; Latency++)
+    {
+        debugfs_create_file(LatencyNameTable[Latency], 0444, LatencyDirPtr, (void __force *) CountersPtr->LatencyBuckets[Latency],
+                            &TomUsbCamStatsLatencyFops);
     }
-                                     
-    EnableCamera(UsbDevStructPtr);                                         
 
-    return BytesRcvdOrErrorCode;
+    debugfs_create_file("fps", 0444, DirPtr, TomUsbCamCtrlIntfDevStructPtr, &TomUsbCamStatsFpsFops);
+    debugfs_create_u8("alt_setting", 0444, DirPtr, &StreamStatsPtr->AltSetting);
 }
 
-// EnableCamera() & DisableCamera() are helper functions to start and stop streaming since 
-// this is a common occurence, e.g. any time a camera parameter is updated.
-static int EnableCamera(struct usb_device *UsbDevStructPtr)
+// Called at disconnect, before the struct the files point into goes away.
+static void TomUsbCamRemoveDebugfs(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr)
 {
-    
-    int BytesRcvdOrErrorCode = WriteToCamera(UsbDevStructPtr,
-                                             SetInterfaceRequest,
-                                             StandardTypeRequestType,
-                                             InterfaceRecipientRequestType,
-                                             OperationalInterfaceValue,
-                                             0x0,
-                                             InterfaceVideoStreamingIndex,
-                                             NULL,
-                                             0x0,
-                                             FiveSecTimeoutInMsecs);
-                               
-    return BytesRcvdOrErrorCode;
-}
 
-static int DisableCamera(struct usb_device *UsbDevStructPtr)
-{
+    debugfs_remove_recursive(TomUsbCamCtrlIntfDevStructPtr->StreamStatsForThisCameraStruct.DebugfsDirPtr);
 
-    int BytesRcvdOrErrorCode = WriteToCamera(UsbDevStructPtr,
-                                             SetInterfaceRequest,
-                                             StandardTypeRequestType,
-                                             InterfaceRecipientRequestType,
-                                             ZeroBandwidthInterfaceValue,
-                                             0x0,
-                                             InterfaceVideoStreamingIndex,
-                                             NULL,
-                                             0x0,
-                                             FiveSecTimeoutInMsecs);
-                  
-    return BytesRcvdOrErrorCode;
+    TomUsbCamCtrlIntfDevStructPtr->StreamStatsForThisCameraStruct.DebugfsDirPtr = NULL;
 }
 
-// Save a list of structs containing all the Usb descriptor information.
-static int SaveAllDescriptors(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr)
+//***********************************************************************************************
+
+// Device registry functions
+//***********************************************************************************************
+
+// Find the struct of the camera this interface belongs to, or create it if this is the camera's 1st interface.
+// Returns it with a reference held for the caller, or NULL if it couldn't be allocated.
+static struct TomUsbCamDeviceStruct *TomUsbCamGetDevice(struct usb_interface *UsbDevInterfaceStructPtr)
 {
 
-    // Tom see section 2.3.4.7 of [6] & 3.7.2.5 of [5] for querying the camera capabilites before attempting
-    // to set their values.
-    
-    // Per [4], querying the configuration descriptor also returns all the interface and endpoint descriptors.
-    // First get the combined descriptors length, which is cotained in bytes 3 & 4 of the configuration descriptor.
-    unsigned char *DescriptorSizePtr = kzalloc(4, GFP_NOIO);
-
-    ReadFromCamera(TomUsbCamCtrlIntfDevStructPtr->UsbDevStructPtr,
-                   GetStandardDescriptorRequest,
-                   StandardTypeRequestType,
-                   DeviceRecipientRequestType,
-                   GetDescriptorConfigurationValue,
-                   0x0,
-                   0x0,
-                   DescriptorSizePtr,
-                   0x4,
-                   FiveSecTimeoutInMsecs);
-                   
-    int AllDescriptorsPacketLen = (int16_t) (DescriptorSizePtr[2] | DescriptorSizePtr[3] << 8);                   
-                   
-    kfree(DescriptorSizePtr);
-    
-    // Now read all the descriptors now that we know the length.
-    unsigned char *AllDescriptorsPtr = kzalloc(AllDescriptorsPacketLen, GFP_NOIO);
-    
-    ReadFromCamera(TomUsbCamCtrlIntfDevStructPtr->UsbDevStructPtr,
-                   GetStandardDescriptorRequest,
-                   StandardTypeRequestType,
-                   DeviceRecipientRequestType,
-                   GetDescriptorConfigurationValue,
-                   0x0,
-                   0x0,
-                   AllDescriptorsPtr,
-                   AllDescriptorsPacketLen,
-                   FiveSecTimeoutInMsecs);
-                   
-    int CurrentDescriptorsPacketLoc = 0;
-    int ConfigurationDescriptorStructTotalCount = 0;
-    int InterfaceDescriptorStructTotalCount = 0;
-    int EndpointDescriptorStructTotalCount = 0;
-    int VideoDescriptorStructTotalCount = 0;
-    
-    // Parse all the descriptors into their appropriate structs.
-    // First figure out the descriptor count in each catergory for memory allocation.
-    while (CurrentDescriptorsPacketLoc < AllDescriptorsPacketLen)
+    struct usb_device *UsbDevStructPtr = interface_to_usbdev(UsbDevInterfaceStructPtr);
+    struct TomUsbCamDeviceStruct *TomUsbCamDeviceStructPtr;
+
+    mutex_lock(&TomUsbCamDeviceListLock);
+
+    list_for_each_entry(TomUsbCamDeviceStructPtr, &TomUsbCamDeviceListHead, DeviceListHead)
     {
-                
-        // bLength & bDescriptorType are always the first 2 bytes.
-        uint8_t bLength = AllDescriptorsPtr[CurrentDescriptorsPacketLoc];
-        uint8_t bDescriptorType = AllDescriptorsPtr[CurrentDescriptorsPacketLoc + 1];
 
-        // Only save the configuration, interface, endpoint and VideoControl descriptors for now.
-        if (bDescriptorType == DescriptorTypeConfiguration)
-        {
-            ConfigurationDescriptorStructTotalCount += 1;
-        }
-        
-        if (bDescriptorType == DescriptorTypeInterface)
+        if (TomUsbCamDeviceStructPtr->UsbDevStructPtr == UsbDevStructPtr)
         {
-            InterfaceDescriptorStructTotalCount += 1;
+
+            kref_get(&TomUsbCamDeviceStructPtr->KernelRefCountStruct);
+
+            mutex_unlock(&TomUsbCamDeviceListLock);
+
+            return TomUsbCamDeviceStructPtr;
         }
-        
-        if (bDescriptorType == DescriptorTypeEndpoint)
-        {
-            EndpointDescriptorStructTotalCount += 1;
-        }        
-        
-        if (bDescriptorType == DescriptorTypeVideoInterface)
-        {
-            VideoDescriptorStructTotalCount += 1;
-        }   
-        
-        CurrentDescriptorsPacketLoc += bLength;
     }
-    
-    // Allocate memory for all the structs. Note that (sizeof *x) is the the dereferenced size, i.e. the size
-    // of the struct, not the size of the pointer. See:
-    // https://stackoverflow.com/questions/10468128/how-do-you-make-an-array-of-structs-in-c#answer-24542015
-    TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.ConfigurationDescriptorStructPtr = 
-        kzalloc(ConfigurationDescriptorStructTotalCount * 
-                sizeof *TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.ConfigurationDescriptorStructPtr, 
-                GFP_NOIO);
-        
-    TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.InterfaceDescriptorStructPtr = 
-        kzalloc(InterfaceDescriptorStructTotalCount * 
-                sizeof *TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.InterfaceDescriptorStructPtr, 
-                GFP_NOIO);   
-        
-    TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.EndpointDescriptorStructPtr = 
-        kzalloc(EndpointDescriptorStructTotalCount * 
-                sizeof *TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.EndpointDescriptorStructPtr, 
-                GFP_NOIO);  
-                        
-    TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.VideoInterfaceDescriptorStructPtr = 
-        kzalloc(VideoDescriptorStructTotalCount *
-                sizeof *TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.VideoInterfaceDescriptorStructPtr, 
-                GFP_NOIO);                           
-
-    // Reset the packet location for the 2nd iteration to actually divy up the descriptors.
-    // Remember to add offsets for the parent struct association numbers when performing memcpy().
-    // It seems everything is reported in order, such that each parent config is followed by its children
-    // interface and endpoint descriptors. Rely on this to make all of the associations.
-    CurrentDescriptorsPacketLoc = 0;
-    uint8_t ConfigurationDescriptorStructCount = 0;
-    uint8_t InterfaceDescriptorStructCount = 0;
-    uint8_t EndpointDescriptorStructCount = 0;
-    uint8_t VideoDescriptorStructCount = 0;
-    
-    uint8_t CurrentConfiguration = 0;
-    uint8_t CurrentParentInterfaceInterfaceNumber = 0;
-    uint8_t CurrentParentInterfaceAlternateSetting = 0;
-    
-    while (CurrentDescriptorsPacketLoc < AllDescriptorsPacketLen)
+
+    TomUsbCamDeviceStructPtr = kzalloc(sizeof(*TomUsbCamDeviceStructPtr), GFP_KERNEL);
+
+    if (TomUsbCamDeviceStructPtr)
     {
-                
-        // bLength & bDescriptorType are always the first 2 bytes.
-        uint8_t bLength = AllDescriptorsPtr[CurrentDescriptorsPacketLoc];
-        uint8_t bDescriptorType = AllDescriptorsPtr[CurrentDescriptorsPacketLoc + 1];
-        
-        // You could use memcpy() to fill all these structs but I am assigning explicit bytes when a struct has uint16_t's
-        // due to byte-ordering of the uint16_t and also struct padding problems from the compiler. See:
-        // https://stackoverflow.com/questions/58633342/c-memcpy-to-struct-allocation
-        if (bDescriptorType == DescriptorTypeConfiguration)
-        {
 
-            TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.ConfigurationDescriptorStructPtr[ConfigurationDescriptorStructCount].bLength = 
-                AllDescriptorsPtr[CurrentDescriptorsPacketLoc];
-                   
-            TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.ConfigurationDescriptorStructPtr[ConfigurationDescriptorStructCount].bDescriptorType = 
-                AllDescriptorsPtr[CurrentDescriptorsPacketLoc + 1];                   
-                   
-            // Fix the reverse byte ordering for 2-byte values (uint16_t).
-            TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.ConfigurationDescriptorStructPtr[ConfigurationDescriptorStructCount].wTotalLength = 
-                (AllDescriptorsPtr[CurrentDescriptorsPacketLoc + 2] | (AllDescriptorsPtr[CurrentDescriptorsPacketLoc + 3] << 8));
+        kref_init(&TomUsbCamDeviceStructPtr->KernelRefCountStruct);
 
-            TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.ConfigurationDescriptorStructPtr[ConfigurationDescriptorStructCount].bNumInterfaces = 
-                AllDescriptorsPtr[CurrentDescriptorsPacketLoc + 4];  
-                
-            TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.ConfigurationDescriptorStructPtr[ConfigurationDescriptorStructCount].bConfigurationValue = 
-                AllDescriptorsPtr[CurrentDescriptorsPacketLoc + 5];  
-                
-            TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.ConfigurationDescriptorStructPtr[ConfigurationDescriptorStructCount].iConfiguration = 
-                AllDescriptorsPtr[CurrentDescriptorsPacketLoc + 6];  
-                
-            TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.ConfigurationDescriptorStructPtr[ConfigurationDescriptorStructCount].bmAttributes = 
-                AllDescriptorsPtr[CurrentDescriptorsPacketLoc + 7];
-                
-            TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.ConfigurationDescriptorStructPtr[ConfigurationDescriptorStructCount].bMaxPower = 
-                AllDescriptorsPtr[CurrentDescriptorsPacketLoc + 8];                                                                  
+        TomUsbCamDeviceStructPtr->UsbDevStructPtr = usb_get_dev(UsbDevStructPtr);
 
-            CurrentConfiguration = 
-                TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.ConfigurationDescriptorStructPtr[ConfigurationDescriptorStructCount].bConfigurationValue;
+        // The list is short, so just try each index until one is free.
+        bool DeviceIdxInUse = true;
 
-            ConfigurationDescriptorStructCount += 1;         
-        }
-        
-        if (bDescriptorType == DescriptorTypeInterface)
+        for (TomUsbCamDeviceStructPtr->DeviceIdx = 0; DeviceIdxInUse; )
         {
-        
-            TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.InterfaceDescriptorStructPtr[InterfaceDescriptorStructCount].ConfigurationAssoc = 
-                CurrentConfiguration;
-        
-            memcpy(&TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.InterfaceDescriptorStructPtr[InterfaceDescriptorStructCount].bLength, 
-                   &AllDescriptorsPtr[CurrentDescriptorsPacketLoc], 
-                   bLength);
 
-            CurrentParentInterfaceInterfaceNumber = 
-                TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.InterfaceDescriptorStructPtr[InterfaceDescriptorStructCount].bInterfaceNumber;
+            struct TomUsbCamDeviceStruct *OtherDeviceStructPtr;
 
-            CurrentParentInterfaceAlternateSetting = 
-                TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.InterfaceDescriptorStructPtr[InterfaceDescriptorStructCount].bAlternateSetting;
+            DeviceIdxInUse = false;
 
-            InterfaceDescriptorStructCount += 1;         
-        }  
-        
-        if (bDescriptorType == DescriptorTypeEndpoint)
-        {
-        
-            TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.EndpointDescriptorStructPtr[EndpointDescriptorStructCount].ConfigurationAssoc = 
-                CurrentConfiguration;
-                
-            TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.EndpointDescriptorStructPtr[EndpointDescriptorStructCount].ParentInterfaceAssoc = 
-                CurrentParentInterfaceInterfaceNumber;   
-                
-            TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.EndpointDescriptorStructPtr[EndpointDescriptorStructCount].AlternateSettingAssoc = 
-                CurrentParentInterfaceAlternateSetting;                                  
+            list_for_each_entry(OtherDeviceStructPtr, &TomUsbCamDeviceListHead, DeviceListHead)
+            {
 
-           TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.EndpointDescriptorStructPtr[EndpointDescriptorStructCount].bLength = 
-                AllDescriptorsPtr[CurrentDescriptorsPacketLoc + 0];
-                
-           TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.EndpointDescriptorStructPtr[EndpointDescriptorStructCount].bDescriptorType = 
-                AllDescriptorsPtr[CurrentDescriptorsPacketLoc + 1];
-                
-           TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.EndpointDescriptorStructPtr[EndpointDescriptorStructCount].bEndpointAddress = 
-                AllDescriptorsPtr[CurrentDescriptorsPacketLoc + 2];
-                
-           TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.EndpointDescriptorStructPtr[EndpointDescriptorStructCount].bmAttributes = 
-                AllDescriptorsPtr[CurrentDescriptorsPacketLoc + 3];                                                
-           
-           // Fix the byte ordering for uint16_t
-           TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.EndpointDescriptorStructPtr[EndpointDescriptorStructCount].wMaxPacketSize = 
-                (AllDescriptorsPtr[CurrentDescriptorsPacketLoc + 4] | (AllDescriptorsPtr[CurrentDescriptorsPacketLoc + 5] << 8));
-                
-           TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.EndpointDescriptorStructPtr[EndpointDescriptorStructCount].bInterval = 
-                AllDescriptorsPtr[CurrentDescriptorsPacketLoc + 6];
+                if (OtherDeviceStructPtr->DeviceIdx == TomUsbCamDeviceStructPtr->DeviceIdx)
+                {
 
-            EndpointDescriptorStructCount += 1;         
-        } 
-        
-        if (bDescriptorType == DescriptorTypeVideoInterface)
-        {
-        
-            TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.VideoInterfaceDescriptorStructPtr[VideoDescriptorStructCount].ConfigurationAssoc = 
-                CurrentConfiguration;
-                
-            TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.VideoInterfaceDescriptorStructPtr[VideoDescriptorStructCount].ParentInterfaceAssoc = 
-                CurrentParentInterfaceInterfaceNumber;          
-        
-            // Only the 1st 3 fields (bytes) are consistent for the VideoControl descriptors.        
-            memcpy(&TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.VideoInterfaceDescriptorStructPtr[VideoDescriptorStructCount].bLength, 
-                   &AllDescriptorsPtr[CurrentDescriptorsPacketLoc], 
-                   3);
-                   
-            TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.VideoInterfaceDescriptorStructPtr[VideoDescriptorStructCount].VarData = 
-                kzalloc(bLength - 3, GFP_NOIO);                      
-                                     
-            memcpy(&TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.VideoInterfaceDescriptorStructPtr[VideoDescriptorStructCount].VarData[0], 
-                   &AllDescriptorsPtr[CurrentDescriptorsPacketLoc + 3], 
-                   (bLength - 3));
+                    DeviceIdxInUse = true;
+                    TomUsbCamDeviceStructPtr->DeviceIdx++;
+                    break;
+                }
+            }
+        }
 
-           VideoDescriptorStructCount += 1;         
-        }                        
-        
-        CurrentDescriptorsPacketLoc += bLength;
+        // e.g. "usb-0000:00:14.0-2", i.e. the host controller followed by the port path.
+        usb_make_path(UsbDevStructPtr, TomUsbCamDeviceStructPtr->BusInfo, sizeof(TomUsbCamDeviceStructPtr->BusInfo));
+
+        list_add_tail(&TomUsbCamDeviceStructPtr->DeviceListHead, &TomUsbCamDeviceListHead);
     }
-    
-    // Keep track of the counts to avoid having to constantly re-querying the device.
-    TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.ConfigurationDescriptorStructCount = ConfigurationDescriptorStructCount;
-    TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.InterfaceDescriptorStructCount = InterfaceDescriptorStructCount;
-    TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.EndpointDescriptorStructCount = EndpointDescriptorStructCount;
-    TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.VideoDescriptorStructCount = VideoDescriptorStructCount;
 
-    kfree(AllDescriptorsPtr);                
-    
-    return 0;                  
+    mutex_unlock(&TomUsbCamDeviceListLock);
+
+    return TomUsbCamDeviceStructPtr;
 }
 
-// Return a user-requested descriptor so the user can extract whatever values they want. Configurations are only 
-// enumerated by their index. It seems their is only ever one configuration descriptor for cameras anyways.
-static void GetConfigurationDescriptorStruct(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr, uint8_t DescriptorIndex, 
-                                             struct ConfigurationDescriptorStruct **ConfigurationDescriptorStructPtr, int8_t *DescriptorReadSuccess)
+static void TomUsbCamPutDevice(struct TomUsbCamDeviceStruct *TomUsbCamDeviceStructPtr)
 {
+    kref_put_mutex(&TomUsbCamDeviceStructPtr->KernelRefCountStruct, TomUsbCamDeviceDelete, &TomUsbCamDeviceListLock);
+}
 
-    *DescriptorReadSuccess = -1;     
+// Called with TomUsbCamDeviceListLock held once both interfaces are gone.
+static void TomUsbCamDeviceDelete(struct kref *KernelRefCountStructPtr)
+{
 
-    if (DescriptorIndex < TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.ConfigurationDescriptorStructCount)
-    {
+    struct TomUsbCamDeviceStruct *TomUsbCamDeviceStructPtr =
+        container_of(KernelRefCountStructPtr, struct TomUsbCamDeviceStruct, KernelRefCountStruct);
 
-        *ConfigurationDescriptorStructPtr = &TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.ConfigurationDescriptorStructPtr[DescriptorIndex];
+    list_del(&TomUsbCamDeviceStructPtr->DeviceListHead);
 
-        *DescriptorReadSuccess = 1;
-    }
+    mutex_unlock(&TomUsbCamDeviceListLock);
+
+    usb_put_dev(TomUsbCamDeviceStructPtr->UsbDevStructPtr);
+    kfree(TomUsbCamDeviceStructPtr);
 }
 
-static void GetInterfaceDescriptorStruct(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr, uint8_t DescriptorIndex,
-                                         struct InterfaceDescriptorStruct **InterfaceDescriptorStructPtr, int8_t *DescriptorReadSuccess)
+// Publish a successfully probed interface. Pass NULL for the other one.
+static void TomUsbCamAttachInterface(struct TomUsbCamDeviceStruct *TomUsbCamDeviceStructPtr,
+                                     struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr,
+                                     struct TomUsbCamIsochronousInputDevStruct *TomUsbCamIsochronousInputDevStructPtr)
 {
 
-    *DescriptorReadSuccess = -1;
-    
-    if (DescriptorIndex < TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.InterfaceDescriptorStructCount)
+    mutex_lock(&TomUsbCamDeviceListLock);
+
+    if (TomUsbCamCtrlIntfDevStructPtr)
     {
+        TomUsbCamDeviceStructPtr->CtrlIntfDevStructPtr = TomUsbCamCtrlIntfDevStructPtr;
+    }
 
-        *InterfaceDescriptorStructPtr = &TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.InterfaceDescriptorStructPtr[DescriptorIndex];
+    if (TomUsbCamIsochronousInputDevStructPtr)
+    {
+        TomUsbCamDeviceStructPtr->IsochronousInputDevStructPtr = TomUsbCamIsochronousInputDevStructPtr;
+    }
 
-        *DescriptorReadSuccess = 1;
-    }    
+    mutex_unlock(&TomUsbCamDeviceListLock);
 }
 
-static void GetEndpointDescriptorStruct(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr, uint8_t ParentInterfaceAssoc,
-                                        uint8_t AlternateSettingAssoc, struct EndpointDescriptorStruct **EndpointDescriptorStructPtr, 
-                                        int8_t *DescriptorReadSuccess)
+static void TomUsbCamDetachInterface(struct TomUsbCamDeviceStruct *TomUsbCamDeviceStructPtr, bool IntfIsForCtrl)
 {
 
-    *DescriptorReadSuccess = -1;
-    
-    // Loop through all of the endpoint descriptors looking for the matching parent and alternate setting numbers instead of using
-    // an endpoint index.
-    for (int idx = 0; idx < TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.EndpointDescriptorStructCount; idx++)
-    {
-
-        if ((ParentInterfaceAssoc == TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.EndpointDescriptorStructPtr[idx].ParentInterfaceAssoc) &&
-            (AlternateSettingAssoc == TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.EndpointDescriptorStructPtr[idx].AlternateSettingAssoc))
-        {
+    mutex_lock(&TomUsbCamDeviceListLock);
 
-            *EndpointDescriptorStructPtr = &TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.EndpointDescriptorStructPtr[idx];
-            
-            *DescriptorReadSuccess = 1;  
-        }
+    if (IntfIsForCtrl)
+    {
+        TomUsbCamDeviceStructPtr->CtrlIntfDevStructPtr = NULL;
+    }
+    else
+    {
+        TomUsbCamDeviceStructPtr->IsochronousInputDevStructPtr = NULL;
     }
+
+    mutex_unlock(&TomUsbCamDeviceListLock);
 }
 
-static void GetVideoInterfaceDescriptorStruct(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr, uint8_t ParentInterfaceAssoc,
-                                              uint8_t VideoInterfaceSubtype, struct VideoInterfaceDescriptorStruct **VideoInterfaceDescriptorStructPtr, 
-                                              int8_t *DescriptorReadSuccess)
+// Get this camera's streaming interface with a reference held, or NULL if it isn't attached (any more).
+static struct TomUsbCamIsochronousInputDevStruct *TomUsbCamGetStreamingInterface(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr)
 {
 
-    *DescriptorReadSuccess = -1;
-    
-    // Loop through all of the video interface descriptors looking for the matching parent number and video interface subtype instead of using
-    // a video interface index.
-    for (int idx = 0; idx < TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.VideoDescriptorStructCount; idx++)
-    {        
-        
-        if ((ParentInterfaceAssoc == TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.VideoInterfaceDescriptorStructPtr[idx].ParentInterfaceAssoc) &&
-            (VideoInterfaceSubtype == TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.VideoInterfaceDescriptorStructPtr[idx].bDescriptorSubtype))
-        {
+    struct TomUsbCamIsochronousInputDevStruct *TomUsbCamIsochronousInputDevStructPtr;
 
-            *VideoInterfaceDescriptorStructPtr = &TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.VideoInterfaceDescriptorStructPtr[idx];
-            
-            *DescriptorReadSuccess = 1;  
-        }                
+    mutex_lock(&TomUsbCamDeviceListLock);
+
+    TomUsbCamIsochronousInputDevStructPtr = TomUsbCamCtrlIntfDevStructPtr->DeviceStructPtr->IsochronousInputDevStructPtr;
+
+    if (TomUsbCamIsochronousInputDevStructPtr)
+    {
+        kref_get(&TomUsbCamIsochronousInputDevStructPtr->KernelRefCountStruct);
     }
-}
 
-// V4l2-specific functions for the queue
-//***********************************************************************************************
+    mutex_unlock(&TomUsbCamDeviceListLock);
 
-// Check the camera to see if a packed/interleaved format or planar format is used. "NumImagePlanes" will
-// be "1" for an interleaved format. See:
-// "Other videobuf2 callbacks" here: https://lwn.net/Articles/447435/
-// Since we're using yuyv for this camera, which is a a packed format, NumImagePlanes == 1.
-static int TomUsbCamV4l2QueueSetup(struct vb2_queue *VideoBufferQueue,
-		                           unsigned int *NumBuffers, unsigned int *NumImagePlanes,
-		                           unsigned int ImageSizes[], struct device *alloc_devs[])
+    return TomUsbCamIsochronousInputDevStructPtr;
+}
+
+// One line per attached camera for /sys/module/TomUsbCam/parameters/cameras, e.g.
+// "0 video2 bus 1 0000:00:14.0 usb-0000:00:14.0-2". A camera whose control interface isn't probed shows "-".
+static int TomUsbCamGetCameras(char *Buffer, const struct kernel_param *KernelParamPtr)
 {
 
-    // The pointer to the containing struct was previously saved in this struct's "private data" section.
-    struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr = vb2_get_drv_priv(VideoBufferQueue);
+    struct TomUsbCamDeviceStruct *TomUsbCamDeviceStructPtr;
+    int BufferLen = 0;
 
+    mutex_lock(&TomUsbCamDeviceListLock);
 
-    // tom continue following "queue_setup()" function here
-    
-    return -1;
-}
+    list_for_each_entry(TomUsbCamDeviceStructPtr, &TomUsbCamDeviceListHead, DeviceListHead)
+    {
 
-// Tom this is a stub for now
-static int buffer_prepare(struct vb2_buffer *vb)
-{
-    return -1;
-}
+        struct usb_bus *UsbBusPtr = TomUsbCamDeviceStructPtr->UsbDevStructPtr->bus;
 
-// Tom this is a stub for now
-static void buffer_queue(struct vb2_buffer *vb)
-{
-    return;
-}
+        if (TomUsbCamDeviceStructPtr->CtrlIntfDevStructPtr)
+        {
+            BufferLen += scnprintf(&Buffer[BufferLen], PAGE_SIZE - BufferLen, "%d video%d", TomUsbCamDeviceStructPtr->DeviceIdx,
+                                   TomUsbCamDeviceStructPtr->CtrlIntfDevStructPtr->VideoDevice.num);
+        }
+        else
+        {
+            BufferLen += scnprintf(&Buffer[BufferLen], PAGE_SIZE - BufferLen, "%d -", TomUsbCamDeviceStructPtr->DeviceIdx);
+        }
 
-// Tom this is a stub for now
-static int start_streaming(struct vb2_queue *vq, unsigned int count)
-{
-    return -1;
+        BufferLen += scnprintf(&Buffer[BufferLen], PAGE_SIZE - BufferLen, " bus %d %s %s %u\n", UsbBusPtr->busnum, UsbBusPtr->bus_name,
+                               TomUsbCamDeviceStructPtr->BusInfo, TomUsbCamDeviceStructPtr->ReservedBandwidth);
+    }
+
+    mutex_unlock(&TomUsbCamDeviceListLock);
+
+    return BufferLen;
 }
 
-// Tom this is a stub for now
-static void stop_streaming(struct vb2_queue *vb)
+// A camera's entry of a per-camera module parameter. Cameras past the end of the array get Default, the same as a
+// camera whose entry was left unset.
+static int TomUsbCamDeviceParam(const int *ParamArray, int DeviceIdx, int Default)
 {
-    return;
+    return (DeviceIdx < TOM_USB_CAM_MAX_DEVICES) ? ParamArray[DeviceIdx] : Default;
 }
 
 //***********************************************************************************************
@@ -1658,9 +6510,9 @@ static void TomUsbCamDisconnect(struct usb_interface *UsbDevInterfaceStructPtr)
 
     // Since this disconnect function is called for both the control and isochronous interfaces, figure out which
     // one we are dealing with before proceeding.
-    int NumOfAltSettingsForThisIntf = UsbDevInterfaceStructPtr->num_altsetting;
-        
-    bool IntfIsForCtrl = (NumOfAltSettingsForThisIntf > 1) ? false : true;
+    bool IntfIsForCtrl = (UsbDevInterfaceStructPtr->cur_altsetting->desc.bInterfaceSubClass == VideoControlInterfaceSubclass);
+
+    struct TomUsbCamDeviceStruct *TomUsbCamDeviceStructPtr;
 
 	// Declare both of these structs but only init the one pertinent to this interface.
 	struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr = NULL;
@@ -1675,43 +6527,61 @@ static void TomUsbCamDisconnect(struct usb_interface *UsbDevInterfaceStructPtr)
     
         // Extract the saved interface pointer so the proper reference count can be decremented.
 	    TomUsbCamCtrlIntfDevStructPtr = usb_get_intfdata(UsbDevInterfaceStructPtr);
+
+	    TomUsbCamDeviceStructPtr = TomUsbCamCtrlIntfDevStructPtr->DeviceStructPtr;
+
+	    // The statistics directory is named after the camera's index, so it has to go before the index can be reused. The
+	    // counters themselves stay until the struct is freed, as a stream may still be stopping.
+	    TomUsbCamRemoveDebugfs(TomUsbCamCtrlIntfDevStructPtr);
+
+	    // Then take the camera out of the registry.
+	    TomUsbCamDetachInterface(TomUsbCamDeviceStructPtr, true);
     
         DeviceMinorNum = TomUsbCamCtrlIntfDevStructPtr->VideoDevice.minor;
 	    
 	    // Reset the internally saved user data pointer.
 	    usb_set_intfdata(UsbDevInterfaceStructPtr, NULL);
-	    
-	    // Decrement the total number of kernel reference counts to this device
-	    kref_put(&TomUsbCamCtrlIntfDevStructPtr->KernelRefCountStruct, TomUsbCamCtrlIntfDelete);
-	    
+
         dev_info(&TomUsbCamCtrlIntfDevStructPtr->VideoDevice.dev, "TomUsbCam #%d now disconnected", DeviceMinorNum);
 
-        video_unregister_device(&TomUsbCamCtrlIntfDevStructPtr->VideoDevice);
-	    v4l2_ctrl_handler_free(&TomUsbCamCtrlIntfDevStructPtr->V4l2CtrlHandler);
-	    v4l2_device_unregister(&TomUsbCamCtrlIntfDevStructPtr->V4l2DevStruct);
+#ifdef CONFIG_MEDIA_CONTROLLER
+        media_device_unregister(&TomUsbCamCtrlIntfDevStructPtr->MediaDev);
+#endif
 
-	    // Free all the saved Usb descriptor info
-	    uint8_t VideoDescriptorStructCount = TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.VideoDescriptorStructCount;
-	    
-        for(uint8_t VideoDescriptorStructIdx = 0 ; VideoDescriptorStructIdx < VideoDescriptorStructCount; VideoDescriptorStructIdx++)
-        {
-            kfree(&TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.VideoInterfaceDescriptorStructPtr[VideoDescriptorStructIdx].VarData[0]);	    
-        }
-	    
-        kfree(TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.ConfigurationDescriptorStructPtr);
-        
-        kfree(TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.InterfaceDescriptorStructPtr);   
-        
-        kfree(TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.EndpointDescriptorStructPtr);  
-                        
-        kfree(TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.VideoInterfaceDescriptorStructPtr);
+        // Other cameras keep streaming while this one goes, and an application may still hold its nodes open. Only
+        // take the nodes away here, which also stops a stream that is still running so no isochronous Urb completes
+        // into this struct later. The video queue goes first, so a still image being filled is back on the still
+        // queue when that is released. A handle closed after this doesn't release the queues again.
+        vb2_video_unregister_device(&TomUsbCamCtrlIntfDevStructPtr->VideoDevice);
+        vb2_video_unregister_device(&TomUsbCamCtrlIntfDevStructPtr->StillCaptureForThisCameraStruct.VideoDevice);
+
+        v4l2_device_disconnect(&TomUsbCamCtrlIntfDevStructPtr->V4l2DevStruct);
+
+        // No new opens can come in, so finish off the control queries and let anyone waiting on them go.
+        TomUsbCamCancelDeferredQueries(TomUsbCamCtrlIntfDevStructPtr);
+
+        // With both queues stopped, a still capture still running finds nothing left to do.
+        cancel_work_sync(&TomUsbCamCtrlIntfDevStructPtr->StillCaptureForThisCameraStruct.CaptureWork);
+
+        // The camera is gone, so nothing more is sent to it. The controls themselves stay until the last handle is
+        // closed, as closing a handle unsubscribes its control events.
+        TomUsbCamFreeAsyncControls(TomUsbCamCtrlIntfDevStructPtr);
 
-        kfree(TomUsbCamCtrlIntfDevStructPtr);
+        // Decrement the total number of kernel reference counts to this device
+        kref_put(&TomUsbCamCtrlIntfDevStructPtr->KernelRefCountStruct, TomUsbCamCtrlIntfDelete);
+
+        // The rest goes in TomUsbCamV4l2DeviceRelease() once the last open handle of either node is closed.
+        v4l2_device_put(&TomUsbCamCtrlIntfDevStructPtr->V4l2DevStruct);
     }
     else
     {
     
 	    TomUsbCamIsochronousInputDevStructPtr = usb_get_intfdata(UsbDevInterfaceStructPtr);
+
+	    TomUsbCamDeviceStructPtr = TomUsbCamIsochronousInputDevStructPtr->DeviceStructPtr;
+
+	    // After this a new stream can't pick up the isochronous struct any more.
+	    TomUsbCamDetachInterface(TomUsbCamDeviceStructPtr, false);
 	    
 	    DeviceMinorNum = UsbDevInterfaceStructPtr->minor;
 	    
@@ -1719,7 +6589,12 @@ static void TomUsbCamDisconnect(struct usb_interface *UsbDevInterfaceStructPtr)
 
 	    usb_deregister_dev(UsbDevInterfaceStructPtr, &TomUsbCamClass);
 
+	    // The control interface may still hold a reference while it is streaming, but the Urbs must stop now.
+	    TomUsbCamKillIsochronousUrbs(TomUsbCamIsochronousInputDevStructPtr);
+
 	    kref_put(&TomUsbCamIsochronousInputDevStructPtr->KernelRefCountStruct, TomUsbCamIsochronousInputDelete);
+
+	    TomUsbCamPutDevice(TomUsbCamDeviceStructPtr);
 	    
 	    dev_info(&UsbDevInterfaceStructPtr->dev, "TomUsbCam #%d now disconnected", DeviceMinorNum);
     }
@@ -1744,6 +6619,42 @@ static void TomUsbCamCtrlIntfDelete(struct kref *KernelRefCountStructPtr)
 	//kfree(TomUsbCamCtrlIntfDevStructPtr);
 }
 
+// Called once the control interface is disconnected and the last open handle of its video and still nodes is closed.
+// Each registered node holds a reference to the v4l2_device, and disconnect drops the one from v4l2_device_register().
+static void TomUsbCamV4l2DeviceRelease(struct v4l2_device *V4l2DevStructPtr)
+{
+
+    struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr =
+        container_of(V4l2DevStructPtr, struct TomUsbCamCtrlIntfDevStruct, V4l2DevStruct);
+
+    struct TomUsbCamDeviceStruct *TomUsbCamDeviceStructPtr = TomUsbCamCtrlIntfDevStructPtr->DeviceStructPtr;
+
+    v4l2_ctrl_handler_free(&TomUsbCamCtrlIntfDevStructPtr->V4l2CtrlHandler);
+    v4l2_device_unregister(V4l2DevStructPtr);
+
+#ifdef CONFIG_MEDIA_CONTROLLER
+    media_device_cleanup(&TomUsbCamCtrlIntfDevStructPtr->MediaDev);
+#endif
+
+    TomUsbCamFreeCtrlIntf(TomUsbCamCtrlIntfDevStructPtr);
+
+    TomUsbCamPutDevice(TomUsbCamDeviceStructPtr);
+}
+
+// Free the control interface struct and what lives as long as it does. Everything set up on top of it has to be
+// undone already.
+static void TomUsbCamFreeCtrlIntf(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr)
+{
+
+    // All the saved Usb descriptor info lives in the one arena.
+    kfree(TomUsbCamCtrlIntfDevStructPtr->UsbDescriptorsForThisCameraStruct.DescriptorArenaPtr);
+
+    free_percpu(TomUsbCamCtrlIntfDevStructPtr->StreamStatsForThisCameraStruct.CountersPtr);
+
+    usb_put_dev(TomUsbCamCtrlIntfDevStructPtr->UsbDevStructPtr);
+    kfree(TomUsbCamCtrlIntfDevStructPtr);
+}
+
 static void TomUsbCamIsochronousInputDelete(struct kref *KernelRefCountStructPtr)
 {	
 
@@ -1752,8 +6663,11 @@ static void TomUsbCamIsochronousInputDelete(struct kref *KernelRefCountStructPtr
 	struct TomUsbCamIsochronousInputDevStruct *TomUsbCamIsochronousInputDevStructPtr = 
 	        container_of(KernelRefCountStructPtr, struct TomUsbCamIsochronousInputDevStruct, KernelRefCountStruct);
 
+	TomUsbCamDestroyProcessingStage(TomUsbCamIsochronousInputDevStructPtr);
+
+	// The coherent buffers have to be freed while the usb device is still referenced.
+	TomUsbCamFreeIsochronousUrbs(TomUsbCamIsochronousInputDevStructPtr);
 	usb_put_dev(TomUsbCamIsochronousInputDevStructPtr->UsbDevStructPtr);
-	kfree(TomUsbCamIsochronousInputDevStructPtr->IsochronousInputBuffer);
 	kfree(TomUsbCamIsochronousInputDevStructPtr);
 }
 
@@ -1761,12 +6675,16 @@ static void TomUsbCamIsochronousInputDelete(struct kref *KernelRefCountStructPtr
 static int __init TomUsbCamInit(void)
 {
 
+    // The statistics are only a debugging aid, so carry on without them if debugfs isn't there.
+    TomUsbCamDebugfsRootPtr = debugfs_create_dir("TomUsbCam", NULL);
+
     // Register this driver with the USB subsystem
 	int UsbRegisterResult = usb_register(&TomUsbCamDriver);
 	
 	if (UsbRegisterResult)
 	{
 	    pr_err("TomUsbCamInit error: usb_register() failed. Error number %d", UsbRegisterResult);
+	    debugfs_remove_recursive(TomUsbCamDebugfsRootPtr);
     }
 
 	return UsbRegisterResult;
@@ -1776,11 +6694,18 @@ static void __exit TomUsbCamExit(void)
 {
 	// De-register this driver with the USB subsystem
 	usb_deregister(&TomUsbCamDriver);
+
+	debugfs_remove_recursive(TomUsbCamDebugfsRootPtr);
 }
 
 module_init (TomUsbCamInit);
 module_exit (TomUsbCamExit);
 
+// "make KUNIT=1" builds the frame assembler's KUnit suite into the module, see TomUsbCamDriverTest.c.
+#ifdef TOM_USB_CAM_KUNIT_TEST
+#include "TomUsbCamDriverTest.c"
+#endif
+
 
 
 
@@ -24,12 +24,30 @@
 #include <media/videobuf2-v4l2.h>
 
 #include <media/videobuf2-dma-contig.h>
+#include <media/videobuf2-vmalloc.h>
+#include <media/videobuf2-dma-sg.h>
+#include <linux/scatterlist.h>
+#include <linux/highmem.h>
+#include <linux/llist.h>
+#include <linux/kthread.h>
+#include <linux/workqueue.h>
+#include <linux/cpumask.h>
+#include <linux/math64.h>
+#include <linux/sort.h>
+#include <media/media-device.h>
+#include <media/media-request.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/percpu.h>
 
 
 
 //Is this needed still?
 #include <linux/dma-mapping.h>
 
+// get_unaligned_le32() for pulling multi-byte fields out of Uvc control blocks.
+#include <asm/unaligned.h>
+
 
 // Everything is declared "static" to prevent it being used outside of this object file's scope. See:
 // https://stackoverflow.com/questions/7259830/why-and-when-to-use-static-structures-in-c-programming
@@ -51,8 +69,44 @@ static void TomUsbCamDisconnect(struct usb_interface*);
 static void TomUsbCamCtrlIntfDelete(struct kref *);
 static void TomUsbCamIsochronousInputDelete(struct kref *);
 
-// This struct is defined below. Declare here for the enable/disable functions below.
+// These structs are defined below. Declare here for the enable/disable functions below.
+struct TomUsbCamDeviceStruct;
 struct TomUsbCamCtrlIntfDevStruct;
+struct TomUsbCamIsochronousInputDevStruct;
+struct StreamCountersStruct;
+struct TomUsbCamV4l2VideoBufferContainer;
+
+// Device registry functions
+static struct TomUsbCamDeviceStruct *TomUsbCamGetDevice(struct usb_interface *);
+static void TomUsbCamPutDevice(struct TomUsbCamDeviceStruct *);
+static void TomUsbCamDeviceDelete(struct kref *);
+static void TomUsbCamAttachInterface(struct TomUsbCamDeviceStruct *, struct TomUsbCamCtrlIntfDevStruct *, struct TomUsbCamIsochronousInputDevStruct *);
+static void TomUsbCamDetachInterface(struct TomUsbCamDeviceStruct *, bool);
+static struct TomUsbCamIsochronousInputDevStruct *TomUsbCamGetStreamingInterface(struct TomUsbCamCtrlIntfDevStruct *);
+static int TomUsbCamGetCameras(char *, const struct kernel_param *);
+static int TomUsbCamDeviceParam(const int *, int, int);
+static void TomUsbCamFreeCtrlIntf(struct TomUsbCamCtrlIntfDevStruct *);
+static void TomUsbCamV4l2DeviceRelease(struct v4l2_device *);
+
+// Streaming statistics functions
+static void TomUsbCamCreateDebugfs(struct TomUsbCamCtrlIntfDevStruct *);
+static void TomUsbCamRemoveDebugfs(struct TomUsbCamCtrlIntfDevStruct *);
+static void TomUsbCamCountPacketError(struct StreamCountersStruct __percpu *, int);
+static void TomUsbCamMeasureFrameInterval(struct TomUsbCamCtrlIntfDevStruct *);
+static void TomUsbCamResetFrameInterval(struct TomUsbCamCtrlIntfDevStruct *);
+static int TomUsbCamGetStatsCounter(void *, u64 *);
+static int TomUsbCamShowFps(struct seq_file *, void *);
+static int TomUsbCamOpenFps(struct inode *, struct file *);
+static void TomUsbCamRecordLatency(struct StreamCountersStruct __percpu *, int, u64, u64);
+static void TomUsbCamRecordBufferDone(struct TomUsbCamCtrlIntfDevStruct *, struct TomUsbCamV4l2VideoBufferContainer *, enum vb2_buffer_state);
+static int TomUsbCamShowLatency(struct seq_file *, void *);
+static int TomUsbCamOpenLatency(struct inode *, struct file *);
+struct StreamingFormatStruct;
+struct ControlStateStruct;
+struct StreamingFrameStruct;
+struct FrameAssemblyStruct;
+struct PayloadHeaderStruct;
+struct StillCaptureStruct;
 
 // Each device is laid out in a tree with descending associations, possibly many-to-1:
 // Device -> Configuration -> Interface -> Endpoint. Some interfaces (e.g. VideolInterface)
@@ -110,22 +164,77 @@ struct VideoInterfaceDescriptorStruct
     uint8_t *VarData;
 };
 
+// Running state for walking the descriptors. The same walk is done twice, once to size the arena and once,
+// with Fill set, to copy the descriptors into it.
+struct DescriptorParseStateStruct
+{
+    bool Fill;
+    
+    int ConfigurationCount;
+    int InterfaceCount;
+    int EndpointCount;
+    int VideoCount;
+    size_t VarDataLen;
+    
+    uint8_t IndexedInterfaceCount;
+    uint8_t IndexedAlternateSettingCount;
+    uint8_t IndexedSubtypeCount;
+    
+    uint8_t CurrentConfiguration;
+    uint8_t CurrentInterfaceNumber;
+    uint8_t CurrentAlternateSetting;
+    
+    uint8_t *NextVarDataPtr;
+};
+
 // V4l2-specific functions
 static int TomUsbCamSetV4l2Control(struct v4l2_ctrl *);
+static int TomUsbCamV4l2Open(struct file *);
 static int TomUsbCamQueryCapability(struct file *, void *, struct v4l2_capability *);
 static int TomUsbCamTryFormat(struct file *, void *, struct v4l2_format *);
 static int TomUsbCamSetFormat(struct file *, void *, struct v4l2_format *);
 static int TomUsbCamGetFormat(struct file *, void *, struct v4l2_format *);
-static int WriteToCamera(struct usb_device *, __u8 , __u8 , __u8 , __u16 , __u16 , __u16 , unsigned char *, __u16 , int );
-static int ReadFromCamera(struct usb_device *, __u8 , __u8 , __u8 , __u16 , __u16 , __u16 , unsigned char *, __u16 , int );
-static int QueryCameraFactoryValues(struct usb_device *, __u16, __u16, unsigned char *, int *, int *, int *, int *, bool);
-static int EnableCamera(struct usb_device *);
-static int DisableCamera(struct usb_device *);
+static int TomUsbCamEnumFormat(struct file *, void *, struct v4l2_fmtdesc *);
+static int TomUsbCamEnumFrameSizes(struct file *, void *, struct v4l2_frmsizeenum *);
+static int TomUsbCamEnumFrameIntervals(struct file *, void *, struct v4l2_frmivalenum *);
+static int TomUsbCamGetStreamParameters(struct file *, void *, struct v4l2_streamparm *);
+static int TomUsbCamSetStreamParameters(struct file *, void *, struct v4l2_streamparm *);
+static int WriteToCamera(struct TomUsbCamCtrlIntfDevStruct *, __u8 , __u8 , __u8 , __u16 , __u16 , __u16 , unsigned char *, __u16 , int );
+static int ReadFromCamera(struct TomUsbCamCtrlIntfDevStruct *, __u8 , __u8 , __u8 , __u16 , __u16 , __u16 , unsigned char *, __u16 , int );
+static int QueryCameraFactoryValues(struct TomUsbCamCtrlIntfDevStruct *, struct ControlStateStruct *);
+static void TomUsbCamBuildControlTable(struct TomUsbCamCtrlIntfDevStruct *);
+static struct ControlStateStruct *TomUsbCamFindControl(struct TomUsbCamCtrlIntfDevStruct *, u32);
+static void TomUsbCamUpdateControlsFromCamera(struct TomUsbCamCtrlIntfDevStruct *, uint8_t, const unsigned char *);
+static int TomUsbCamWriteControl(struct TomUsbCamCtrlIntfDevStruct *, struct v4l2_ctrl *);
+static void TomUsbCamHoldControlWrites(struct TomUsbCamCtrlIntfDevStruct *, bool);
 static int SaveAllDescriptors(struct TomUsbCamCtrlIntfDevStruct *);
+static void WalkCachedDescriptors(struct TomUsbCamCtrlIntfDevStruct *, struct DescriptorParseStateStruct *);
+static void ParseDescriptorBlob(struct TomUsbCamCtrlIntfDevStruct *, struct DescriptorParseStateStruct *, const uint8_t *, int);
 static void GetConfigurationDescriptorStruct(struct TomUsbCamCtrlIntfDevStruct *, uint8_t, struct ConfigurationDescriptorStruct **, int8_t *);
 static void GetInterfaceDescriptorStruct(struct TomUsbCamCtrlIntfDevStruct *, uint8_t, struct InterfaceDescriptorStruct **, int8_t *);
 static void GetEndpointDescriptorStruct(struct TomUsbCamCtrlIntfDevStruct *, uint8_t, uint8_t, struct EndpointDescriptorStruct **, int8_t *);
 static void GetVideoInterfaceDescriptorStruct(struct TomUsbCamCtrlIntfDevStruct *, uint8_t, uint8_t, struct VideoInterfaceDescriptorStruct **, int8_t *);
+static int BuildStreamingModeTable(struct TomUsbCamCtrlIntfDevStruct *);
+static void AddConvertedFormats(struct TomUsbCamCtrlIntfDevStruct *);
+static struct StreamingFormatStruct *GetStreamingFormat(struct TomUsbCamCtrlIntfDevStruct *, uint32_t);
+static int GetStreamingMode(struct TomUsbCamCtrlIntfDevStruct *, uint32_t, uint32_t, uint32_t, struct StreamingFormatStruct **, struct StreamingFrameStruct **);
+static struct StreamingFrameStruct *GetClosestStreamingFrame(struct StreamingFrameStruct *, uint8_t, uint32_t, uint32_t);
+static void FillPixFormatFromStreamingMode(struct StreamingFormatStruct *, struct StreamingFrameStruct *, struct v4l2_pix_format *);
+static size_t TomUsbCamFormatLen(struct StreamingFormatStruct *, size_t);
+static uint32_t TomUsbCamFormatSizeImage(struct StreamingFormatStruct *, uint32_t, uint32_t);
+static int TomUsbCamNegotiateStreamingParameters(struct TomUsbCamCtrlIntfDevStruct *, uint32_t, uint32_t, uint32_t, uint32_t);
+static int TomUsbCamCommitStreamingParameters(struct TomUsbCamCtrlIntfDevStruct *);
+static int SelectStreamingAltSetting(struct TomUsbCamCtrlIntfDevStruct *, uint32_t, uint32_t, struct TomUsbCamIsochronousInputDevStruct *);
+
+// Bandwidth admission functions
+static uint32_t TomUsbCamAvailableBandwidth(struct TomUsbCamDeviceStruct *);
+static int TomUsbCamReserveBandwidth(struct TomUsbCamCtrlIntfDevStruct *, struct TomUsbCamIsochronousInputDevStruct *);
+static void TomUsbCamReleaseBandwidth(struct TomUsbCamCtrlIntfDevStruct *);
+static int TomUsbCamStartIsochronousStream(struct TomUsbCamCtrlIntfDevStruct *, struct TomUsbCamIsochronousInputDevStruct *);
+static int TomUsbCamStartFallbackStream(struct TomUsbCamCtrlIntfDevStruct *, struct TomUsbCamIsochronousInputDevStruct *);
+static int TomUsbCamCompareFallbackIntervalFirst(const void *, const void *);
+static int TomUsbCamCompareFallbackSizeFirst(const void *, const void *);
+static void TomUsbCamRestoreRequestedMode(struct TomUsbCamCtrlIntfDevStruct *);
 static int TomUsbCamV4l2QueueSetup(struct vb2_queue *, unsigned int *, unsigned int *,
 		                           unsigned int[], struct device *[]);
 //Tom is forward declaration of arrays above correct?		                           
@@ -133,10 +242,90 @@ static int TomUsbCamV4l2QueueSetup(struct vb2_queue *, unsigned int *, unsigned
 //		                           unsigned int *NumBuffers, unsigned int *NumImagePlanes,
 //		                           unsigned int ImageSizes[], struct device *alloc_devs[]);
 static int buffer_prepare(struct vb2_buffer *);
+static void buffer_finish(struct vb2_buffer *);
 static void buffer_queue(struct vb2_buffer *);
+static void buffer_request_complete(struct vb2_buffer *);
 static int start_streaming(struct vb2_queue *, unsigned int);
 static void stop_streaming(struct vb2_queue *);
 
+// Isochronous streaming functions
+static int TomUsbCamAllocIsochronousUrbs(struct TomUsbCamIsochronousInputDevStruct *);
+static void TomUsbCamPrepareIsochronousUrbs(struct TomUsbCamIsochronousInputDevStruct *);
+static void TomUsbCamFreeIsochronousUrbs(struct TomUsbCamIsochronousInputDevStruct *);
+static void TomUsbCamKillIsochronousUrbs(struct TomUsbCamIsochronousInputDevStruct *);
+static void TomUsbCamIsochronousUrbComplete(struct urb *);
+static int TomUsbCamParsePayloadHeader(const unsigned char *, unsigned int, struct PayloadHeaderStruct *);
+static void TomUsbCamProcessPayload(struct FrameAssemblyStruct *, const unsigned char *, unsigned int);
+static void TomUsbCamCopyToFrame(struct FrameAssemblyStruct *, const unsigned char *, size_t);
+static void TomUsbCamConvertYuyv(struct FrameAssemblyStruct *, unsigned char *, const unsigned char *, size_t, size_t);
+static void TomUsbCamEndFrame(struct FrameAssemblyStruct *);
+static bool TomUsbCamStartFrame(struct FrameAssemblyStruct *);
+static void TomUsbCamProcessUrbPackets(struct TomUsbCamCtrlIntfDevStruct *, struct urb *);
+static int TomUsbCamStartProcessingStage(struct TomUsbCamIsochronousInputDevStruct *, int);
+static void TomUsbCamStopProcessingStage(struct TomUsbCamIsochronousInputDevStruct *);
+static void TomUsbCamDestroyProcessingStage(struct TomUsbCamIsochronousInputDevStruct *);
+static int TomUsbCamProcessingThread(void *);
+static void TomUsbCamProcessingWork(struct work_struct *);
+static void TomUsbCamProcessPendingUrbs(struct TomUsbCamIsochronousInputDevStruct *);
+static int TomUsbCamInitAsyncControls(struct TomUsbCamCtrlIntfDevStruct *);
+static void TomUsbCamFreeAsyncControls(struct TomUsbCamCtrlIntfDevStruct *);
+static int TomUsbCamQueueControlWrite(struct TomUsbCamCtrlIntfDevStruct *, u32, __u16, __u16, __u16, s32);
+static int TomUsbCamSubmitNextControlWrite(struct TomUsbCamCtrlIntfDevStruct *);
+static void TomUsbCamResyncFailedControlWrite(struct TomUsbCamCtrlIntfDevStruct *);
+static void TomUsbCamControlUrbComplete(struct urb *);
+static void TomUsbCamResyncControlsWork(struct work_struct *);
+static void TomUsbCamQueryControlsWork(struct work_struct *);
+static void TomUsbCamCancelDeferredQueries(struct TomUsbCamCtrlIntfDevStruct *);
+static void TomUsbCamResetClockRecovery(struct TomUsbCamCtrlIntfDevStruct *);
+static void TomUsbCamAddClockSample(struct FrameAssemblyStruct *, const unsigned char *);
+static bool TomUsbCamPtsToHostTime(struct TomUsbCamCtrlIntfDevStruct *, uint32_t, u64 *);
+static void TomUsbCamCompleteFrame(struct FrameAssemblyStruct *);
+static struct TomUsbCamV4l2VideoBufferContainer *TomUsbCamGetNextQueuedBuffer(struct TomUsbCamCtrlIntfDevStruct *);
+static void TomUsbCamRequeueBuffer(struct TomUsbCamCtrlIntfDevStruct *, struct TomUsbCamV4l2VideoBufferContainer *);
+static void TomUsbCamScheduleRequestControls(struct TomUsbCamCtrlIntfDevStruct *);
+static void TomUsbCamApplyRequestControlsWork(struct work_struct *);
+static void TomUsbCamFinishBuffer(struct TomUsbCamCtrlIntfDevStruct *, struct TomUsbCamV4l2VideoBufferContainer *, enum vb2_buffer_state);
+static void TomUsbCamBufferDone(struct TomUsbCamCtrlIntfDevStruct *, struct TomUsbCamV4l2VideoBufferContainer *, enum vb2_buffer_state);
+static void TomUsbCamDoneBuffersWork(struct work_struct *);
+static void TomUsbCamDrainRequestControls(struct TomUsbCamCtrlIntfDevStruct *);
+static void TomUsbCamReturnAllBuffers(struct TomUsbCamCtrlIntfDevStruct *, enum vb2_buffer_state);
+static void TomUsbCamStopIsochronousStream(struct TomUsbCamCtrlIntfDevStruct *, enum vb2_buffer_state);
+static int TomUsbCamSetAltSetting(struct TomUsbCamCtrlIntfDevStruct *, struct TomUsbCamIsochronousInputDevStruct *, int);
+static int TomUsbCamSubmitIsochronousUrbs(struct TomUsbCamCtrlIntfDevStruct *, struct TomUsbCamIsochronousInputDevStruct *);
+static void TomUsbCamPauseIsochronousStream(struct TomUsbCamCtrlIntfDevStruct *, struct TomUsbCamIsochronousInputDevStruct *);
+static void TomUsbCamResetFrameAssembly(struct FrameAssemblyStruct *);
+
+// Still image capture functions
+static int TomUsbCamInitStillCapture(struct TomUsbCamCtrlIntfDevStruct *, int);
+static void BuildStillImageTable(struct TomUsbCamCtrlIntfDevStruct *);
+static int TomUsbCamStillEnumFormat(struct file *, void *, struct v4l2_fmtdesc *);
+static int TomUsbCamStillEnumFrameSizes(struct file *, void *, struct v4l2_frmsizeenum *);
+static int TomUsbCamStillTryFormat(struct file *, void *, struct v4l2_format *);
+static int TomUsbCamStillSetFormat(struct file *, void *, struct v4l2_format *);
+static int TomUsbCamStillGetFormat(struct file *, void *, struct v4l2_format *);
+static int TomUsbCamNegotiateStillParameters(struct TomUsbCamCtrlIntfDevStruct *);
+static int TomUsbCamCommitStillParameters(struct TomUsbCamCtrlIntfDevStruct *);
+static int TomUsbCamStillQueueSetup(struct vb2_queue *, unsigned int *, unsigned int *, unsigned int [], struct device *[]);
+static int still_buffer_prepare(struct vb2_buffer *);
+static void still_buffer_queue(struct vb2_buffer *);
+static int still_start_streaming(struct vb2_queue *, unsigned int);
+static void still_stop_streaming(struct vb2_queue *);
+static bool TomUsbCamStillUsesCamera(struct StillCaptureStruct *);
+static bool TomUsbCamIsStillBuffer(struct TomUsbCamCtrlIntfDevStruct *, struct TomUsbCamV4l2VideoBufferContainer *);
+static bool TomUsbCamStillImagesWaiting(struct TomUsbCamCtrlIntfDevStruct *, bool);
+static bool TomUsbCamStartStillFrame(struct TomUsbCamCtrlIntfDevStruct *, struct FrameAssemblyStruct *);
+static void TomUsbCamCompleteStillFrame(struct TomUsbCamCtrlIntfDevStruct *, struct FrameAssemblyStruct *);
+static void TomUsbCamRequeueStillBuffer(struct TomUsbCamCtrlIntfDevStruct *, struct TomUsbCamV4l2VideoBufferContainer *);
+static void TomUsbCamReturnStillBuffer(struct TomUsbCamCtrlIntfDevStruct *, enum vb2_buffer_state);
+static bool TomUsbCamStartBulkStillFrame(struct FrameAssemblyStruct *);
+static void TomUsbCamAddBulkStillClockSample(struct FrameAssemblyStruct *, const unsigned char *);
+static void TomUsbCamCompleteBulkStillFrame(struct FrameAssemblyStruct *);
+static int TomUsbCamTriggerStillImage(struct TomUsbCamCtrlIntfDevStruct *, uint8_t);
+static int TomUsbCamCaptureInterleavedStillImage(struct TomUsbCamCtrlIntfDevStruct *);
+static int TomUsbCamCaptureBulkStillImage(struct TomUsbCamCtrlIntfDevStruct *);
+static int TomUsbCamCaptureSwitchedStillImage(struct TomUsbCamCtrlIntfDevStruct *);
+static void TomUsbCamStillCaptureWork(struct work_struct *);
+
 static struct v4l2_file_operations TomUsbCamV4l2FileOps;
 		                           
 
@@ -158,6 +347,383 @@ static struct usb_device_id TomUsbCamTable [] =
 // Tom get a minor range for your devices from the usb maintainer 
 #define TOM_USB_CAM_MINOR_BASE 192
 
+// Number of isochronous Urbs kept in flight while streaming. While one Urb is sitting in its completion handler
+// the host controller keeps filling the others, so a handful are needed to avoid gaps in the stream.
+#define TOM_USB_CAM_NUM_ISOCHRONOUS_URBS 5
+
+// Number of (micro)frame packets in each isochronous Urb. At 125 us per microframe this is 4 ms of video per Urb.
+#define TOM_USB_CAM_PACKETS_PER_ISOCHRONOUS_URB 32
+
+// Number of negotiated probe control blocks remembered per camera, one per (format, frame, interval) tuple.
+#define TOM_USB_CAM_NUM_PROBE_CONTROL_CACHE_ENTRIES 16
+
+// Most cameras the per-device module parameters can be given for.
+#define TOM_USB_CAM_MAX_DEVICES 8
+
+// Memory behind the vb2 video buffers, selected per camera with the buffer_backend module parameter.
+#define TOM_USB_CAM_BUFFER_BACKEND_VMALLOC 0
+#define TOM_USB_CAM_BUFFER_BACKEND_DMA_SG 1
+
+// Where the isochronous payloads are parsed and copied into the video buffers, selected per camera with the
+// processing_stage module parameter. The Urb completion handler shares its context with every other device on the
+// host controller, so the heavy copies at large frame sizes can be moved to a kthread or an unbound workqueue.
+#define TOM_USB_CAM_PROCESSING_STAGE_URB_COMPLETION 0
+#define TOM_USB_CAM_PROCESSING_STAGE_KTHREAD 1
+#define TOM_USB_CAM_PROCESSING_STAGE_WORKQUEUE 2
+
+// One v4l2 control backed by a processing unit control, or by a field of one when the control packs several values
+// (white balance component is blue then red). See section 4.2.2.3 of [3] for the sizes.
+struct UvcControlMappingStruct
+{
+    uint8_t BmControlsBit;
+    uint8_t Selector;
+    uint8_t ControlLen;
+    uint8_t FieldOffset;
+    uint8_t FieldLen;
+    bool Signed;
+    u32 V4l2Id;
+    enum v4l2_ctrl_type V4l2Type;
+};
+
+// Every processing unit control with a v4l2 equivalent. Integer controls take their range from the camera, boolean
+// and menu controls only their default and current value.
+static const struct UvcControlMappingStruct UvcControlMappingTable[] =
+{
+    {0, ProcessingUnitBrightnessControl, 2, 0, 2, true, V4L2_CID_BRIGHTNESS, V4L2_CTRL_TYPE_INTEGER},
+    {1, ProcessingUnitContrastControl, 2, 0, 2, false, V4L2_CID_CONTRAST, V4L2_CTRL_TYPE_INTEGER},
+    {2, ProcessingUnitHueControl, 2, 0, 2, true, V4L2_CID_HUE, V4L2_CTRL_TYPE_INTEGER},
+    {3, ProcessingUnitSaturationControl, 2, 0, 2, false, V4L2_CID_SATURATION, V4L2_CTRL_TYPE_INTEGER},
+    {4, ProcessingUnitSharpnessControl, 2, 0, 2, false, V4L2_CID_SHARPNESS, V4L2_CTRL_TYPE_INTEGER},
+    {5, ProcessingUnitGammaControl, 2, 0, 2, false, V4L2_CID_GAMMA, V4L2_CTRL_TYPE_INTEGER},
+    {6, ProcessingUnitWhiteBalanceTemperatureControl, 2, 0, 2, false, V4L2_CID_WHITE_BALANCE_TEMPERATURE, V4L2_CTRL_TYPE_INTEGER},
+    {7, ProcessingUnitWhiteBalanceComponentControl, 4, 0, 2, false, V4L2_CID_BLUE_BALANCE, V4L2_CTRL_TYPE_INTEGER},
+    {7, ProcessingUnitWhiteBalanceComponentControl, 4, 2, 2, false, V4L2_CID_RED_BALANCE, V4L2_CTRL_TYPE_INTEGER},
+    {8, ProcessingUnitBacklightCompensationControl, 2, 0, 2, false, V4L2_CID_BACKLIGHT_COMPENSATION, V4L2_CTRL_TYPE_INTEGER},
+    {9, ProcessingUnitGainControl, 2, 0, 2, false, V4L2_CID_GAIN, V4L2_CTRL_TYPE_INTEGER},
+    {10, ProcessingUnitPowerLineFrequencyControl, 1, 0, 1, false, V4L2_CID_POWER_LINE_FREQUENCY, V4L2_CTRL_TYPE_MENU},
+    {11, ProcessingUnitHueAutoControl, 1, 0, 1, false, V4L2_CID_HUE_AUTO, V4L2_CTRL_TYPE_BOOLEAN},
+    {12, ProcessingUnitWhiteBalanceTemperatureAutoControl, 1, 0, 1, false, V4L2_CID_AUTO_WHITE_BALANCE, V4L2_CTRL_TYPE_BOOLEAN},
+};
+
+#define TOM_USB_CAM_MAX_CONTROLS ARRAY_SIZE(UvcControlMappingTable)
+
+// Auto/manual control pairs, clustered so v4l2 marks the manual control inactive while the auto one is on.
+// The auto control comes first as the cluster's master.
+static const u32 UvcAutoClusterTable[][2] =
+{
+    {V4L2_CID_HUE_AUTO, V4L2_CID_HUE},
+    {V4L2_CID_AUTO_WHITE_BALANCE, V4L2_CID_WHITE_BALANCE_TEMPERATURE},
+};
+
+// Most media requests whose controls can be waiting to be applied at once.
+#define TOM_USB_CAM_NUM_DUE_REQUESTS 8
+
+// The camera's range and current value of a control, queried once at probe. The current value is what was last
+// sent, so reads and writes of an unchanged value never touch the bus.
+struct ControlStateStruct
+{
+    const struct UvcControlMappingStruct *MappingPtr;
+    struct v4l2_ctrl *V4l2CtrlPtr;
+    s32 Min;
+    s32 Max;
+    s32 Res;
+    s32 Def;
+    s32 Cur;
+};
+
+// Most controls that can have a write waiting for the control Urb at once, and the longest control value.
+// Writes to a control that is already waiting just replace its value.
+#define TOM_USB_CAM_NUM_PENDING_CONTROL_WRITES 8
+#define TOM_USB_CAM_MAX_CONTROL_LEN 4
+
+// What happens to frames the assembler knows are damaged, selected per camera with the damaged_frames module
+// parameter. Delivered frames carry V4L2_BUF_FLAG_ERROR, dropped ones go back on the queue and are refilled.
+#define TOM_USB_CAM_DAMAGED_FRAMES_DELIVER 0
+#define TOM_USB_CAM_DAMAGED_FRAMES_DROP 1
+
+// Why a frame is damaged. Isochronous transfers aren't retried, so anything lost on the bus stays lost.
+#define TOM_USB_CAM_FRAME_ERROR_PACKET 0x01       // An isochronous packet completed with an error status.
+#define TOM_USB_CAM_FRAME_ERROR_HEADER 0x02       // A payload had the error bit set or a malformed header.
+#define TOM_USB_CAM_FRAME_ERROR_NO_EOF 0x04       // The frame Id toggled before the end-of-frame bit was seen.
+#define TOM_USB_CAM_FRAME_ERROR_OVERFLOW 0x08     // More data arrived than fits in the buffer.
+#define TOM_USB_CAM_FRAME_ERROR_SHORT 0x10        // The frame ended with fewer bytes than the format needs.
+
+// Number of (device clock, host clock) samples the timestamp fit is done over, one per frame. It has to be even, as
+// the fit draws a line through the average of the older half and the average of the newer half.
+#define TOM_USB_CAM_NUM_CLOCK_SAMPLES 32
+
+// Size limits of the mode table built from the VideoStreaming descriptors. Anything past these is ignored with a warning.
+#define TOM_USB_CAM_MAX_STREAMING_FORMATS 8
+#define TOM_USB_CAM_MAX_FRAMES_PER_FORMAT 16
+#define TOM_USB_CAM_MAX_FRAME_INTERVALS 8
+
+// What start_streaming tries when the bus doesn't have the periodic bandwidth left for the requested mode, selected per
+// camera with the bandwidth_fallback module parameter. Only modes of the same format that fit in the buffers already
+// allocated are tried, and the mode that is granted is what G_FMT and G_PARM report until streaming stops.
+#define TOM_USB_CAM_BANDWIDTH_FALLBACK_INTERVAL_FIRST 0    // Keep the frame size as long as possible, lower the frame rate.
+#define TOM_USB_CAM_BANDWIDTH_FALLBACK_SIZE_FIRST 1        // Keep the frame rate as long as possible, shrink the frame.
+#define TOM_USB_CAM_BANDWIDTH_FALLBACK_NONE 2              // Fail STREAMON with -ENOSPC.
+
+// Still capture methods from bStillCaptureMethod of the input header, see section 2.4.2.4 of [3].
+#define TOM_USB_CAM_STILL_METHOD_NONE 0           // The camera doesn't capture still images itself.
+#define TOM_USB_CAM_STILL_METHOD_VIDEO_FRAME 1    // A still image is just a frame of the video stream.
+#define TOM_USB_CAM_STILL_METHOD_INTERLEAVED 2    // Triggered still images go out between video frames on the video endpoint.
+#define TOM_USB_CAM_STILL_METHOD_BULK 3           // Triggered still images go out on a bulk endpoint of their own.
+
+// How the still node gets its images, selected per camera with the still_capture module parameter. Switching means
+// stopping the video stream, streaming the still frame size until the still buffers are filled, then going back to
+// the video mode, all inside the driver. The video node only sees a gap in its sequence numbers.
+#define TOM_USB_CAM_STILL_CAPTURE_CAMERA 0    // The camera's method 2 or 3 if it has one, switching otherwise.
+#define TOM_USB_CAM_STILL_CAPTURE_SWITCH 1    // Always switch.
+
+// How long a still image may take to arrive before the attempt is given up. A 1600x1200 Yuyv frame takes 143 ms at
+// the camera's fastest rate for that size, and the frame already in flight is skipped first.
+#define TOM_USB_CAM_STILL_TIMEOUT_MS 2000
+
+// Periodic bandwidth the cameras on one bus may reserve between them, in bytes per (micro)frame, unless the
+// periodic_budget module parameter says otherwise. Usb 2.0 lets 80% of a high-speed microframe (7500 bytes) and 90%
+// of a full-speed frame (1500 bytes) go to periodic transfers, section 5.6.4 of the Usb 2.0 spec.
+#define TOM_USB_CAM_HIGH_SPEED_PERIODIC_BUDGET 6000
+#define TOM_USB_CAM_FULL_SPEED_PERIODIC_BUDGET 1350
+
+// What TomUsbCamParsePayloadHeader() found in the header of a payload.
+struct PayloadHeaderStruct
+{
+    uint8_t HeaderLen;
+    uint8_t HeaderInfo;
+
+    uint32_t Pts;
+    bool PtsValid;
+
+    // Points into the payload, or NULL if the header has no source clock reference.
+    const unsigned char *ScrPtr;
+};
+
+// How the frame assembler hands frames to whoever owns the buffers. Keeping vb2 out of the assembler lets the
+// KUnit suite in TomUsbCamDriverTest.c drive it with plain memory.
+struct FrameAssemblyOpsStruct
+{
+    // A new frame started. Returns true after pointing DstVaddr or DstSgTablePtr and DstSize at a buffer for it, or
+    // false if there is none and the frame has to be skipped.
+    bool (*StartFrame)(struct FrameAssemblyStruct *);
+
+    // The first source clock reference of each frame.
+    void (*AddClockSample)(struct FrameAssemblyStruct *, const unsigned char *);
+
+    // The frame is finished, BytesUsed, ErrorFlags and Sequence describe it.
+    void (*CompleteFrame)(struct FrameAssemblyStruct *);
+};
+
+// Isochronous packet errors with a debugfs counter of their own, see Documentation/driver-api/usb/error-codes.rst.
+// Any other status is counted as "other".
+#define TOM_USB_CAM_NUM_PACKET_ERROR_STATUSES 6
+
+struct PacketErrorStatusStruct
+{
+    int Status;
+    const char *Name;
+};
+
+static const struct PacketErrorStatusStruct PacketErrorStatusTable[TOM_USB_CAM_NUM_PACKET_ERROR_STATUSES] =
+{
+    { -EPROTO, "eproto" },         // Bitstuff error, or no response from the camera.
+    { -EILSEQ, "eilseq" },         // Crc mismatch.
+    { -ETIME, "etime" },           // No response in time.
+    { -EOVERFLOW, "eoverflow" },   // The camera sent more than the packet could hold.
+    { -ECOMM, "ecomm" },           // The host controller couldn't write the data to memory fast enough.
+    { -EXDEV, "exdev" },           // The packet wasn't transferred at all, e.g. the host controller missed its microframe.
+};
+
+// Latencies with a log2 histogram each in debugfs, see TomUsbCamRecordLatency(). The names are the file names.
+#define TOM_USB_CAM_LATENCY_ASSEMBLY 0    // First packet of a frame to the end of the frame.
+#define TOM_USB_CAM_LATENCY_DELIVERY 1    // End of the frame to vb2_buffer_done().
+#define TOM_USB_CAM_LATENCY_DEQUEUE 2     // vb2_buffer_done() to user space dequeuing the buffer.
+#define TOM_USB_CAM_LATENCY_CONTROL 3     // A control transfer asked for to the camera answering it.
+#define TOM_USB_CAM_LATENCY_PTS 4         // The frame's Pts, turned into host time, to vb2_buffer_done().
+#define TOM_USB_CAM_NUM_LATENCIES 5
+
+static const char * const LatencyNameTable[TOM_USB_CAM_NUM_LATENCIES] =
+{
+    "frame_assembly",
+    "frame_delivery",
+    "dequeue",
+    "control",
+    "pts_to_delivery",
+};
+
+// Bucket 0 counts latencies under 1 us and bucket N those from 2^(N-1) us up to 2^N us. The last bucket also takes
+// everything longer, which is anything from about 17 s up.
+#define TOM_USB_CAM_NUM_LATENCY_BUCKETS 26
+
+// Streaming counters, one copy per cpu, see StreamStatsStruct.
+struct StreamCountersStruct
+{
+    u64 UrbsCompleted;
+    u64 UrbsResubmitted;
+    u64 BytesReceived;
+
+    // Indexed like PacketErrorStatusTable, the last one counts every other status.
+    u64 PacketErrors[TOM_USB_CAM_NUM_PACKET_ERROR_STATUSES + 1];
+
+    // Frames given to user space intact, given to user space flagged with V4L2_BUF_FLAG_ERROR, or damaged and
+    // dropped because of the damaged_frames parameter.
+    u64 FramesCompleted;
+    u64 FramesErrored;
+    u64 FramesDropped;
+
+    // Frames skipped because user space had no buffer queued when they started.
+    u64 QueueUnderruns;
+
+    u64 LatencyBuckets[TOM_USB_CAM_NUM_LATENCIES][TOM_USB_CAM_NUM_LATENCY_BUCKETS];
+};
+
+// One mode start_streaming can fall back to.
+struct FallbackModeStruct
+{
+    struct StreamingFrameStruct *FramePtr;
+    uint32_t FrameInterval;
+};
+
+// One frame size of a streaming format, with everything the format ioctls need already worked out so they
+// never have to go back to the descriptors or the camera.
+struct StreamingFrameStruct
+{
+    uint8_t FrameIndex;
+    uint16_t Width;
+    uint16_t Height;
+    uint32_t BytesPerLine;
+    uint32_t SizeImage;
+    
+    // Frame intervals are in 100 ns units. If the camera supports a continuous range, FrameIntervals holds the
+    // minimum, maximum & step instead of a list.
+    uint32_t DefaultFrameInterval;
+    bool ContinuousFrameIntervals;
+    uint8_t FrameIntervalCount;
+    uint32_t FrameIntervals[TOM_USB_CAM_MAX_FRAME_INTERVALS];
+};
+
+struct StreamingFormatStruct
+{
+    uint8_t FormatIndex;
+    uint32_t PixelFormat;
+    const char *Description;
+    uint8_t BitsPerPixel;
+    bool Planar;
+    
+    // From the color matching descriptor, or the Uvc defaults if the camera doesn't have one.
+    enum v4l2_colorspace Colorspace;
+    enum v4l2_xfer_func XferFunc;
+    enum v4l2_ycbcr_encoding YcbcrEncoding;
+    
+    // Position of the default frame in Frames[], not the bFrameIndex.
+    uint8_t DefaultFrameIdx;
+    uint8_t FrameCount;
+    struct StreamingFrameStruct Frames[TOM_USB_CAM_MAX_FRAMES_PER_FORMAT];
+    
+    // TOM_USB_CAM_CONVERSION_*. Converted formats share the FormatIndex and frames of the camera's Yuyv format.
+    int Conversion;
+};
+
+// Formats offered on top of a camera's Yuyv format. The camera still streams Yuyv, and the payloads are converted
+// while they are copied into the vb2 buffer, so no extra pass over the frame is needed.
+#define TOM_USB_CAM_CONVERSION_NONE 0
+#define TOM_USB_CAM_CONVERSION_GREY 1    // Only the luma bytes, half of what Yuyv takes.
+#define TOM_USB_CAM_CONVERSION_NV16 2    // A luma plane, then a plane of interleaved Cb/Cr at full height.
+#define TOM_USB_CAM_CONVERSION_NV12 3    // Like Nv16, with the chroma of every odd line dropped.
+
+struct ConvertedFormatStruct
+{
+    uint32_t PixelFormat;
+    int Conversion;
+    uint8_t BitsPerPixel;
+    bool Planar;
+    const char *Description;
+};
+
+static const struct ConvertedFormatStruct ConvertedFormatTable[] =
+{
+    {V4L2_PIX_FMT_GREY, TOM_USB_CAM_CONVERSION_GREY, 8, false, "Greyscale 8-bit (from YUYV)"},
+    {V4L2_PIX_FMT_NV12, TOM_USB_CAM_CONVERSION_NV12, 12, true, "Y/CbCr 4:2:0 (from YUYV)"},
+    {V4L2_PIX_FMT_NV16, TOM_USB_CAM_CONVERSION_NV16, 16, true, "Y/CbCr 4:2:2 (from YUYV)"},
+};
+
+// Uncompressed format Guids from table 2-1 of the Uvc uncompressed payload spec. Only the first 4 bytes differ, and
+// they're the FourCC.
+struct UncompressedFormatGuidStruct
+{
+    uint8_t Guid[16];
+    uint32_t PixelFormat;
+    bool Planar;
+    const char *Description;
+};
+
+static const struct UncompressedFormatGuidStruct UncompressedFormatGuidTable[] =
+{
+    {{'Y', 'U', 'Y', '2', 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71}, V4L2_PIX_FMT_YUYV, false, "YUYV 4:2:2"},
+    {{'U', 'Y', 'V', 'Y', 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71}, V4L2_PIX_FMT_UYVY, false, "UYVY 4:2:2"},
+    {{'Y', '8', '0', '0', 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71}, V4L2_PIX_FMT_GREY, false, "Greyscale 8-bit"},
+    {{'N', 'V', '1', '2', 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71}, V4L2_PIX_FMT_NV12, true, "Y/CbCr 4:2:0"},
+    {{'I', '4', '2', '0', 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71}, V4L2_PIX_FMT_YUV420, true, "Planar YUV 4:2:0"},
+};
+
+// The color matching descriptor codes from table 3-3 of the Uvc payload spec and their V4l2 equivalents. Code 0
+// means unspecified.
+static const enum v4l2_colorspace ColorPrimariesToV4l2Colorspace[] =
+{
+    V4L2_COLORSPACE_SRGB,
+    V4L2_COLORSPACE_SRGB,
+    V4L2_COLORSPACE_470_SYSTEM_M,
+    V4L2_COLORSPACE_470_SYSTEM_BG,
+    V4L2_COLORSPACE_SMPTE170M,
+    V4L2_COLORSPACE_SMPTE240M,
+};
+
+static const enum v4l2_xfer_func TransferCharacteristicsToV4l2XferFunc[] =
+{
+    V4L2_XFER_FUNC_DEFAULT,
+    V4L2_XFER_FUNC_709,
+    V4L2_XFER_FUNC_709,
+    V4L2_XFER_FUNC_709,
+    V4L2_XFER_FUNC_709,
+    V4L2_XFER_FUNC_SMPTE240M,
+    V4L2_XFER_FUNC_NONE,
+    V4L2_XFER_FUNC_SRGB,
+};
+
+static const enum v4l2_ycbcr_encoding MatrixCoefficientsToV4l2YcbcrEncoding[] =
+{
+    V4L2_YCBCR_ENC_DEFAULT,
+    V4L2_YCBCR_ENC_709,
+    V4L2_YCBCR_ENC_601,
+    V4L2_YCBCR_ENC_601,
+    V4L2_YCBCR_ENC_601,
+    V4L2_YCBCR_ENC_SMPTE240M,
+};
+
+// One of these per attached camera, shared by its control and streaming interfaces, which are probed and
+// disconnected separately. Each interface holds a reference. All of them are kept on TomUsbCamDeviceListHead.
+struct TomUsbCamDeviceStruct
+{
+	struct usb_device *UsbDevStructPtr;
+	struct kref KernelRefCountStruct;
+	struct list_head DeviceListHead;
+	
+	// Index into the per-camera module parameters: the lowest one no other attached camera is using, so a camera
+	// that is unplugged and plugged back in keeps its settings.
+	int DeviceIdx;
+	
+	// Both halves of the camera, NULL while that interface isn't probed. Protected by TomUsbCamDeviceListLock.
+	struct TomUsbCamCtrlIntfDevStruct *CtrlIntfDevStructPtr;
+	struct TomUsbCamIsochronousInputDevStruct *IsochronousInputDevStructPtr;
+	
+	// Which bus and host controller the camera is on, e.g. "usb-0000:00:14.0-2" for VIDIOC_QUERYCAP.
+	char BusInfo[32];
+	
+	// Periodic bandwidth the camera holds while streaming, in bytes per (micro)frame, 0 otherwise. Counted against
+	// the budget of its bus by every other camera there. Protected by TomUsbCamDeviceListLock.
+	uint32_t ReservedBandwidth;
+};
+
 // Structure to hold all of our device specific info.
 // An isochrounous input interface is preferred for streaming applications because
 // it is lossy and low-latency, as opposed to a bulk interface where data reception is guaranteed.
@@ -165,6 +731,7 @@ static struct usb_device_id TomUsbCamTable [] =
 // functions are called individually for each interface.
 struct TomUsbCamCtrlIntfDevStruct 
 {
+	struct TomUsbCamDeviceStruct *DeviceStructPtr;
 	struct usb_device *UsbDevStructPtr;
 	struct usb_interface *UsbDevInterfaceStructPtr;
 	signed char *CtrlIntfBuffer;
@@ -189,6 +756,285 @@ struct TomUsbCamCtrlIntfDevStruct
 	// A queue used for the video frames?
 	struct vb2_queue TomUsbCamV4l2Queue;
 	
+	// TOM_USB_CAM_BUFFER_BACKEND_*, i.e. which vb2 memops the queue uses.
+	int BufferBackend;
+	
+	// TOM_USB_CAM_PROCESSING_STAGE_*, handed to the isochronous interface when streaming starts.
+	int ProcessingStage;
+	
+	// TOM_USB_CAM_DAMAGED_FRAMES_*.
+	int DamagedFramePolicy;
+	
+	// TOM_USB_CAM_BANDWIDTH_FALLBACK_*.
+	int BandwidthFallback;
+	
+	// Querying every control's range costs several control transfers each, so it is done by a work item after the
+	// video node is registered instead of holding up probe. Opening the node waits for it to finish.
+	struct DeferredQueriesStruct
+	{
+	    struct work_struct QueryWork;
+	    struct completion QueriesDone;
+	    
+	    // Set at disconnect so a query still running stops early.
+	    bool Abort;
+	}
+	DeferredQueriesForThisCameraStruct;
+	
+	// Control writes go out as SET_CUR requests on a single control Urb while streaming carries on. The v4l2 control
+	// framework already holds the new value when s_ctrl returns, so a write the camera rejects is followed by a
+	// GET_CUR from a work item that puts the camera's actual value back into the framework.
+	struct AsyncControlStruct
+	{
+	    struct urb *ControlUrbPtr;
+	    struct usb_ctrlrequest *ControlSetupPtr;
+	    unsigned char *ControlDataPtr;
+	    
+	    // Protects everything below. Taken in the control Urb's completion handler.
+	    spinlock_t AsyncControlLock;
+	    bool ControlUrbBusy;
+	    bool Stopped;
+	    
+	    struct ControlWriteStruct
+	    {
+	        bool Pending;
+	        u32 V4l2Id;
+	        __u16 Value;
+	        __u16 Index;
+	        __u16 Len;
+	        unsigned char Data[TOM_USB_CAM_MAX_CONTROL_LEN];
+	        
+	        // When the write was first asked for. A later value for the same control doesn't move it.
+	        u64 RequestedNs;
+	    }
+	    PendingWrites[TOM_USB_CAM_NUM_PENDING_CONTROL_WRITES], InFlightWrite;
+	    
+	    // Controls whose write failed and that need to be read back, as pending writes so the same lookup works.
+	    struct ControlWriteStruct FailedWrites[TOM_USB_CAM_NUM_PENDING_CONTROL_WRITES];
+	    struct work_struct ResyncWork;
+	    
+	    // Set while a batch of writes is being queued, so they go out back to back once the batch is complete.
+	    bool HoldWrites;
+	    
+	    // Set while the work item updates a control, so s_ctrl doesn't send the value back to the camera.
+	    // Only touched with the control handler lock held.
+	    bool ResyncInProgress;
+	}
+	AsyncControlForThisCameraStruct;
+	
+	// Media requests carry the controls for the frame of the buffer queued with them. Their controls are applied
+	// one frame ahead, at the frame boundary where the buffer before theirs starts being filled, so the camera has
+	// a whole frame to take them. The control framework needs process context, so applying a request's controls and
+	// completing its buffer are both done from work items. Everything here is protected by QueuedVideoBufferListLock.
+	struct RequestControlsStruct
+	{
+	    // Requests whose controls are due, with a reference held on each.
+	    struct media_request *DueRequests[TOM_USB_CAM_NUM_DUE_REQUESTS];
+	    unsigned int DueRequestCount;
+	    struct work_struct ApplyWork;
+	    
+	    // Filled buffers that belong to a request, and every buffer filled after one, so user space still gets
+	    // them in order.
+	    struct list_head DoneBufferListHead;
+	    struct work_struct DoneWork;
+	}
+	RequestControlsForThisCameraStruct;
+	
+#ifdef CONFIG_MEDIA_CONTROLLER
+	// Needed for user space to allocate media requests.
+	struct media_device MediaDev;
+#endif
+	
+	// Buffers handed to the driver by vb2 wait on this list until the isochronous completion handler fills them.
+	// The completion handler runs in interrupt context, so a spinlock is used here instead of TomUsbCamLock.
+	struct list_head QueuedVideoBufferListHead;
+	spinlock_t QueuedVideoBufferListLock;
+	
+	// The isochronous interface the frames are streamed from. This is only set while streaming.
+	struct TomUsbCamIsochronousInputDevStruct *IsochronousInputDevStructPtr;
+	
+	// Keep track of the frame that is currently being pieced together from the isochronous payloads.
+	struct FrameAssemblyStruct
+	{
+	
+	    const struct FrameAssemblyOpsStruct *OpsPtr;
+	    
+	    // The vb2 buffer being filled, or NULL if the current frame is being skipped. Only the driver's
+	    // FrameAssemblyOpsStruct functions use it, the assembler itself goes by FrameActive and the Dst fields.
+	    struct TomUsbCamV4l2VideoBufferContainer *CurrentBufferPtr;
+	    bool FrameActive;
+	    size_t BytesUsed;
+	    
+	    // Where the frame goes: a kernel mapping of the buffer, or a dma-sg page list if it has none.
+	    unsigned char *DstVaddr;
+	    struct sg_table *DstSgTablePtr;
+	    size_t DstSize;
+	    
+	    // Where the next byte goes when the buffer is a dma-sg page list.
+	    struct scatterlist *CurrentSgPtr;
+	    size_t CurrentSgOffset;
+	    
+	    // TOM_USB_CAM_CONVERSION_* of the format being streamed, and the size of its frames. FrameLen is what the
+	    // camera sends for a whole frame, so converted frames are counted in its Yuyv bytes, BytesUsed included.
+	    int Conversion;
+	    uint32_t Width;
+	    uint32_t Height;
+	    size_t FrameLen;
+	    
+	    // The frame Id bit of the last payload, or -1 if no payload has been seen since streaming started.
+	    int8_t LastFrameId;
+	    
+	    // Whether the current frame is a still image, from the still image bit of its payloads.
+	    bool StillImage;
+	    
+	    // TOM_USB_CAM_FRAME_ERROR_* bits collected for the current frame.
+	    unsigned int ErrorFlags;
+	    
+	    // TOM_USB_CAM_FRAME_ERROR_* bits of payloads lost since the last one that arrived. Until the next payload
+	    // shows whether the frame Id toggled, it isn't known which frame they belong to.
+	    unsigned int PendingErrorFlags;
+	    
+	    // The presentation time stamp of the current frame, i.e. the device clock when its exposure started.
+	    uint32_t Pts;
+	    bool PtsValid;
+	    bool ClockSampled;
+	    
+	    uint32_t Sequence;
+	}
+	FrameAssemblyForThisCameraStruct;
+	
+	// Still images at up to the camera's full resolution, captured on a video node of their own while the main node
+	// keeps previewing. Each buffer queued on the still node gets one image. The camera sends it between the video
+	// frames (method 2) or on its bulk still endpoint (method 3) if it can, otherwise the stream is switched over to the
+	// still frame size and back, so user space never has to go through STREAMOFF, S_FMT and STREAMON for it.
+	struct StillCaptureStruct
+	{
+	    // TOM_USB_CAM_STILL_METHOD_* from the input header, and TOM_USB_CAM_STILL_CAPTURE_*.
+	    int Method;
+	    int StillCapture;
+	    
+	    // The format the still image frame descriptor belongs to, its bulk endpoint for method 3, and its image sizes
+	    // with FrameIndex the 1-based pattern index. Without the descriptor, the frame sizes of the video format.
+	    uint32_t PixelFormat;
+	    uint8_t FormatIndex;
+	    uint8_t BulkEndpointAddr;
+	    uint8_t CompressionCount;
+	    uint8_t FrameCount;
+	    struct StreamingFrameStruct Frames[TOM_USB_CAM_MAX_FRAMES_PER_FORMAT];
+	    
+	    // The still node shares TomUsbCamLock with the main node.
+	    struct video_device VideoDevice;
+	    struct vb2_queue V4l2Queue;
+	    struct v4l2_pix_format V4l2PixFormatStruct;
+	    
+	    // The still probe control block negotiated for V4l2PixFormatStruct. Once streaming, it is only valid if it was
+	    // committed too, so methods 2 and 3 are only tried when it is.
+	    unsigned char ProbeControlBlock[VideoStreamingStillProbeControlPacketLen];
+	    bool ProbeControlBlockValid;
+	    
+	    // Still buffers waiting for an image, and whether one is being filled. Protected by QueuedVideoBufferListLock.
+	    struct list_head QueuedBufferListHead;
+	    bool FrameInProgress;
+	    
+	    // Bumped for every image handed to user space, which CaptureWork waits on.
+	    unsigned int ImagesDelivered;
+	    wait_queue_head_t DeliveredWaitQueue;
+	    struct work_struct CaptureWork;
+	    
+	    // Set while the stream is switched over to the still frame size, so every frame goes to the still node.
+	    bool SwitchActive;
+	    
+	    // The frame layout of the video mode being streamed, put back at each video frame after a still image.
+	    int VideoConversion;
+	    size_t VideoFrameLen;
+	    
+	    // Method 3 payloads come from the bulk endpoint, so they get a frame assembler of their own.
+	    struct FrameAssemblyStruct BulkFrameAssembly;
+	    
+	    uint32_t Sequence;
+	}
+	StillCaptureForThisCameraStruct;
+	
+	// Maps the camera's clock to CLOCK_MONOTONIC so the frames can be stamped with when their exposure started. Each
+	// frame's first source clock reference gives a device clock value and the Usb frame it was sampled in. Reading the
+	// host's frame number next to ktime_get_ns() tells how many frames ago that was, which takes out however long the
+	// payload sat in the host controller and the Urb completion path.
+	struct ClockRecoveryStruct
+	{
+	    struct ClockSampleStruct
+	    {
+	        // Device clock with its wraps counted, and the host time of the same instant.
+	        u64 DeviceTicks;
+	        u64 HostNs;
+	    }
+	    Samples[TOM_USB_CAM_NUM_CLOCK_SAMPLES];
+	    
+	    unsigned int NextSampleIdx;
+	    unsigned int SampleCount;
+	    
+	    // The newest raw device clock value, to count wraps and to place Pts values next to it.
+	    uint32_t LastDeviceClock;
+	}
+	ClockRecoveryForThisCameraStruct;
+	
+	// Streaming statistics in /sys/kernel/debug/TomUsbCam/<camera index>/. The counters are per cpu so the Urb
+	// completion path bumps them without a lock or a shared cache line, and they are only added up when read.
+	struct StreamStatsStruct
+	{
+	    struct StreamCountersStruct __percpu *CountersPtr;
+	    
+	    // When the last frame started and a moving average of the time between frames, which the fps file is worked
+	    // out from. Only the frame assembler writes these.
+	    u64 LastFrameStartNs;
+	    u64 FrameIntervalNs;
+	    
+	    // The alt setting being streamed, 0 while stopped.
+	    u8 AltSetting;
+	    
+	    struct dentry *DebugfsDirPtr;
+	}
+	StreamStatsForThisCameraStruct;
+	
+	// Every format, frame size & frame interval the camera advertises, parsed once from the saved descriptors.
+	struct StreamingModeTableStruct
+	{
+	    uint8_t FormatCount;
+	    struct StreamingFormatStruct Formats[TOM_USB_CAM_MAX_STREAMING_FORMATS];
+	}
+	StreamingModeTableForThisCameraStruct;
+	
+	// The streaming parameters negotiated with the camera through the probe/commit controls. Every negotiation is a
+	// SET_CUR and a GET_CUR round trip, so the results are cached per (format, frame, interval) tuple. STREAMON at a
+	// mode that was already negotiated then only has to send the commit.
+	struct StreamingParametersStruct
+	{
+	
+	    // Requested frame interval in 100 ns units, or 0 to use the frame descriptor's default.
+	    uint32_t FrameInterval;
+	    
+	    // The probe control block negotiated for the current format, which is what gets committed on STREAMON.
+	    unsigned char ProbeControlBlock[VideoStreamingProbeControlPacketLen];
+	    bool ProbeControlBlockValid;
+	    
+	    struct ProbeControlCacheEntryStruct
+	    {
+	        bool Valid;
+	        uint8_t FormatIndex;
+	        uint8_t FrameIndex;
+	        uint32_t FrameInterval;
+	        unsigned char ProbeControlBlock[VideoStreamingProbeControlPacketLen];
+	    }
+	    ProbeControlCacheEntries[TOM_USB_CAM_NUM_PROBE_CONTROL_CACHE_ENTRIES];
+	    
+	    // Entries are replaced round robin once the cache is full.
+	    unsigned int NextProbeControlCacheEntryIdx;
+	    
+	    // What user space asked for while streaming in a fallback mode, put back by TomUsbCamRestoreRequestedMode().
+	    bool FallbackActive;
+	    struct v4l2_pix_format RequestedPixFormat;
+	    uint32_t RequestedFrameInterval;
+	}
+	StreamingParametersForThisCameraStruct;
+	
 	// Keep track of the all the various descriptors describing this camera.
 	struct UsbDescriptorsStruct
 	{
@@ -199,28 +1045,81 @@ struct TomUsbCamCtrlIntfDevStruct
 	    uint8_t EndpointDescriptorStructCount;
 	    uint8_t VideoDescriptorStructCount;
 	
+	    // All of these point into the arena below.
 	    struct ConfigurationDescriptorStruct *ConfigurationDescriptorStructPtr;
 	    struct InterfaceDescriptorStruct *InterfaceDescriptorStructPtr;
 	    struct EndpointDescriptorStruct *EndpointDescriptorStructPtr;
 	    struct VideoInterfaceDescriptorStruct *VideoInterfaceDescriptorStructPtr;
+	    
+	    // Direct lookup indexes holding the array index of a descriptor, or -1 if there is none. Endpoints are indexed
+	    // by [bInterfaceNumber][bAlternateSetting], VideoInterface descriptors by [ParentInterfaceAssoc][bDescriptorSubtype].
+	    uint8_t IndexedInterfaceCount;
+	    uint8_t IndexedAlternateSettingCount;
+	    uint8_t IndexedSubtypeCount;
+	    int16_t *EndpointIndexPtr;
+	    int16_t *VideoInterfaceIndexPtr;
+	    
+	    // One allocation holding the descriptor arrays, the lookup indexes and the VideoInterface VarData bytes,
+	    // so the whole lot is freed with a single kfree() at disconnect.
+	    void *DescriptorArenaPtr;
 	} 
 	UsbDescriptorsForThisCameraStruct;
 	
-	// Make sure the camera can support these changes by querying the various descriptors.
-	bool HueChangeSupported;
-    bool ContrastChangeSupported;
-    bool BrightnessChangeSupported;
+	// The controls the processing unit's bmControls says the camera has, filled in at probe.
+	struct ControlTableStruct
+	{
+	    uint8_t ProcessingUnitId;
+	    unsigned int ControlCount;
+	    struct ControlStateStruct Controls[TOM_USB_CAM_MAX_CONTROLS];
+	    
+	    // v4l2 keeps a pointer to each cluster's array, so it has to live as long as the controls.
+	    struct v4l2_ctrl *AutoClusters[ARRAY_SIZE(UvcAutoClusterTable)][2];
+	}
+	ControlTableForThisCameraStruct;
 };
 
 struct TomUsbCamIsochronousInputDevStruct 
 {
+	struct TomUsbCamDeviceStruct *DeviceStructPtr;
 	struct usb_device *UsbDevStructPtr;
 	struct usb_interface *UsbDevInterfaceStructPtr;
-	unsigned char *IsochronousInputBuffer;
+	
+	// Bytes per (micro)frame packet, including any extra high-bandwidth transactions.
 	size_t IsochronousInputBufferSize;
 	__u8 IsochronousInputEndpointAddr;
+	__u8 IsochronousInputInterfaceNumber;
+	__u8 IsochronousInputAltSetting;
+	
+	// Polling interval in (micro)frames, i.e. 2^(bInterval - 1).
+	unsigned int IsochronousInputInterval;
 	struct kref KernelRefCountStruct;
 	
+	// Ring of Urbs that are resubmitted from their own completion handler while streaming. The coherent
+	// transfer buffers are allocated once at probe time so starting a stream doesn't have to allocate anything.
+	struct urb *IsochronousUrbPtrs[TOM_USB_CAM_NUM_ISOCHRONOUS_URBS];
+	size_t IsochronousUrbBufferSize;
+	
+	// Each Urb's context, so a completed Urb can be linked onto the pending list below.
+	struct IsochronousUrbContextStruct
+	{
+	    struct urb *UrbPtr;
+	    struct TomUsbCamIsochronousInputDevStruct *IsochronousInputDevStructPtr;
+	    struct llist_node PendingUrbNode;
+	}
+	IsochronousUrbContexts[TOM_USB_CAM_NUM_ISOCHRONOUS_URBS];
+	
+	// TOM_USB_CAM_PROCESSING_STAGE_*. Unless the payloads are processed in the completion handler, completed Urbs
+	// are pushed onto PendingUrbList without taking a lock, and the kthread or work item processes and resubmits them.
+	// The kthread and workqueue are created the first time streaming starts and live until the interface goes away.
+	int ProcessingStage;
+	struct llist_head PendingUrbList;
+	struct task_struct *ProcessingThreadPtr;
+	struct workqueue_struct *ProcessingWorkQueuePtr;
+	struct work_struct ProcessingWork;
+	
+	// The control interface that owns the vb2 queue. Only set while streaming.
+	struct TomUsbCamCtrlIntfDevStruct *CtrlIntfDevStructPtr;
+	
 	//struct v4l2_device v4l2_dev;
 };
 
@@ -257,9 +1156,55 @@ static struct usb_driver TomUsbCamDriver =
 	.id_table = TomUsbCamTable,
 	.probe = TomUsbCamProbe,
 	.disconnect = TomUsbCamDisconnect,
+	
+	// Nothing in probe talks to the camera any more, the control queries run from QueryWork, so probe doesn't hold up
+	// the other devices on the hub without asking for an asynchronous probe.
 	//.unlocked_ioctl = TomUsbCamIoctl,
 };
 
+// How the frame assembler gets vb2 buffers and gives them back.
+static const struct FrameAssemblyOpsStruct TomUsbCamFrameAssemblyOps =
+{
+	.StartFrame = TomUsbCamStartFrame,
+	.AddClockSample = TomUsbCamAddClockSample,
+	.CompleteFrame = TomUsbCamCompleteFrame,
+};
+
+// Method 3 still images are assembled from the bulk endpoint's payloads straight into the still buffers.
+static const struct FrameAssemblyOpsStruct TomUsbCamBulkStillFrameAssemblyOps =
+{
+	.StartFrame = TomUsbCamStartBulkStillFrame,
+	.AddClockSample = TomUsbCamAddBulkStillClockSample,
+	.CompleteFrame = TomUsbCamCompleteBulkStillFrame,
+};
+
+// Every counter file in debugfs is one field of StreamCountersStruct, added up over the cpus.
+DEFINE_DEBUGFS_ATTRIBUTE(TomUsbCamStatsCounterFops, TomUsbCamGetStatsCounter, NULL, "%llu\n");
+
+static const struct file_operations TomUsbCamStatsFpsFops =
+{
+	.owner = THIS_MODULE,
+	.open = TomUsbCamOpenFps,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static const struct file_operations TomUsbCamStatsLatencyFops =
+{
+	.owner = THIS_MODULE,
+	.open = TomUsbCamOpenLatency,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+// /sys/module/TomUsbCam/parameters/cameras lists the attached cameras and where they are.
+static const struct kernel_param_ops TomUsbCamCamerasParamOps = 
+{
+	.get = TomUsbCamGetCameras,
+};
+
 // Specify what function should handle the V4l2 control requests from user space
 static struct v4l2_ctrl_ops TomUsbCamV4l2ControlOps = 
 {
@@ -274,9 +1219,25 @@ static struct v4l2_ctrl_ops TomUsbCamV4l2ControlOps =
 static struct v4l2_ioctl_ops TomUsbCamV4l2IoctlOps = 
 {
 	.vidioc_querycap = TomUsbCamQueryCapability,
+	.vidioc_enum_fmt_vid_cap = TomUsbCamEnumFormat,
+	.vidioc_enum_framesizes = TomUsbCamEnumFrameSizes,
+	.vidioc_enum_frameintervals = TomUsbCamEnumFrameIntervals,
 	.vidioc_try_fmt_vid_cap = TomUsbCamTryFormat,
 	.vidioc_s_fmt_vid_cap = TomUsbCamSetFormat,
 	.vidioc_g_fmt_vid_cap = TomUsbCamGetFormat,
+	.vidioc_g_parm = TomUsbCamGetStreamParameters,
+	.vidioc_s_parm = TomUsbCamSetStreamParameters,
+	
+	// The buffer ioctls are all handled by the vb2 queue attached to the video device.
+	.vidioc_reqbufs = vb2_ioctl_reqbufs,
+	.vidioc_create_bufs = vb2_ioctl_create_bufs,
+	.vidioc_prepare_buf = vb2_ioctl_prepare_buf,
+	.vidioc_querybuf = vb2_ioctl_querybuf,
+	.vidioc_qbuf = vb2_ioctl_qbuf,
+	.vidioc_dqbuf = vb2_ioctl_dqbuf,
+	.vidioc_expbuf = vb2_ioctl_expbuf,
+	.vidioc_streamon = vb2_ioctl_streamon,
+	.vidioc_streamoff = vb2_ioctl_streamoff,
 };
 
 // Specify all the available file operations on this v4l2 device. The structure is defined here:
@@ -288,7 +1249,7 @@ static struct v4l2_ioctl_ops TomUsbCamV4l2IoctlOps =
 static struct v4l2_file_operations TomUsbCamV4l2FileOps = 
 {
 	.owner =   THIS_MODULE,
-	.open =    v4l2_fh_open,
+	.open =    TomUsbCamV4l2Open,
 	.release = vb2_fop_release,
 	.unlocked_ioctl = video_ioctl2,
 	.read =    vb2_fop_read,
@@ -312,18 +1273,72 @@ static struct vb2_ops TomUsbCamV4l2QueueOps =
 
 	.queue_setup		= TomUsbCamV4l2QueueSetup,
 	.buf_prepare		= buffer_prepare,
+	.buf_finish		    = buffer_finish,
 	.buf_queue		    = buffer_queue,
+	.buf_request_complete = buffer_request_complete,
 	.start_streaming	= start_streaming,
 	.stop_streaming		= stop_streaming,
 	.wait_prepare		= vb2_ops_wait_prepare,
 	.wait_finish		= vb2_ops_wait_finish,
 };
 
+// The still node only captures, one image per buffer, so it has no frame intervals, stream parameters or requests.
+static struct v4l2_ioctl_ops TomUsbCamStillV4l2IoctlOps = 
+{
+	.vidioc_querycap = TomUsbCamQueryCapability,
+	.vidioc_enum_fmt_vid_cap = TomUsbCamStillEnumFormat,
+	.vidioc_enum_framesizes = TomUsbCamStillEnumFrameSizes,
+	.vidioc_try_fmt_vid_cap = TomUsbCamStillTryFormat,
+	.vidioc_s_fmt_vid_cap = TomUsbCamStillSetFormat,
+	.vidioc_g_fmt_vid_cap = TomUsbCamStillGetFormat,
+	.vidioc_reqbufs = vb2_ioctl_reqbufs,
+	.vidioc_create_bufs = vb2_ioctl_create_bufs,
+	.vidioc_prepare_buf = vb2_ioctl_prepare_buf,
+	.vidioc_querybuf = vb2_ioctl_querybuf,
+	.vidioc_qbuf = vb2_ioctl_qbuf,
+	.vidioc_dqbuf = vb2_ioctl_dqbuf,
+	.vidioc_expbuf = vb2_ioctl_expbuf,
+	.vidioc_streamon = vb2_ioctl_streamon,
+	.vidioc_streamoff = vb2_ioctl_streamoff,
+};
+
+static struct vb2_ops TomUsbCamStillV4l2QueueOps = 
+{
+	.queue_setup		= TomUsbCamStillQueueSetup,
+	.buf_prepare		= still_buffer_prepare,
+	.buf_queue		    = still_buffer_queue,
+	.start_streaming	= still_start_streaming,
+	.stop_streaming		= still_stop_streaming,
+	.wait_prepare		= vb2_ops_wait_prepare,
+	.wait_finish		= vb2_ops_wait_finish,
+};
+
+#ifdef CONFIG_MEDIA_CONTROLLER
+// Media requests are validated and queued by vb2.
+static const struct media_device_ops TomUsbCamMediaOps =
+{
+	.req_validate = vb2_request_validate,
+	.req_queue = vb2_request_queue,
+};
+#endif
+
 // Set up the buffer that will be used by V4l2 for video frames.
 struct TomUsbCamV4l2VideoBufferContainer 
 {
 	struct vb2_v4l2_buffer TomUsbCamV4l2VideoBuffer;
+	
+	// On the queued list until the buffer is filled, then on the done list if it has to be completed by the work item.
 	struct list_head TomUsbCamV4l2VideoBufferListHead;
+	
+	// Set once the controls of the buffer's media request are on their way to the camera.
+	bool RequestControlsScheduled;
+	enum vb2_buffer_state DoneState;
+	
+	// For the latency histograms: when the frame in the buffer ended, when its Pts says it was captured in host
+	// time, and when the buffer went back to vb2. Each is 0 until it happens, and PtsHostNs stays 0 without a Pts.
+	u64 EofNs;
+	u64 PtsHostNs;
+	u64 DoneNs;
 };
 
 #endif
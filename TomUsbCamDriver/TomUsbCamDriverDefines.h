@@ -49,10 +49,37 @@
 #define BrightnessValue 0x200
 #define ContrastValue 0x300
 #define HueValue 0x600
+// Processing unit control selectors, per table A.13 of [3]. The selector goes in the high byte of wValue and the
+// unit Id in the high byte of wIndex.
+#define ProcessingUnitBacklightCompensationControl 0x01
+#define ProcessingUnitBrightnessControl 0x02
+#define ProcessingUnitContrastControl 0x03
+#define ProcessingUnitGainControl 0x04
+#define ProcessingUnitPowerLineFrequencyControl 0x05
+#define ProcessingUnitHueControl 0x06
+#define ProcessingUnitSaturationControl 0x07
+#define ProcessingUnitSharpnessControl 0x08
+#define ProcessingUnitGammaControl 0x09
+#define ProcessingUnitWhiteBalanceTemperatureControl 0x0a
+#define ProcessingUnitWhiteBalanceTemperatureAutoControl 0x0b
+#define ProcessingUnitWhiteBalanceComponentControl 0x0c
+#define ProcessingUnitHueAutoControl 0x10
+
+// Offsets into the processing unit descriptor past bDescriptorSubtype, per table 3-8 of [3]. bmControls is
+// bControlSize bytes long, and bit N says whether the camera has the control of bit N in that table.
+#define ProcessingUnitDescriptorUnitIdOffset 0
+#define ProcessingUnitDescriptorControlSizeOffset 4
+#define ProcessingUnitDescriptorControlsOffset 5
+#define ProcessingUnitDescriptorMinLen 5
+
 #define SelectorOutputTerminalIndex 0x3 << 8
 #define SelectorProcessingUnitIndex 0x5 << 8
 #define InterfaceVideoControlIndex 0x0
 #define InterfaceVideoStreamingIndex 0x1
+
+// bInterfaceSubClass of the video interfaces, per table A.2 of [3].
+#define VideoControlInterfaceSubclass 0x1
+#define VideoStreamingInterfaceSubclass 0x2
 #define InterfaceProcessingUnitIndex 0x5
 
 #define BrightnessControlPacketLen 0x2
@@ -65,4 +92,115 @@
 #define DescriptorTypeEndpoint 0x5
 #define DescriptorTypeVideoInterface 0x24
 
+// Bits of the bmHeaderInfo byte at the start of every isochronous payload. See section 2.4.3.3 of [3].
+#define PayloadHeaderFrameIdBit 0x01
+#define PayloadHeaderEndOfFrameBit 0x02
+#define PayloadHeaderPresentationTimeBit 0x04
+#define PayloadHeaderSourceClockBit 0x08
+#define PayloadHeaderStillImageBit 0x20
+#define PayloadHeaderErrorBit 0x40
+#define PayloadHeaderEndOfHeaderBit 0x80
+
+// The header length byte and bmHeaderInfo byte are always present.
+#define PayloadHeaderMinLen 0x2
+
+// The optional header fields follow bmHeaderInfo: a 4 byte presentation time stamp if its bit is set, then a 6 byte
+// source clock reference if its bit is set. The Scr is the device clock's 32 bit value followed by the 11 bit Usb
+// frame number (Sof) it was sampled in. Both clocks count in device clock ticks, see section 2.4.3.3 of [3].
+#define PayloadHeaderPtsOffset 0x2
+#define PayloadHeaderPtsLen 0x4
+#define PayloadHeaderScrLen 0x6
+#define PayloadHeaderScrSofOffset 0x4
+#define PayloadHeaderScrSofMask 0x7ff
+
+// Usb full/high speed frames are 1 ms long. The device's frame number wraps after 2048 of them, but the host
+// controller's may wrap sooner, e.g. after 1024 or 256 on Ehci, so only the low 8 bits of the two can be compared.
+#define UsbFrameNumberDelayMask 0xff
+#define UsbFrameLenNs 1000000
+
+// A payload is seen when its Urb completes, up to a whole Urb after it arrived. A clock sample taken more than this
+// many Usb frames later than that is too stale to be trusted.
+#define UsbClockSampleSofDelayMargin 4
+
+// Video probe and commit controls, see section 4.3.1.1 of [3]. The control selector goes in the high byte of wValue
+// and the streaming interface number in wIndex.
+#define VideoStreamingProbeControlValue 0x1 << 8
+#define VideoStreamingCommitControlValue 0x2 << 8
+
+// The probe/commit control block is 26 bytes for Uvc 1.0 devices like this camera. Offsets of its fields per table 4-75 of [3].
+#define VideoStreamingProbeControlPacketLen 0x1a
+#define ProbeControlHintOffset 0
+#define ProbeControlFormatIndexOffset 2
+#define ProbeControlFrameIndexOffset 3
+#define ProbeControlFrameIntervalOffset 4
+#define ProbeControlMaxVideoFrameSizeOffset 18
+#define ProbeControlMaxPayloadTransferSizeOffset 22
+
+// bmHint bit asking the camera to keep dwFrameInterval fixed while it negotiates the rest of the block.
+#define ProbeControlHintFrameInterval 0x1
+
+// Frame intervals are in 100 ns units.
+#define FrameIntervalUnitsPerSec 10000000
+
+// Still image probe, commit and trigger controls, see sections 4.3.1.2 and 4.3.1.3 of [3]. Like the video ones, the
+// selector goes in the high byte of wValue and the streaming interface number in wIndex.
+#define VideoStreamingStillProbeControlValue 0x3 << 8
+#define VideoStreamingStillCommitControlValue 0x4 << 8
+#define VideoStreamingStillImageTriggerControlValue 0x5 << 8
+
+// The still probe/commit control block is 11 bytes. Offsets of its fields per table 4-78 of [3].
+#define VideoStreamingStillProbeControlPacketLen 0xb
+#define StillProbeControlFormatIndexOffset 0
+#define StillProbeControlFrameIndexOffset 1
+#define StillProbeControlCompressionIndexOffset 2
+#define StillProbeControlMaxVideoFrameSizeOffset 3
+#define StillProbeControlMaxPayloadTransferSizeOffset 7
+
+// bTrigger values of the 1 byte still image trigger control, per table 4-80 of [3].
+#define StillImageTriggerControlPacketLen 0x1
+#define StillImageTriggerTransmit 0x1
+#define StillImageTriggerTransmitBulk 0x2
+#define StillImageTriggerAbort 0x3
+
+// VideoStreaming interface descriptor subtypes, see table A-6 of [3].
+#define VideoStreamingInputHeaderSubtype 0x1
+#define VideoStreamingStillImageFrameSubtype 0x3
+#define VideoStreamingFormatUncompressedSubtype 0x4
+#define VideoStreamingFrameUncompressedSubtype 0x5
+#define VideoStreamingColorFormatSubtype 0xd
+
+// Offsets into the VarData of the uncompressed format and frame descriptors. VarData starts after the common
+// bLength/bDescriptorType/bDescriptorSubtype bytes, so these are 3 less than the offsets in the Uvc payload spec.
+#define FormatDescriptorFormatIndexOffset 0
+#define FormatDescriptorGuidOffset 2
+#define FormatDescriptorBitsPerPixelOffset 18
+#define FormatDescriptorDefaultFrameIndexOffset 19
+#define FormatDescriptorMinLen 27
+#define FrameDescriptorFrameIndexOffset 0
+#define FrameDescriptorWidthOffset 2
+#define FrameDescriptorHeightOffset 4
+#define FrameDescriptorDefaultFrameIntervalOffset 18
+#define FrameDescriptorFrameIntervalTypeOffset 22
+#define FrameDescriptorFrameIntervalsOffset 23
+#define FrameDescriptorMinLen 26
+#define ColorFormatDescriptorColorPrimariesOffset 0
+#define ColorFormatDescriptorTransferCharacteristicsOffset 1
+#define ColorFormatDescriptorMatrixCoefficientsOffset 2
+#define ColorFormatDescriptorMinLen 6
+
+// Offsets into the VarData of the input header and still image frame descriptors, tables 3-14 and 3-18 of [3]. The
+// still image frame descriptor lists bNumImageSizePatterns wWidth/wHeight pairs, then bNumCompressionPattern.
+#define InputHeaderStillCaptureMethodOffset 6
+#define InputHeaderMinLen 13
+#define StillFrameDescriptorEndpointAddressOffset 0
+#define StillFrameDescriptorNumImageSizePatternsOffset 1
+#define StillFrameDescriptorImageSizePatternsOffset 2
+#define StillFrameDescriptorMinLen 5
+
+// wMaxPacketSize holds the transaction size in bits 10..0 and the number of additional transactions per
+// microframe in bits 12..11. See table 9-13 of the Usb 2.0 specification.
+#define EndpointMaxPacketSizeMask 0x7ff
+#define EndpointAdditionalTransactionsShift 11
+#define EndpointAdditionalTransactionsMask 0x3
+
 #endif
@@ -0,0 +1,1012 @@
+// KUnit suite for the payload header parser and the frame assembler, and a benchmark of the copy loop. It isn't a
+// module of its own: "make KUNIT=1" includes it at the end of TomUsbCamDriver.c so it can reach the static
+// functions, and the suite runs each time the module is loaded. Needs a kernel built with CONFIG_KUNIT. Results
+// show up in the kernel log, or in /sys/kernel/debug/kunit/TomUsbCamFrameAssembly/results.
+#include <kunit/test.h>
+#include <linux/prandom.h>
+#include <linux/vmalloc.h>
+
+// The eight frame sizes of the camera's uncompressed format, see TextFileToPassDataToVirtualMachine.txt.
+struct TestFrameSizeStruct
+{
+    uint32_t Width;
+    uint32_t Height;
+};
+
+static const struct TestFrameSizeStruct TestFrameSizeTable[] =
+{
+    { 640, 480 },
+    { 800, 600 },
+    { 1280, 720 },
+    { 1600, 1200 },
+    { 352, 288 },
+    { 320, 240 },
+    { 176, 144 },
+    { 160, 120 },
+};
+
+// wMaxPacketSize of each alt setting of the streaming interface, the last one being 3 transactions of 1020 bytes.
+static const unsigned int TestPacketSizeTable[] = { 160, 208, 768, 780, 812, 976, 1020, 3 * 1020 };
+
+#define TEST_MAX_FRAME_LEN (1600 * 1200 * 2)
+#define TEST_MAX_PACKET_SIZE (3 * 1020)
+
+// What the camera puts in front of every payload: the two mandatory bytes, a Pts and an Scr.
+#define TEST_HEADER_LEN 12
+
+// Bytes past the end of the buffer that must never be written.
+#define TEST_GUARD_LEN 4096
+#define TEST_GUARD_BYTE 0xa5
+
+// TestSendFrame() flags.
+#define TEST_NO_EOF 0x01          // Leave the end-of-frame bit off the last payload.
+#define TEST_RANDOM_SPLIT 0x02    // Cut the frame at random payload lengths, with zero-length packets in between.
+#define TEST_LOSSY 0x04           // Lose about one packet in 64, the way failed isochronous packets are lost.
+#define TEST_STILL_IMAGE 0x08     // Send a method 2 still image, with the still image bit set in every header.
+#define TEST_LOSE_FIRST 0x10      // Lose the first payload, the one right after the frame Id toggle.
+
+// Stands in for the driver: hands the assembler the same buffer for every frame and records what it delivered.
+struct TestContextStruct
+{
+    struct kunit *Test;
+    struct FrameAssemblyStruct FrameAssemblyStruct;
+
+    // The buffer, or the page list standing in for a dma-sg buffer when UseSgTable is set.
+    unsigned char *BufferPtr;
+    size_t BufferSize;
+    bool UseSgTable;
+    struct sg_table SgTable;
+    struct page **PagePtrs;
+    unsigned int PageCount;
+
+    // How many more frames get a buffer, or -1 for all of them.
+    int BuffersAvailable;
+
+    // The frame the camera sends, and what the assembler should make of it.
+    unsigned char *FramePtr;
+    unsigned char *ExpectedPtr;
+    size_t ExpectedLen;
+
+    unsigned char *PacketPtr;
+    uint8_t FrameId;
+    uint32_t Pts;
+    struct rnd_state RandomState;
+
+    unsigned int FramesCompleted;
+    unsigned int FramesDamaged;
+    unsigned int ClockSamples;
+    unsigned int LastErrorFlags;
+    size_t LastBytesUsed;
+    uint32_t LastSequence;
+    bool LastStillImage;
+    bool LastPtsValid;
+    uint32_t LastPts;
+};
+
+static bool TestStartFrame(struct FrameAssemblyStruct *FrameAssemblyPtr)
+{
+
+    struct TestContextStruct *ContextPtr = container_of(FrameAssemblyPtr, struct TestContextStruct, FrameAssemblyStruct);
+
+    if (ContextPtr->BuffersAvailable == 0)
+    {
+        return false;
+    }
+
+    if (ContextPtr->BuffersAvailable > 0)
+    {
+        ContextPtr->BuffersAvailable--;
+    }
+
+    FrameAssemblyPtr->DstVaddr = ContextPtr->UseSgTable ? NULL : ContextPtr->BufferPtr;
+    FrameAssemblyPtr->DstSgTablePtr = ContextPtr->UseSgTable ? &ContextPtr->SgTable : NULL;
+    FrameAssemblyPtr->DstSize = ContextPtr->BufferSize;
+
+    return true;
+}
+
+static void TestAddClockSample(struct FrameAssemblyStruct *FrameAssemblyPtr, const unsigned char *ScrPtr)
+{
+
+    struct TestContextStruct *ContextPtr = container_of(FrameAssemblyPtr, struct TestContextStruct, FrameAssemblyStruct);
+
+    ContextPtr->ClockSamples++;
+}
+
+static void TestCompleteFrame(struct FrameAssemblyStruct *FrameAssemblyPtr)
+{
+
+    struct TestContextStruct *ContextPtr = container_of(FrameAssemblyPtr, struct TestContextStruct, FrameAssemblyStruct);
+
+    // Whatever the stream looked like, the assembler must never have written past the end of the frame.
+    if (FrameAssemblyPtr->Conversion == TOM_USB_CAM_CONVERSION_NONE)
+    {
+        KUNIT_EXPECT_LE(ContextPtr->Test, FrameAssemblyPtr->BytesUsed, FrameAssemblyPtr->DstSize);
+    }
+    else
+    {
+        KUNIT_EXPECT_LE(ContextPtr->Test, FrameAssemblyPtr->BytesUsed, FrameAssemblyPtr->FrameLen);
+    }
+
+    ContextPtr->FramesCompleted++;
+    ContextPtr->FramesDamaged += FrameAssemblyPtr->ErrorFlags ? 1 : 0;
+    ContextPtr->LastErrorFlags = FrameAssemblyPtr->ErrorFlags;
+    ContextPtr->LastBytesUsed = FrameAssemblyPtr->BytesUsed;
+    ContextPtr->LastSequence = FrameAssemblyPtr->Sequence;
+    ContextPtr->LastStillImage = FrameAssemblyPtr->StillImage;
+    ContextPtr->LastPtsValid = FrameAssemblyPtr->PtsValid;
+    ContextPtr->LastPts = FrameAssemblyPtr->Pts;
+}
+
+static const struct FrameAssemblyOpsStruct TestFrameAssemblyOps =
+{
+    .StartFrame = TestStartFrame,
+    .AddClockSample = TestAddClockSample,
+    .CompleteFrame = TestCompleteFrame,
+};
+
+// What the driver does for each converted format, one pixel at a time.
+static void TestReferenceConvert(struct TestContextStruct *ContextPtr)
+{
+
+    struct FrameAssemblyStruct *FrameAssemblyPtr = &ContextPtr->FrameAssemblyStruct;
+
+    size_t Width = FrameAssemblyPtr->Width;
+    size_t Height = FrameAssemblyPtr->Height;
+
+    for (size_t Line = 0; Line < Height; Line++)
+    {
+
+        for (size_t Pixel = 0; Pixel < Width; Pixel++)
+        {
+
+            const unsigned char *SrcPtr = ContextPtr->FramePtr + Line * Width * 2 + Pixel * 2;
+
+            ContextPtr->ExpectedPtr[Line * Width + Pixel] = SrcPtr[0];
+
+            if (FrameAssemblyPtr->Conversion == TOM_USB_CAM_CONVERSION_NV16)
+            {
+                ContextPtr->ExpectedPtr[Width * Height + Line * Width + Pixel] = SrcPtr[1];
+            }
+            else if ((FrameAssemblyPtr->Conversion == TOM_USB_CAM_CONVERSION_NV12) && !(Line & 1))
+            {
+                ContextPtr->ExpectedPtr[Width * Height + (Line / 2) * Width + Pixel] = SrcPtr[1];
+            }
+        }
+    }
+}
+
+// Make up the next frame the camera sends.
+static void TestNextFrame(struct TestContextStruct *ContextPtr)
+{
+
+    prandom_bytes_state(&ContextPtr->RandomState, ContextPtr->FramePtr, ContextPtr->FrameAssemblyStruct.FrameLen);
+
+    if (ContextPtr->FrameAssemblyStruct.Conversion == TOM_USB_CAM_CONVERSION_NONE)
+    {
+        memcpy(ContextPtr->ExpectedPtr, ContextPtr->FramePtr, ContextPtr->ExpectedLen);
+    }
+    else
+    {
+        TestReferenceConvert(ContextPtr);
+    }
+}
+
+// Start over as if streaming had just been switched on with this format.
+static void TestSetFormat(struct TestContextStruct *ContextPtr, uint32_t Width, uint32_t Height, int Conversion)
+{
+
+    struct FrameAssemblyStruct *FrameAssemblyPtr = &ContextPtr->FrameAssemblyStruct;
+
+    memset(FrameAssemblyPtr, 0, sizeof(*FrameAssemblyPtr));
+
+    FrameAssemblyPtr->OpsPtr = &TestFrameAssemblyOps;
+    FrameAssemblyPtr->LastFrameId = -1;
+    FrameAssemblyPtr->Conversion = Conversion;
+    FrameAssemblyPtr->Width = Width;
+    FrameAssemblyPtr->Height = Height;
+    FrameAssemblyPtr->FrameLen = (size_t) Width * 2 * Height;
+
+    switch (Conversion)
+    {
+        case TOM_USB_CAM_CONVERSION_GREY:
+            ContextPtr->ExpectedLen = (size_t) Width * Height;
+            break;
+        case TOM_USB_CAM_CONVERSION_NV12:
+            ContextPtr->ExpectedLen = (size_t) Width * Height * 3 / 2;
+            break;
+        default:
+            ContextPtr->ExpectedLen = FrameAssemblyPtr->FrameLen;
+            break;
+    }
+
+    ContextPtr->BufferSize = ContextPtr->ExpectedLen;
+    ContextPtr->BuffersAvailable = -1;
+    ContextPtr->FrameId = 0;
+    ContextPtr->Pts = 0;
+
+    ContextPtr->FramesCompleted = 0;
+    ContextPtr->FramesDamaged = 0;
+    ContextPtr->ClockSamples = 0;
+    ContextPtr->LastErrorFlags = 0;
+    ContextPtr->LastBytesUsed = 0;
+
+    memset(ContextPtr->BufferPtr + ContextPtr->BufferSize, TEST_GUARD_BYTE, TEST_GUARD_LEN);
+
+    TestNextFrame(ContextPtr);
+}
+
+static void TestBuildHeader(struct TestContextStruct *ContextPtr, unsigned char *PacketPtr, uint8_t FrameId, uint8_t ExtraInfo)
+{
+    PacketPtr[0] = TEST_HEADER_LEN;
+    PacketPtr[1] = PayloadHeaderEndOfHeaderBit | PayloadHeaderPresentationTimeBit | PayloadHeaderSourceClockBit | FrameId | ExtraInfo;
+
+    put_unaligned_le32(ContextPtr->Pts, PacketPtr + PayloadHeaderPtsOffset);
+    put_unaligned_le32(ContextPtr->Pts + 1000, PacketPtr + PayloadHeaderPtsOffset + PayloadHeaderPtsLen);
+    put_unaligned_le16(0, PacketPtr + PayloadHeaderPtsOffset + PayloadHeaderPtsLen + PayloadHeaderScrSofOffset);
+}
+
+// Send the end of whatever frame was in flight when streaming started. The assembler skips it, and starts with the
+// next frame.
+static void TestSync(struct TestContextStruct *ContextPtr)
+{
+
+    TestBuildHeader(ContextPtr, ContextPtr->PacketPtr, ContextPtr->FrameId, PayloadHeaderEndOfFrameBit);
+
+    TomUsbCamProcessPayload(&ContextPtr->FrameAssemblyStruct, ContextPtr->PacketPtr, TEST_HEADER_LEN);
+}
+
+// Toggle the frame Id and send the first SendLen bytes of the frame the way the camera does, in payloads of at most
+// PacketSize bytes including the header. Returns how many packets were lost.
+static unsigned int TestSendFrame(struct TestContextStruct *ContextPtr, size_t SendLen, unsigned int PacketSize, unsigned int Flags)
+{
+
+    struct FrameAssemblyStruct *FrameAssemblyPtr = &ContextPtr->FrameAssemblyStruct;
+
+    unsigned int LostPackets = 0;
+    size_t Offset = 0;
+
+    ContextPtr->FrameId ^= PayloadHeaderFrameIdBit;
+    ContextPtr->Pts += 1000;
+
+    do
+    {
+
+        size_t ChunkLen = PacketSize - TEST_HEADER_LEN;
+
+        if (Flags & TEST_RANDOM_SPLIT)
+        {
+            ChunkLen = prandom_u32_state(&ContextPtr->RandomState) % (ChunkLen + 1);
+        }
+
+        ChunkLen = min(ChunkLen, SendLen - Offset);
+
+        bool LastPacket = (Offset + ChunkLen == SendLen);
+
+        TestBuildHeader(ContextPtr, ContextPtr->PacketPtr, ContextPtr->FrameId,
+                        ((LastPacket && !(Flags & TEST_NO_EOF)) ? PayloadHeaderEndOfFrameBit : 0) |
+                        ((Flags & TEST_STILL_IMAGE) ? PayloadHeaderStillImageBit : 0));
+
+        memcpy(ContextPtr->PacketPtr + TEST_HEADER_LEN, ContextPtr->FramePtr + Offset, ChunkLen);
+
+        bool FirstPacket = (Offset == 0);
+
+        Offset += ChunkLen;
+
+        // Same as TomUsbCamProcessUrbPackets() does for a packet that completed with an error. Only packets with data
+        // are lost, so every frame that loses one is damaged.
+        if (ChunkLen && (((Flags & TEST_LOSE_FIRST) && FirstPacket) ||
+                         ((Flags & TEST_LOSSY) && (prandom_u32_state(&ContextPtr->RandomState) % 64 == 0))))
+        {
+            FrameAssemblyPtr->PendingErrorFlags |= TOM_USB_CAM_FRAME_ERROR_PACKET;
+            LostPackets++;
+            continue;
+        }
+
+        TomUsbCamProcessPayload(FrameAssemblyPtr, ContextPtr->PacketPtr, TEST_HEADER_LEN + ChunkLen);
+
+        if ((Flags & TEST_RANDOM_SPLIT) && (prandom_u32_state(&ContextPtr->RandomState) % 16 == 0))
+        {
+            TomUsbCamProcessPayload(FrameAssemblyPtr, ContextPtr->PacketPtr, 0);
+        }
+    }
+    while (Offset < SendLen);
+
+    return LostPackets;
+}
+
+// Whether the buffer holds what the assembler should have made of the last frame, and nothing was written past it.
+static bool TestFrameMatches(struct TestContextStruct *ContextPtr)
+{
+
+    if (memchr_inv(ContextPtr->BufferPtr + ContextPtr->BufferSize, TEST_GUARD_BYTE, TEST_GUARD_LEN))
+    {
+        return false;
+    }
+
+    if (!ContextPtr->UseSgTable)
+    {
+        return memcmp(ContextPtr->BufferPtr, ContextPtr->ExpectedPtr, ContextPtr->ExpectedLen) == 0;
+    }
+
+    for (unsigned int PageIdx = 0; PageIdx < ContextPtr->PageCount; PageIdx++)
+    {
+
+        size_t Offset = (size_t) PageIdx * PAGE_SIZE;
+
+        if (memcmp(page_address(ContextPtr->PagePtrs[PageIdx]), ContextPtr->ExpectedPtr + Offset,
+                   min_t(size_t, PAGE_SIZE, ContextPtr->ExpectedLen - Offset)))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Build a page list for the current format, one page per entry unless the allocator happens to hand out
+// neighbouring pages.
+static int TestUseSgTable(struct TestContextStruct *ContextPtr)
+{
+
+    ContextPtr->PageCount = DIV_ROUND_UP(ContextPtr->BufferSize, PAGE_SIZE);
+    ContextPtr->PagePtrs = kcalloc(ContextPtr->PageCount, sizeof(struct page *), GFP_KERNEL);
+
+    if (!ContextPtr->PagePtrs)
+    {
+        return -ENOMEM;
+    }
+
+    for (unsigned int PageIdx = 0; PageIdx < ContextPtr->PageCount; PageIdx++)
+    {
+
+        ContextPtr->PagePtrs[PageIdx] = alloc_page(GFP_KERNEL);
+
+        if (!ContextPtr->PagePtrs[PageIdx])
+        {
+            return -ENOMEM;
+        }
+    }
+
+    int SgReturnCode = sg_alloc_table_from_pages(&ContextPtr->SgTable, ContextPtr->PagePtrs, ContextPtr->PageCount, 0,
+                                                 ContextPtr->BufferSize, GFP_KERNEL);
+
+    ContextPtr->UseSgTable = (SgReturnCode == 0);
+
+    return SgReturnCode;
+}
+
+static void TestFreeSgTable(struct TestContextStruct *ContextPtr)
+{
+
+    if (ContextPtr->UseSgTable)
+    {
+        sg_free_table(&ContextPtr->SgTable);
+        ContextPtr->UseSgTable = false;
+    }
+
+    if (ContextPtr->PagePtrs)
+    {
+
+        for (unsigned int PageIdx = 0; PageIdx < ContextPtr->PageCount; PageIdx++)
+        {
+
+            if (ContextPtr->PagePtrs[PageIdx])
+            {
+                __free_page(ContextPtr->PagePtrs[PageIdx]);
+            }
+        }
+
+        kfree(ContextPtr->PagePtrs);
+        ContextPtr->PagePtrs = NULL;
+    }
+}
+
+static int TestInit(struct kunit *Test)
+{
+
+    struct TestContextStruct *ContextPtr = kunit_kzalloc(Test, sizeof(*ContextPtr), GFP_KERNEL);
+
+    if (!ContextPtr)
+    {
+        return -ENOMEM;
+    }
+
+    ContextPtr->Test = Test;
+    ContextPtr->BufferPtr = vmalloc(TEST_MAX_FRAME_LEN + TEST_GUARD_LEN);
+    ContextPtr->FramePtr = vmalloc(TEST_MAX_FRAME_LEN);
+    ContextPtr->ExpectedPtr = vmalloc(TEST_MAX_FRAME_LEN);
+    ContextPtr->PacketPtr = kunit_kmalloc(Test, TEST_MAX_PACKET_SIZE, GFP_KERNEL);
+
+    prandom_seed_state(&ContextPtr->RandomState, 0x109);
+
+    Test->priv = ContextPtr;
+
+    if (!ContextPtr->BufferPtr || !ContextPtr->FramePtr || !ContextPtr->ExpectedPtr || !ContextPtr->PacketPtr)
+    {
+        return -ENOMEM;
+    }
+
+    TestSetFormat(ContextPtr, 320, 240, TOM_USB_CAM_CONVERSION_NONE);
+
+    return 0;
+}
+
+static void TestExit(struct kunit *Test)
+{
+
+    struct TestContextStruct *ContextPtr = Test->priv;
+
+    if (!ContextPtr)
+    {
+        return;
+    }
+
+    TestFreeSgTable(ContextPtr);
+
+    vfree(ContextPtr->BufferPtr);
+    vfree(ContextPtr->FramePtr);
+    vfree(ContextPtr->ExpectedPtr);
+}
+
+//***********************************************************************************************
+
+// Test cases
+
+//***********************************************************************************************
+
+static void TestParsePayloadHeader(struct kunit *Test)
+{
+
+    struct PayloadHeaderStruct PayloadHeader;
+
+    unsigned char PayloadBytes[16] = { 0 };
+
+    // Zero-length packets, and a lone byte that can't hold a header, are simply nothing to do.
+    KUNIT_EXPECT_EQ(Test, TomUsbCamParsePayloadHeader(PayloadBytes, 0, &PayloadHeader), -ENODATA);
+    KUNIT_EXPECT_EQ(Test, TomUsbCamParsePayloadHeader(PayloadBytes, 1, &PayloadHeader), -ENODATA);
+
+    // A header can't be shorter than its two mandatory bytes, or longer than its payload.
+    PayloadBytes[0] = 1;
+    KUNIT_EXPECT_EQ(Test, TomUsbCamParsePayloadHeader(PayloadBytes, sizeof(PayloadBytes), &PayloadHeader), -EPROTO);
+
+    PayloadBytes[0] = 12;
+    KUNIT_EXPECT_EQ(Test, TomUsbCamParsePayloadHeader(PayloadBytes, 11, &PayloadHeader), -EPROTO);
+
+    // Just the two mandatory bytes.
+    PayloadBytes[0] = 2;
+    PayloadBytes[1] = PayloadHeaderEndOfHeaderBit | PayloadHeaderEndOfFrameBit | PayloadHeaderFrameIdBit;
+    KUNIT_ASSERT_EQ(Test, TomUsbCamParsePayloadHeader(PayloadBytes, 2, &PayloadHeader), 0);
+    KUNIT_EXPECT_EQ(Test, PayloadHeader.HeaderLen, 2);
+    KUNIT_EXPECT_EQ(Test, PayloadHeader.HeaderInfo, PayloadBytes[1]);
+    KUNIT_EXPECT_FALSE(Test, PayloadHeader.PtsValid);
+    KUNIT_EXPECT_NULL(Test, PayloadHeader.ScrPtr);
+
+    // Pts and Scr, little endian and not aligned.
+    PayloadBytes[0] = 12;
+    PayloadBytes[1] = PayloadHeaderEndOfHeaderBit | PayloadHeaderPresentationTimeBit | PayloadHeaderSourceClockBit;
+    put_unaligned_le32(0x12345678, PayloadBytes + 2);
+    KUNIT_ASSERT_EQ(Test, TomUsbCamParsePayloadHeader(PayloadBytes, 12, &PayloadHeader), 0);
+    KUNIT_EXPECT_TRUE(Test, PayloadHeader.PtsValid);
+    KUNIT_EXPECT_EQ(Test, PayloadHeader.Pts, 0x12345678);
+    KUNIT_EXPECT_PTR_EQ(Test, PayloadHeader.ScrPtr, (const unsigned char *) PayloadBytes + 6);
+
+    // Scr without Pts comes straight after the mandatory bytes.
+    PayloadBytes[0] = 8;
+    PayloadBytes[1] = PayloadHeaderEndOfHeaderBit | PayloadHeaderSourceClockBit;
+    KUNIT_ASSERT_EQ(Test, TomUsbCamParsePayloadHeader(PayloadBytes, 8, &PayloadHeader), 0);
+    KUNIT_EXPECT_FALSE(Test, PayloadHeader.PtsValid);
+    KUNIT_EXPECT_PTR_EQ(Test, PayloadHeader.ScrPtr, (const unsigned char *) PayloadBytes + 2);
+
+    // Flags for fields the header is too short to hold are ignored.
+    PayloadBytes[0] = 2;
+    PayloadBytes[1] = PayloadHeaderEndOfHeaderBit | PayloadHeaderPresentationTimeBit | PayloadHeaderSourceClockBit;
+    KUNIT_ASSERT_EQ(Test, TomUsbCamParsePayloadHeader(PayloadBytes, sizeof(PayloadBytes), &PayloadHeader), 0);
+    KUNIT_EXPECT_FALSE(Test, PayloadHeader.PtsValid);
+    KUNIT_EXPECT_NULL(Test, PayloadHeader.ScrPtr);
+}
+
+// The frame in flight when streaming starts is skipped, everything after it is delivered whole, with its Pts and
+// one clock sample per frame.
+static void TestFirstFrameSkipped(struct kunit *Test)
+{
+
+    struct TestContextStruct *ContextPtr = Test->priv;
+
+    TestSendFrame(ContextPtr, ContextPtr->FrameAssemblyStruct.FrameLen, 1020, 0);
+    KUNIT_EXPECT_EQ(Test, ContextPtr->FramesCompleted, 0);
+
+    for (int FrameIdx = 0; FrameIdx < 3; FrameIdx++)
+    {
+
+        TestNextFrame(ContextPtr);
+        TestSendFrame(ContextPtr, ContextPtr->FrameAssemblyStruct.FrameLen, 1020, 0);
+
+        KUNIT_EXPECT_EQ(Test, ContextPtr->FramesCompleted, FrameIdx + 1);
+        KUNIT_EXPECT_EQ(Test, ContextPtr->LastErrorFlags, 0);
+        KUNIT_EXPECT_EQ(Test, ContextPtr->LastSequence, FrameIdx);
+        KUNIT_EXPECT_TRUE(Test, ContextPtr->LastPtsValid);
+        KUNIT_EXPECT_EQ(Test, ContextPtr->LastPts, ContextPtr->Pts);
+        KUNIT_EXPECT_TRUE(Test, TestFrameMatches(ContextPtr));
+    }
+
+    KUNIT_EXPECT_EQ(Test, ContextPtr->ClockSamples, 4);
+}
+
+// A frame Id toggle without an end-of-frame bit finishes the previous frame, flagged.
+static void TestMissingEndOfFrame(struct kunit *Test)
+{
+
+    struct TestContextStruct *ContextPtr = Test->priv;
+    size_t FrameLen = ContextPtr->FrameAssemblyStruct.FrameLen;
+
+    TestSync(ContextPtr);
+
+    TestSendFrame(ContextPtr, FrameLen, 1020, TEST_NO_EOF);
+    KUNIT_EXPECT_EQ(Test, ContextPtr->FramesCompleted, 0);
+
+    TestSendFrame(ContextPtr, FrameLen / 2, 1020, TEST_NO_EOF);
+    KUNIT_EXPECT_EQ(Test, ContextPtr->FramesCompleted, 1);
+    KUNIT_EXPECT_EQ(Test, ContextPtr->LastErrorFlags, TOM_USB_CAM_FRAME_ERROR_NO_EOF);
+    KUNIT_EXPECT_EQ(Test, ContextPtr->LastBytesUsed, FrameLen);
+
+    TestNextFrame(ContextPtr);
+    TestSendFrame(ContextPtr, FrameLen, 1020, 0);
+    KUNIT_EXPECT_EQ(Test, ContextPtr->FramesCompleted, 3);
+    KUNIT_EXPECT_EQ(Test, ContextPtr->FramesDamaged, 2);
+    KUNIT_EXPECT_EQ(Test, ContextPtr->LastErrorFlags, 0);
+    KUNIT_EXPECT_TRUE(Test, TestFrameMatches(ContextPtr));
+}
+
+// The end-of-frame bit can come on a payload with no data, and payloads after it with the same frame Id are ignored.
+static void TestEndOfFrameEdgeCases(struct kunit *Test)
+{
+
+    struct TestContextStruct *ContextPtr = Test->priv;
+    size_t FrameLen = ContextPtr->FrameAssemblyStruct.FrameLen;
+
+    TestSync(ContextPtr);
+
+    TestSendFrame(ContextPtr, FrameLen, 1020, TEST_NO_EOF);
+
+    TestBuildHeader(ContextPtr, ContextPtr->PacketPtr, ContextPtr->FrameId, PayloadHeaderEndOfFrameBit);
+    TomUsbCamProcessPayload(&ContextPtr->FrameAssemblyStruct, ContextPtr->PacketPtr, TEST_HEADER_LEN);
+
+    KUNIT_EXPECT_EQ(Test, ContextPtr->FramesCompleted, 1);
+    KUNIT_EXPECT_EQ(Test, ContextPtr->LastErrorFlags, 0);
+    KUNIT_EXPECT_TRUE(Test, TestFrameMatches(ContextPtr));
+
+    // Stray data and a second end-of-frame bit don't start or finish anything.
+    memset(ContextPtr->PacketPtr + TEST_HEADER_LEN, 0, 500);
+    TomUsbCamProcessPayload(&ContextPtr->FrameAssemblyStruct, ContextPtr->PacketPtr, TEST_HEADER_LEN + 500);
+    TestBuildHeader(ContextPtr, ContextPtr->PacketPtr, ContextPtr->FrameId, 0);
+    TomUsbCamProcessPayload(&ContextPtr->FrameAssemblyStruct, ContextPtr->PacketPtr, TEST_HEADER_LEN + 500);
+
+    KUNIT_EXPECT_EQ(Test, ContextPtr->FramesCompleted, 1);
+    KUNIT_EXPECT_TRUE(Test, TestFrameMatches(ContextPtr));
+
+    // An end-of-frame bit on the first payload of a frame makes a short frame.
+    TestSendFrame(ContextPtr, 100, 1020, 0);
+    KUNIT_EXPECT_EQ(Test, ContextPtr->FramesCompleted, 2);
+    KUNIT_EXPECT_EQ(Test, ContextPtr->LastErrorFlags, TOM_USB_CAM_FRAME_ERROR_SHORT);
+    KUNIT_EXPECT_EQ(Test, ContextPtr->LastBytesUsed, 100);
+}
+
+// The camera's error bit, malformed headers and frames longer than the buffer are flagged, without writing past it.
+static void TestDamagedPayloads(struct kunit *Test)
+{
+
+    struct TestContextStruct *ContextPtr = Test->priv;
+    size_t FrameLen = ContextPtr->FrameAssemblyStruct.FrameLen;
+
+    TestSync(ContextPtr);
+
+    TestSendFrame(ContextPtr, FrameLen, 1020, TEST_NO_EOF);
+    TestBuildHeader(ContextPtr, ContextPtr->PacketPtr, ContextPtr->FrameId, PayloadHeaderErrorBit | PayloadHeaderEndOfFrameBit);
+    TomUsbCamProcessPayload(&ContextPtr->FrameAssemblyStruct, ContextPtr->PacketPtr, TEST_HEADER_LEN);
+    KUNIT_EXPECT_EQ(Test, ContextPtr->LastErrorFlags, TOM_USB_CAM_FRAME_ERROR_HEADER);
+
+    TestSendFrame(ContextPtr, FrameLen, 1020, TEST_NO_EOF);
+    ContextPtr->PacketPtr[0] = 200;
+    ContextPtr->PacketPtr[1] = PayloadHeaderEndOfHeaderBit | ContextPtr->FrameId;
+    TomUsbCamProcessPayload(&ContextPtr->FrameAssemblyStruct, ContextPtr->PacketPtr, 100);
+    TestBuildHeader(ContextPtr, ContextPtr->PacketPtr, ContextPtr->FrameId, PayloadHeaderEndOfFrameBit);
+    TomUsbCamProcessPayload(&ContextPtr->FrameAssemblyStruct, ContextPtr->PacketPtr, TEST_HEADER_LEN);
+    KUNIT_EXPECT_EQ(Test, ContextPtr->LastErrorFlags, TOM_USB_CAM_FRAME_ERROR_HEADER);
+
+    TestNextFrame(ContextPtr);
+    TestSendFrame(ContextPtr, FrameLen + 3000, 1020, 0);
+    KUNIT_EXPECT_EQ(Test, ContextPtr->FramesCompleted, 3);
+    KUNIT_EXPECT_EQ(Test, ContextPtr->LastErrorFlags, TOM_USB_CAM_FRAME_ERROR_OVERFLOW);
+    KUNIT_EXPECT_EQ(Test, ContextPtr->LastBytesUsed, FrameLen);
+    KUNIT_EXPECT_TRUE(Test, TestFrameMatches(ContextPtr));
+}
+
+// Frames that start while user space has no buffer queued are skipped whole, but still use up their sequence numbers.
+static void TestNoBufferQueued(struct kunit *Test)
+{
+
+    struct TestContextStruct *ContextPtr = Test->priv;
+    size_t FrameLen = ContextPtr->FrameAssemblyStruct.FrameLen;
+
+    TestSync(ContextPtr);
+
+    ContextPtr->BuffersAvailable = 1;
+
+    for (int FrameIdx = 0; FrameIdx < 3; FrameIdx++)
+    {
+        TestNextFrame(ContextPtr);
+        TestSendFrame(ContextPtr, FrameLen, 1020, 0);
+    }
+
+    KUNIT_EXPECT_EQ(Test, ContextPtr->FramesCompleted, 1);
+    KUNIT_EXPECT_EQ(Test, ContextPtr->LastSequence, 0);
+
+    ContextPtr->BuffersAvailable = -1;
+
+    // Frames 1 and 2 were skipped.
+    TestNextFrame(ContextPtr);
+    TestSendFrame(ContextPtr, FrameLen, 1020, 0);
+    KUNIT_EXPECT_EQ(Test, ContextPtr->FramesCompleted, 2);
+    KUNIT_EXPECT_EQ(Test, ContextPtr->LastSequence, 3);
+    KUNIT_EXPECT_EQ(Test, ContextPtr->LastErrorFlags, 0);
+    KUNIT_EXPECT_TRUE(Test, TestFrameMatches(ContextPtr));
+}
+
+// A still image sent between two video frames is flagged as one, and doesn't use up a video sequence number.
+static void TestStillImageFrame(struct kunit *Test)
+{
+
+    struct TestContextStruct *ContextPtr = Test->priv;
+    size_t FrameLen = ContextPtr->FrameAssemblyStruct.FrameLen;
+
+    TestSync(ContextPtr);
+
+    TestNextFrame(ContextPtr);
+    TestSendFrame(ContextPtr, FrameLen, 1020, 0);
+    KUNIT_EXPECT_EQ(Test, ContextPtr->LastSequence, 0);
+    KUNIT_EXPECT_FALSE(Test, ContextPtr->LastStillImage);
+
+    TestNextFrame(ContextPtr);
+    TestSendFrame(ContextPtr, FrameLen, 1020, TEST_STILL_IMAGE);
+    KUNIT_EXPECT_EQ(Test, ContextPtr->FramesCompleted, 2);
+    KUNIT_EXPECT_TRUE(Test, ContextPtr->LastStillImage);
+    KUNIT_EXPECT_EQ(Test, ContextPtr->LastSequence, 1);
+    KUNIT_EXPECT_EQ(Test, ContextPtr->LastErrorFlags, 0);
+    KUNIT_EXPECT_TRUE(Test, TestFrameMatches(ContextPtr));
+
+    TestNextFrame(ContextPtr);
+    TestSendFrame(ContextPtr, FrameLen, 1020, 0);
+    KUNIT_EXPECT_EQ(Test, ContextPtr->FramesCompleted, 3);
+    KUNIT_EXPECT_FALSE(Test, ContextPtr->LastStillImage);
+    KUNIT_EXPECT_EQ(Test, ContextPtr->LastSequence, 1);
+    KUNIT_EXPECT_TRUE(Test, TestFrameMatches(ContextPtr));
+}
+
+// Every frame that lost a packet is flagged, every other one is delivered intact, and no frame goes missing.
+static void TestLossyStream(struct kunit *Test)
+{
+
+    struct TestContextStruct *ContextPtr = Test->priv;
+    size_t FrameLen = ContextPtr->FrameAssemblyStruct.FrameLen;
+    unsigned int LossyFrames = 0;
+    const unsigned int FrameCount = 200;
+
+    TestSync(ContextPtr);
+
+    for (unsigned int FrameIdx = 0; FrameIdx < FrameCount; FrameIdx++)
+    {
+
+        TestNextFrame(ContextPtr);
+
+        if (TestSendFrame(ContextPtr, FrameLen, 1020, TEST_LOSSY | TEST_RANDOM_SPLIT))
+        {
+            LossyFrames++;
+        }
+        else
+        {
+            KUNIT_EXPECT_EQ(Test, ContextPtr->FramesCompleted, FrameIdx + 1);
+            KUNIT_EXPECT_EQ(Test, ContextPtr->LastErrorFlags, 0);
+            KUNIT_EXPECT_TRUE(Test, TestFrameMatches(ContextPtr));
+        }
+    }
+
+    // A frame that lost its end-of-frame payload is only finished by the next one.
+    TestSendFrame(ContextPtr, FrameLen, 1020, 0);
+
+    KUNIT_EXPECT_GT(Test, LossyFrames, 0);
+    KUNIT_EXPECT_EQ(Test, ContextPtr->FramesCompleted, FrameCount + 1);
+    KUNIT_EXPECT_EQ(Test, ContextPtr->FramesDamaged, LossyFrames);
+    KUNIT_EXPECT_EQ(Test, ContextPtr->LastSequence, FrameCount);
+
+    // The payload lost right after the toggle was the head of the new frame, not the tail of the intact one before.
+    TestNextFrame(ContextPtr);
+    TestSendFrame(ContextPtr, FrameLen, 1020, TEST_LOSE_FIRST);
+
+    KUNIT_EXPECT_EQ(Test, ContextPtr->FramesCompleted, FrameCount + 2);
+    KUNIT_EXPECT_EQ(Test, ContextPtr->FramesDamaged, LossyFrames + 1);
+    KUNIT_EXPECT_TRUE(Test, ContextPtr->LastErrorFlags & TOM_USB_CAM_FRAME_ERROR_PACKET);
+    KUNIT_EXPECT_EQ(Test, ContextPtr->LastSequence, FrameCount + 1);
+
+    // And the frame after it doesn't inherit anything.
+    TestNextFrame(ContextPtr);
+    TestSendFrame(ContextPtr, FrameLen, 1020, 0);
+
+    KUNIT_EXPECT_EQ(Test, ContextPtr->FramesCompleted, FrameCount + 3);
+    KUNIT_EXPECT_EQ(Test, ContextPtr->LastErrorFlags, 0);
+    KUNIT_EXPECT_TRUE(Test, TestFrameMatches(ContextPtr));
+}
+
+// Random payloads, every conversion. Nothing may be written past the buffer, and the next good frame after the noise
+// has to come through intact.
+static void TestFuzzedStream(struct kunit *Test)
+{
+
+    struct TestContextStruct *ContextPtr = Test->priv;
+
+    for (int Conversion = TOM_USB_CAM_CONVERSION_NONE; Conversion <= TOM_USB_CAM_CONVERSION_NV12; Conversion++)
+    {
+
+        TestSetFormat(ContextPtr, 320, 240, Conversion);
+        TestSync(ContextPtr);
+
+        for (int PacketIdx = 0; PacketIdx < 20000; PacketIdx++)
+        {
+
+            unsigned int PayloadLen = prandom_u32_state(&ContextPtr->RandomState) % (TEST_MAX_PACKET_SIZE + 1);
+
+            prandom_bytes_state(&ContextPtr->RandomState, ContextPtr->PacketPtr, PayloadLen);
+
+            // Mostly plausible header lengths, or the noise would hardly ever get past the parser.
+            if ((PayloadLen >= 2) && (prandom_u32_state(&ContextPtr->RandomState) & 1))
+            {
+                ContextPtr->PacketPtr[0] = 2 + prandom_u32_state(&ContextPtr->RandomState) % 11;
+            }
+
+            TomUsbCamProcessPayload(&ContextPtr->FrameAssemblyStruct, ContextPtr->PacketPtr, PayloadLen);
+        }
+
+        KUNIT_EXPECT_GT(Test, ContextPtr->FramesCompleted, 0);
+
+        ContextPtr->FrameId = ContextPtr->FrameAssemblyStruct.LastFrameId & PayloadHeaderFrameIdBit;
+
+        TestNextFrame(ContextPtr);
+        TestSendFrame(ContextPtr, ContextPtr->FrameAssemblyStruct.FrameLen, 1020, TEST_RANDOM_SPLIT);
+
+        KUNIT_EXPECT_EQ(Test, ContextPtr->LastErrorFlags, 0);
+        KUNIT_EXPECT_TRUE(Test, TestFrameMatches(ContextPtr));
+    }
+}
+
+static void TestFrameSizeDescription(const struct TestFrameSizeStruct *FrameSizePtr, char *DescriptionPtr)
+{
+    snprintf(DescriptionPtr, KUNIT_PARAM_DESC_SIZE, "%ux%u", FrameSizePtr->Width, FrameSizePtr->Height);
+}
+
+KUNIT_ARRAY_PARAM(TestFrameSize, TestFrameSizeTable, TestFrameSizeDescription);
+
+// Every frame size of the camera, as Yuyv and converted, cut at random payload lengths.
+static void TestFrameSizes(struct kunit *Test)
+{
+
+    struct TestContextStruct *ContextPtr = Test->priv;
+    const struct TestFrameSizeStruct *FrameSizePtr = Test->param_value;
+
+    for (int Conversion = TOM_USB_CAM_CONVERSION_NONE; Conversion <= TOM_USB_CAM_CONVERSION_NV12; Conversion++)
+    {
+
+        TestSetFormat(ContextPtr, FrameSizePtr->Width, FrameSizePtr->Height, Conversion);
+        TestSync(ContextPtr);
+
+        for (int FrameIdx = 0; FrameIdx < 2; FrameIdx++)
+        {
+
+            TestNextFrame(ContextPtr);
+            TestSendFrame(ContextPtr, ContextPtr->FrameAssemblyStruct.FrameLen, TEST_MAX_PACKET_SIZE, TEST_RANDOM_SPLIT);
+
+            KUNIT_EXPECT_EQ(Test, ContextPtr->FramesCompleted, FrameIdx + 1);
+            KUNIT_EXPECT_EQ(Test, ContextPtr->LastErrorFlags, 0);
+            KUNIT_EXPECT_TRUE_MSG(Test, TestFrameMatches(ContextPtr), "conversion %d", Conversion);
+        }
+    }
+}
+
+// sizeimage and bytesused go by each format's own bits per pixel, not by the Yuyv bytes the camera sends.
+static void TestFormatSizes(struct kunit *Test)
+{
+
+    struct TestContextStruct *ContextPtr = Test->priv;
+    struct StreamingFormatStruct FormatStruct = { .BitsPerPixel = 16, .Conversion = TOM_USB_CAM_CONVERSION_NONE };
+
+    // The camera's own Yuyv first, then every converted format.
+    for (int FormatIdx = -1; FormatIdx < (int) ARRAY_SIZE(ConvertedFormatTable); FormatIdx++)
+    {
+
+        if (FormatIdx >= 0)
+        {
+            FormatStruct.BitsPerPixel = ConvertedFormatTable[FormatIdx].BitsPerPixel;
+            FormatStruct.Conversion = ConvertedFormatTable[FormatIdx].Conversion;
+        }
+
+        TestSetFormat(ContextPtr, 640, 480, FormatStruct.Conversion);
+
+        size_t FrameLen = ContextPtr->FrameAssemblyStruct.FrameLen;
+        size_t ExpectedLen = ContextPtr->ExpectedLen;
+
+        // A camera asking for exactly the Yuyv frame, and one asking for twice that.
+        KUNIT_EXPECT_EQ_MSG(Test, TomUsbCamFormatSizeImage(&FormatStruct, ExpectedLen, FrameLen), ExpectedLen,
+                            "conversion %d", FormatStruct.Conversion);
+        KUNIT_EXPECT_EQ_MSG(Test, TomUsbCamFormatSizeImage(&FormatStruct, ExpectedLen, 2 * FrameLen), 2 * ExpectedLen,
+                            "conversion %d", FormatStruct.Conversion);
+
+        TestSync(ContextPtr);
+        TestNextFrame(ContextPtr);
+        TestSendFrame(ContextPtr, FrameLen, 1020, 0);
+
+        KUNIT_EXPECT_EQ(Test, ContextPtr->FramesCompleted, 1);
+        KUNIT_EXPECT_EQ_MSG(Test, TomUsbCamFormatLen(&FormatStruct, ContextPtr->LastBytesUsed), ExpectedLen,
+                            "conversion %d", FormatStruct.Conversion);
+        KUNIT_EXPECT_TRUE(Test, TestFrameMatches(ContextPtr));
+    }
+}
+
+// Page lists are filled through the cursor, across page boundaries at any offset.
+static void TestDmaSgBuffer(struct kunit *Test)
+{
+
+    struct TestContextStruct *ContextPtr = Test->priv;
+
+    TestSetFormat(ContextPtr, 640, 480, TOM_USB_CAM_CONVERSION_NONE);
+
+    KUNIT_ASSERT_EQ(Test, TestUseSgTable(ContextPtr), 0);
+
+    TestSync(ContextPtr);
+
+    for (int FrameIdx = 0; FrameIdx < 3; FrameIdx++)
+    {
+
+        TestNextFrame(ContextPtr);
+        TestSendFrame(ContextPtr, ContextPtr->FrameAssemblyStruct.FrameLen, TEST_MAX_PACKET_SIZE, TEST_RANDOM_SPLIT);
+
+        KUNIT_EXPECT_EQ(Test, ContextPtr->LastErrorFlags, 0);
+        KUNIT_EXPECT_TRUE(Test, TestFrameMatches(ContextPtr));
+    }
+}
+
+//***********************************************************************************************
+
+// Benchmark
+
+//***********************************************************************************************
+
+// Cut both frame Ids of a 640x480 Yuyv frame into payloads of PacketSize bytes ahead of time, so the measurement is
+// only the assembler.
+static unsigned char *TestBuildPacketTrain(struct TestContextStruct *ContextPtr, unsigned int PacketSize, unsigned int *PacketCountPtr)
+{
+
+    size_t FrameLen = ContextPtr->FrameAssemblyStruct.FrameLen;
+    unsigned int PacketCount = DIV_ROUND_UP(FrameLen, PacketSize - TEST_HEADER_LEN);
+    unsigned char *TrainPtr = vmalloc((size_t) 2 * PacketCount * PacketSize);
+
+    if (!TrainPtr)
+    {
+        return NULL;
+    }
+
+    for (uint8_t FrameId = 0; FrameId < 2; FrameId++)
+    {
+
+        for (unsigned int PacketIdx = 0; PacketIdx < PacketCount; PacketIdx++)
+        {
+
+            unsigned char *PacketPtr = TrainPtr + ((size_t) FrameId * PacketCount + PacketIdx) * PacketSize;
+            size_t Offset = (size_t) PacketIdx * (PacketSize - TEST_HEADER_LEN);
+
+            TestBuildHeader(ContextPtr, PacketPtr, FrameId, (PacketIdx == PacketCount - 1) ? PayloadHeaderEndOfFrameBit : 0);
+
+            memcpy(PacketPtr + TEST_HEADER_LEN, ContextPtr->FramePtr + Offset, min_t(size_t, PacketSize - TEST_HEADER_LEN, FrameLen - Offset));
+        }
+    }
+
+    *PacketCountPtr = PacketCount;
+
+    return TrainPtr;
+}
+
+// Feed the packet train for about 100 ms and return the frame data rate in MB/s.
+static u64 TestMeasureThroughput(struct TestContextStruct *ContextPtr, const unsigned char *TrainPtr, unsigned int PacketSize,
+                                 unsigned int PacketCount)
+{
+
+    struct FrameAssemblyStruct *FrameAssemblyPtr = &ContextPtr->FrameAssemblyStruct;
+
+    size_t FrameLen = FrameAssemblyPtr->FrameLen;
+    size_t LastPacketLen = TEST_HEADER_LEN + FrameLen - (size_t) (PacketCount - 1) * (PacketSize - TEST_HEADER_LEN);
+    unsigned int FrameCount = 0;
+
+    u64 StartNs = ktime_get_ns();
+    u64 ElapsedNs;
+
+    do
+    {
+
+        const unsigned char *PacketPtr = TrainPtr + (size_t) (FrameCount & 1) * PacketCount * PacketSize;
+
+        for (unsigned int PacketIdx = 0; PacketIdx < PacketCount; PacketIdx++, PacketPtr += PacketSize)
+        {
+            TomUsbCamProcessPayload(FrameAssemblyPtr, PacketPtr, (PacketIdx == PacketCount - 1) ? LastPacketLen : PacketSize);
+        }
+
+        FrameCount++;
+
+        cond_resched();
+
+        ElapsedNs = ktime_get_ns() - StartNs;
+    }
+    while ((ElapsedNs < 100 * NSEC_PER_MSEC) || (FrameCount < 10));
+
+    return div64_u64((u64) FrameCount * FrameLen * 1000, ElapsedNs);
+}
+
+// Frame data rate through the assembler for every packet size the camera uses, into a vmalloc'd buffer and a page
+// list. The numbers are informational, nothing fails on them.
+static void TestBenchmarkCopy(struct kunit *Test)
+{
+
+    struct TestContextStruct *ContextPtr = Test->priv;
+
+    TestSetFormat(ContextPtr, 640, 480, TOM_USB_CAM_CONVERSION_NONE);
+
+    for (unsigned int PacketSizeIdx = 0; PacketSizeIdx < ARRAY_SIZE(TestPacketSizeTable); PacketSizeIdx++)
+    {
+
+        unsigned int PacketSize = TestPacketSizeTable[PacketSizeIdx];
+        unsigned int PacketCount;
+
+        unsigned char *TrainPtr = TestBuildPacketTrain(ContextPtr, PacketSize, &PacketCount);
+
+        KUNIT_ASSERT_NOT_NULL(Test, TrainPtr);
+
+        TestSetFormat(ContextPtr, 640, 480, TOM_USB_CAM_CONVERSION_NONE);
+        u64 VmallocMBytesPerSec = TestMeasureThroughput(ContextPtr, TrainPtr, PacketSize, PacketCount);
+        KUNIT_EXPECT_EQ(Test, ContextPtr->FramesDamaged, 0);
+
+        TestSetFormat(ContextPtr, 640, 480, TOM_USB_CAM_CONVERSION_NONE);
+        KUNIT_ASSERT_EQ(Test, TestUseSgTable(ContextPtr), 0);
+        u64 DmaSgMBytesPerSec = TestMeasureThroughput(ContextPtr, TrainPtr, PacketSize, PacketCount);
+        KUNIT_EXPECT_EQ(Test, ContextPtr->FramesDamaged, 0);
+        TestFreeSgTable(ContextPtr);
+
+        kunit_info(Test, "%4u byte packets: %5llu MB/s vmalloc, %5llu MB/s dma-sg", PacketSize, VmallocMBytesPerSec, DmaSgMBytesPerSec);
+
+        vfree(TrainPtr);
+    }
+}
+
+static struct kunit_case TomUsbCamTestCases[] =
+{
+    KUNIT_CASE(TestParsePayloadHeader),
+    KUNIT_CASE(TestFirstFrameSkipped),
+    KUNIT_CASE(TestMissingEndOfFrame),
+    KUNIT_CASE(TestEndOfFrameEdgeCases),
+    KUNIT_CASE(TestDamagedPayloads),
+    KUNIT_CASE(TestNoBufferQueued),
+    KUNIT_CASE(TestStillImageFrame),
+    KUNIT_CASE(TestLossyStream),
+    KUNIT_CASE(TestFuzzedStream),
+    KUNIT_CASE_PARAM(TestFrameSizes, TestFrameSizeGenParams),
+    KUNIT_CASE(TestFormatSizes),
+    KUNIT_CASE(TestDmaSgBuffer),
+    KUNIT_CASE(TestBenchmarkCopy),
+    {}
+};
+
+static struct kunit_suite TomUsbCamTestSuite =
+{
+    .name = "TomUsbCamFrameAssembly",
+    .init = TestInit,
+    .exit = TestExit,
+    .test_cases = TomUsbCamTestCases,
+};
+
+kunit_test_suite(TomUsbCamTestSuite);
@@ -0,0 +1,274 @@
+// Static tracepoints across the life of a frame, under events/tomusbcam/ in tracefs. Each event carries the camera's
+// index, the same one the cameras parameter and debugfs use, and the sequence number of the frame being assembled
+// when it fired, or of the buffer for buffer_done. That way one frame can be followed from the Urbs that carried it,
+// through the frame assembler, to vb2. For example:
+//
+//   perf record -e 'tomusbcam:*' -a -- v4l2-ctl --stream-mmap --stream-count=100
+//   perf script
+//
+// or "echo 1 > /sys/kernel/tracing/events/tomusbcam/enable" and read /sys/kernel/tracing/trace.
+// TomUsbCamDriver.c defines CREATE_TRACE_POINTS before it includes this file. Any other file that includes it only
+// gets the trace_*() declarations. Like TomUsbCamDriver.h, this needs the driver's structs defined first.
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM tomusbcam
+
+#if !defined(_TOM_USB_CAM_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TOM_USB_CAM_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// An isochronous Urb was handed to the host controller. The result is the return value of usb_submit_urb().
+TRACE_EVENT(tomusbcam_urb_submit,
+
+    TP_PROTO(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr, struct urb *UrbPtr, int Result),
+
+    TP_ARGS(TomUsbCamCtrlIntfDevStructPtr, UrbPtr, Result),
+
+    TP_STRUCT__entry(
+        __field(int, camera)
+        __field(u32, sequence)
+        __field(const void *, urb)
+        __field(int, result)
+    ),
+
+    TP_fast_assign(
+        __entry->camera = TomUsbCamCtrlIntfDevStructPtr->DeviceStructPtr->DeviceIdx;
+        __entry->sequence = TomUsbCamCtrlIntfDevStructPtr->FrameAssemblyForThisCameraStruct.Sequence;
+        __entry->urb = UrbPtr;
+        __entry->result = Result;
+    ),
+
+    TP_printk("camera=%d seq=%u urb=%p result=%d", __entry->camera, __entry->sequence, __entry->urb, __entry->result)
+);
+
+// The host controller gave an isochronous Urb back. error_count is how many of its packets failed.
+TRACE_EVENT(tomusbcam_urb_complete,
+
+    TP_PROTO(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr, struct urb *UrbPtr),
+
+    TP_ARGS(TomUsbCamCtrlIntfDevStructPtr, UrbPtr),
+
+    TP_STRUCT__entry(
+        __field(int, camera)
+        __field(u32, sequence)
+        __field(const void *, urb)
+        __field(int, status)
+        __field(u32, actual_length)
+        __field(int, error_count)
+    ),
+
+    TP_fast_assign(
+        __entry->camera = TomUsbCamCtrlIntfDevStructPtr->DeviceStructPtr->DeviceIdx;
+        __entry->sequence = TomUsbCamCtrlIntfDevStructPtr->FrameAssemblyForThisCameraStruct.Sequence;
+        __entry->urb = UrbPtr;
+        __entry->status = UrbPtr->status;
+        __entry->actual_length = UrbPtr->actual_length;
+        __entry->error_count = UrbPtr->error_count;
+    ),
+
+    TP_printk("camera=%d seq=%u urb=%p status=%d actual_length=%u error_count=%d", __entry->camera, __entry->sequence,
+              __entry->urb, __entry->status, __entry->actual_length, __entry->error_count)
+);
+
+// The frame id bit toggled, so the camera started a new frame. has_buffer is 0 when user space had no buffer queued
+// and the frame is skipped.
+TRACE_EVENT(tomusbcam_frame_start,
+
+    TP_PROTO(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr, bool HasBuffer),
+
+    TP_ARGS(TomUsbCamCtrlIntfDevStructPtr, HasBuffer),
+
+    TP_STRUCT__entry(
+        __field(int, camera)
+        __field(u32, sequence)
+        __field(bool, has_buffer)
+    ),
+
+    TP_fast_assign(
+        __entry->camera = TomUsbCamCtrlIntfDevStructPtr->DeviceStructPtr->DeviceIdx;
+        __entry->sequence = TomUsbCamCtrlIntfDevStructPtr->FrameAssemblyForThisCameraStruct.Sequence;
+        __entry->has_buffer = HasBuffer;
+    ),
+
+    TP_printk("camera=%d seq=%u has_buffer=%d", __entry->camera, __entry->sequence, __entry->has_buffer)
+);
+
+// A frame with a buffer ended, normally on its end-of-frame bit. error_flags are the TOM_USB_CAM_FRAME_ERROR_* bits,
+// where 0x4 means it ended because the next frame started instead.
+TRACE_EVENT(tomusbcam_frame_end,
+
+    TP_PROTO(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr),
+
+    TP_ARGS(TomUsbCamCtrlIntfDevStructPtr),
+
+    TP_STRUCT__entry(
+        __field(int, camera)
+        __field(u32, sequence)
+        __field(size_t, bytes_used)
+        __field(u32, error_flags)
+    ),
+
+    TP_fast_assign(
+        __entry->camera = TomUsbCamCtrlIntfDevStructPtr->DeviceStructPtr->DeviceIdx;
+        __entry->sequence = TomUsbCamCtrlIntfDevStructPtr->FrameAssemblyForThisCameraStruct.Sequence;
+        __entry->bytes_used = TomUsbCamCtrlIntfDevStructPtr->FrameAssemblyForThisCameraStruct.BytesUsed;
+        __entry->error_flags = TomUsbCamCtrlIntfDevStructPtr->FrameAssemblyForThisCameraStruct.ErrorFlags;
+    ),
+
+    TP_printk("camera=%d seq=%u bytes_used=%zu error_flags=0x%x", __entry->camera, __entry->sequence,
+              __entry->bytes_used, __entry->error_flags)
+);
+
+// A buffer went back to vb2 through vb2_buffer_done(). state is the enum vb2_buffer_state, 2 for done and 3 for error.
+TRACE_EVENT(tomusbcam_buffer_done,
+
+    TP_PROTO(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr, struct vb2_v4l2_buffer *V4l2BufferPtr, int State),
+
+    TP_ARGS(TomUsbCamCtrlIntfDevStructPtr, V4l2BufferPtr, State),
+
+    TP_STRUCT__entry(
+        __field(int, camera)
+        __field(u32, sequence)
+        __field(u32, index)
+        __field(int, state)
+    ),
+
+    TP_fast_assign(
+        __entry->camera = TomUsbCamCtrlIntfDevStructPtr->DeviceStructPtr->DeviceIdx;
+        __entry->sequence = V4l2BufferPtr->sequence;
+        __entry->index = V4l2BufferPtr->vb2_buf.index;
+        __entry->state = State;
+    ),
+
+    TP_printk("camera=%d seq=%u index=%u state=%d", __entry->camera, __entry->sequence, __entry->index, __entry->state)
+);
+
+// A control transfer is about to go out, and when it is done. request_type has the direction in bit 7, and the
+// result is the byte count or a negative error code.
+TRACE_EVENT(tomusbcam_control_start,
+
+    TP_PROTO(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr, u8 RequestType, u8 Request, u16 Value, u16 Index, u16 Len),
+
+    TP_ARGS(TomUsbCamCtrlIntfDevStructPtr, RequestType, Request, Value, Index, Len),
+
+    TP_STRUCT__entry(
+        __field(int, camera)
+        __field(u32, sequence)
+        __field(u8, request_type)
+        __field(u8, request)
+        __field(u16, value)
+        __field(u16, index)
+        __field(u16, len)
+    ),
+
+    TP_fast_assign(
+        __entry->camera = TomUsbCamCtrlIntfDevStructPtr->DeviceStructPtr->DeviceIdx;
+        __entry->sequence = TomUsbCamCtrlIntfDevStructPtr->FrameAssemblyForThisCameraStruct.Sequence;
+        __entry->request_type = RequestType;
+        __entry->request = Request;
+        __entry->value = Value;
+        __entry->index = Index;
+        __entry->len = Len;
+    ),
+
+    TP_printk("camera=%d seq=%u request_type=0x%02x request=0x%02x value=0x%04x index=0x%04x len=%u", __entry->camera,
+              __entry->sequence, __entry->request_type, __entry->request, __entry->value, __entry->index, __entry->len)
+);
+
+TRACE_EVENT(tomusbcam_control_end,
+
+    TP_PROTO(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr, u8 RequestType, u8 Request, u16 Value, u16 Index, int Result),
+
+    TP_ARGS(TomUsbCamCtrlIntfDevStructPtr, RequestType, Request, Value, Index, Result),
+
+    TP_STRUCT__entry(
+        __field(int, camera)
+        __field(u32, sequence)
+        __field(u8, request_type)
+        __field(u8, request)
+        __field(u16, value)
+        __field(u16, index)
+        __field(int, result)
+    ),
+
+    TP_fast_assign(
+        __entry->camera = TomUsbCamCtrlIntfDevStructPtr->DeviceStructPtr->DeviceIdx;
+        __entry->sequence = TomUsbCamCtrlIntfDevStructPtr->FrameAssemblyForThisCameraStruct.Sequence;
+        __entry->request_type = RequestType;
+        __entry->request = Request;
+        __entry->value = Value;
+        __entry->index = Index;
+        __entry->result = Result;
+    ),
+
+    TP_printk("camera=%d seq=%u request_type=0x%02x request=0x%02x value=0x%04x index=0x%04x result=%d", __entry->camera,
+              __entry->sequence, __entry->request_type, __entry->request, __entry->value, __entry->index, __entry->result)
+);
+
+// The streaming interface was switched to another alternate setting. The result is the return value of
+// usb_set_interface().
+TRACE_EVENT(tomusbcam_alt_setting,
+
+    TP_PROTO(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr, int Interface, int AltSetting, int Result),
+
+    TP_ARGS(TomUsbCamCtrlIntfDevStructPtr, Interface, AltSetting, Result),
+
+    TP_STRUCT__entry(
+        __field(int, camera)
+        __field(u32, sequence)
+        __field(int, interface)
+        __field(int, alt_setting)
+        __field(int, result)
+    ),
+
+    TP_fast_assign(
+        __entry->camera = TomUsbCamCtrlIntfDevStructPtr->DeviceStructPtr->DeviceIdx;
+        __entry->sequence = TomUsbCamCtrlIntfDevStructPtr->FrameAssemblyForThisCameraStruct.Sequence;
+        __entry->interface = Interface;
+        __entry->alt_setting = AltSetting;
+        __entry->result = Result;
+    ),
+
+    TP_printk("camera=%d seq=%u interface=%d alt_setting=%d result=%d", __entry->camera, __entry->sequence,
+              __entry->interface, __entry->alt_setting, __entry->result)
+);
+
+// A still image was captured for the still node, or wasn't. method is the Uvc still capture method used, where 1 means
+// the stream was switched over to the still frame size, and the result is 0 once the image went to user space.
+TRACE_EVENT(tomusbcam_still,
+
+    TP_PROTO(struct TomUsbCamCtrlIntfDevStruct *TomUsbCamCtrlIntfDevStructPtr, int Method, int Result),
+
+    TP_ARGS(TomUsbCamCtrlIntfDevStructPtr, Method, Result),
+
+    TP_STRUCT__entry(
+        __field(int, camera)
+        __field(u32, sequence)
+        __field(int, method)
+        __field(u32, width)
+        __field(u32, height)
+        __field(int, result)
+    ),
+
+    TP_fast_assign(
+        __entry->camera = TomUsbCamCtrlIntfDevStructPtr->DeviceStructPtr->DeviceIdx;
+        __entry->sequence = TomUsbCamCtrlIntfDevStructPtr->FrameAssemblyForThisCameraStruct.Sequence;
+        __entry->method = Method;
+        __entry->width = TomUsbCamCtrlIntfDevStructPtr->StillCaptureForThisCameraStruct.V4l2PixFormatStruct.width;
+        __entry->height = TomUsbCamCtrlIntfDevStructPtr->StillCaptureForThisCameraStruct.V4l2PixFormatStruct.height;
+        __entry->result = Result;
+    ),
+
+    TP_printk("camera=%d seq=%u method=%d width=%u height=%u result=%d", __entry->camera, __entry->sequence,
+              __entry->method, __entry->width, __entry->height, __entry->result)
+);
+
+#endif
+
+// The trace header isn't under include/trace/events/, so tell define_trace.h where to find it. The Makefile adds
+// this directory to the include path.
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE TomUsbCamTrace
+#include <trace/define_trace.h>